@@ -30,6 +30,7 @@ LOCAL_SRC_FILES:= \
 	selinux.c \
 	services.c \
 	signals.c \
+	stats.c \
 	utils.c
 
 LOCAL_SHARED_LIBRARIES := \
@@ -41,6 +41,9 @@
 #define DBUS_SERVICE_NAME "Name"
 #define DBUS_SERVICE_EXEC "Exec"
 
+static void handle_spawn_timeout (DBusTimeout *timeout,
+                                  void        *data);
+
 struct BusActivation
 {
   int refcount;
@@ -53,6 +56,10 @@ struct BusActivation
                               * activations per se
                               */
   DBusHashTable *directories;
+  char **child_env;          /**< Environment for activated services, built on first use */
+  DBusList *spawn_queue;     /**< Pending activations to be spawned together */
+  DBusTimeout *spawn_timeout; /**< Zero-length timeout that spawns the queue */
+  BusActivationLatency latency;
 };
 
 typedef struct
@@ -70,6 +77,7 @@ typedef struct
   unsigned long mtime;
   BusServiceDirectory *s_dir;
   char *filename;
+  char **argv; /**< exec split into arguments, parsed on first use */
 } BusActivationEntry;
 
 typedef struct BusPendingActivationEntry BusPendingActivationEntry;
@@ -88,11 +96,19 @@ typedef struct
   BusActivation *activation;
   char *service_name;
   char *exec;
+  BusActivationEntry *entry;
   DBusList *entries;
   int n_entries;
   DBusBabysitter *babysitter;
   DBusTimeout *timeout;
+  long request_tv_sec;   /**< When the activation was first requested */
+  long request_tv_usec;
+  long spawn_tv_sec;     /**< When the child was spawned */
+  long spawn_tv_usec;
+  long exec_tv_sec;      /**< When the child had called exec() */
+  long exec_tv_usec;
   unsigned int timeout_added : 1;
+  unsigned int exec_seen : 1;
 } BusPendingActivation;
 
 #if 0
@@ -126,6 +142,35 @@ bus_service_directory_unref (BusServiceDirectory *dir)
   dbus_free (dir);
 }
 
+static BusActivationEntry *
+bus_activation_entry_ref (BusActivationEntry *entry)
+{
+  _dbus_assert (entry->refcount > 0);
+  entry->refcount++;
+
+  return entry;
+}
+
+static void
+bus_activation_entry_unref (BusActivationEntry *entry)
+{
+  if (entry == NULL) /* hash table requires this */
+    return;
+  
+  _dbus_assert (entry->refcount > 0);
+  entry->refcount--;
+  
+  if (entry->refcount > 0) 
+    return;
+  
+  dbus_free (entry->name);
+  dbus_free (entry->exec);
+  dbus_free (entry->filename);
+  dbus_free_string_array (entry->argv);
+
+  dbus_free (entry);
+}
+
 static void
 bus_pending_activation_entry_free (BusPendingActivationEntry *entry)
 {
@@ -195,6 +240,7 @@ bus_pending_activation_unref (BusPendingActivation *pending_activation)
   
   dbus_free (pending_activation->service_name);
   dbus_free (pending_activation->exec);
+  bus_activation_entry_unref (pending_activation->entry);
 
   link = _dbus_list_get_first_link (&pending_activation->entries);
 
@@ -216,34 +262,6 @@ bus_pending_activation_unref (BusPendingActivation *pending_activation)
   dbus_free (pending_activation);
 }
 
-static BusActivationEntry *
-bus_activation_entry_ref (BusActivationEntry *entry)
-{
-  _dbus_assert (entry->refcount > 0);
-  entry->refcount++;
-
-  return entry;
-}
-
-static void
-bus_activation_entry_unref (BusActivationEntry *entry)
-{
-  if (entry == NULL) /* hash table requires this */
-    return;
-  
-  _dbus_assert (entry->refcount > 0);
-  entry->refcount--;
-  
-  if (entry->refcount > 0) 
-    return;
-  
-  dbus_free (entry->name);
-  dbus_free (entry->exec);
-  dbus_free (entry->filename);
-
-  dbus_free (entry);
-}
-
 static dbus_bool_t
 update_desktop_file_entry (BusActivation       *activation,
                            BusServiceDirectory *s_dir,
@@ -359,8 +377,10 @@ update_desktop_file_entry (BusActivation       *activation,
  
       dbus_free (entry->name);
       dbus_free (entry->exec);
+      dbus_free_string_array (entry->argv);
       entry->name = name;
       entry->exec = exec;
+      entry->argv = NULL;
       if (!_dbus_hash_table_insert_string (activation->entries,
                                            entry->name, bus_activation_entry_ref(entry)))
         {
@@ -774,6 +794,17 @@ bus_activation_unref (BusActivation *activation)
 
   if (activation->refcount > 0)
     return;
+
+  while (activation->spawn_queue != NULL)
+    bus_pending_activation_unref (_dbus_list_pop_first (&activation->spawn_queue));
+
+  if (activation->spawn_timeout)
+    {
+      _dbus_loop_remove_timeout (bus_context_get_loop (activation->context),
+                                 activation->spawn_timeout,
+                                 handle_spawn_timeout, activation);
+      _dbus_timeout_unref (activation->spawn_timeout);
+    }
   
   dbus_free (activation->server_address);
   if (activation->entries)
@@ -782,41 +813,106 @@ bus_activation_unref (BusActivation *activation)
     _dbus_hash_table_unref (activation->pending_activations);
   if (activation->directories)  
     _dbus_hash_table_unref (activation->directories);
+  dbus_free_string_array (activation->child_env);
   
   dbus_free (activation);
 }
 
-static void
-child_setup (void *data)
+/**
+ * Gets the histograms of how long each step of activating a service
+ * has taken, since the activation subsystem was created (i.e. since
+ * the configuration was last loaded).
+ *
+ * @param activation the activation subsystem
+ * @returns the histograms, owned by the activation subsystem
+ */
+const BusActivationLatency*
+bus_activation_get_latency (BusActivation *activation)
 {
-  BusActivation *activation = data;
+  return &activation->latency;
+}
+
+/* Adds NAME=value to a NULL-terminated environment array */
+static dbus_bool_t
+append_child_env (char       **env,
+                  const char  *name,
+                  const char  *value)
+{
+  DBusString str;
+  int i;
+
+  if (!_dbus_string_init (&str))
+    return FALSE;
+
+  if (!_dbus_string_append (&str, name) ||
+      !_dbus_string_append_byte (&str, '=') ||
+      !_dbus_string_append (&str, value))
+    {
+      _dbus_string_free (&str);
+      return FALSE;
+    }
+
+  for (i = 0; env[i] != NULL; i++)
+    ;
+
+  if (!_dbus_string_steal_data (&str, &env[i]))
+    {
+      _dbus_string_free (&str);
+      return FALSE;
+    }
+
+  _dbus_string_free (&str);
+  return TRUE;
+}
+
+/* The variables that tell an activated service how to reach us; they
+ * are given to the spawn code rather than set in the child, so the
+ * child can be started without running any of our code after fork().
+ * They are the same for every service, so they are built once.
+ */
+static char **
+get_child_env (BusActivation *activation)
+{
+  char **env;
   const char *type;
-  
-  /* If no memory, we simply have the child exit, so it won't try
-   * to connect to the wrong thing.
-   */
-  if (!_dbus_setenv ("DBUS_STARTER_ADDRESS", activation->server_address))
-    _dbus_exit (1);
+
+  if (activation->child_env != NULL)
+    return activation->child_env;
+
+  env = dbus_new0 (char *, 4);
+  if (env == NULL)
+    return NULL;
+
+  if (!append_child_env (env, "DBUS_STARTER_ADDRESS",
+                         activation->server_address))
+    goto nomem;
   
   type = bus_context_get_type (activation->context);
   if (type != NULL)
     {
-      if (!_dbus_setenv ("DBUS_STARTER_BUS_TYPE", type))
-        _dbus_exit (1);
+      if (!append_child_env (env, "DBUS_STARTER_BUS_TYPE", type))
+        goto nomem;
 
       if (strcmp (type, "session") == 0)
         {
-          if (!_dbus_setenv ("DBUS_SESSION_BUS_ADDRESS",
-                             activation->server_address))
-            _dbus_exit (1);
+          if (!append_child_env (env, "DBUS_SESSION_BUS_ADDRESS",
+                                 activation->server_address))
+            goto nomem;
         }
       else if (strcmp (type, "system") == 0)
         {
-          if (!_dbus_setenv ("DBUS_SYSTEM_BUS_ADDRESS",
-                             activation->server_address))
-            _dbus_exit (1);
+          if (!append_child_env (env, "DBUS_SYSTEM_BUS_ADDRESS",
+                                 activation->server_address))
+            goto nomem;
         }
     }
+
+  activation->child_env = env;
+  return env;
+
+ nomem:
+  dbus_free_string_array (env);
+  return NULL;
 }
 
 typedef struct
@@ -888,6 +984,33 @@ add_restore_pending_to_transaction (BusTransaction       *transaction,
   return TRUE;
 }
 
+static void
+record_name_acquired (BusPendingActivation *pending_activation)
+{
+  BusActivationLatency *latency;
+  long tv_sec, tv_usec;
+
+  latency = &pending_activation->activation->latency;
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  if (pending_activation->exec_seen)
+    _dbus_histogram_add (&latency->name,
+                         _dbus_usec_since (pending_activation->exec_tv_sec,
+                                           pending_activation->exec_tv_usec,
+                                           tv_sec, tv_usec));
+
+  _dbus_histogram_add (&latency->total,
+                       _dbus_usec_since (pending_activation->request_tv_sec,
+                                         pending_activation->request_tv_usec,
+                                         tv_sec, tv_usec));
+
+  _dbus_verbose ("Activation of %s took %ld usec\n",
+                 pending_activation->service_name,
+                 _dbus_usec_since (pending_activation->request_tv_sec,
+                                   pending_activation->request_tv_usec,
+                                   tv_sec, tv_usec));
+}
+
 dbus_bool_t
 bus_activation_service_created (BusActivation  *activation,
                                 const char     *service_name,
@@ -906,6 +1029,8 @@ bus_activation_service_created (BusActivation  *activation,
   if (!pending_activation)
     return TRUE;
 
+  record_name_acquired (pending_activation);
+
   link = _dbus_list_get_first_link (&pending_activation->entries);
   while (link != NULL)
     {
@@ -987,6 +1112,30 @@ bus_activation_send_pending_auto_activation_messages (BusActivation  *activation
           
           addressed_recipient = bus_service_get_primary_owners_connection (service);
 
+          if (dbus_message_contains_unix_fds (entry->activation_message) &&
+              !dbus_connection_can_send_type (addressed_recipient, DBUS_TYPE_UNIX_FD))
+            {
+              DBusError fd_error;
+
+              dbus_error_init (&fd_error);
+              dbus_set_error_const (&fd_error, DBUS_ERROR_NOT_SUPPORTED,
+                                    "Tried to send message with Unix file descriptors to a client that doesn't support that.");
+
+              if (!bus_transaction_send_error_reply (transaction,
+                                                     entry->connection,
+                                                     &fd_error,
+                                                     entry->activation_message))
+                {
+                  dbus_error_free (&fd_error);
+                  BUS_SET_OOM (error);
+                  goto error;
+                }
+
+              dbus_error_free (&fd_error);
+              link = next;
+              continue;
+            }
+
           /* Check the security policy, which has the side-effect of adding an
            * expected pending reply.
            */
@@ -1102,6 +1251,20 @@ babysitter_watch_callback (DBusWatch     *watch,
   
   retval = dbus_watch_handle (watch, condition);
 
+  if (!pending_activation->exec_seen &&
+      _dbus_babysitter_get_child_started (babysitter))
+    {
+      _dbus_get_current_time (&pending_activation->exec_tv_sec,
+                              &pending_activation->exec_tv_usec);
+      pending_activation->exec_seen = TRUE;
+
+      _dbus_histogram_add (&pending_activation->activation->latency.exec,
+                           _dbus_usec_since (pending_activation->spawn_tv_sec,
+                                             pending_activation->spawn_tv_usec,
+                                             pending_activation->exec_tv_sec,
+                                             pending_activation->exec_tv_usec));
+    }
+
   /* FIXME this is broken in the same way that
    * connection watches used to be; there should be
    * a separate callback for status change, instead
@@ -1295,6 +1458,175 @@ activation_find_entry (BusActivation *activation,
   return entry;
 }
 
+static dbus_bool_t
+get_entry_argv (BusActivationEntry *entry,
+                char             ***argv_p,
+                DBusError          *error)
+{
+  char **argv;
+  int argc;
+
+  if (entry->argv == NULL)
+    {
+      if (!_dbus_shell_parse_argv (entry->exec, &argc, &argv, error))
+        {
+          _dbus_verbose ("Failed to parse command line: %s\n", entry->exec);
+          return FALSE;
+        }
+
+      entry->argv = argv;
+    }
+
+  *argv_p = entry->argv;
+  return TRUE;
+}
+
+/* Returns FALSE only if we ran out of memory and the spawn should be
+ * tried again; any other failure is reported to the requesters.
+ */
+static dbus_bool_t
+spawn_pending_activation (BusPendingActivation *pending_activation)
+{
+  BusActivation *activation;
+  BusActivationLatency *latency;
+  DBusError error;
+  char **argv;
+  char **env;
+
+  activation = pending_activation->activation;
+
+  /* The transaction that queued it may have been canceled since, or
+   * the activation may have timed out or been replaced
+   */
+  if (_dbus_hash_table_lookup_string (activation->pending_activations,
+                                      pending_activation->service_name) != pending_activation)
+    return TRUE;
+
+  dbus_error_init (&error);
+
+  if (!get_entry_argv (pending_activation->entry, &argv, &error))
+    goto failed;
+
+  env = get_child_env (activation);
+  if (env == NULL)
+    return FALSE;
+
+  _dbus_verbose ("Spawning %s ...\n", argv[0]);
+  if (!_dbus_spawn_async_with_babysitter (&pending_activation->babysitter, argv,
+                                          env, NULL, NULL,
+                                          &error))
+    {
+      _dbus_verbose ("Failed to spawn child\n");
+      goto failed;
+    }
+
+  _dbus_assert (pending_activation->babysitter != NULL);
+  
+  if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
+                                             add_babysitter_watch,
+                                             remove_babysitter_watch,
+                                             NULL,
+                                             pending_activation,
+                                             NULL))
+    {
+      _dbus_verbose ("Failed to set babysitter watch functions\n");
+      _dbus_babysitter_kill_child (pending_activation->babysitter);
+      _dbus_babysitter_unref (pending_activation->babysitter);
+      pending_activation->babysitter = NULL;
+      return FALSE;
+    }
+
+  latency = &activation->latency;
+  _dbus_get_current_time (&pending_activation->spawn_tv_sec,
+                          &pending_activation->spawn_tv_usec);
+  _dbus_histogram_add (&latency->spawn,
+                       _dbus_usec_since (pending_activation->request_tv_sec,
+                                         pending_activation->request_tv_usec,
+                                         pending_activation->spawn_tv_sec,
+                                         pending_activation->spawn_tv_usec));
+  
+  return TRUE;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (&error);
+
+  if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+    {
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  pending_activation_failed (pending_activation, &error);
+  dbus_error_free (&error);
+  return TRUE;
+}
+
+/* Activations requested while dispatching are spawned together from
+ * a zero-length timeout, i.e. at the start of the next main loop
+ * iteration, so a burst of requests shares one pass over the spawn
+ * machinery instead of interleaving it with message dispatch.
+ */
+static dbus_bool_t
+spawn_queued_activations (void *data)
+{
+  BusActivation *activation = data;
+  BusPendingActivation *pending_activation;
+
+  while (activation->spawn_queue != NULL)
+    {
+      pending_activation = _dbus_list_get_first (&activation->spawn_queue);
+
+      if (!spawn_pending_activation (pending_activation))
+        return FALSE;
+
+      _dbus_list_pop_first (&activation->spawn_queue);
+      bus_pending_activation_unref (pending_activation);
+    }
+
+  _dbus_timeout_set_enabled (activation->spawn_timeout, FALSE);
+
+  return TRUE;
+}
+
+static void
+handle_spawn_timeout (DBusTimeout *timeout,
+                      void        *data)
+{
+  while (!dbus_timeout_handle (timeout))
+    _dbus_wait_for_memory ();
+}
+
+static dbus_bool_t
+queue_spawn (BusActivation        *activation,
+             BusPendingActivation *pending_activation)
+{
+  if (activation->spawn_timeout == NULL)
+    {
+      activation->spawn_timeout = _dbus_timeout_new (0, spawn_queued_activations,
+                                                     activation, NULL);
+      if (activation->spawn_timeout == NULL)
+        return FALSE;
+
+      if (!_dbus_loop_add_timeout (bus_context_get_loop (activation->context),
+                                   activation->spawn_timeout,
+                                   handle_spawn_timeout,
+                                   activation, NULL))
+        {
+          _dbus_timeout_unref (activation->spawn_timeout);
+          activation->spawn_timeout = NULL;
+          return FALSE;
+        }
+    }
+
+  if (!_dbus_list_append (&activation->spawn_queue, pending_activation))
+    return FALSE;
+
+  bus_pending_activation_ref (pending_activation);
+  _dbus_timeout_set_enabled (activation->spawn_timeout, TRUE);
+
+  return TRUE;
+}
+
 dbus_bool_t
 bus_activation_activate_service (BusActivation  *activation,
                                  DBusConnection *connection,
@@ -1310,10 +1642,11 @@ bus_activation_activate_service (BusActivation  *activation,
   DBusMessage *message;
   DBusString service_str;
   char **argv;
-  int argc;
   dbus_bool_t retval;
   DBusHashIter iter;
   dbus_bool_t activated;
+  long tv_sec, tv_usec;
+  long now_tv_sec, now_tv_usec;
   
   activated = TRUE;
 
@@ -1328,7 +1661,15 @@ bus_activation_activate_service (BusActivation  *activation,
       return FALSE;
     }
 
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
   entry = activation_find_entry (activation, service_name, error);
+
+  _dbus_get_current_time (&now_tv_sec, &now_tv_usec);
+  _dbus_histogram_add (&activation->latency.lookup,
+                       _dbus_usec_since (tv_sec, tv_usec,
+                                         now_tv_sec, now_tv_usec));
+
   if (!entry) 
     return FALSE;
 
@@ -1423,6 +1764,9 @@ bus_activation_activate_service (BusActivation  *activation,
 
       pending_activation->activation = activation;
       pending_activation->refcount = 1;
+      pending_activation->entry = bus_activation_entry_ref (entry);
+      pending_activation->request_tv_sec = tv_sec;
+      pending_activation->request_tv_usec = tv_usec;
       
       pending_activation->service_name = _dbus_strdup (service_name);
       if (!pending_activation->service_name)
@@ -1527,10 +1871,11 @@ bus_activation_activate_service (BusActivation  *activation,
   if (activated)
     return TRUE;
 
-  /* Now try to spawn the process */
-  if (!_dbus_shell_parse_argv (entry->exec, &argc, &argv, error))
+  /* Parse the command line now so a broken one is reported to the
+   * caller, then leave the spawning to the batch
+   */
+  if (!get_entry_argv (entry, &argv, error))
     {
-      _dbus_verbose ("Failed to parse command line: %s\n", entry->exec);
       _DBUS_ASSERT_ERROR_IS_SET (error);
       
       _dbus_hash_table_remove_string (activation->pending_activations,
@@ -1539,31 +1884,12 @@ bus_activation_activate_service (BusActivation  *activation,
       return FALSE;
     }
 
-  _dbus_verbose ("Spawning %s ...\n", argv[0]);
-  if (!_dbus_spawn_async_with_babysitter (&pending_activation->babysitter, argv,
-                                          child_setup, activation, 
-                                          error))
-    {
-      _dbus_verbose ("Failed to spawn child\n");
-      _DBUS_ASSERT_ERROR_IS_SET (error);
-      dbus_free_string_array (argv);
-
-      return FALSE;
-    }
-
-  dbus_free_string_array (argv);
-
-  _dbus_assert (pending_activation->babysitter != NULL);
-  
-  if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
-                                             add_babysitter_watch,
-                                             remove_babysitter_watch,
-                                             NULL,
-                                             pending_activation,
-                                             NULL))
+  if (!queue_spawn (activation, pending_activation))
     {
+      _dbus_verbose ("Failed to queue pending activation for spawning\n");
       BUS_SET_OOM (error);
-      _dbus_verbose ("Failed to set babysitter watch functions\n");
+      _dbus_hash_table_remove_string (activation->pending_activations,
+                                      pending_activation->service_name);
       return FALSE;
     }
   
@@ -26,8 +26,22 @@
 
 #include <dbus/dbus.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-internals.h>
 #include "bus.h"
 
+/**
+ * How long the steps of activating a service took. Each activation
+ * adds one sample to each histogram for the steps it went through.
+ */
+typedef struct
+{
+  DBusHistogram lookup; /**< Finding the service file for the name */
+  DBusHistogram spawn;  /**< From the request until the spawn was started, including the wait for the rest of the batch */
+  DBusHistogram exec;   /**< From starting the spawn until the child had called exec() */
+  DBusHistogram name;   /**< From exec() until the service owned the name */
+  DBusHistogram total;  /**< From the request until the service owned the name */
+} BusActivationLatency;
+
 BusActivation* bus_activation_new              (BusContext        *context,
 						const DBusString  *address,
 						DBusList         **directories,
@@ -54,6 +68,8 @@ dbus_bool_t    bus_activation_send_pending_auto_activation_messages (BusActivati
 								     BusTransaction    *transaction,
 								     DBusError         *error);
 
+const BusActivationLatency* bus_activation_get_latency (BusActivation     *activation);
+
 
 
 #endif /* BUS_ACTIVATION_H */
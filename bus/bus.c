@@ -34,6 +34,8 @@
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-spawn.h>
+#include <syslog.h>
 
 struct BusContext
 {
@@ -186,8 +188,14 @@ new_connection_callback (DBusServer     *server,
   dbus_connection_set_max_received_size (new_connection,
                                          context->limits.max_incoming_bytes);
 
+  dbus_connection_set_max_received_unix_fds (new_connection,
+                                             context->limits.max_incoming_unix_fds);
+
   dbus_connection_set_max_message_size (new_connection,
                                         context->limits.max_message_size);
+
+  dbus_connection_set_prioritize_replies (new_connection,
+                                          context->limits.prioritize_replies != 0);
   
   /* on OOM, we won't have ref'd the connection so it will die. */
 }
@@ -395,6 +403,38 @@ process_config_first_time_only (BusContext      *context,
   return retval;
 }
 
+static void
+loop_stall_function (const char *kind,
+                     int         fd,
+                     void       *callback_data,
+                     long        usec,
+                     void       *data)
+{
+  BusContext *context = data;
+  DBusConnection *connection;
+  const char *name;
+
+  connection = NULL;
+  if (context->connections != NULL)
+    connection = bus_connections_lookup (context->connections,
+                                         callback_data);
+
+  if (connection == NULL)
+    {
+      syslog (LOG_WARNING,
+              "Main loop stalled for %ld ms in a %s callback (fd %d)",
+              usec / 1000, kind, fd);
+      return;
+    }
+
+  name = bus_connection_is_active (connection) ?
+    bus_connection_get_name (connection) : "(inactive)";
+
+  syslog (LOG_WARNING,
+          "Main loop stalled for %ld ms in a %s callback (fd %d) for connection %s",
+          usec / 1000, kind, fd, name);
+}
+
 /* This code gets executed every time the config files
    are parsed: both during BusContext construction
    and on reloads. */
@@ -424,6 +464,36 @@ process_config_every_time (BusContext      *context,
   /* get our limits and timeout lengths */
   bus_config_parser_get_limits (parser, &context->limits);
 
+  _dbus_loop_set_dispatch_quantum (context->loop,
+                                   context->limits.dispatch_quantum);
+
+  _dbus_loop_set_stall_function (context->loop,
+                                 context->limits.stall_threshold * 1000L,
+                                 loop_stall_function, context);
+
+  if (context->limits.listen_backlog > 0)
+    {
+      link = _dbus_list_get_first_link (&context->servers);
+      while (link != NULL)
+        {
+          DBusError backlog_error;
+
+          dbus_error_init (&backlog_error);
+
+          /* Not fatal; the server just keeps the backlog it has */
+          if (!dbus_server_set_listen_backlog (link->data,
+                                               context->limits.listen_backlog,
+                                               &backlog_error))
+            {
+              _dbus_verbose ("Not setting listen backlog: %s\n",
+                             backlog_error.message);
+              dbus_error_free (&backlog_error);
+            }
+
+          link = _dbus_list_get_next_link (&context->servers, link);
+        }
+    }
+
   context->policy = bus_config_parser_steal_policy (parser);
   _dbus_assert (context->policy != NULL);
 
@@ -785,6 +855,21 @@ bus_context_new (const DBusString *config_file,
 	  goto failed;
 	}
     }
+
+  /* Activated services are forked from a helper that stays as small
+   * as we are now; without it they are forked from us, which gets
+   * slower as we grow
+   */
+  {
+    DBusError tmp_error;
+
+    dbus_error_init (&tmp_error);
+    if (!_dbus_spawn_start_helper (&tmp_error))
+      {
+        _dbus_verbose ("Not using a spawn helper: %s\n", tmp_error.message);
+        dbus_error_free (&tmp_error);
+      }
+  }
   
   dbus_server_free_data_slot (&server_data_slot);
   
@@ -935,6 +1020,7 @@ bus_context_unref (BusContext *context)
       
       if (context->loop)
         {
+          _dbus_loop_set_stall_function (context->loop, 0, NULL, NULL);
           _dbus_loop_unref (context->loop);
           context->loop = NULL;
         }
@@ -1005,6 +1091,38 @@ bus_context_get_activation (BusContext  *context)
   return context->activation;
 }
 
+/**
+ * Gets the accept() counters of all the servers the bus listens on,
+ * added together; max_per_wakeup is the largest of any one server.
+ *
+ * @param context the bus context
+ * @param stats return location for the counters
+ */
+void
+bus_context_get_accept_stats (BusContext            *context,
+                              DBusServerAcceptStats *stats)
+{
+  DBusList *link;
+
+  _DBUS_ZERO (*stats);
+
+  link = _dbus_list_get_first_link (&context->servers);
+  while (link != NULL)
+    {
+      DBusServerAcceptStats server_stats;
+
+      _dbus_server_get_accept_stats (link->data, &server_stats);
+
+      stats->n_wakeups += server_stats.n_wakeups;
+      stats->n_accepted += server_stats.n_accepted;
+      stats->n_failed += server_stats.n_failed;
+      if (server_stats.max_per_wakeup > stats->max_per_wakeup)
+        stats->max_per_wakeup = server_stats.max_per_wakeup;
+
+      link = _dbus_list_get_next_link (&context->servers, link);
+    }
+}
+
 BusMatchmaker*
 bus_context_get_matchmaker (BusContext  *context)
 {
@@ -1103,12 +1221,24 @@ bus_context_get_max_replies_per_connection (BusContext *context)
   return context->limits.max_replies_per_connection;
 }
 
+long
+bus_context_get_max_memory_per_user (BusContext *context)
+{
+  return context->limits.max_memory_per_user;
+}
+
 int
 bus_context_get_reply_timeout (BusContext *context)
 {
   return context->limits.reply_timeout;
 }
 
+int
+bus_context_get_dispatch_quantum (BusContext *context)
+{
+  return context->limits.dispatch_quantum;
+}
+
 /*
  * addressed_recipient is the recipient specified in the message.
  *
@@ -30,6 +30,7 @@
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-mainloop.h>
 #include <dbus/dbus-userdb.h>
+#include <dbus/dbus-server-protected.h>
 
 typedef struct BusActivation    BusActivation;
 typedef struct BusConnections   BusConnections;
@@ -48,6 +49,7 @@ typedef struct BusMatchRule     BusMatchRule;
 typedef struct
 {
   long max_incoming_bytes;          /**< How many incoming message bytes for a single connection */
+  long max_incoming_unix_fds;       /**< How many unix fds incoming messages from a single connection may hold */
   long max_outgoing_bytes;          /**< How many outgoing bytes can be queued for a single connection */
   long max_message_size;            /**< Max size of a single message in bytes */
   int activation_timeout;           /**< How long to wait for an activation to time out */
@@ -59,7 +61,12 @@ typedef struct
   int max_services_per_connection;  /**< Max number of owned services for a single connection */
   int max_match_rules_per_connection; /**< Max number of match rules for a single connection */
   int max_replies_per_connection;     /**< Max number of replies that can be pending for each connection */
+  long max_memory_per_user;           /**< Max bytes the bus holds for the match rules, names and pending replies of one user's connections */
   int reply_timeout;                  /**< How long to wait before timing out a reply */
+  int dispatch_quantum;               /**< Max messages dispatched per connection each main loop iteration, 0 for no limit */
+  int prioritize_replies;             /**< Nonzero to send replies and driver messages ahead of queued signals */
+  int listen_backlog;                 /**< Connections the kernel queues on each listening socket, 0 for the library default */
+  int stall_threshold;                /**< Milliseconds a main loop callback may run before it is logged, 0 for never */
 } BusLimits;
 
 typedef enum
@@ -85,6 +92,8 @@ BusRegistry*      bus_context_get_registry                       (BusContext
 BusConnections*   bus_context_get_connections                    (BusContext       *context);
 BusActivation*    bus_context_get_activation                     (BusContext       *context);
 BusMatchmaker*    bus_context_get_matchmaker                     (BusContext       *context);
+void              bus_context_get_accept_stats                   (BusContext            *context,
+                                                                  DBusServerAcceptStats *stats);
 DBusLoop*         bus_context_get_loop                           (BusContext       *context);
 DBusUserDatabase* bus_context_get_user_database                  (BusContext       *context);
 
@@ -104,7 +113,9 @@ int               bus_context_get_max_pending_activations        (BusContext
 int               bus_context_get_max_services_per_connection    (BusContext       *context);
 int               bus_context_get_max_match_rules_per_connection (BusContext       *context);
 int               bus_context_get_max_replies_per_connection     (BusContext       *context);
+long              bus_context_get_max_memory_per_user            (BusContext       *context);
 int               bus_context_get_reply_timeout                  (BusContext       *context);
+int               bus_context_get_dispatch_quantum               (BusContext       *context);
 dbus_bool_t       bus_context_check_security_policy              (BusContext       *context,
                                                                   BusTransaction   *transaction,
                                                                   DBusConnection   *sender,
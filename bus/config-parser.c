@@ -461,6 +461,7 @@ bus_config_parser_new (const DBusString      *basedir,
 
       /* Make up some numbers! woot! */
       parser->limits.max_incoming_bytes = _DBUS_ONE_MEGABYTE * 63;
+      parser->limits.max_incoming_unix_fds = 64 * 4;
       parser->limits.max_outgoing_bytes = _DBUS_ONE_MEGABYTE * 63;
       parser->limits.max_message_size = _DBUS_ONE_MEGABYTE * 32;
       
@@ -492,6 +493,26 @@ bus_config_parser_new (const DBusString      *basedir,
       
       parser->limits.reply_timeout = 5 * 60 * 1000; /* 5 minutes */
       parser->limits.max_replies_per_connection = 32;
+
+      /* Well above what max_connections_per_user connections can
+       * reach within their other limits, so this only matters when
+       * those are raised.
+       */
+      parser->limits.max_memory_per_user = _DBUS_ONE_MEGABYTE * 64;
+
+      /* Long enough that only a real stall gets logged */
+      parser->limits.stall_threshold = 1000; /* 1 second */
+
+      /* Small enough that one chatty client can't hold up everyone
+       * else for long, large enough that a busy client doesn't pay
+       * for an extra poll() every couple of messages.
+       */
+      parser->limits.dispatch_quantum = 16;
+
+      /* Enough that everyone reconnecting after a restart doesn't
+       * get refused while we work through them.
+       */
+      parser->limits.listen_backlog = 128;
     }
       
   parser->refcount = 1;
@@ -1779,6 +1800,11 @@ set_limit (BusConfigParser *parser,
       must_be_positive = TRUE;
       parser->limits.max_incoming_bytes = value;
     }
+  else if (strcmp (name, "max_incoming_unix_fds") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_incoming_unix_fds = value;
+    }
   else if (strcmp (name, "max_outgoing_bytes") == 0)
     {
       must_be_positive = TRUE;
@@ -1849,6 +1875,35 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_replies_per_connection = value;
     }
+  else if (strcmp (name, "max_memory_per_user") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_memory_per_user = value;
+    }
+  else if (strcmp (name, "dispatch_quantum") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.dispatch_quantum = value;
+    }
+  else if (strcmp (name, "prioritize_replies") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.prioritize_replies = value;
+    }
+  else if (strcmp (name, "stall_threshold") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.stall_threshold = value;
+    }
+  else if (strcmp (name, "listen_backlog") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.listen_backlog = value;
+    }
   else
     {
       dbus_set_error (error, DBUS_ERROR_FAILED,
@@ -2837,6 +2892,7 @@ limits_equal (const BusLimits *a,
 {
   return
     (a->max_incoming_bytes == b->max_incoming_bytes
+     || a->max_incoming_unix_fds == b->max_incoming_unix_fds
      || a->max_outgoing_bytes == b->max_outgoing_bytes
      || a->max_message_size == b->max_message_size
      || a->activation_timeout == b->activation_timeout
@@ -2848,7 +2904,12 @@ limits_equal (const BusLimits *a,
      || a->max_services_per_connection == b->max_services_per_connection
      || a->max_match_rules_per_connection == b->max_match_rules_per_connection
      || a->max_replies_per_connection == b->max_replies_per_connection
-     || a->reply_timeout == b->reply_timeout);
+     || a->max_memory_per_user == b->max_memory_per_user
+     || a->reply_timeout == b->reply_timeout
+     || a->dispatch_quantum == b->dispatch_quantum
+     || a->prioritize_replies == b->prioritize_replies
+     || a->listen_backlog == b->listen_backlog
+     || a->stall_threshold == b->stall_threshold);
 }
 
 static dbus_bool_t
@@ -30,7 +30,10 @@
 #include "selinux.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
+#include <dbus/dbus-mempool.h>
+#include <dbus/dbus-message-internal.h>
 #include <dbus/dbus-timeout.h>
+#include <string.h>
 
 static void bus_connection_remove_transactions (DBusConnection *connection);
 
@@ -53,12 +56,22 @@ struct BusConnections
   DBusList *incomplete; /**< List of all not-yet-active connections */
   int n_incomplete;     /**< Length of incomplete list */
   BusContext *context;
-  DBusHashTable *completed_by_user; /**< Number of completed connections for each UID */
+  DBusHashTable *completed_by_user; /**< BusUserData for each UID with completed connections */
   DBusTimeout *expire_timeout; /**< Timeout for expiring incomplete connections. */
   int stamp;                   /**< Incrementing number */
   BusExpireList *pending_replies; /**< List of pending replies */
+  BusConnectionStats totals;   /**< Message counts summed over all connections, peaks per connection */
 };
 
+/**
+ * What the connections of one UID hold between them
+ */
+typedef struct
+{
+  int n_connections; /**< Number of completed connections */
+  long bytes_held;   /**< Memory held by the bus for those connections */
+} BusUserData;
+
 static dbus_int32_t connection_data_slot = -1;
 
 typedef struct
@@ -81,8 +94,33 @@ typedef struct
   long connection_tv_sec;  /**< Time when we connected (seconds component) */
   long connection_tv_usec; /**< Time when we connected (microsec component) */
   int stamp;               /**< connections->stamp last time we were traversed */
+
+  long data_arrived_tv_sec;  /**< Time when incoming data became available or the last message was dispatched, 0 when the queue is empty */
+  long data_arrived_tv_usec; /**< Time when incoming data became available or the last message was dispatched (microsec component) */
+  DBusHistogram queue_wait;  /**< Time each message waited for its turn to be dispatched */
+  BusConnectionStats stats;  /**< Message counts and peaks for this connection */
+  BusConnectionMemory memory; /**< Memory the bus holds for this connection */
+  BusUserData *user;         /**< Totals for our UID while we are active, or #NULL */
 } BusConnectionData;
 
+/* Per-connection data is pooled so that the memory used by a burst of
+ * connections is returned once they disconnect.
+ */
+static BusLazyPool connection_data_pool =
+  BUS_LAZY_POOL_INIT (BusConnectionData);
+
+/**
+ * Fills in memory usage statistics for the per-connection data
+ * of all connections.
+ *
+ * @param stats return location for the statistics
+ */
+void
+bus_connection_get_data_pool_stats (DBusMemPoolStats *stats)
+{
+  bus_lazy_pool_get_stats (&connection_data_pool, stats);
+}
+
 static dbus_bool_t bus_pending_reply_expired (BusExpireList *list,
                                               DBusList      *link,
                                               void          *data);
@@ -109,17 +147,14 @@ static int
 get_connections_for_uid (BusConnections *connections,
                          dbus_uid_t      uid)
 {
-  void *val;
-  int current_count;
+  BusUserData *user;
 
-  /* val is NULL is 0 when it isn't in the hash yet */
+  /* a UID isn't in the hash until it has a connection */
   
-  val = _dbus_hash_table_lookup_ulong (connections->completed_by_user,
-                                       uid);
-
-  current_count = _DBUS_POINTER_TO_INT (val);
+  user = _dbus_hash_table_lookup_ulong (connections->completed_by_user,
+                                        uid);
 
-  return current_count;
+  return user != NULL ? user->n_connections : 0;
 }
 
 static dbus_bool_t
@@ -148,18 +183,50 @@ adjust_connections_for_uid (BusConnections *connections,
     }
   else
     {
-      dbus_bool_t retval;
-      
-      retval = _dbus_hash_table_insert_ulong (connections->completed_by_user,
-                                              uid, _DBUS_INT_TO_POINTER (current_count));
+      BusUserData *user;
 
-      /* only positive adjustment can fail as otherwise
-       * a hash entry should already exist
-       */
-      _dbus_assert (adjustment > 0 ||
-                    (adjustment <= 0 && retval));
+      user = _dbus_hash_table_lookup_ulong (connections->completed_by_user,
+                                            uid);
+      if (user == NULL)
+        {
+          /* only positive adjustment can fail as otherwise
+           * a hash entry should already exist
+           */
+          _dbus_assert (adjustment > 0);
+
+          user = dbus_new0 (BusUserData, 1);
+          if (user == NULL)
+            return FALSE;
 
-      return retval;
+          if (!_dbus_hash_table_insert_ulong (connections->completed_by_user,
+                                              uid, user))
+            {
+              dbus_free (user);
+              return FALSE;
+            }
+        }
+
+      user->n_connections = current_count;
+
+      return TRUE;
+    }
+}
+
+/* Charges memory held on behalf of a connection (or with a negative
+ * size, releases it) to one of its counters and to its UID.
+ */
+static void
+adjust_memory (BusConnectionData *d,
+               long              *counter,
+               long               size)
+{
+  *counter += size;
+  _dbus_assert (*counter >= 0);
+
+  if (d->user != NULL)
+    {
+      d->user->bytes_held += size;
+      _dbus_assert (d->user->bytes_held >= 0);
     }
 }
 
@@ -176,6 +243,10 @@ bus_connection_disconnected (DBusConnection *connection)
   _dbus_verbose ("%s disconnected, dropping all service ownership and releasing\n",
                  d->name ? d->name : "(inactive)");
 
+  _dbus_verbose ("%s dispatched %lu messages, longest queue wait %lu usec\n",
+                 d->name ? d->name : "(inactive)",
+                 d->queue_wait.count, d->queue_wait.max_usec);
+
   /* Delete our match rules */
   if (d->n_match_rules > 0)
     {
@@ -258,6 +329,13 @@ bus_connection_disconnected (DBusConnection *connection)
           d->link_in_connection_list = NULL;
           d->connections->n_completed -= 1;
 
+          if (d->user != NULL)
+            {
+              d->user->bytes_held -= bus_connection_memory_get_total (&d->memory);
+              _dbus_assert (d->user->bytes_held >= 0);
+              d->user = NULL;
+            }
+
           if (dbus_connection_get_unix_user (connection, &uid))
             {
               if (!adjust_connections_for_uid (d->connections,
@@ -359,12 +437,24 @@ dispatch_status_function (DBusConnection    *connection,
                           void              *data)
 {
   DBusLoop *loop = data;
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
   
   if (new_status != DBUS_DISPATCH_COMPLETE)
     {
+      if (d != NULL && d->data_arrived_tv_sec == 0)
+        _dbus_get_current_time (&d->data_arrived_tv_sec,
+                                &d->data_arrived_tv_usec);
+      
       while (!_dbus_loop_queue_dispatch (loop, connection))
         _dbus_wait_for_memory ();
     }
+  else if (d != NULL)
+    {
+      d->data_arrived_tv_sec = 0;
+      d->data_arrived_tv_usec = 0;
+    }
 }
 
 static dbus_bool_t
@@ -406,7 +496,7 @@ free_connection_data (void *data)
   
   dbus_free (d->name);
   
-  dbus_free (d);
+  bus_lazy_pool_dealloc (&connection_data_pool, d);
 }
 
 static void
@@ -430,7 +520,7 @@ bus_connections_new (BusContext *context)
     goto failed_1;
 
   connections->completed_by_user = _dbus_hash_table_new (DBUS_HASH_ULONG,
-                                                         NULL, NULL);
+                                                         NULL, dbus_free);
   if (connections->completed_by_user == NULL)
     goto failed_2;
 
@@ -543,13 +633,14 @@ bus_connections_setup_connection (BusConnections *connections,
   dbus_bool_t retval;
   DBusError error;
   
-  d = dbus_new0 (BusConnectionData, 1);
+  d = bus_lazy_pool_alloc (&connection_data_pool);
   
   if (d == NULL)
     return FALSE;
 
   d->connections = connections;
   d->connection = connection;
+  d->memory.connection_bytes = sizeof (BusConnectionData);
   
   _dbus_get_current_time (&d->connection_tv_sec,
                           &d->connection_tv_usec);
@@ -560,7 +651,7 @@ bus_connections_setup_connection (BusConnections *connections,
                                  connection_data_slot,
                                  d, free_connection_data))
     {
-      dbus_free (d);
+      bus_lazy_pool_dealloc (&connection_data_pool, d);
       return FALSE;
     }
 
@@ -838,6 +929,299 @@ bus_connection_is_in_group (DBusConnection *connection,
   return FALSE;
 }
 
+/**
+ * Called as each message from the connection is dispatched, to count
+ * it and record how long it sat in the incoming queue. The wait is
+ * measured from the moment the connection last went from having
+ * nothing to dispatch to having data, so with the dispatch quantum in
+ * effect it includes the time spent waiting for other connections to
+ * take their turn.
+ *
+ * @param connection the connection the message came from
+ * @param message the message
+ */
+void
+bus_connection_message_dispatched (DBusConnection *connection,
+                                   DBusMessage    *message)
+{
+  BusConnectionData *d;
+  long tv_sec, tv_usec;
+  int size;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  size = _dbus_message_get_size (message);
+  d->stats.n_messages_in += 1;
+  d->stats.n_bytes_in += size;
+  d->connections->totals.n_messages_in += 1;
+  d->connections->totals.n_bytes_in += size;
+
+  if (d->data_arrived_tv_sec == 0)
+    return;
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  _dbus_histogram_add (&d->queue_wait,
+                       _dbus_usec_since (d->data_arrived_tv_sec,
+                                         d->data_arrived_tv_usec,
+                                         tv_sec, tv_usec));
+
+  /* The next message's turn starts now; counting from when the queue
+   * filled up would charge it for everything dispatched before it.
+   */
+  d->data_arrived_tv_sec = tv_sec;
+  d->data_arrived_tv_usec = tv_usec;
+}
+
+/**
+ * Gets the histogram of time messages from this connection waited
+ * to be dispatched, counted from when they became available or the
+ * previous message was dispatched, whichever was later.
+ *
+ * @param connection the connection
+ * @returns the histogram, owned by the connection
+ */
+const DBusHistogram*
+bus_connection_get_queue_wait (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->queue_wait;
+}
+
+/**
+ * Gets the message counters and peaks kept for a connection.
+ *
+ * @param connection the connection
+ * @returns the statistics, owned by the connection
+ */
+const BusConnectionStats*
+bus_connection_get_stats (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->stats;
+}
+
+/**
+ * Gets statistics for all connections: the message counters summed
+ * over every connection there has been, and the largest peaks seen
+ * on any one connection.
+ *
+ * @param connections the connections object
+ * @param n_completed return location for the number of active connections
+ * @param n_incomplete return location for the number of connections
+ *        still authenticating
+ * @returns the statistics, owned by the connections object
+ */
+const BusConnectionStats*
+bus_connections_get_stats (BusConnections *connections,
+                           int            *n_completed,
+                           int            *n_incomplete)
+{
+  *n_completed = connections->n_completed;
+  *n_incomplete = connections->n_incomplete;
+
+  return &connections->totals;
+}
+
+/**
+ * Counts pending method call replies.
+ *
+ * @param connections the connections object
+ * @param will_get_reply only count replies owed to this connection,
+ *        or #NULL to count all of them
+ * @returns the number of pending replies
+ */
+int
+bus_connections_get_n_pending_replies (BusConnections *connections,
+                                       DBusConnection *will_get_reply)
+{
+  DBusList *link;
+  int count;
+
+  if (will_get_reply == NULL)
+    return _dbus_list_get_length (&connections->pending_replies->items);
+
+  count = 0;
+  link = _dbus_list_get_first_link (&connections->pending_replies->items);
+  while (link != NULL)
+    {
+      BusPendingReply *pending = link->data;
+
+      if (pending->will_get_reply == will_get_reply)
+        ++count;
+
+      link = _dbus_list_get_next_link (&connections->pending_replies->items,
+                                       link);
+    }
+
+  return count;
+}
+
+/**
+ * Adds up the memory counters of a connection.
+ *
+ * @param memory the counters
+ * @returns total bytes
+ */
+long
+bus_connection_memory_get_total (const BusConnectionMemory *memory)
+{
+  return memory->connection_bytes + memory->match_rule_bytes +
+    memory->name_bytes + memory->pending_reply_bytes;
+}
+
+/**
+ * Gets an estimate of the memory the bus holds on behalf of a
+ * connection. Messages queued on the connection are not included,
+ * they are limited and counted separately.
+ *
+ * @param connection the connection
+ * @returns the connection's memory counters
+ */
+const BusConnectionMemory*
+bus_connection_get_memory (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->memory;
+}
+
+/**
+ * Adds up the memory counters of all connections.
+ *
+ * @param connections the connections object
+ * @param total return location for the sums
+ */
+void
+bus_connections_get_memory (BusConnections      *connections,
+                            BusConnectionMemory *total)
+{
+  DBusList *lists[2];
+  DBusList *link;
+  int i;
+
+  _DBUS_ZERO (*total);
+
+  lists[0] = connections->completed;
+  lists[1] = connections->incomplete;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (lists); i++)
+    {
+      link = _dbus_list_get_first_link (&lists[i]);
+      while (link != NULL)
+        {
+          BusConnectionData *d = BUS_CONNECTION_DATA (link->data);
+
+          total->connection_bytes += d->memory.connection_bytes;
+          total->match_rule_bytes += d->memory.match_rule_bytes;
+          total->name_bytes += d->memory.name_bytes;
+          total->pending_reply_bytes += d->memory.pending_reply_bytes;
+
+          link = _dbus_list_get_next_link (&lists[i], link);
+        }
+    }
+}
+
+/**
+ * Gets the memory the bus holds for all active connections of a UID,
+ * see bus_connection_get_memory().
+ *
+ * @param connections the connections object
+ * @param uid the user
+ * @returns total bytes, 0 if the user has no active connections
+ */
+long
+bus_connections_get_memory_for_uid (BusConnections *connections,
+                                    unsigned long   uid)
+{
+  BusUserData *user;
+
+  user = _dbus_hash_table_lookup_ulong (connections->completed_by_user,
+                                        uid);
+
+  return user != NULL ? user->bytes_held : 0;
+}
+
+/**
+ * Finds the connection at the given address, if it is one of ours.
+ * Used to name the connection behind a main loop callback, whose
+ * data may or may not be a connection.
+ *
+ * @param connections the connections object
+ * @param pointer the address
+ * @returns the connection or #NULL
+ */
+DBusConnection*
+bus_connections_lookup (BusConnections *connections,
+                        void           *pointer)
+{
+  DBusList *lists[2];
+  DBusList *link;
+  int i;
+
+  lists[0] = connections->completed;
+  lists[1] = connections->incomplete;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (lists); i++)
+    {
+      link = _dbus_list_get_first_link (&lists[i]);
+      while (link != NULL)
+        {
+          if (link->data == pointer)
+            return link->data;
+
+          link = _dbus_list_get_next_link (&lists[i], link);
+        }
+    }
+
+  return NULL;
+}
+
+/**
+ * Checks whether the bus may hold another extra_bytes for the
+ * connection without exceeding the memory limit for its UID.
+ *
+ * @param connection the connection
+ * @param extra_bytes memory about to be taken
+ * @param error set if the limit would be exceeded
+ * @returns #FALSE if the limit would be exceeded
+ */
+dbus_bool_t
+bus_connection_check_memory_limit (DBusConnection *connection,
+                                   long            extra_bytes,
+                                   DBusError      *error)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (d->user != NULL &&
+      d->user->bytes_held + extra_bytes >
+      bus_context_get_max_memory_per_user (d->connections->context))
+    {
+      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "The maximum memory for the connections of this user "
+                      "has been reached (increase limits in configuration "
+                      "file if required)");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 BusClientPolicy*
 bus_connection_get_policy (DBusConnection *connection)
 {
@@ -1150,6 +1534,16 @@ bus_connection_add_match_rule_link (DBusConnection *connection,
   _dbus_list_append_link (&d->match_rules, link);
 
   d->n_match_rules += 1;
+
+  adjust_memory (d, &d->memory.match_rule_bytes,
+                 sizeof (DBusList) + bus_match_rule_get_size (link->data));
+
+  if (d->n_match_rules > d->stats.peak_match_rules)
+    {
+      d->stats.peak_match_rules = d->n_match_rules;
+      if (d->n_match_rules > d->connections->totals.peak_match_rules)
+        d->connections->totals.peak_match_rules = d->n_match_rules;
+    }
 }
 
 dbus_bool_t
@@ -1181,6 +1575,9 @@ bus_connection_remove_match_rule (DBusConnection *connection,
 
   d->n_match_rules -= 1;
   _dbus_assert (d->n_match_rules >= 0);
+
+  adjust_memory (d, &d->memory.match_rule_bytes,
+                 - (long) (sizeof (DBusList) + bus_match_rule_get_size (rule)));
 }
 
 int
@@ -1206,6 +1603,16 @@ bus_connection_add_owned_service_link (DBusConnection *connection,
   _dbus_list_append_link (&d->services_owned, link);
 
   d->n_services_owned += 1;
+
+  adjust_memory (d, &d->memory.name_bytes,
+                 sizeof (DBusList) + strlen (bus_service_get_name (link->data)) + 1);
+
+  if (d->n_services_owned > d->stats.peak_services_owned)
+    {
+      d->stats.peak_services_owned = d->n_services_owned;
+      if (d->n_services_owned > d->connections->totals.peak_services_owned)
+        d->connections->totals.peak_services_owned = d->n_services_owned;
+    }
 }
 
 dbus_bool_t
@@ -1237,6 +1644,9 @@ bus_connection_remove_owned_service (DBusConnection *connection,
 
   d->n_services_owned -= 1;
   _dbus_assert (d->n_services_owned >= 0);
+
+  adjust_memory (d, &d->memory.name_bytes,
+                 - (long) (sizeof (DBusList) + strlen (bus_service_get_name (service)) + 1));
 }
 
 int
@@ -1304,7 +1714,16 @@ bus_connection_complete (DBusConnection   *connection,
           d->name = NULL;
           return FALSE;
         }
+
+      d->user = _dbus_hash_table_lookup_ulong (d->connections->completed_by_user,
+                                               uid);
+      _dbus_assert (d->user != NULL);
+      d->user->bytes_held += bus_connection_memory_get_total (&d->memory);
     }
+
+  adjust_memory (d, &d->memory.connection_bytes,
+                 _dbus_string_get_length (name) + 1 +
+                 bus_client_policy_get_size (d->policy));
   
   /* Now the connection is active, move it between lists */
   _dbus_list_unlink (&d->connections->incomplete,
@@ -1376,15 +1795,25 @@ bus_connections_check_limits (BusConnections  *connections,
   return TRUE;
 }
 
+/* a pending reply and its link in the list of them */
+#define PENDING_REPLY_SIZE (sizeof (BusPendingReply) + sizeof (DBusList))
+
 static void
 bus_pending_reply_free (BusPendingReply *pending)
 {
+  BusConnectionData *d;
+
   _dbus_verbose ("Freeing pending reply %p, replier %p receiver %p serial %u\n",
                  pending,
                  pending->will_send_reply,
                  pending->will_get_reply,
                  pending->reply_serial);
 
+  d = BUS_CONNECTION_DATA (pending->will_get_reply);
+  if (d != NULL)
+    adjust_memory (d, &d->memory.pending_reply_bytes,
+                   - (long) PENDING_REPLY_SIZE);
+
   dbus_free (pending);
 }
 
@@ -1577,6 +2006,7 @@ bus_connections_expect_reply (BusConnections  *connections,
                               DBusError       *error)
 {
   BusPendingReply *pending;
+  BusConnectionData *d;
   dbus_uint32_t reply_serial;
   DBusList *link;
   CancelPendingReplyData *cprd;
@@ -1620,6 +2050,10 @@ bus_connections_expect_reply (BusConnections  *connections,
       return FALSE;
     }
 
+  if (!bus_connection_check_memory_limit (will_get_reply,
+                                          PENDING_REPLY_SIZE, error))
+    return FALSE;
+
   pending = dbus_new0 (BusPendingReply, 1);
   if (pending == NULL)
     {
@@ -1627,6 +2061,10 @@ bus_connections_expect_reply (BusConnections  *connections,
       return FALSE;
     }
 
+  /* from here on bus_pending_reply_free() releases this again */
+  d = BUS_CONNECTION_DATA (will_get_reply);
+  adjust_memory (d, &d->memory.pending_reply_bytes, PENDING_REPLY_SIZE);
+
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   /* so we can see a not-yet-added pending reply */
   pending->expire_item.added_tv_sec = 1;
@@ -2077,6 +2515,7 @@ connection_execute_transaction (DBusConnection *connection,
 {
   DBusList *link;
   BusConnectionData *d;
+  int size;
   
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
@@ -2094,6 +2533,12 @@ connection_execute_transaction (DBusConnection *connection,
                                   link);
 
           _dbus_assert (dbus_message_get_sender (m->message) != NULL);
+
+          size = _dbus_message_get_size (m->message);
+          d->stats.n_messages_out += 1;
+          d->stats.n_bytes_out += size;
+          d->connections->totals.n_messages_out += 1;
+          d->connections->totals.n_bytes_out += size;
           
           dbus_connection_send_preallocated (connection,
                                              m->preallocated,
@@ -26,11 +26,44 @@
 
 #include <dbus/dbus.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-mempool.h>
 #include "bus.h"
 
 typedef dbus_bool_t (* BusConnectionForeachFunction) (DBusConnection *connection, 
                                                       void           *data);
 
+/** Byte counter; 64-bit where we have it, busy buses pass 4GB */
+#ifdef DBUS_HAVE_INT64
+typedef dbus_uint64_t BusByteCount;
+#else
+typedef unsigned long BusByteCount;
+#endif
+
+/**
+ * Message counters and peaks kept for each connection, and summed
+ * (with the largest peaks) for all connections
+ */
+typedef struct
+{
+  unsigned long n_messages_in;  /**< Messages received from the connection */
+  BusByteCount n_bytes_in;      /**< Bytes of messages received */
+  unsigned long n_messages_out; /**< Messages sent to the connection */
+  BusByteCount n_bytes_out;     /**< Bytes of messages sent */
+  int peak_match_rules;         /**< Most match rules held at once */
+  int peak_services_owned;      /**< Most names owned at once */
+} BusConnectionStats;
+
+/**
+ * Estimate of the memory the bus holds on behalf of a connection
+ */
+typedef struct
+{
+  long connection_bytes;    /**< Connection data, unique name and security policy */
+  long match_rule_bytes;    /**< Match rules added by the connection */
+  long name_bytes;          /**< Bus names owned by the connection */
+  long pending_reply_bytes; /**< Replies the connection is waiting for */
+} BusConnectionMemory;
+
 
 BusConnections* bus_connections_new               (BusContext                   *context);
 BusConnections* bus_connections_ref               (BusConnections               *connections);
@@ -113,6 +146,33 @@ dbus_bool_t      bus_connection_get_groups  (DBusConnection       *connection,
                                              DBusError            *error);
 BusClientPolicy* bus_connection_get_policy  (DBusConnection       *connection);
 
+/* called by dispatch.c for each incoming message */
+void                 bus_connection_message_dispatched (DBusConnection *connection,
+                                                        DBusMessage    *message);
+const DBusHistogram* bus_connection_get_queue_wait     (DBusConnection *connection);
+
+const BusConnectionStats* bus_connection_get_stats              (DBusConnection *connection);
+const BusConnectionStats* bus_connections_get_stats             (BusConnections *connections,
+                                                                 int            *n_completed,
+                                                                 int            *n_incomplete);
+int                       bus_connections_get_n_pending_replies (BusConnections *connections,
+                                                                 DBusConnection *will_get_reply);
+
+long                       bus_connection_memory_get_total    (const BusConnectionMemory *memory);
+const BusConnectionMemory* bus_connection_get_memory          (DBusConnection            *connection);
+void                       bus_connections_get_memory         (BusConnections            *connections,
+                                                               BusConnectionMemory       *total);
+long                       bus_connections_get_memory_for_uid (BusConnections            *connections,
+                                                               unsigned long              uid);
+dbus_bool_t                bus_connection_check_memory_limit  (DBusConnection            *connection,
+                                                               long                       extra_bytes,
+                                                               DBusError                 *error);
+
+DBusConnection* bus_connections_lookup (BusConnections *connections,
+                                        void           *pointer);
+
+void bus_connection_get_data_pool_stats (DBusMemPoolStats *stats);
+
 /* transaction API so we can send or not send a block of messages as a whole */
 
 typedef void (* BusTransactionCancelFunction) (void *data);
@@ -31,6 +31,7 @@
 #include "utils.h"
 #include "bus.h"
 #include "signals.h"
+#include "stats.h"
 #include "test.h"
 #include <dbus/dbus-internals.h>
 #include <string.h>
@@ -51,6 +52,10 @@ send_one_message (DBusConnection *connection,
                                           message,
                                           NULL))
     return TRUE; /* silently don't send it */
+
+  if (dbus_message_contains_unix_fds (message) &&
+      !dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD))
+    return TRUE; /* silently don't send it */
   
   if (!bus_transaction_send (transaction,
                              connection,
@@ -289,6 +294,16 @@ bus_dispatch (DBusConnection *connection,
         {
           addressed_recipient = bus_service_get_primary_owners_connection (service);
           _dbus_assert (addressed_recipient != NULL);
+
+          if (dbus_message_contains_unix_fds (message) &&
+              !dbus_connection_can_send_type (addressed_recipient, DBUS_TYPE_UNIX_FD))
+            {
+              dbus_set_error (&error,
+                              DBUS_ERROR_NOT_SUPPORTED,
+                              "Tried to send message with Unix file descriptors "
+                              "to a client that doesn't support that.");
+              goto out;
+            }
           
           if (!bus_context_check_security_policy (context, transaction,
                                                   connection, addressed_recipient,
@@ -371,6 +386,8 @@ bus_dispatch_message_filter (DBusConnection     *connection,
                              DBusMessage        *message,
                              void               *user_data)
 {
+  bus_connection_message_dispatched (connection, message);
+  
   return bus_dispatch (connection, message);
 }
 
@@ -1039,45 +1056,1232 @@ check_double_hello_message (BusContext     *context,
   retval = TRUE;
   
  out:
-  dbus_error_free (&error);
-  
+  dbus_error_free (&error);
+  
+  if (message)
+    dbus_message_unref (message);
+  
+  return retval;
+}
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_get_connection_unix_user (BusContext     *context,
+                                DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+  DBusError error;
+  const char *base_service_name;
+  dbus_uint32_t uid;
+
+  retval = FALSE;
+  dbus_error_init (&error);
+  message = NULL;
+
+  _dbus_verbose ("check_get_connection_unix_user for %p\n", connection);
+  
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "GetConnectionUnixUser");
+
+  if (message == NULL)
+    return TRUE;
+
+  base_service_name = dbus_bus_get_unique_name (connection);
+
+  if (!dbus_message_append_args (message, 
+                                 DBUS_TYPE_STRING, &base_service_name,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  /* send our message */
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  dbus_connection_ref (connection); /* because we may get disconnected */
+  block_connection_until_message_from_bus (context, connection, "reply to GetConnectionUnixUser");
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected: %s %d\n", _DBUS_FUNCTION_NAME, __LINE__);
+      
+      dbus_connection_unref (connection);
+      
+      return TRUE;
+    }
+
+  dbus_connection_unref (connection);
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  "GetConnectionUnixUser", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else
+        {
+          warn_unexpected (connection, message, "not this error");
+
+          goto out;
+        }
+    }
+  else
+    {
+      if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+        {
+          ; /* good, expected */
+        }
+      else
+        {
+          warn_unexpected (connection, message,
+                           "method_return for GetConnectionUnixUser");
+
+          goto out;
+        }
+
+    retry_get_property:
+
+      if (!dbus_message_get_args (message, &error,
+                                  DBUS_TYPE_UINT32, &uid,
+                                  DBUS_TYPE_INVALID))
+        {
+          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+            {
+              _dbus_verbose ("no memory to get uid by GetConnectionUnixUser\n");
+              dbus_error_free (&error);
+              _dbus_wait_for_memory ();
+              goto retry_get_property;
+            }
+          else
+            {
+              _dbus_assert (dbus_error_is_set (&error));
+              _dbus_warn ("Did not get the expected DBUS_TYPE_UINT32 from GetConnectionUnixUser\n");
+              goto out;
+            }
+        }
+    }
+
+  if (!check_no_leftovers (context))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  dbus_error_free (&error);
+  
+  if (message)
+    dbus_message_unref (message);
+  
+  return retval;
+}
+
+#define N_BATCH_MESSAGES 3
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_send_batch (BusContext     *context,
+                  DBusConnection *connection)
+{
+  DBusMessage *messages[N_BATCH_MESSAGES];
+  dbus_uint32_t serials[N_BATCH_MESSAGES];
+  DBusMessage *message;
+  const char *name;
+  dbus_bool_t retval;
+  int i;
+
+  retval = FALSE;
+  message = NULL;
+  name = DBUS_SERVICE_DBUS;
+
+  _dbus_verbose ("check_send_batch for %p\n", connection);
+
+  for (i = 0; i < N_BATCH_MESSAGES; i++)
+    {
+      messages[i] = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                                  DBUS_PATH_DBUS,
+                                                  DBUS_INTERFACE_DBUS,
+                                                  "NameHasOwner");
+      if (messages[i] == NULL ||
+          !dbus_message_append_args (messages[i],
+                                     DBUS_TYPE_STRING, &name,
+                                     DBUS_TYPE_INVALID))
+        {
+          if (messages[i] != NULL)
+            dbus_message_unref (messages[i]);
+          while (i-- > 0)
+            dbus_message_unref (messages[i]);
+          return TRUE;
+        }
+    }
+
+  if (!dbus_connection_send_batch (connection, messages, N_BATCH_MESSAGES,
+                                   serials))
+    {
+      for (i = 0; i < N_BATCH_MESSAGES; i++)
+        dbus_message_unref (messages[i]);
+      return TRUE;
+    }
+
+  for (i = 0; i < N_BATCH_MESSAGES; i++)
+    dbus_message_unref (messages[i]);
+
+  for (i = 1; i < N_BATCH_MESSAGES; i++)
+    {
+      if (serials[i] <= serials[i - 1])
+        {
+          _dbus_warn ("Batch was not given serials in order\n");
+          return FALSE;
+        }
+    }
+
+  /* send our messages */
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+
+  dbus_connection_ref (connection); /* because we may get disconnected */
+
+  /* the replies have to come back in the order the calls were queued */
+  for (i = 0; i < N_BATCH_MESSAGES; i++)
+    {
+      block_connection_until_message_from_bus (context, connection, "reply to batched NameHasOwner");
+
+      if (!dbus_connection_get_is_connected (connection))
+        {
+          _dbus_verbose ("connection was disconnected: %s %d\n", _DBUS_FUNCTION_NAME, __LINE__);
+          retval = TRUE;
+          goto out;
+        }
+
+      message = pop_message_waiting_for_memory (connection);
+      if (message == NULL)
+        {
+          _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                      "NameHasOwner", serials[i], connection);
+          goto out;
+        }
+
+      verbose_message_received (connection, message);
+
+      if (dbus_message_get_reply_serial (message) != serials[i])
+        {
+          warn_unexpected (connection, message, "reply to the next batched message");
+          goto out;
+        }
+
+      if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+        {
+          if (!dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY))
+            {
+              warn_unexpected (connection, message, "not this error");
+              goto out;
+            }
+        }
+      else if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+        {
+          warn_unexpected (connection, message,
+                           "method_return for NameHasOwner");
+          goto out;
+        }
+
+      dbus_message_unref (message);
+      message = NULL;
+    }
+
+  if (!check_no_leftovers (context))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  dbus_connection_unref (connection);
+
+  return retval;
+}
+
+/* the bus's end of the connection a test client is using */
+static DBusConnection*
+get_bus_side_connection (BusContext     *context,
+                         DBusConnection *connection)
+{
+  DBusString name;
+  BusService *service;
+
+  _dbus_string_init_const (&name, dbus_bus_get_unique_name (connection));
+
+  service = bus_registry_lookup (bus_context_get_registry (context), &name);
+  if (service == NULL)
+    return NULL;
+
+  return bus_service_get_primary_owners_connection (service);
+}
+
+static dbus_bool_t
+send_name_has_owner (DBusConnection *connection)
+{
+  DBusMessage *message;
+  const char *name;
+  dbus_bool_t retval;
+
+  name = DBUS_SERVICE_DBUS;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "NameHasOwner");
+  if (message == NULL)
+    return FALSE;
+
+  retval = dbus_message_append_args (message,
+                                     DBUS_TYPE_STRING, &name,
+                                     DBUS_TYPE_INVALID) &&
+    dbus_connection_send (connection, message, NULL);
+
+  dbus_message_unref (message);
+
+  return retval;
+}
+
+/* pops n replies to NameHasOwner, which may be NoMemory errors */
+static dbus_bool_t
+pop_name_has_owner_replies (BusContext     *context,
+                            DBusConnection *connection,
+                            int             n)
+{
+  DBusMessage *message;
+
+  while (n-- > 0)
+    {
+      block_connection_until_message_from_bus (context, connection, "reply to NameHasOwner");
+
+      message = pop_message_waiting_for_memory (connection);
+      if (message == NULL)
+        {
+          _dbus_warn ("Did not receive a reply to NameHasOwner on %p\n",
+                      connection);
+          return FALSE;
+        }
+
+      verbose_message_received (connection, message);
+
+      if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+          !dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY))
+        {
+          warn_unexpected (connection, message, "method_return for NameHasOwner");
+          dbus_message_unref (message);
+          return FALSE;
+        }
+
+      dbus_message_unref (message);
+    }
+
+  return TRUE;
+}
+
+#define N_FLOOD_MESSAGES 32
+#define TEST_DISPATCH_QUANTUM 2
+
+/* A connection with a lot of queued messages must not hold up
+ * dispatching for another one: after a single main loop iteration has
+ * read from both, the connection with one message has been served
+ * while the flooding one still has messages left. The quantum is
+ * lowered for the test so that the first read from the flooder is
+ * sure to bring in more than one quantum's worth.
+ */
+static dbus_bool_t
+check_dispatch_quantum (BusContext     *context,
+                        DBusConnection *flooder,
+                        DBusConnection *connection)
+{
+  DBusLoop *loop;
+  DBusConnection *bus_flooder;
+  DBusConnection *bus_connection;
+  dbus_bool_t retval;
+  unsigned long n_flooder_in;
+  unsigned long n_connection_in;
+  int n_sent;
+
+  _dbus_verbose ("check_dispatch_quantum for %p and %p\n", flooder, connection);
+
+  bus_flooder = get_bus_side_connection (context, flooder);
+  bus_connection = get_bus_side_connection (context, connection);
+  if (bus_flooder == NULL || bus_connection == NULL)
+    {
+      _dbus_warn ("Could not find the bus side of the test connections\n");
+      return FALSE;
+    }
+
+  for (n_sent = 0; n_sent < N_FLOOD_MESSAGES; n_sent++)
+    {
+      if (!send_name_has_owner (flooder))
+        break;
+    }
+
+  if (n_sent <= TEST_DISPATCH_QUANTUM || !send_name_has_owner (connection))
+    {
+      /* out of memory, just clean up what we sent */
+      return pop_name_has_owner_replies (context, flooder, n_sent) &&
+        check_no_leftovers (context);
+    }
+
+  dbus_connection_flush (flooder);
+  dbus_connection_flush (connection);
+
+  n_flooder_in = bus_connection_get_stats (bus_flooder)->n_messages_in;
+  n_connection_in = bus_connection_get_stats (bus_connection)->n_messages_in;
+
+  retval = FALSE;
+  loop = bus_context_get_loop (context);
+  _dbus_loop_set_dispatch_quantum (loop, TEST_DISPATCH_QUANTUM);
+
+  _dbus_loop_iterate (loop, FALSE);
+
+  /* Both have been read from and served in this one iteration */
+  if (bus_connection_get_stats (bus_connection)->n_messages_in !=
+      n_connection_in + 1)
+    {
+      _dbus_warn ("Message from connection %p was not dispatched while %p was flooding the bus\n",
+                  connection, flooder);
+      goto out;
+    }
+
+  n_flooder_in = bus_connection_get_stats (bus_flooder)->n_messages_in -
+    n_flooder_in;
+  if (n_flooder_in == 0 || n_flooder_in > TEST_DISPATCH_QUANTUM)
+    {
+      _dbus_warn ("Connection %p got %lu messages dispatched in one iteration, quantum is %d\n",
+                  flooder, n_flooder_in, TEST_DISPATCH_QUANTUM);
+      goto out;
+    }
+
+  if (dbus_connection_get_dispatch_status (bus_connection) != DBUS_DISPATCH_COMPLETE)
+    {
+      _dbus_warn ("Connection %p was starved by %p flooding the bus\n",
+                  connection, flooder);
+      goto out;
+    }
+
+  if (dbus_connection_get_dispatch_status (bus_flooder) != DBUS_DISPATCH_DATA_REMAINS)
+    {
+      _dbus_warn ("Connection %p got more than a quantum of %d messages dispatched in one iteration\n",
+                  flooder, TEST_DISPATCH_QUANTUM);
+      goto out;
+    }
+
+  if (!pop_name_has_owner_replies (context, connection, 1) ||
+      !pop_name_has_owner_replies (context, flooder, n_sent))
+    goto out;
+
+  if (!check_no_leftovers (context))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  _dbus_loop_set_dispatch_quantum (loop, bus_context_get_dispatch_quantum (context));
+
+  return retval;
+}
+
+#define PADDING_SIZE (64 * 1024)
+#define MAX_PADDING_SIGNALS 256
+
+static DBusMessage*
+new_padding_signal (void)
+{
+  DBusMessage *message;
+  char *padding;
+  dbus_bool_t ok;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestSuite",
+                                     "org.freedesktop.TestSuite",
+                                     "Padding");
+  if (message == NULL)
+    return NULL;
+
+  padding = dbus_malloc0 (PADDING_SIZE);
+  if (padding == NULL)
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  ok = dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                 &padding, PADDING_SIZE,
+                                 DBUS_TYPE_INVALID);
+  dbus_free (padding);
+
+  if (!ok)
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  return message;
+}
+
+/* Like block_connection_until_message_from_bus(), but never blocks
+ * the bus: with a full socket the bus may not see it as writable
+ * again until the client has read a good part of it back out.
+ */
+static void
+spin_connection_until_message_from_bus (BusContext     *context,
+                                        DBusConnection *connection)
+{
+  while (dbus_connection_get_dispatch_status (connection) ==
+         DBUS_DISPATCH_COMPLETE &&
+         dbus_connection_get_is_connected (connection))
+    {
+      bus_test_run_bus_loop (context, FALSE);
+      _dbus_loop_iterate (bus_context_get_loop (context), FALSE);
+      bus_test_run_clients_loop (FALSE);
+    }
+}
+
+/* With reply prioritization on, a method return queued behind a
+ * backlog of signals the client has not read yet overtakes all of
+ * them except the one already being written.
+ */
+static dbus_bool_t
+check_prioritize_replies (BusContext     *context,
+                          DBusConnection *connection)
+{
+  DBusConnection *bus_connection;
+  DBusMessage *message;
+  dbus_uint32_t reply_serial;
+  int n_signals;
+  int n_before;
+  int n_after;
+  dbus_bool_t got_reply;
+  dbus_bool_t backed_up;
+  dbus_bool_t retval;
+  int i;
+
+  _dbus_verbose ("check_prioritize_replies for %p\n", connection);
+
+  bus_connection = get_bus_side_connection (context, connection);
+  if (bus_connection == NULL)
+    {
+      _dbus_warn ("Could not find the bus side of connection %p\n", connection);
+      return FALSE;
+    }
+
+  retval = FALSE;
+  dbus_connection_set_prioritize_replies (bus_connection, TRUE);
+
+  /* queue signals until the socket is full and a few whole ones are
+   * waiting behind the one being written
+   */
+  n_signals = 0;
+  while (n_signals < MAX_PADDING_SIGNALS &&
+         dbus_connection_get_outgoing_size (bus_connection) < 3 * PADDING_SIZE)
+    {
+      message = new_padding_signal ();
+      if (message == NULL)
+        break;
+
+      if (!dbus_connection_send (bus_connection, message, NULL))
+        {
+          dbus_message_unref (message);
+          break;
+        }
+
+      dbus_message_unref (message);
+      n_signals += 1;
+    }
+
+  backed_up = dbus_connection_get_outgoing_size (bus_connection) >= 3 * PADDING_SIZE;
+
+  message = dbus_message_new (DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  reply_serial = 1234;
+  if (message == NULL ||
+      !dbus_message_set_reply_serial (message, reply_serial) ||
+      !dbus_connection_send (bus_connection, message, NULL))
+    {
+      /* out of memory; drop what got queued */
+      if (message != NULL)
+        dbus_message_unref (message);
+      message = NULL;
+
+      for (i = 0; i < n_signals; i++)
+        {
+          spin_connection_until_message_from_bus (context, connection);
+          message = pop_message_waiting_for_memory (connection);
+          if (message == NULL)
+            goto out;
+          dbus_message_unref (message);
+          message = NULL;
+        }
+
+      retval = TRUE;
+      goto out;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  n_before = 0;
+  n_after = 0;
+  got_reply = FALSE;
+  for (i = 0; i < n_signals + 1; i++)
+    {
+      spin_connection_until_message_from_bus (context, connection);
+
+      message = pop_message_waiting_for_memory (connection);
+      if (message == NULL)
+        {
+          _dbus_warn ("Did not receive the padding signals and reply on %p\n",
+                      connection);
+          goto out;
+        }
+
+      if (dbus_message_is_signal (message, "org.freedesktop.TestSuite", "Padding"))
+        {
+          if (got_reply)
+            n_after += 1;
+          else
+            n_before += 1;
+        }
+      else if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+               dbus_message_get_reply_serial (message) == reply_serial)
+        {
+          got_reply = TRUE;
+        }
+      else
+        {
+          warn_unexpected (connection, message, "padding signal or reply");
+          goto out;
+        }
+
+      dbus_message_unref (message);
+      message = NULL;
+    }
+
+  _dbus_verbose ("reply came after %d and before %d of the padding signals\n",
+                 n_before, n_after);
+
+  if (dbus_connection_get_outgoing_size (bus_connection) > 0 || !got_reply)
+    {
+      _dbus_warn ("Not everything queued on %p arrived\n", connection);
+      goto out;
+    }
+
+  /* if the socket never filled up there was nothing to overtake */
+  if (backed_up && n_after == 0)
+    {
+      _dbus_warn ("Reply was sent after all %d queued signals\n", n_signals);
+      goto out;
+    }
+
+  if (!check_no_leftovers (context))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  dbus_connection_set_prioritize_replies (bus_connection, FALSE);
+
+  return retval;
+}
+
+/* A message whose unix fds would take what a connection's queued
+ * messages hold over the limit is refused at the transport with
+ * LimitsExceeded, and never reaches the bus.
+ */
+static dbus_bool_t
+check_unix_fd_limit (BusContext     *context,
+                     DBusConnection *connection)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  DBusConnection *bus_connection;
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+  long max_unix_fds;
+  int fd1, fd2;
+
+  if (!dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD))
+    {
+      _dbus_verbose ("connection %p can't pass unix fds, skipping check_unix_fd_limit\n",
+                     connection);
+      return TRUE;
+    }
+
+  _dbus_verbose ("check_unix_fd_limit for %p\n", connection);
+
+  bus_connection = get_bus_side_connection (context, connection);
+  if (bus_connection == NULL)
+    {
+      _dbus_warn ("Could not find the bus side of connection %p\n", connection);
+      return FALSE;
+    }
+
+  if (!_dbus_full_duplex_pipe (&fd1, &fd2, TRUE, NULL))
+    return TRUE;
+
+  retval = FALSE;
+  message = NULL;
+  max_unix_fds = dbus_connection_get_max_received_unix_fds (bus_connection);
+  dbus_connection_set_max_received_unix_fds (bus_connection, 1);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "NameHasOwner");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_UNIX_FD, &fd1,
+                                 DBUS_TYPE_UNIX_FD, &fd2,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (connection, message, &serial))
+    {
+      retval = TRUE;
+      goto out;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection, "reply to message with too many fds");
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_warn ("Connection %p was disconnected for sending too many fds\n",
+                  connection);
+      goto out;
+    }
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  "NameHasOwner", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_reply_serial (message) != serial ||
+      !(dbus_message_is_error (message, DBUS_ERROR_LIMITS_EXCEEDED) ||
+        dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY)))
+    {
+      warn_unexpected (connection, message, DBUS_ERROR_LIMITS_EXCEEDED);
+      goto out;
+    }
+
+  if (!check_no_leftovers (context))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  dbus_connection_set_max_received_unix_fds (bus_connection, max_unix_fds);
+
+  _dbus_close_socket (fd1, NULL);
+  _dbus_close_socket (fd2, NULL);
+
+  return retval;
+#else
+  return TRUE;
+#endif
+}
+
+#define BORROWED_ARRAY_LEN (64 * 1024)
+
+static void
+count_borrowed_free (void *data)
+{
+  int *n_frees = data;
+
+  *n_frees += 1;
+}
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_borrowed_array (BusContext     *context,
+                      DBusConnection *connection)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
+  unsigned char *array;
+  const char *name;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+  int n_frees;
+  int i;
+
+  retval = FALSE;
+  message = NULL;
+  name = DBUS_SERVICE_DBUS;
+  n_frees = 0;
+
+  _dbus_verbose ("check_borrowed_array for %p\n", connection);
+
+  array = dbus_malloc (BORROWED_ARRAY_LEN);
+  if (array == NULL)
+    return TRUE;
+
+  for (i = 0; i < BORROWED_ARRAY_LEN; i++)
+    array[i] = i;
+
+  /* The bus checks the signature, so it answers InvalidArgs; but it
+   * can only do that once the whole message has arrived intact, where
+   * a framing mistake would get us disconnected.
+   */
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "NameHasOwner");
+  if (message == NULL)
+    {
+      retval = TRUE;
+      goto out;
+    }
+
+  dbus_message_iter_init_append (message, &iter);
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &name) ||
+      !dbus_message_iter_append_borrowed_array (&iter, DBUS_TYPE_BYTE,
+                                                &array, BORROWED_ARRAY_LEN,
+                                                count_borrowed_free,
+                                                &n_frees))
+    {
+      dbus_message_unref (message);
+      message = NULL;
+      retval = TRUE;
+      goto out;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      message = NULL;
+      retval = TRUE;
+      goto out;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  /* send our message */
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+
+  dbus_connection_ref (connection); /* because we may get disconnected */
+
+  block_connection_until_message_from_bus (context, connection, "reply to NameHasOwner with a borrowed array");
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected: %s %d\n", _DBUS_FUNCTION_NAME, __LINE__);
+      dbus_connection_unref (connection);
+      retval = TRUE;
+      goto out;
+    }
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  "NameHasOwner", serial, connection);
+      goto out_unref;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_reply_serial (message) != serial)
+    {
+      warn_unexpected (connection, message, "reply to NameHasOwner");
+      goto out_unref;
+    }
+
+  if (!dbus_message_is_error (message, DBUS_ERROR_INVALID_ARGS) &&
+      !dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY))
+    {
+      warn_unexpected (connection, message,
+                       "InvalidArgs error for NameHasOwner");
+      goto out_unref;
+    }
+
+  if (n_frees != 1)
+    {
+      _dbus_warn ("Borrowed array was released %d times after sending\n",
+                  n_frees);
+      goto out_unref;
+    }
+
+  if (!check_no_leftovers (context))
+    goto out_unref;
+
+  retval = TRUE;
+
+ out_unref:
+  dbus_connection_unref (connection);
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  dbus_free (array);
+
+  return retval;
+}
+
+/* Looks up key in an a{sv} statistics reply; FALSE if it isn't
+ * there or its value doesn't have the given basic type
+ */
+static dbus_bool_t
+get_stats_value (DBusMessage *message,
+                 const char  *key,
+                 int          type,
+                 void        *value)
+{
+  DBusMessageIter iter, dict, entry, variant;
+  const char *name;
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_recurse (&iter, &dict);
+
+  while (dbus_message_iter_get_arg_type (&dict) == DBUS_TYPE_DICT_ENTRY)
+    {
+      dbus_message_iter_recurse (&dict, &entry);
+      dbus_message_iter_get_basic (&entry, &name);
+
+      if (strcmp (name, key) == 0)
+        {
+          dbus_message_iter_next (&entry);
+          dbus_message_iter_recurse (&entry, &variant);
+
+          if (dbus_message_iter_get_arg_type (&variant) != type)
+            return FALSE;
+
+          dbus_message_iter_get_basic (&variant, value);
+          return TRUE;
+        }
+
+      dbus_message_iter_next (&dict);
+    }
+
+  return FALSE;
+}
+
+/* Sends message and checks that the bus refuses it with
+ * LimitsExceeded (or NoMemory). Takes over the message.
+ */
+static dbus_bool_t
+check_send_exceeds_limits (BusContext     *context,
+                           DBusConnection *connection,
+                           DBusMessage    *message,
+                           const char     *what)
+{
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+
+  retval = FALSE;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection, what);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_warn ("Connection %p was disconnected instead of getting an error for %s\n",
+                  connection, what);
+      goto out;
+    }
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  what, serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_reply_serial (message) != serial ||
+      !(dbus_message_is_error (message, DBUS_ERROR_LIMITS_EXCEEDED) ||
+        dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY)))
+    {
+      warn_unexpected (connection, message, DBUS_ERROR_LIMITS_EXCEEDED);
+      goto out;
+    }
+
+  /* and nothing was delivered */
+  if (!check_no_leftovers (context))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
+/* With max_memory_per_user below what a connection already takes,
+ * the bus refuses anything that would hold more memory for it
+ */
+static dbus_bool_t
+check_memory_limit (BusContext     *context,
+                    DBusConnection *connection)
+{
+  DBusMessage *message;
+  const char *rule = "type='signal'";
+
+  _dbus_verbose ("check_memory_limit for %p\n", connection);
+
+  /* a match rule */
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "AddMatch");
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_message_append_args (message, DBUS_TYPE_STRING, &rule,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (!check_send_exceeds_limits (context, connection, message, "AddMatch"))
+    return FALSE;
+
+  /* a pending reply; the call is to ourselves, since any other
+   * client would have needed a match rule to see us connect
+   */
+  message = dbus_message_new_method_call (dbus_bus_get_unique_name (connection),
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Echo");
+  if (message == NULL)
+    return TRUE;
+
+  if (!check_send_exceeds_limits (context, connection, message,
+                                  "method call expecting a reply"))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_stats_method (BusContext     *context,
+                    DBusConnection *connection,
+                    const char     *method)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+  const char *base_service_name;
+
+  retval = FALSE;
+
+  _dbus_verbose ("check_stats_method %s for %p\n", method, connection);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          BUS_INTERFACE_STATS,
+                                          method);
+
+  if (message == NULL)
+    return TRUE;
+
+  /* GetConnectionStats is asked about ourselves */
+  base_service_name = dbus_bus_get_unique_name (connection);
+
+  if (strcmp (method, "GetConnectionStats") == 0 &&
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &base_service_name,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  /* send our message */
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  dbus_connection_ref (connection); /* because we may get disconnected */
+  block_connection_until_message_from_bus (context, connection, method);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected: %s %d\n", _DBUS_FUNCTION_NAME, __LINE__);
+
+      dbus_connection_unref (connection);
+
+      return TRUE;
+    }
+
+  dbus_connection_unref (connection);
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  method, serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else
+        {
+          warn_unexpected (connection, message, "not this error");
+
+          goto out;
+        }
+    }
+  else if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+           !dbus_message_has_signature (message, "a{sv}"))
+    {
+      warn_unexpected (connection, message, "a{sv} method_return");
+
+      goto out;
+    }
+  else
+    {
+      const char *key;
+      dbus_uint32_t n;
+#ifdef DBUS_HAVE_INT64
+      dbus_uint64_t n_bytes;
+#endif
+
+      /* we are connected, and we own at least our unique name */
+      if (strcmp (method, "GetConnectionStats") == 0)
+        key = "BusNames";
+      else
+        key = "ActiveConnections";
+
+      if (!get_stats_value (message, key, DBUS_TYPE_UINT32, &n) || n < 1)
+        {
+          _dbus_warn ("%s reply has no %s of at least 1\n", method, key);
+          goto out;
+        }
+
+#ifdef DBUS_HAVE_INT64
+      /* and the bus has received at least the Hello from us */
+      if (!get_stats_value (message, "IncomingBytes", DBUS_TYPE_UINT64,
+                            &n_bytes) || n_bytes == 0)
+        {
+          _dbus_warn ("%s reply has no 64-bit IncomingBytes above 0\n",
+                      method);
+          goto out;
+        }
+#endif
+    }
+
+  if (!check_no_leftovers (context))
+    goto out;
+
+  retval = TRUE;
+
+ out:
   if (message)
     dbus_message_unref (message);
-  
+
   return retval;
 }
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
+/* The driver defaults to its own interface for calls without one;
+ * the system bus policy must let those through too. returns TRUE if
+ * the correct thing happens, but the correct thing may include OOM
+ * errors.
  */
 static dbus_bool_t
-check_get_connection_unix_user (BusContext     *context,
-                                DBusConnection *connection)
+check_interfaceless_driver_call (BusContext     *context,
+                                 DBusConnection *connection)
 {
   DBusMessage *message;
   dbus_uint32_t serial;
   dbus_bool_t retval;
   DBusError error;
   const char *base_service_name;
-  dbus_uint32_t uid;
+  const char *owner;
 
   retval = FALSE;
   dbus_error_init (&error);
-  message = NULL;
 
-  _dbus_verbose ("check_get_connection_unix_user for %p\n", connection);
-  
+  _dbus_verbose ("check_interfaceless_driver_call for %p\n", connection);
+
   message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
                                           DBUS_PATH_DBUS,
-                                          DBUS_INTERFACE_DBUS,
-                                          "GetConnectionUnixUser");
+                                          NULL,
+                                          "GetNameOwner");
 
   if (message == NULL)
     return TRUE;
 
   base_service_name = dbus_bus_get_unique_name (connection);
 
-  if (!dbus_message_append_args (message, 
+  if (!dbus_message_append_args (message,
                                  DBUS_TYPE_STRING, &base_service_name,
                                  DBUS_TYPE_INVALID))
     {
@@ -1098,14 +2302,15 @@ check_get_connection_unix_user (BusContext     *context,
   message = NULL;
 
   dbus_connection_ref (connection); /* because we may get disconnected */
-  block_connection_until_message_from_bus (context, connection, "reply to GetConnectionUnixUser");
+  block_connection_until_message_from_bus (context, connection,
+                                           "reply to GetNameOwner without interface");
 
   if (!dbus_connection_get_is_connected (connection))
     {
       _dbus_verbose ("connection was disconnected: %s %d\n", _DBUS_FUNCTION_NAME, __LINE__);
-      
+
       dbus_connection_unref (connection);
-      
+
       return TRUE;
     }
 
@@ -1115,7 +2320,7 @@ check_get_connection_unix_user (BusContext     *context,
   if (message == NULL)
     {
       _dbus_warn ("Did not receive a reply to %s %d on %p\n",
-                  "GetConnectionUnixUser", serial, connection);
+                  "GetNameOwner", serial, connection);
       goto out;
     }
 
@@ -1134,40 +2339,39 @@ check_get_connection_unix_user (BusContext     *context,
           goto out;
         }
     }
-  else
+  else if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
     {
-      if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
-        {
-          ; /* good, expected */
-        }
-      else
-        {
-          warn_unexpected (connection, message,
-                           "method_return for GetConnectionUnixUser");
+      warn_unexpected (connection, message, "method_return for GetNameOwner");
 
-          goto out;
-        }
-
-    retry_get_property:
+      goto out;
+    }
+  else
+    {
+    retry_get_owner:
 
       if (!dbus_message_get_args (message, &error,
-                                  DBUS_TYPE_UINT32, &uid,
+                                  DBUS_TYPE_STRING, &owner,
                                   DBUS_TYPE_INVALID))
         {
           if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
             {
-              _dbus_verbose ("no memory to get uid by GetConnectionUnixUser\n");
               dbus_error_free (&error);
               _dbus_wait_for_memory ();
-              goto retry_get_property;
+              goto retry_get_owner;
             }
           else
             {
-              _dbus_assert (dbus_error_is_set (&error));
-              _dbus_warn ("Did not get the expected DBUS_TYPE_UINT32 from GetConnectionUnixUser\n");
+              _dbus_warn ("Did not get the expected owner from GetNameOwner\n");
               goto out;
             }
         }
+
+      if (strcmp (owner, base_service_name) != 0)
+        {
+          _dbus_warn ("GetNameOwner said %s owns %s\n",
+                      owner, base_service_name);
+          goto out;
+        }
     }
 
   if (!check_no_leftovers (context))
@@ -1177,13 +2381,145 @@ check_get_connection_unix_user (BusContext     *context,
 
  out:
   dbus_error_free (&error);
-  
+
   if (message)
     dbus_message_unref (message);
-  
+
   return retval;
 }
 
+typedef struct
+{
+  dbus_bool_t failed;
+  dbus_bool_t have_uid;
+  unsigned long uid;
+  long uid_bytes;
+} CheckMemoryData;
+
+static dbus_bool_t
+check_memory_foreach (DBusConnection *connection,
+                      void           *data)
+{
+  CheckMemoryData *d = data;
+  const BusConnectionMemory *memory;
+  unsigned long uid;
+
+  memory = bus_connection_get_memory (connection);
+
+  /* every active connection has a unique name and a policy */
+  if (memory->connection_bytes <= 0 || memory->name_bytes <= 0 ||
+      (bus_connection_get_n_match_rules (connection) > 0) !=
+      (memory->match_rule_bytes > 0))
+    {
+      _dbus_warn ("Memory of %s not accounted for: %ld %ld %ld\n",
+                  bus_connection_get_name (connection),
+                  memory->connection_bytes, memory->name_bytes,
+                  memory->match_rule_bytes);
+      d->failed = TRUE;
+      return FALSE;
+    }
+
+  if (dbus_connection_get_unix_user (connection, &uid))
+    {
+      if (!d->have_uid)
+        {
+          d->have_uid = TRUE;
+          d->uid = uid;
+        }
+
+      if (uid == d->uid)
+        d->uid_bytes += bus_connection_memory_get_total (memory);
+    }
+
+  return TRUE;
+}
+
+/* The per-user total is kept up to date as connections change, check
+ * it against the connections themselves.
+ */
+static dbus_bool_t
+check_memory_accounting (BusContext *context)
+{
+  BusConnections *connections;
+  CheckMemoryData d;
+  long held;
+
+  _DBUS_ZERO (d);
+  connections = bus_context_get_connections (context);
+
+  bus_connections_foreach_active (connections, check_memory_foreach, &d);
+
+  if (d.failed)
+    return FALSE;
+
+  if (d.have_uid)
+    {
+      held = bus_connections_get_memory_for_uid (connections, d.uid);
+      if (held != d.uid_bytes)
+        {
+          _dbus_warn ("UID %lu holds %ld bytes but its connections add up to %ld\n",
+                      d.uid, held, d.uid_bytes);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+count_stalls_function (const char *kind,
+                       int         fd,
+                       void       *callback_data,
+                       long        usec,
+                       void       *data)
+{
+  int *n_stalls = data;
+
+  *n_stalls += 1;
+}
+
+/* Leaves the loop with no stall function, so only use it when
+ * nothing else will be checked for stalls.
+ */
+static dbus_bool_t
+check_loop_stats (BusContext     *context,
+                  DBusConnection *connection)
+{
+  DBusLoop *loop;
+  const DBusLoopStats *stats;
+  unsigned long n_stalls_before;
+  int n_stalls;
+
+  loop = bus_context_get_loop (context);
+  stats = _dbus_loop_get_stats (loop);
+
+  if (stats->iteration.count == 0 || stats->poll_wait.count == 0 ||
+      stats->watch.count == 0 || stats->dispatch.count == 0)
+    {
+      _dbus_warn ("Main loop time was not recorded\n");
+      return FALSE;
+    }
+
+  /* with a 1us threshold, anything the bus does is a stall */
+  n_stalls = 0;
+  n_stalls_before = stats->n_stalls;
+  _dbus_loop_set_stall_function (loop, 1, count_stalls_function, &n_stalls);
+
+  if (!check_stats_method (context, connection, "GetStats"))
+    return FALSE;
+
+  _dbus_loop_set_stall_function (loop, 0, NULL, NULL);
+
+  if (n_stalls == 0 || stats->n_stalls - n_stalls_before != (unsigned long) n_stalls)
+    {
+      _dbus_warn ("Stall function called %d times for %lu stalls\n",
+                  n_stalls, stats->n_stalls - n_stalls_before);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /* returns TRUE if the correct thing happens,
  * but the correct thing may include OOM errors.
  */
@@ -1517,6 +2853,112 @@ check_hello_connection (BusContext *context)
   return TRUE;
 }
 
+#define N_HELLO_TRIALS 100
+
+/* Opens a connection, sends Hello straight away and spins until the
+ * reply comes back, returning how many times the bus had to run
+ * before it did, i.e. the round trips from connect to first reply.
+ */
+static int
+hello_round_trips (BusContext  *context,
+                   dbus_bool_t  pipelined)
+{
+  DBusConnection *connection;
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  DBusError error;
+  int round_trips;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private ("debug-pipe:name=test-server", &error);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (pipelined && !dbus_connection_set_pipelined_auth (connection))
+    _dbus_assert_not_reached ("could not pipeline auth");
+
+  if (!bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "Hello");
+  if (message == NULL ||
+      !dbus_connection_send (connection, message, &serial))
+    _dbus_assert_not_reached ("could not send Hello");
+
+  dbus_message_unref (message);
+
+  round_trips = 0;
+  message = NULL;
+  while (dbus_connection_get_is_connected (connection))
+    {
+      bus_test_run_clients_loop (FALSE);
+
+      message = pop_message_waiting_for_memory (connection);
+      if (message != NULL)
+        break;
+
+      bus_test_run_bus_loop (context, FALSE);
+      round_trips += 1;
+    }
+
+  if (message == NULL ||
+      dbus_message_get_reply_serial (message) != serial)
+    _dbus_assert_not_reached ("no reply to Hello");
+
+  /* throw away NameAcquired */
+  while (message != NULL)
+    {
+      dbus_message_unref (message);
+      message = pop_message_waiting_for_memory (connection);
+    }
+
+  kill_client_connection_unchecked (connection);
+  bus_test_run_bus_loop (context, FALSE);
+
+  return round_trips;
+}
+
+/* Compares connect-to-first-reply latency with and without
+ * pipelined auth. Over the in-process pipe the time is mostly CPU,
+ * so the round trips are what matters for a real socket.
+ */
+static void
+check_pipelined_auth (BusContext *context)
+{
+  long start_tv_sec, start_tv_usec;
+  long end_tv_sec, end_tv_usec;
+  long classic_usec, pipelined_usec;
+  int classic_round_trips, pipelined_round_trips;
+  int i;
+
+  _dbus_get_current_time (&start_tv_sec, &start_tv_usec);
+  for (i = 0; i < N_HELLO_TRIALS; i++)
+    classic_round_trips = hello_round_trips (context, FALSE);
+  _dbus_get_current_time (&end_tv_sec, &end_tv_usec);
+  classic_usec = ((end_tv_sec - start_tv_sec) * 1000000 +
+                  (end_tv_usec - start_tv_usec)) / N_HELLO_TRIALS;
+
+  _dbus_get_current_time (&start_tv_sec, &start_tv_usec);
+  for (i = 0; i < N_HELLO_TRIALS; i++)
+    pipelined_round_trips = hello_round_trips (context, TRUE);
+  _dbus_get_current_time (&end_tv_sec, &end_tv_usec);
+  pipelined_usec = ((end_tv_sec - start_tv_sec) * 1000000 +
+                    (end_tv_usec - start_tv_usec)) / N_HELLO_TRIALS;
+
+  printf ("connect to first reply: %d round trips %ld usec classic, "
+          "%d round trips %ld usec pipelined\n",
+          classic_round_trips, classic_usec,
+          pipelined_round_trips, pipelined_usec);
+
+  if (pipelined_round_trips != 1 ||
+      classic_round_trips <= pipelined_round_trips)
+    _dbus_assert_not_reached ("pipelined auth didn't save round trips");
+}
+
 #define NONEXISTENT_SERVICE_NAME "test.this.service.does.not.exist.ewuoiurjdfxcvn"
 
 /* returns TRUE if the correct thing happens,
@@ -3998,6 +5440,9 @@ bus_dispatch_test (const DBusString *test_data_dir)
                                   "valid-config-files/debug-allow-all.conf");
   if (context == NULL)
     return FALSE;
+
+  /* before anyone else is around to see the new connections */
+  check_pipelined_auth (context);
   
   foo = dbus_connection_open_private ("debug-pipe:name=test-server", &error);
   if (foo == NULL)
@@ -4055,6 +5500,30 @@ bus_dispatch_test (const DBusString *test_data_dir)
 
   if (!check_list_services (context, baz))
     _dbus_assert_not_reached ("ListActivatableNames message failed");
+
+  if (!check_send_batch (context, baz))
+    _dbus_assert_not_reached ("batch of NameHasOwner messages failed");
+
+  if (!check_borrowed_array (context, baz))
+    _dbus_assert_not_reached ("NameHasOwner with a borrowed array failed");
+
+  if (!check_dispatch_quantum (context, foo, bar))
+    _dbus_assert_not_reached ("flooding connection starved another one");
+
+  if (!check_prioritize_replies (context, baz))
+    _dbus_assert_not_reached ("reply was not sent ahead of queued signals");
+
+  if (!check_unix_fd_limit (context, foo))
+    _dbus_assert_not_reached ("too many unix fds were not refused");
+
+  if (!check_stats_method (context, baz, "GetStats"))
+    _dbus_assert_not_reached ("GetStats message failed");
+
+  if (!check_stats_method (context, baz, "GetConnectionStats"))
+    _dbus_assert_not_reached ("GetConnectionStats message failed");
+
+  if (!check_memory_accounting (context))
+    _dbus_assert_not_reached ("connection memory accounting is off");
   
   if (!check_no_leftovers (context))
     {
@@ -4098,6 +5567,24 @@ bus_dispatch_test (const DBusString *test_data_dir)
   if (!check_shell_service_success_auto_start (context, foo))
     _dbus_assert_not_reached ("shell success service auto start failed");
 
+  {
+    const BusActivationLatency *latency;
+
+    /* the two successful activations above each went through every step */
+    latency = bus_activation_get_latency (bus_context_get_activation (context));
+    if (latency->spawn.count < 2 || latency->exec.count < 2 ||
+        latency->name.count < 2 || latency->total.count < 2 ||
+        latency->lookup.count < latency->spawn.count)
+      _dbus_assert_not_reached ("activation latencies were not recorded");
+  }
+
+  /* services came and went, some of them under OOM */
+  if (!check_memory_accounting (context))
+    _dbus_assert_not_reached ("connection memory accounting is off");
+
+  if (!check_loop_stats (context, baz))
+    _dbus_assert_not_reached ("main loop statistics are off");
+
   _dbus_verbose ("Disconnecting foo, bar, and baz\n");
 
   kill_client_connection_unchecked (foo);
@@ -4157,4 +5644,92 @@ bus_dispatch_sha1_test (const DBusString *test_data_dir)
   return TRUE;
 }
 
+dbus_bool_t
+bus_dispatch_memory_limit_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-memory-limit.conf");
+  if (context == NULL)
+    return FALSE;
+
+  foo = dbus_connection_open_private ("debug-pipe:name=test-server", &error);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, foo);
+
+  if (!check_hello_message (context, foo))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_no_leftovers (context))
+    {
+      _dbus_warn ("Messages were left over after setting up initial connection\n");
+      _dbus_assert_not_reached ("initial connection setup failed");
+    }
+
+  if (!check_memory_limit (context, foo))
+    _dbus_assert_not_reached ("memory limit was not enforced");
+
+  kill_client_connection_unchecked (foo);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_dispatch_system_policy_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-system-policy.conf");
+  if (context == NULL)
+    return FALSE;
+
+  foo = dbus_connection_open_private ("debug-pipe:name=test-server", &error);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, foo);
+
+  if (!check_hello_message (context, foo))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_no_leftovers (context))
+    {
+      _dbus_warn ("Messages were left over after setting up initial connection\n");
+      _dbus_assert_not_reached ("initial connection setup failed");
+    }
+
+  if (!check_interfaceless_driver_call (context, foo))
+    _dbus_assert_not_reached ("driver call without interface was refused");
+
+  /* we run as the same user as the bus */
+  if (!check_stats_method (context, foo, "GetStats"))
+    _dbus_assert_not_reached ("bus statistics were refused");
+
+  kill_client_connection_unchecked (foo);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
 #endif /* DBUS_BUILD_TESTS */
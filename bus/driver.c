@@ -29,6 +29,7 @@
 #include "services.h"
 #include "selinux.h"
 #include "signals.h"
+#include "stats.h"
 #include "utils.h"
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-internals.h>
@@ -852,6 +853,12 @@ bus_driver_handle_add_match (DBusConnection *connection,
   if (rule == NULL)
     goto failed;
 
+  if (!bus_connection_check_memory_limit (connection,
+                                          sizeof (DBusList) +
+                                          bus_match_rule_get_size (rule),
+                                          error))
+    goto failed;
+
   matchmaker = bus_connection_get_matchmaker (connection);
 
   if (!bus_matchmaker_add_rule (matchmaker, rule))
@@ -1386,7 +1393,7 @@ bus_driver_handle_reload_config (DBusConnection *connection,
  * frequency of use (but doesn't matter with only a few items
  * anyhow)
  */
-struct
+typedef struct
 {
   const char *name;
   const char *in_args;
@@ -1395,7 +1402,9 @@ struct
                            BusTransaction *transaction,
                            DBusMessage    *message,
                            DBusError      *error);
-} message_handlers[] = {
+} MessageHandler;
+
+static const MessageHandler dbus_message_handlers[] = {
   { "RequestName",
     DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UINT32_AS_STRING,
     DBUS_TYPE_UINT32_AS_STRING,
@@ -1458,6 +1467,34 @@ struct
     bus_driver_handle_reload_config }
 };
 
+/* Only root may call these by default, see the bus configuration */
+static const MessageHandler stats_message_handlers[] = {
+  { "GetStats",
+    "",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+    DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+    DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_stats_handle_get_stats },
+  { "GetConnectionStats",
+    DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+    DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+    DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_stats_handle_get_connection_stats }
+};
+
+static const struct
+{
+  const char *name;
+  const MessageHandler *handlers;
+  int n_handlers;
+} interface_handlers[] = {
+  { DBUS_INTERFACE_DBUS,
+    dbus_message_handlers, _DBUS_N_ELEMENTS (dbus_message_handlers) },
+  { BUS_INTERFACE_STATS,
+    stats_message_handlers, _DBUS_N_ELEMENTS (stats_message_handlers) }
+};
+
 static dbus_bool_t
 write_args_for_direction (DBusString *xml,
 			  const char *signature,
@@ -1493,6 +1530,35 @@ write_args_for_direction (DBusString *xml,
   return FALSE;
 }
 
+static dbus_bool_t
+write_methods (DBusString           *xml,
+               const MessageHandler *handlers,
+               int                   n_handlers)
+{
+  int i;
+
+  i = 0;
+  while (i < n_handlers)
+    {
+      if (!_dbus_string_append_printf (xml, "    <method name=\"%s\">\n",
+                                       handlers[i].name))
+        return FALSE;
+
+      if (!write_args_for_direction (xml, handlers[i].in_args, TRUE))
+	return FALSE;
+
+      if (!write_args_for_direction (xml, handlers[i].out_args, FALSE))
+	return FALSE;
+
+      if (!_dbus_string_append (xml, "    </method>\n"))
+	return FALSE;
+      
+      ++i;
+    }
+
+  return TRUE;
+}
+
 dbus_bool_t
 bus_driver_generate_introspect_string (DBusString *xml)
 {
@@ -1517,25 +1583,9 @@ bus_driver_generate_introspect_string (DBusString *xml)
                                    DBUS_INTERFACE_DBUS))
     return FALSE;
 
-  i = 0;
-  while (i < _DBUS_N_ELEMENTS (message_handlers))
-    {
-	  
-      if (!_dbus_string_append_printf (xml, "    <method name=\"%s\">\n",
-                                       message_handlers[i].name))
-        return FALSE;
-
-      if (!write_args_for_direction (xml, message_handlers[i].in_args, TRUE))
-	return FALSE;
-
-      if (!write_args_for_direction (xml, message_handlers[i].out_args, FALSE))
-	return FALSE;
-
-      if (!_dbus_string_append (xml, "    </method>\n"))
-	return FALSE;
-      
-      ++i;
-    }
+  if (!write_methods (xml, dbus_message_handlers,
+                      _DBUS_N_ELEMENTS (dbus_message_handlers)))
+    return FALSE;
 
   if (!_dbus_string_append_printf (xml, "    <signal name=\"NameOwnerChanged\">\n"))
     return FALSE;
@@ -1576,6 +1626,24 @@ bus_driver_generate_introspect_string (DBusString *xml)
 
   if (!_dbus_string_append (xml, "  </interface>\n"))
     return FALSE;
+
+  /* the other interfaces have methods only */
+  i = 1;
+  while (i < _DBUS_N_ELEMENTS (interface_handlers))
+    {
+      if (!_dbus_string_append_printf (xml, "  <interface name=\"%s\">\n",
+                                       interface_handlers[i].name))
+        return FALSE;
+
+      if (!write_methods (xml, interface_handlers[i].handlers,
+                          interface_handlers[i].n_handlers))
+        return FALSE;
+
+      if (!_dbus_string_append (xml, "  </interface>\n"))
+        return FALSE;
+
+      ++i;
+    }
   
   if (!_dbus_string_append (xml, "</node>\n"))
     return FALSE;
@@ -1652,6 +1720,8 @@ bus_driver_handle_message (DBusConnection *connection,
                            DBusError      *error)
 {
   const char *name, *sender, *interface;
+  const MessageHandler *handlers;
+  int n_handlers;
   int i;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
@@ -1676,8 +1746,21 @@ bus_driver_handle_message (DBusConnection *connection,
   name = dbus_message_get_member (message);
   sender = dbus_message_get_sender (message);
   
-  if (strcmp (interface,
-              DBUS_INTERFACE_DBUS) != 0)
+  handlers = NULL;
+  n_handlers = 0;
+  i = 0;
+  while (i < _DBUS_N_ELEMENTS (interface_handlers))
+    {
+      if (strcmp (interface_handlers[i].name, interface) == 0)
+        {
+          handlers = interface_handlers[i].handlers;
+          n_handlers = interface_handlers[i].n_handlers;
+          break;
+        }
+      ++i;
+    }
+
+  if (handlers == NULL)
     {
       _dbus_verbose ("Driver got message to unknown interface \"%s\"\n",
                      interface);
@@ -1691,28 +1774,28 @@ bus_driver_handle_message (DBusConnection *connection,
   _dbus_assert (sender != NULL || strcmp (name, "Hello") == 0);
   
   i = 0;
-  while (i < _DBUS_N_ELEMENTS (message_handlers))
+  while (i < n_handlers)
     {
-      if (strcmp (message_handlers[i].name, name) == 0)
+      if (strcmp (handlers[i].name, name) == 0)
         {
           _dbus_verbose ("Found driver handler for %s\n", name);
 
-          if (!dbus_message_has_signature (message, message_handlers[i].in_args))
+          if (!dbus_message_has_signature (message, handlers[i].in_args))
             {
               _DBUS_ASSERT_ERROR_IS_CLEAR (error);
               _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
                              name, dbus_message_get_signature (message),
-                             message_handlers[i].in_args);
+                             handlers[i].in_args);
               
               dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
                               "Call to %s has wrong args (%s, expected %s)\n",
                               name, dbus_message_get_signature (message),
-                              message_handlers[i].in_args);
+                              handlers[i].in_args);
               _DBUS_ASSERT_ERROR_IS_SET (error);
               return FALSE;
             }
           
-          if ((* message_handlers[i].handler) (connection, transaction, message, error))
+          if ((* handlers[i].handler) (connection, transaction, message, error))
             {
               _DBUS_ASSERT_ERROR_IS_CLEAR (error);
               _dbus_verbose ("Driver handler succeeded\n");
@@ -27,15 +27,32 @@
 #include "utils.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
+#include <dbus/dbus-mempool.h>
 #include <dbus/dbus-internals.h>
 
+/* A large configuration has thousands of policy rules, and all of
+ * them are replaced on every reload.
+ */
+static BusLazyPool rule_pool = BUS_LAZY_POOL_INIT (BusPolicyRule);
+
+/**
+ * Fills in memory usage statistics for all policy rules.
+ *
+ * @param stats return location for the statistics
+ */
+void
+bus_policy_rule_get_pool_stats (DBusMemPoolStats *stats)
+{
+  bus_lazy_pool_get_stats (&rule_pool, stats);
+}
+
 BusPolicyRule*
 bus_policy_rule_new (BusPolicyRuleType type,
                      dbus_bool_t       allow)
 {
   BusPolicyRule *rule;
 
-  rule = dbus_new0 (BusPolicyRule, 1);
+  rule = bus_lazy_pool_alloc (&rule_pool);
   if (rule == NULL)
     return NULL;
 
@@ -117,7 +134,7 @@ bus_policy_rule_unref (BusPolicyRule *rule)
           break;
         }
       
-      dbus_free (rule);
+      bus_lazy_pool_dealloc (&rule_pool, rule);
     }
 }
 
@@ -707,6 +724,21 @@ bus_client_policy_ref (BusClientPolicy *policy)
   return policy;
 }
 
+/**
+ * Estimates the memory held by a client policy. The rules are shared
+ * with the bus configuration, so only the list linking them into this
+ * policy counts.
+ *
+ * @param policy the policy
+ * @returns size in bytes
+ */
+int
+bus_client_policy_get_size (BusClientPolicy *policy)
+{
+  return sizeof (BusClientPolicy) +
+    _dbus_list_get_length (&policy->rules) * sizeof (DBusList);
+}
+
 static void
 rule_unref_foreach (void *data,
                     void *user_data)
@@ -28,6 +28,7 @@
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-mempool.h>
 #include "bus.h"
 
 typedef enum
@@ -106,6 +107,8 @@ BusPolicyRule* bus_policy_rule_new   (BusPolicyRuleType type,
 BusPolicyRule* bus_policy_rule_ref   (BusPolicyRule    *rule);
 void           bus_policy_rule_unref (BusPolicyRule    *rule);
 
+void           bus_policy_rule_get_pool_stats (DBusMemPoolStats *stats);
+
 BusPolicy*       bus_policy_new                   (void);
 BusPolicy*       bus_policy_ref                   (BusPolicy        *policy);
 void             bus_policy_unref                 (BusPolicy        *policy);
@@ -153,6 +156,7 @@ dbus_bool_t      bus_client_policy_check_can_own     (BusClientPolicy  *policy,
 dbus_bool_t      bus_client_policy_append_rule       (BusClientPolicy  *policy,
                                                       BusPolicyRule    *rule);
 void             bus_client_policy_optimize          (BusClientPolicy  *policy);
+int              bus_client_policy_get_size          (BusClientPolicy  *policy);
 
 
 #endif /* BUS_POLICY_H */
@@ -66,6 +66,8 @@ struct BusRegistry
   DBusMemPool   *owner_pool;
 
   DBusHashTable *service_sid_table;
+
+  int peak_services; /**< Most names there have been at once */
 };
 
 BusRegistry*
@@ -308,6 +310,11 @@ bus_registry_ensure (BusRegistry               *registry,
       BUS_SET_OOM (error);
       return NULL;
     }
+
+  if (_dbus_hash_table_get_n_entries (registry->service_hash) >
+      registry->peak_services)
+    registry->peak_services =
+      _dbus_hash_table_get_n_entries (registry->service_hash);
   
   return service;
 }
@@ -372,6 +379,22 @@ bus_registry_list_services (BusRegistry *registry,
   return FALSE;
 }
 
+/**
+ * Gets the number of names on the bus, unique names included.
+ *
+ * @param registry the registry
+ * @param n_services return location for the number of names
+ * @param peak_services return location for the most names there have been
+ */
+void
+bus_registry_get_stats (BusRegistry *registry,
+                        int         *n_services,
+                        int         *peak_services)
+{
+  *n_services = _dbus_hash_table_get_n_entries (registry->service_hash);
+  *peak_services = registry->peak_services;
+}
+
 dbus_bool_t
 bus_registry_acquire_service (BusRegistry      *registry,
                               DBusConnection   *connection,
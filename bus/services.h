@@ -50,6 +50,9 @@ void         bus_registry_foreach         (BusRegistry                 *registry
 dbus_bool_t  bus_registry_list_services   (BusRegistry                 *registry,
                                            char                      ***listp,
                                            int                         *array_len);
+void         bus_registry_get_stats       (BusRegistry                 *registry,
+                                           int                         *n_services,
+                                           int                         *peak_services);
 dbus_bool_t  bus_registry_acquire_service (BusRegistry                 *registry,
                                            DBusConnection              *connection,
                                            const DBusString            *service_name,
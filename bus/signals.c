@@ -24,6 +24,7 @@
 #include "services.h"
 #include "utils.h"
 #include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-mempool.h>
 
 struct BusMatchRule
 {
@@ -44,12 +45,66 @@ struct BusMatchRule
   int args_len;
 };
 
+/* Clients add and remove match rules all the time; keep them in a
+ * pool that gives the memory back when the rules go away.
+ */
+static BusLazyPool rule_pool = BUS_LAZY_POOL_INIT (BusMatchRule);
+
+/**
+ * Fills in memory usage statistics for all match rules.
+ *
+ * @param stats return location for the statistics
+ */
+void
+bus_match_rule_get_pool_stats (DBusMemPoolStats *stats)
+{
+  bus_lazy_pool_get_stats (&rule_pool, stats);
+}
+
+static int
+string_size (const char *str)
+{
+  return str != NULL ? strlen (str) + 1 : 0;
+}
+
+/**
+ * Estimates the memory a rule takes up: the rule itself and the
+ * strings it owns. Used to account memory to the connection that
+ * added the rule.
+ *
+ * @param rule the rule
+ * @returns size in bytes
+ */
+int
+bus_match_rule_get_size (BusMatchRule *rule)
+{
+  int size;
+  int i;
+
+  size = sizeof (BusMatchRule);
+  size += string_size (rule->interface);
+  size += string_size (rule->member);
+  size += string_size (rule->sender);
+  size += string_size (rule->destination);
+  size += string_size (rule->path);
+
+  if (rule->args != NULL)
+    {
+      size += sizeof (rule->args[0]) * (rule->args_len + 1);
+
+      for (i = 0; i < rule->args_len; i++)
+        size += string_size (rule->args[i]);
+    }
+
+  return size;
+}
+
 BusMatchRule*
 bus_match_rule_new (DBusConnection *matches_go_to)
 {
   BusMatchRule *rule;
 
-  rule = dbus_new0 (BusMatchRule, 1);
+  rule = bus_lazy_pool_alloc (&rule_pool);
   if (rule == NULL)
     return NULL;
 
@@ -105,7 +160,7 @@ bus_match_rule_unref (BusMatchRule *rule)
           dbus_free (rule->args);
         }
       
-      dbus_free (rule);
+      bus_lazy_pool_dealloc (&rule_pool, rule);
     }
 }
 
@@ -981,6 +1036,8 @@ struct BusMatchmaker
   int refcount;
 
   DBusList *all_rules;
+  int n_rules;    /**< Length of all_rules */
+  int peak_rules; /**< Largest n_rules has been */
 };
 
 BusMatchmaker*
@@ -1047,6 +1104,10 @@ bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
   
   bus_match_rule_ref (rule);
 
+  matchmaker->n_rules += 1;
+  if (matchmaker->n_rules > matchmaker->peak_rules)
+    matchmaker->peak_rules = matchmaker->n_rules;
+
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
     char *s = match_rule_to_string (rule);
@@ -1129,6 +1190,7 @@ bus_matchmaker_remove_rule_link (BusMatchmaker   *matchmaker,
   
   bus_connection_remove_match_rule (rule->matches_go_to, rule);
   _dbus_list_remove_link (&matchmaker->all_rules, link);
+  matchmaker->n_rules -= 1;
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
@@ -1149,6 +1211,7 @@ bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
 {
   bus_connection_remove_match_rule (rule->matches_go_to, rule);
   _dbus_list_remove (&matchmaker->all_rules, rule);
+  matchmaker->n_rules -= 1;
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
@@ -1429,6 +1492,22 @@ match_rule_matches (BusMatchRule    *rule,
   return TRUE;
 }
 
+/**
+ * Gets the number of match rules on the bus.
+ *
+ * @param matchmaker the matchmaker
+ * @param n_rules return location for the number of rules
+ * @param peak_rules return location for the most rules there have been
+ */
+void
+bus_matchmaker_get_stats (BusMatchmaker *matchmaker,
+                          int           *n_rules,
+                          int           *peak_rules)
+{
+  *n_rules = matchmaker->n_rules;
+  *peak_rules = matchmaker->peak_rules;
+}
+
 dbus_bool_t
 bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
                                BusConnections  *connections,
@@ -1931,6 +2010,44 @@ test_matching (void)
   dbus_message_unref (message1);
 }
 
+#define N_POOLED_RULES 5000
+
+static void
+test_rule_pool (void)
+{
+  BusMatchRule **rules;
+  DBusMemPoolStats before;
+  DBusMemPoolStats stats;
+  int i;
+
+  bus_match_rule_get_pool_stats (&before);
+
+  rules = dbus_new (BusMatchRule*, N_POOLED_RULES);
+  _dbus_assert (rules != NULL);
+
+  for (i = 0; i < N_POOLED_RULES; i++)
+    {
+      rules[i] = bus_match_rule_new (NULL);
+      if (rules[i] == NULL)
+        _dbus_assert_not_reached ("oom");
+    }
+
+  bus_match_rule_get_pool_stats (&stats);
+  _dbus_assert (stats.live_elements == before.live_elements + N_POOLED_RULES);
+  _dbus_assert (stats.bytes_retained >=
+                (unsigned long) N_POOLED_RULES * stats.element_size);
+
+  for (i = 0; i < N_POOLED_RULES; i++)
+    bus_match_rule_unref (rules[i]);
+
+  dbus_free (rules);
+
+  /* the memory went back rather than staying in the pool */
+  bus_match_rule_get_pool_stats (&stats);
+  _dbus_assert (stats.live_elements == before.live_elements);
+  _dbus_assert (stats.n_blocks <= before.n_blocks + 1);
+}
+
 dbus_bool_t
 bus_signals_test (const DBusString *test_data_dir)
 {
@@ -1947,6 +2064,8 @@ bus_signals_test (const DBusString *test_data_dir)
   test_equality ();
 
   test_matching ();
+
+  test_rule_pool ();
   
   return TRUE;
 }
@@ -27,6 +27,7 @@
 #include <dbus/dbus.h>
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-mempool.h>
 #include "connection.h"
 
 typedef enum
@@ -44,6 +45,9 @@ BusMatchRule* bus_match_rule_new   (DBusConnection *matches_go_to);
 BusMatchRule* bus_match_rule_ref   (BusMatchRule   *rule);
 void          bus_match_rule_unref (BusMatchRule   *rule);
 
+void          bus_match_rule_get_pool_stats (DBusMemPoolStats *stats);
+int           bus_match_rule_get_size       (BusMatchRule     *rule);
+
 dbus_bool_t bus_match_rule_set_message_type (BusMatchRule *rule,
                                              int           type);
 dbus_bool_t bus_match_rule_set_interface    (BusMatchRule *rule,
@@ -77,6 +81,9 @@ void        bus_matchmaker_remove_rule          (BusMatchmaker   *matchmaker,
                                                  BusMatchRule    *rule);
 void        bus_matchmaker_disconnected         (BusMatchmaker   *matchmaker,
                                                  DBusConnection  *disconnected);
+void        bus_matchmaker_get_stats            (BusMatchmaker   *matchmaker,
+                                                 int             *n_rules,
+                                                 int             *peak_rules);
 dbus_bool_t bus_matchmaker_get_recipients       (BusMatchmaker   *matchmaker,
                                                  BusConnections  *connections,
                                                  DBusConnection  *sender,
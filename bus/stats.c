@@ -0,0 +1,485 @@
+/* -*- mode: C; c-file-style: "gnu" -*- */
+/* stats.c  Statistics about the bus, for debugging and monitoring
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "stats.h"
+#include "activation.h"
+#include "connection.h"
+#include "policy.h"
+#include "services.h"
+#include "signals.h"
+#include "utils.h"
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-mempool.h>
+
+/* Both methods reply with a dictionary of name to variant, so new
+ * statistics can be added without breaking existing callers.
+ */
+
+static dbus_bool_t
+open_entry (DBusMessageIter *dict,
+            const char      *key,
+            const char      *signature,
+            DBusMessageIter *entry,
+            DBusMessageIter *variant)
+{
+  return dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY,
+                                           NULL, entry) &&
+    dbus_message_iter_append_basic (entry, DBUS_TYPE_STRING, &key) &&
+    dbus_message_iter_open_container (entry, DBUS_TYPE_VARIANT,
+                                      signature, variant);
+}
+
+static dbus_bool_t
+close_entry (DBusMessageIter *dict,
+             DBusMessageIter *entry,
+             DBusMessageIter *variant)
+{
+  return dbus_message_iter_close_container (entry, variant) &&
+    dbus_message_iter_close_container (dict, entry);
+}
+
+static dbus_bool_t
+add_uint32 (DBusMessageIter *dict,
+            const char      *key,
+            dbus_uint32_t    value)
+{
+  DBusMessageIter entry, variant;
+
+  return open_entry (dict, key, DBUS_TYPE_UINT32_AS_STRING,
+                     &entry, &variant) &&
+    dbus_message_iter_append_basic (&variant, DBUS_TYPE_UINT32, &value) &&
+    close_entry (dict, &entry, &variant);
+}
+
+/* Byte totals pass 4GB on a busy bus, so they are 64-bit where we
+ * have a 64-bit type
+ */
+static dbus_bool_t
+add_byte_count (DBusMessageIter *dict,
+                const char      *key,
+                BusByteCount     value)
+{
+#ifdef DBUS_HAVE_INT64
+  DBusMessageIter entry, variant;
+
+  return open_entry (dict, key, DBUS_TYPE_UINT64_AS_STRING,
+                     &entry, &variant) &&
+    dbus_message_iter_append_basic (&variant, DBUS_TYPE_UINT64, &value) &&
+    close_entry (dict, &entry, &variant);
+#else
+  return add_uint32 (dict, key, value);
+#endif
+}
+
+static dbus_bool_t
+add_string (DBusMessageIter *dict,
+            const char      *key,
+            const char      *value)
+{
+  DBusMessageIter entry, variant;
+
+  return open_entry (dict, key, DBUS_TYPE_STRING_AS_STRING,
+                     &entry, &variant) &&
+    dbus_message_iter_append_basic (&variant, DBUS_TYPE_STRING, &value) &&
+    close_entry (dict, &entry, &variant);
+}
+
+/* A histogram is (count, largest sample in usec, bucket counts), see
+ * DBusHistogram for the bucket boundaries.
+ */
+static dbus_bool_t
+add_histogram (DBusMessageIter     *dict,
+               const char          *key,
+               const DBusHistogram *histogram)
+{
+  DBusMessageIter entry, variant, st, array;
+  dbus_uint32_t value;
+  int i;
+
+  if (!open_entry (dict, key,
+                   DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+                   DBUS_TYPE_UINT32_AS_STRING
+                   DBUS_TYPE_UINT32_AS_STRING
+                   DBUS_TYPE_ARRAY_AS_STRING
+                   DBUS_TYPE_UINT32_AS_STRING
+                   DBUS_STRUCT_END_CHAR_AS_STRING,
+                   &entry, &variant))
+    return FALSE;
+
+  if (!dbus_message_iter_open_container (&variant, DBUS_TYPE_STRUCT,
+                                         NULL, &st))
+    return FALSE;
+
+  value = histogram->count;
+  if (!dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &value))
+    return FALSE;
+
+  value = histogram->max_usec;
+  if (!dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &value))
+    return FALSE;
+
+  if (!dbus_message_iter_open_container (&st, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_UINT32_AS_STRING,
+                                         &array))
+    return FALSE;
+
+  for (i = 0; i < _DBUS_HISTOGRAM_N_BUCKETS; i++)
+    {
+      value = histogram->buckets[i];
+      if (!dbus_message_iter_append_basic (&array, DBUS_TYPE_UINT32, &value))
+        return FALSE;
+    }
+
+  return dbus_message_iter_close_container (&st, &array) &&
+    dbus_message_iter_close_container (&variant, &st) &&
+    close_entry (dict, &entry, &variant);
+}
+
+/* A memory pool is (element size, live elements, blocks, bytes retained) */
+static dbus_bool_t
+add_pool (DBusMessageIter        *dict,
+          const char             *key,
+          const DBusMemPoolStats *stats)
+{
+  DBusMessageIter entry, variant, st;
+  dbus_uint32_t values[4];
+  int i;
+
+  values[0] = stats->element_size;
+  values[1] = stats->live_elements;
+  values[2] = stats->n_blocks;
+  values[3] = stats->bytes_retained;
+
+  if (!open_entry (dict, key,
+                   DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+                   DBUS_TYPE_UINT32_AS_STRING
+                   DBUS_TYPE_UINT32_AS_STRING
+                   DBUS_TYPE_UINT32_AS_STRING
+                   DBUS_TYPE_UINT32_AS_STRING
+                   DBUS_STRUCT_END_CHAR_AS_STRING,
+                   &entry, &variant))
+    return FALSE;
+
+  if (!dbus_message_iter_open_container (&variant, DBUS_TYPE_STRUCT,
+                                         NULL, &st))
+    return FALSE;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (values); i++)
+    {
+      if (!dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &values[i]))
+        return FALSE;
+    }
+
+  return dbus_message_iter_close_container (&variant, &st) &&
+    close_entry (dict, &entry, &variant);
+}
+
+static dbus_bool_t
+add_message_counts (DBusMessageIter          *dict,
+                    const BusConnectionStats *stats)
+{
+  return add_uint32 (dict, "IncomingMessages", stats->n_messages_in) &&
+    add_byte_count (dict, "IncomingBytes", stats->n_bytes_in) &&
+    add_uint32 (dict, "OutgoingMessages", stats->n_messages_out) &&
+    add_byte_count (dict, "OutgoingBytes", stats->n_bytes_out);
+}
+
+static dbus_bool_t
+add_memory (DBusMessageIter           *dict,
+            const BusConnectionMemory *memory)
+{
+  return add_uint32 (dict, "MemoryBytes",
+                     bus_connection_memory_get_total (memory)) &&
+    add_uint32 (dict, "ConnectionBytes", memory->connection_bytes) &&
+    add_uint32 (dict, "MatchRuleBytes", memory->match_rule_bytes) &&
+    add_uint32 (dict, "BusNameBytes", memory->name_bytes) &&
+    add_uint32 (dict, "PendingReplyBytes", memory->pending_reply_bytes);
+}
+
+static DBusMessage*
+new_reply (DBusMessage     *message,
+           DBusMessageIter *iter,
+           DBusMessageIter *dict)
+{
+  DBusMessage *reply;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    return NULL;
+
+  dbus_message_iter_init_append (reply, iter);
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_TYPE_VARIANT_AS_STRING
+                                         DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                                         dict))
+    {
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  return reply;
+}
+
+/* Statistics show what everyone on the bus is doing, so only root
+ * and the user the bus runs as may read them
+ */
+static dbus_bool_t
+check_caller_may_read_stats (DBusConnection *caller,
+                             DBusError      *error)
+{
+  unsigned long uid;
+
+  if (dbus_connection_get_unix_user (caller, &uid) &&
+      (uid == 0 || uid == _dbus_getuid ()))
+    return TRUE;
+
+  dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                  "Bus statistics are only available to root and the user the bus runs as");
+  return FALSE;
+}
+
+dbus_bool_t
+bus_stats_handle_get_stats (DBusConnection *connection,
+                            BusTransaction *transaction,
+                            DBusMessage    *message,
+                            DBusError      *error)
+{
+  BusContext *context;
+  BusActivation *activation;
+  const BusConnectionStats *totals;
+  BusConnectionMemory memory;
+  DBusServerAcceptStats accept_stats;
+  const DBusLoopStats *loop_stats;
+  DBusMemPoolStats pool_stats;
+  DBusMessageIter iter, dict;
+  DBusMessage *reply;
+  int n_completed, n_incomplete;
+  int n, peak;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!check_caller_may_read_stats (connection, error))
+    return FALSE;
+
+  context = bus_connection_get_context (connection);
+
+  reply = new_reply (message, &iter, &dict);
+  if (reply == NULL)
+    goto oom;
+
+  totals = bus_connections_get_stats (bus_context_get_connections (context),
+                                      &n_completed, &n_incomplete);
+
+  if (!add_uint32 (&dict, "ActiveConnections", n_completed) ||
+      !add_uint32 (&dict, "IncompleteConnections", n_incomplete))
+    goto oom;
+
+  bus_matchmaker_get_stats (bus_context_get_matchmaker (context), &n, &peak);
+
+  if (!add_uint32 (&dict, "MatchRules", n) ||
+      !add_uint32 (&dict, "PeakMatchRules", peak) ||
+      !add_uint32 (&dict, "PeakMatchRulesPerConnection",
+                   totals->peak_match_rules))
+    goto oom;
+
+  bus_registry_get_stats (bus_context_get_registry (context), &n, &peak);
+
+  if (!add_uint32 (&dict, "BusNames", n) ||
+      !add_uint32 (&dict, "PeakBusNames", peak) ||
+      !add_uint32 (&dict, "PeakBusNamesPerConnection",
+                   totals->peak_services_owned))
+    goto oom;
+
+  n = bus_connections_get_n_pending_replies (bus_context_get_connections (context),
+                                             NULL);
+
+  if (!add_uint32 (&dict, "PendingReplies", n) ||
+      !add_message_counts (&dict, totals))
+    goto oom;
+
+  bus_connections_get_memory (bus_context_get_connections (context), &memory);
+
+  if (!add_memory (&dict, &memory))
+    goto oom;
+
+  bus_context_get_accept_stats (context, &accept_stats);
+
+  if (!add_uint32 (&dict, "AcceptWakeups", accept_stats.n_wakeups) ||
+      !add_uint32 (&dict, "AcceptedConnections", accept_stats.n_accepted) ||
+      !add_uint32 (&dict, "AcceptFailures", accept_stats.n_failed) ||
+      !add_uint32 (&dict, "PeakAcceptedPerWakeup",
+                   accept_stats.max_per_wakeup))
+    goto oom;
+
+  activation = bus_context_get_activation (context);
+  if (activation != NULL)
+    {
+      const BusActivationLatency *latency;
+
+      latency = bus_activation_get_latency (activation);
+
+      if (!add_histogram (&dict, "ActivationLookup", &latency->lookup) ||
+          !add_histogram (&dict, "ActivationSpawn", &latency->spawn) ||
+          !add_histogram (&dict, "ActivationExec", &latency->exec) ||
+          !add_histogram (&dict, "ActivationName", &latency->name) ||
+          !add_histogram (&dict, "ActivationTotal", &latency->total))
+        goto oom;
+    }
+
+  loop_stats = _dbus_loop_get_stats (bus_context_get_loop (context));
+
+  if (!add_histogram (&dict, "MainLoopIteration", &loop_stats->iteration) ||
+      !add_histogram (&dict, "MainLoopPollWait", &loop_stats->poll_wait) ||
+      !add_histogram (&dict, "MainLoopWatch", &loop_stats->watch) ||
+      !add_histogram (&dict, "MainLoopTimeout", &loop_stats->timeout) ||
+      !add_histogram (&dict, "MainLoopDispatch", &loop_stats->dispatch) ||
+      !add_uint32 (&dict, "MainLoopStalls", loop_stats->n_stalls))
+    goto oom;
+
+  bus_match_rule_get_pool_stats (&pool_stats);
+  if (!add_pool (&dict, "MatchRulePool", &pool_stats))
+    goto oom;
+
+  bus_policy_rule_get_pool_stats (&pool_stats);
+  if (!add_pool (&dict, "PolicyRulePool", &pool_stats))
+    goto oom;
+
+  bus_connection_get_data_pool_stats (&pool_stats);
+  if (!add_pool (&dict, "ConnectionDataPool", &pool_stats))
+    goto oom;
+
+  if (!dbus_message_iter_close_container (&iter, &dict))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+dbus_bool_t
+bus_stats_handle_get_connection_stats (DBusConnection *caller,
+                                       BusTransaction *transaction,
+                                       DBusMessage    *message,
+                                       DBusError      *error)
+{
+  const char *bus_name;
+  DBusString bus_name_str;
+  BusRegistry *registry;
+  BusService *service;
+  DBusConnection *connection;
+  const BusConnectionStats *stats;
+  DBusMessageIter iter, dict;
+  DBusMessage *reply;
+  int in_messages, out_messages;
+  long in_bytes, out_bytes;
+  unsigned long uid;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!check_caller_may_read_stats (caller, error))
+    return FALSE;
+
+  reply = NULL;
+  registry = bus_connection_get_registry (caller);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &bus_name,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  _dbus_string_init_const (&bus_name_str, bus_name);
+  service = bus_registry_lookup (registry, &bus_name_str);
+  if (service == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NAME_HAS_NO_OWNER,
+                      "Bus name '%s' has no owner", bus_name);
+      return FALSE;
+    }
+
+  connection = bus_service_get_primary_owners_connection (service);
+  _dbus_assert (connection != NULL);
+
+  reply = new_reply (message, &iter, &dict);
+  if (reply == NULL)
+    goto oom;
+
+  stats = bus_connection_get_stats (connection);
+
+  if (!add_string (&dict, "UniqueName", bus_connection_get_name (connection)) ||
+      !add_uint32 (&dict, "MatchRules",
+                   bus_connection_get_n_match_rules (connection)) ||
+      !add_uint32 (&dict, "PeakMatchRules", stats->peak_match_rules) ||
+      !add_uint32 (&dict, "BusNames",
+                   bus_connection_get_n_services_owned (connection)) ||
+      !add_uint32 (&dict, "PeakBusNames", stats->peak_services_owned) ||
+      !add_uint32 (&dict, "PendingReplies",
+                   bus_connections_get_n_pending_replies (bus_connection_get_connections (connection),
+                                                          connection)) ||
+      !add_message_counts (&dict, stats))
+    goto oom;
+
+  _dbus_connection_get_stats (connection, &in_messages, &in_bytes,
+                              &out_messages, &out_bytes);
+
+  if (!add_uint32 (&dict, "IncomingQueueMessages", in_messages) ||
+      !add_uint32 (&dict, "IncomingQueueBytes", in_bytes) ||
+      !add_uint32 (&dict, "OutgoingQueueMessages", out_messages) ||
+      !add_uint32 (&dict, "OutgoingQueueBytes", out_bytes) ||
+      !add_histogram (&dict, "QueueWait",
+                      bus_connection_get_queue_wait (connection)) ||
+      !add_memory (&dict, bus_connection_get_memory (connection)))
+    goto oom;
+
+  if (dbus_connection_get_unix_user (connection, &uid) &&
+      !add_uint32 (&dict, "UnixUserMemoryBytes",
+                   bus_connections_get_memory_for_uid (bus_connection_get_connections (connection),
+                                                       uid)))
+    goto oom;
+
+  if (!dbus_message_iter_close_container (&iter, &dict))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, caller, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
@@ -126,6 +126,18 @@ main (int argc, char **argv)
     die ("sha1");
   test_post_hook ();
 
+  test_pre_hook ();
+  printf ("%s: Running memory limit test\n", argv[0]);
+  if (!bus_dispatch_memory_limit_test (&test_data_dir))
+    die ("memory limit");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running system bus policy test\n", argv[0]);
+  if (!bus_dispatch_system_policy_test (&test_data_dir))
+    die ("system policy");
+  test_post_hook ();
+
   test_pre_hook ();
   printf ("%s: Running message dispatch test\n", argv[0]);
   if (!bus_dispatch_test (&test_data_dir)) 
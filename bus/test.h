@@ -34,6 +34,8 @@
 
 dbus_bool_t bus_dispatch_test         (const DBusString             *test_data_dir);
 dbus_bool_t bus_dispatch_sha1_test    (const DBusString             *test_data_dir);
+dbus_bool_t bus_dispatch_memory_limit_test (const DBusString        *test_data_dir);
+dbus_bool_t bus_dispatch_system_policy_test (const DBusString       *test_data_dir);
 dbus_bool_t bus_policy_test           (const DBusString             *test_data_dir);
 dbus_bool_t bus_config_parser_test    (const DBusString             *test_data_dir);
 dbus_bool_t bus_signals_test          (const DBusString             *test_data_dir);
@@ -26,6 +26,7 @@
 #include "utils.h"
 #include <dbus/dbus-sysdeps.h>
 #include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-internals.h>
 
 const char bus_no_memory_message[] = "Memory allocation failure in message bus";
 
@@ -46,3 +47,72 @@ bus_connection_dispatch_one_message  (DBusConnection *connection)
   
   return status == DBUS_DISPATCH_DATA_REMAINS;
 }
+
+/**
+ * Allocates a zeroed element from the pool, creating the pool if
+ * needed.
+ *
+ * @param lazy the pool
+ * @returns the element, or #NULL if no memory
+ */
+void*
+bus_lazy_pool_alloc (BusLazyPool *lazy)
+{
+  void *element;
+
+  if (lazy->pool != NULL)
+    return _dbus_mem_pool_alloc (lazy->pool);
+
+  lazy->pool = _dbus_mem_pool_new (lazy->element_size, TRUE);
+  if (lazy->pool == NULL)
+    return NULL;
+
+  element = _dbus_mem_pool_alloc (lazy->pool);
+  if (element == NULL)
+    {
+      _dbus_mem_pool_free (lazy->pool);
+      lazy->pool = NULL;
+    }
+
+  return element;
+}
+
+/**
+ * Returns an element to the pool, freeing the pool if it was the
+ * last one.
+ *
+ * @param lazy the pool
+ * @param element the element from bus_lazy_pool_alloc()
+ */
+void
+bus_lazy_pool_dealloc (BusLazyPool *lazy,
+                       void        *element)
+{
+  if (_dbus_mem_pool_dealloc (lazy->pool, element))
+    {
+      _dbus_mem_pool_free (lazy->pool);
+      lazy->pool = NULL;
+    }
+}
+
+/**
+ * Fills in memory usage statistics for the pool, which are all zero
+ * apart from the element size while the pool doesn't exist.
+ *
+ * @param lazy the pool
+ * @param stats return location for the statistics
+ */
+void
+bus_lazy_pool_get_stats (BusLazyPool      *lazy,
+                         DBusMemPoolStats *stats)
+{
+  if (lazy->pool != NULL)
+    {
+      _dbus_mem_pool_get_stats (lazy->pool, stats);
+    }
+  else
+    {
+      _DBUS_ZERO (*stats);
+      stats->element_size = lazy->element_size;
+    }
+}
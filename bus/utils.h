@@ -26,6 +26,7 @@
 #define BUS_UTILS_H
 
 #include <dbus/dbus.h>
+#include <dbus/dbus-mempool.h>
 
 extern const char bus_no_memory_message[];
 #define BUS_SET_OOM(error) dbus_set_error_const ((error), DBUS_ERROR_NO_MEMORY, bus_no_memory_message)
@@ -33,4 +34,24 @@ extern const char bus_no_memory_message[];
 void        bus_connection_dispatch_all_messages (DBusConnection *connection);
 dbus_bool_t bus_connection_dispatch_one_message  (DBusConnection *connection);
 
+/**
+ * A memory pool that is only created for the first element and freed
+ * again with the last one, so that the memory taken by a burst of
+ * allocations is given back once they are all gone.
+ */
+typedef struct
+{
+  int element_size;  /**< Size of the elements */
+  DBusMemPool *pool; /**< The pool, #NULL while there are no elements */
+} BusLazyPool;
+
+/** Initializer for a static #BusLazyPool of elements of the given type */
+#define BUS_LAZY_POOL_INIT(type) { sizeof (type), NULL }
+
+void*       bus_lazy_pool_alloc     (BusLazyPool      *lazy);
+void        bus_lazy_pool_dealloc   (BusLazyPool      *lazy,
+                                     void             *element);
+void        bus_lazy_pool_get_stats (BusLazyPool      *lazy,
+                                     DBusMemPoolStats *stats);
+
 #endif /* BUS_UTILS_H */
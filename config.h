@@ -205,6 +205,9 @@
 /* Define to 1 if you have the <unistd.h> header file. */
 #define HAVE_UNISTD_H 1
 
+/* Supports sending UNIX file descriptors */
+#define HAVE_UNIX_FD_PASSING 1
+
 /* Define to 1 if you have the `unsetenv' function. */
 #define HAVE_UNSETENV 1
 
@@ -385,6 +385,16 @@ _dbus_auth_script_run (const DBusString *filename)
           _dbus_auth_set_mechanisms (auth, (const char **) mechs);
           dbus_free_string_array (mechs);
         }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "PIPELINED"))
+        {
+          if (!_dbus_auth_set_pipelined (auth))
+            {
+              _dbus_warn ("could not switch to pipelined auth on line %d\n",
+                          line_no);
+              goto out;
+            }
+        }
       else if (_dbus_string_starts_with_c_str (&line,
                                                "SEND"))
         {
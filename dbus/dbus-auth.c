@@ -122,7 +122,9 @@ typedef enum {
   DBUS_AUTH_COMMAND_REJECTED,
   DBUS_AUTH_COMMAND_OK,
   DBUS_AUTH_COMMAND_ERROR,
-  DBUS_AUTH_COMMAND_UNKNOWN
+  DBUS_AUTH_COMMAND_UNKNOWN,
+  DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD,
+  DBUS_AUTH_COMMAND_AGREE_UNIX_FD
 } DBusAuthCommand;
 
 /**
@@ -185,6 +187,11 @@ struct DBusAuth
   unsigned int already_got_mechanisms : 1;       /**< Client already got mech list */
   unsigned int already_asked_for_initial_response : 1; /**< Already sent a blank challenge to get an initial response */
   unsigned int buffer_outstanding : 1; /**< Buffer is "checked out" for reading data into */
+
+  unsigned int unix_fd_possible : 1;  /**< This side could do unix fd passing */
+  unsigned int unix_fd_negotiated : 1; /**< Unix fd was successfully negotiated */
+
+  unsigned int pipelined : 1;         /**< Client sent BEGIN without waiting for OK */
 };
 
 /**
@@ -224,9 +231,10 @@ static dbus_bool_t send_rejected             (DBusAuth *auth);
 static dbus_bool_t send_error                (DBusAuth *auth,
                                               const char *message);
 static dbus_bool_t send_ok                   (DBusAuth *auth);
-static dbus_bool_t send_begin                (DBusAuth *auth,
-                                              const DBusString *args_from_ok);
+static dbus_bool_t send_begin                (DBusAuth *auth);
 static dbus_bool_t send_cancel               (DBusAuth *auth);
+static dbus_bool_t send_negotiate_unix_fd    (DBusAuth *auth);
+static dbus_bool_t send_agree_unix_fd        (DBusAuth *auth);
 
 /**
  * Client states
@@ -265,6 +273,15 @@ static dbus_bool_t handle_client_state_waiting_for_ok     (DBusAuth         *aut
 static dbus_bool_t handle_client_state_waiting_for_reject (DBusAuth         *auth,
                                                            DBusAuthCommand   command,
                                                            const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_unix_fd (DBusAuth         *auth,
+                                                                  DBusAuthCommand   command,
+                                                                  const DBusString *args);
+static dbus_bool_t handle_client_state_pipelined_waiting_for_ok (DBusAuth         *auth,
+                                                                DBusAuthCommand   command,
+                                                                const DBusString *args);
+static dbus_bool_t handle_client_state_pipelined_waiting_for_agree_unix_fd (DBusAuth         *auth,
+                                                                            DBusAuthCommand   command,
+                                                                            const DBusString *args);
 
 static const DBusAuthStateData client_state_need_send_auth = {
   "NeedSendAuth", NULL
@@ -278,6 +295,15 @@ static const DBusAuthStateData client_state_waiting_for_ok = {
 static const DBusAuthStateData client_state_waiting_for_reject = {
   "WaitingForReject", handle_client_state_waiting_for_reject
 };
+static const DBusAuthStateData client_state_waiting_for_agree_unix_fd = {
+  "WaitingForAgreeUnixFD", handle_client_state_waiting_for_agree_unix_fd
+};
+static const DBusAuthStateData client_state_pipelined_waiting_for_ok = {
+  "PipelinedWaitingForOK", handle_client_state_pipelined_waiting_for_ok
+};
+static const DBusAuthStateData client_state_pipelined_waiting_for_agree_unix_fd = {
+  "PipelinedWaitingForAgreeUnixFD", handle_client_state_pipelined_waiting_for_agree_unix_fd
+};
   
 /**
  * Common terminal states.  Terminal states have handler == NULL.
@@ -529,9 +555,9 @@ sha1_handle_first_client_response (DBusAuth         *auth,
       return FALSE;
     }
 
-  /* we cache the keyring for speed, so here we drop it if it's the
-   * wrong one. FIXME caching the keyring here is useless since we use
-   * a different DBusAuth for every connection.
+  /* we hold on to the keyring, so here we drop it if it's the
+   * wrong one. Keyrings are shared process-wide, so getting it
+   * again is cheap.
    */
   if (auth->keyring &&
       !_dbus_keyring_is_for_user (auth->keyring,
@@ -1348,7 +1374,17 @@ send_ok (DBusAuth *auth)
 }
 
 static dbus_bool_t
-send_begin (DBusAuth         *auth,
+send_begin (DBusAuth         *auth)
+{
+  if (!_dbus_string_append (&auth->outgoing, "BEGIN\r\n"))
+    return FALSE;
+
+  goto_state (auth, &common_state_authenticated);
+  return TRUE;
+}
+
+static dbus_bool_t
+process_ok (DBusAuth         *auth,
             const DBusString *args_from_ok)
 {
   int end_of_hex;
@@ -1375,20 +1411,46 @@ send_begin (DBusAuth         *auth,
       return TRUE;
     }
 
-  if (_dbus_string_copy (args_from_ok, 0, &DBUS_AUTH_CLIENT (auth)->guid_from_server, 0) &&
-      _dbus_string_append (&auth->outgoing, "BEGIN\r\n"))
+  if (!_dbus_string_copy (args_from_ok, 0, &DBUS_AUTH_CLIENT (auth)->guid_from_server, 0))
     {
-      _dbus_verbose ("Got GUID '%s' from the server\n",
-                     _dbus_string_get_const_data (& DBUS_AUTH_CLIENT (auth)->guid_from_server));
-      
-      goto_state (auth, &common_state_authenticated);
+      _dbus_string_set_length (& DBUS_AUTH_CLIENT (auth)->guid_from_server, 0);
+      return FALSE;
+    }
+
+  _dbus_verbose ("Got GUID '%s' from the server\n",
+                 _dbus_string_get_const_data (& DBUS_AUTH_CLIENT (auth)->guid_from_server));
+
+  if (auth->pipelined)
+    {
+      /* NEGOTIATE_UNIX_FD and BEGIN already went out behind AUTH */
+      if (auth->unix_fd_possible)
+        goto_state (auth, &client_state_pipelined_waiting_for_agree_unix_fd);
+      else
+        goto_state (auth, &common_state_authenticated);
+
       return TRUE;
     }
-  else
+
+  if (auth->unix_fd_possible)
+    {
+      if (!send_negotiate_unix_fd (auth))
+        {
+          _dbus_string_set_length (& DBUS_AUTH_CLIENT (auth)->guid_from_server, 0);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+
+  _dbus_verbose ("Not negotiating unix fd passing, since not possible\n");
+
+  if (!send_begin (auth))
     {
       _dbus_string_set_length (& DBUS_AUTH_CLIENT (auth)->guid_from_server, 0);
       return FALSE;
     }
+
+  return TRUE;
 }
 
 static dbus_bool_t
@@ -1403,6 +1465,33 @@ send_cancel (DBusAuth *auth)
     return FALSE;
 }
 
+static dbus_bool_t
+send_negotiate_unix_fd (DBusAuth *auth)
+{
+  if (!_dbus_string_append (&auth->outgoing,
+                            "NEGOTIATE_UNIX_FD\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_agree_unix_fd);
+  return TRUE;
+}
+
+static dbus_bool_t
+send_agree_unix_fd (DBusAuth *auth)
+{
+  _dbus_assert (auth->unix_fd_possible);
+
+  auth->unix_fd_negotiated = TRUE;
+  _dbus_verbose ("Agreed to UNIX FD passing\n");
+
+  if (!_dbus_string_append (&auth->outgoing,
+                            "AGREE_UNIX_FD\r\n"))
+    return FALSE;
+
+  goto_state (auth, &server_state_waiting_for_begin);
+  return TRUE;
+}
+
 static dbus_bool_t
 process_data (DBusAuth             *auth,
               const DBusString     *args,
@@ -1538,9 +1627,13 @@ handle_server_state_waiting_for_auth  (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_ERROR:
       return send_rejected (auth);
 
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+      return send_error (auth, "Need to authenticate first");
+
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1567,9 +1660,13 @@ handle_server_state_waiting_for_data  (DBusAuth         *auth,
       goto_state (auth, &common_state_need_disconnect);
       return TRUE;
 
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+      return send_error (auth, "Need to authenticate first");
+
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1592,9 +1689,16 @@ handle_server_state_waiting_for_begin (DBusAuth         *auth,
       goto_state (auth, &common_state_authenticated);
       return TRUE;
 
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+      if (auth->unix_fd_possible)
+        return send_agree_unix_fd (auth);
+      else
+        return send_error (auth, "Unix FD passing not supported, not authenticated or otherwise not possible");
+
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
     default:
       return send_error (auth, "Unknown command");
 
@@ -1759,7 +1863,7 @@ handle_client_state_waiting_for_data (DBusAuth         *auth,
       return process_rejected (auth, args);
 
     case DBUS_AUTH_COMMAND_OK:
-      return send_begin (auth, args);
+      return process_ok (auth, args);
 
     case DBUS_AUTH_COMMAND_ERROR:
       return send_cancel (auth);
@@ -1768,6 +1872,8 @@ handle_client_state_waiting_for_data (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_CANCEL:
     case DBUS_AUTH_COMMAND_BEGIN:
     case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1784,7 +1890,7 @@ handle_client_state_waiting_for_ok (DBusAuth         *auth,
       return process_rejected (auth, args);
 
     case DBUS_AUTH_COMMAND_OK:
-      return send_begin (auth, args);
+      return process_ok (auth, args);
 
     case DBUS_AUTH_COMMAND_DATA:
     case DBUS_AUTH_COMMAND_ERROR:
@@ -1794,6 +1900,8 @@ handle_client_state_waiting_for_ok (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_CANCEL:
     case DBUS_AUTH_COMMAND_BEGIN:
     case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1816,6 +1924,105 @@ handle_client_state_waiting_for_reject (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_ERROR:
     case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    default:
+      goto_state (auth, &common_state_need_disconnect);
+      return TRUE;
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_unix_fd (DBusAuth         *auth,
+                                               DBusAuthCommand   command,
+                                               const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+      _dbus_assert (auth->unix_fd_possible);
+      auth->unix_fd_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated UNIX FD passing\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert (auth->unix_fd_possible);
+      auth->unix_fd_negotiated = FALSE;
+      _dbus_verbose ("Failed to negotiate UNIX FD passing\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_pipelined_waiting_for_ok (DBusAuth         *auth,
+                                              DBusAuthCommand   command,
+                                              const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_OK:
+      return process_ok (auth, args);
+
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_ERROR:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    default:
+      /* We already sent BEGIN, so the server is going to hang up on
+       * us anyway; there is no way to fall back to another mechanism
+       */
+      _dbus_verbose ("%s: Pipelined authentication was not accepted\n",
+                     DBUS_AUTH_NAME (auth));
+      goto_state (auth, &common_state_need_disconnect);
+      return TRUE;
+    }
+}
+
+static dbus_bool_t
+handle_client_state_pipelined_waiting_for_agree_unix_fd (DBusAuth         *auth,
+                                                         DBusAuthCommand   command,
+                                                         const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+      _dbus_assert (auth->unix_fd_possible);
+      auth->unix_fd_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated UNIX FD passing\n");
+      goto_state (auth, &common_state_authenticated);
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert (auth->unix_fd_possible);
+      auth->unix_fd_negotiated = FALSE;
+      _dbus_verbose ("Failed to negotiate UNIX FD passing\n");
+      goto_state (auth, &common_state_authenticated);
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     default:
       goto_state (auth, &common_state_need_disconnect);
       return TRUE;
@@ -1837,7 +2044,9 @@ static const DBusAuthCommandName auth_command_names[] = {
   { "BEGIN",    DBUS_AUTH_COMMAND_BEGIN },
   { "REJECTED", DBUS_AUTH_COMMAND_REJECTED },
   { "OK",       DBUS_AUTH_COMMAND_OK },
-  { "ERROR",    DBUS_AUTH_COMMAND_ERROR }
+  { "ERROR",    DBUS_AUTH_COMMAND_ERROR },
+  { "NEGOTIATE_UNIX_FD", DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD },
+  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD }
 };
 
 static DBusAuthCommand
@@ -2493,6 +2702,98 @@ _dbus_auth_set_context (DBusAuth               *auth,
                                    &auth->context, 0, _dbus_string_get_length (context));
 }
 
+/**
+ * Sets whether unix fd passing is potentially on the transport and
+ * hence shall be negotiated.
+ *
+ * @param auth the auth conversation
+ * @param b TRUE when unix fd passing shall be negotiated, otherwise FALSE
+ */
+void
+_dbus_auth_set_unix_fd_possible (DBusAuth    *auth,
+                                 dbus_bool_t  b)
+{
+  auth->unix_fd_possible = b;
+}
+
+/**
+ * Switches a client that hasn't sent anything yet to pipelined
+ * authentication: NEGOTIATE_UNIX_FD (if fd passing is possible) and
+ * BEGIN are queued right behind the initial AUTH EXTERNAL, without
+ * waiting for the server to answer, so the whole handshake and the
+ * first messages can go out in one write. The server's OK (and its
+ * answer to NEGOTIATE_UNIX_FD) are picked up later, ahead of the
+ * first message from the server.
+ *
+ * Since BEGIN has already been sent, the client can't fall back to
+ * another mechanism; if the server rejects EXTERNAL, the connection
+ * is dropped.
+ *
+ * @param auth the auth conversation
+ * @returns #FALSE if no memory, or if the conversation already
+ * started or doesn't begin with EXTERNAL
+ */
+dbus_bool_t
+_dbus_auth_set_pipelined (DBusAuth *auth)
+{
+  int orig_len;
+
+  _dbus_assert (DBUS_AUTH_IS_CLIENT (auth));
+
+  if (auth->pipelined)
+    return TRUE;
+
+  if (auth->state != &client_state_waiting_for_data ||
+      auth->mech == NULL ||
+      auth->mech->client_data_func != handle_client_data_external_mech ||
+      _dbus_string_get_length (&auth->incoming) > 0)
+    return FALSE;
+
+  orig_len = _dbus_string_get_length (&auth->outgoing);
+
+  if (auth->unix_fd_possible &&
+      !_dbus_string_append (&auth->outgoing, "NEGOTIATE_UNIX_FD\r\n"))
+    return FALSE;
+
+  if (!_dbus_string_append (&auth->outgoing, "BEGIN\r\n"))
+    {
+      _dbus_string_set_length (&auth->outgoing, orig_len);
+      return FALSE;
+    }
+
+  auth->pipelined = TRUE;
+  goto_state (auth, &client_state_pipelined_waiting_for_ok);
+
+  return TRUE;
+}
+
+/**
+ * Queries whether this is a pipelined client conversation that is
+ * still going, meaning messages may be written as soon as the
+ * outgoing auth bytes are, before the server has answered.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if messages may be sent ahead of authentication
+ */
+dbus_bool_t
+_dbus_auth_get_pipelined (DBusAuth *auth)
+{
+  return auth->pipelined &&
+    auth->state != &common_state_need_disconnect;
+}
+
+/**
+ * Queries whether unix fd passing was successfully negotiated.
+ *
+ * @param auth the auth conversion
+ * @returns #TRUE when unix fd passing was negotiated.
+ */
+dbus_bool_t
+_dbus_auth_get_unix_fd_negotiated (DBusAuth *auth)
+{
+  return auth->unix_fd_negotiated;
+}
+
 /** @} */
 
 /* tests in dbus-auth-util.c */
@@ -76,6 +76,12 @@ dbus_bool_t   _dbus_auth_set_context         (DBusAuth               *auth,
                                               const DBusString       *context);
 const char*   _dbus_auth_get_guid_from_server(DBusAuth               *auth);
 
+void          _dbus_auth_set_unix_fd_possible(DBusAuth               *auth,
+                                              dbus_bool_t             b);
+dbus_bool_t   _dbus_auth_get_unix_fd_negotiated(DBusAuth             *auth);
+dbus_bool_t   _dbus_auth_set_pipelined       (DBusAuth               *auth);
+dbus_bool_t   _dbus_auth_get_pipelined       (DBusAuth               *auth);
+
 
 DBUS_END_DECLS
 
@@ -52,8 +52,15 @@ dbus_bool_t       _dbus_connection_queue_received_message      (DBusConnection
                                                                 DBusMessage        *message);
 void              _dbus_connection_queue_received_message_link (DBusConnection     *connection,
                                                                 DBusList           *link);
+dbus_bool_t       _dbus_connection_reject_received_message_link (DBusConnection     *connection,
+                                                                 DBusList           *link,
+                                                                 const char         *error_name,
+                                                                 const char         *error_message);
 dbus_bool_t       _dbus_connection_has_messages_to_send_unlocked (DBusConnection     *connection);
 DBusMessage*      _dbus_connection_get_message_to_send         (DBusConnection     *connection);
+int               _dbus_connection_get_messages_to_send        (DBusConnection     *connection,
+                                                                DBusMessage       **messages,
+                                                                int                 max_messages);
 void              _dbus_connection_message_sent                (DBusConnection     *connection,
                                                                 DBusMessage        *message);
 dbus_bool_t       _dbus_connection_add_watch_unlocked          (DBusConnection     *connection,
@@ -96,6 +103,11 @@ dbus_bool_t       _dbus_connection_send_and_unlock             (DBusConnection
 
 void              _dbus_connection_queue_synthesized_message_link (DBusConnection *connection,
 						                   DBusList *link);
+void              _dbus_connection_get_stats                      (DBusConnection *connection,
+                                                                   int            *in_messages,
+                                                                   long           *in_bytes,
+                                                                   int            *out_messages,
+                                                                   long           *out_bytes);
 void              _dbus_connection_test_get_locks                 (DBusConnection *conn,
                                                                    DBusMutex **mutex_loc,
                                                                    DBusMutex **dispatch_mutex_loc,
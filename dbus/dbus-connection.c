@@ -32,6 +32,7 @@
 #include "dbus-pending-call-internal.h"
 #include "dbus-list.h"
 #include "dbus-hash.h"
+#include "dbus-marshal-validate.h"
 #include "dbus-message-internal.h"
 #include "dbus-threads.h"
 #include "dbus-protocol.h"
@@ -41,6 +42,7 @@
 #include "dbus-object-tree.h"
 #include "dbus-threads-internal.h"
 #include "dbus-bus.h"
+#include "dbus-marshal-basic.h"
 
 #ifdef DBUS_DISABLE_CHECKS
 #define TOOK_LOCK_CHECK(connection)
@@ -73,6 +75,14 @@
     _dbus_mutex_unlock ((connection)->mutex);                                            \
   } while (0)
 
+#define SLOTS_LOCK(connection) do {                     \
+    _dbus_mutex_lock ((connection)->slot_mutex);        \
+  } while (0)
+
+#define SLOTS_UNLOCK(connection) do {                   \
+    _dbus_mutex_unlock ((connection)->slot_mutex);      \
+  } while (0)
+
 #define DISPATCH_STATUS_NAME(s)                                            \
                      ((s) == DBUS_DISPATCH_COMPLETE ? "complete" :         \
                       (s) == DBUS_DISPATCH_DATA_REMAINS ? "data remains" : \
@@ -210,6 +220,40 @@ struct DBusMessageFilter
   DBusHandleMessageFunction function; /**< Function to call to filter */
   void *user_data; /**< User data for the function */
   DBusFreeFunction free_user_data_function; /**< Function to free the user data */
+  char *path;      /**< Path a message must have for the filter to run, or #NULL */
+  char *interface; /**< Interface a message must have for the filter to run, or #NULL */
+  char *member;    /**< Member a message must have for the filter to run, or #NULL */
+};
+
+/**
+ * Indices into a DBusMessageFilterArray of the filters that require
+ * one particular member
+ */
+typedef struct
+{
+  int n_filters;  /**< Number of filters */
+  int filters[1]; /**< Indices of the filters, in increasing order */
+} DBusMessageFilterIndex;
+
+/**
+ * Internal struct holding the filters of a connection. The array is
+ * never modified while anyone but the connection holds a reference;
+ * adding or removing a filter installs a new array instead, so
+ * dispatch can run the filters from a referenced snapshot without
+ * copying anything.
+ */
+typedef struct DBusMessageFilterArray DBusMessageFilterArray;
+
+/**
+ * Internal struct holding the filters of a connection
+ */
+struct DBusMessageFilterArray
+{
+  DBusAtomic refcount; /**< Reference count */
+  DBusHashTable *by_member; /**< Member to #DBusMessageFilterIndex, #NULL if no filter requires a member */
+  DBusMessageFilterIndex *any_member; /**< Filters that don't require a member, if by_member is not #NULL */
+  int n_filters; /**< Number of filters */
+  DBusMessageFilter *filters[1]; /**< Filters in the order they run, each one referenced */
 };
 
 
@@ -255,8 +299,9 @@ struct DBusConnection
   DBusWatchList *watches;      /**< Stores active watches. */
   DBusTimeoutList *timeouts;   /**< Stores active timeouts. */
   
-  DBusList *filter_list;        /**< List of filters. */
+  DBusMessageFilterArray *filters; /**< Filters, or #NULL if there are none. */
 
+  DBusMutex *slot_mutex;        /**< Lock on slot_list, so the connection lock isn't needed to get data */
   DBusDataSlotList slot_list;   /**< Data stored by allocated integer ID */
 
   DBusHashTable *pending_replies;  /**< Hash of message serials to #DBusPendingCall. */  
@@ -287,6 +332,10 @@ struct DBusConnection
    */
   dbus_bool_t dispatch_acquired; /**< Someone has dispatch path (can drain incoming queue) */
   dbus_bool_t io_path_acquired;  /**< Someone has transport io path (can use the transport to read/write messages) */
+  unsigned long io_path_generation; /**< Bumped each time the io path is released; protected by io_path_mutex */
+
+  int io_thread_read_fd;  /**< Read end of the pipe that interrupts the I/O thread's poll, or -1 */
+  int io_thread_write_fd; /**< Write end of the pipe that interrupts the I/O thread's poll, or -1 */
   
   unsigned int shareable : 1; /**< #TRUE if libdbus owns a reference to the connection and can return it from dbus_connection_open() more than once */
   
@@ -294,6 +343,11 @@ struct DBusConnection
 
   unsigned int route_peer_messages : 1; /**< If #TRUE, if org.freedesktop.DBus.Peer messages have a bus name, don't handle them automatically */
 
+  unsigned int prioritize_replies : 1; /**< If #TRUE, replies, errors and bus driver messages are queued ahead of other outgoing messages */
+
+  unsigned int io_thread_running : 1; /**< If #TRUE, a thread started by dbus_connection_start_io_thread() does all the I/O */
+  unsigned int io_thread_signaled : 1; /**< The I/O thread has been woken up and hasn't started its next iteration yet */
+
   unsigned int disconnected_message_arrived : 1;   /**< We popped or are dispatching the disconnected message.
                                                     * if the disconnect_message_link is NULL then we queued it, but
                                                     * this flag is whether it got to the head of the queue.
@@ -341,11 +395,188 @@ _dbus_message_filter_unref (DBusMessageFilter *filter)
     {
       if (filter->free_user_data_function)
         (* filter->free_user_data_function) (filter->user_data);
-      
+
+      dbus_free (filter->path);
+      dbus_free (filter->interface);
+      dbus_free (filter->member);
       dbus_free (filter);
     }
 }
 
+static DBusMessageFilterArray *
+_dbus_message_filter_array_ref (DBusMessageFilterArray *array)
+{
+  _dbus_assert (array->refcount.value > 0);
+  _dbus_atomic_inc (&array->refcount);
+
+  return array;
+}
+
+static void
+_dbus_message_filter_array_unref (DBusMessageFilterArray *array)
+{
+  int i;
+
+  _dbus_assert (array->refcount.value > 0);
+
+  if (_dbus_atomic_dec (&array->refcount) == 1)
+    {
+      if (array->by_member)
+        _dbus_hash_table_unref (array->by_member);
+      dbus_free (array->any_member);
+
+      for (i = 0; i < array->n_filters; i++)
+        _dbus_message_filter_unref (array->filters[i]); /* may call app callback */
+
+      dbus_free (array);
+    }
+}
+
+/* Lists, in order, the filters of the array whose member is member
+ * (NULL for those without a member)
+ */
+static DBusMessageFilterIndex *
+_dbus_message_filter_index_new (DBusMessageFilterArray *array,
+                                const char             *member)
+{
+  DBusMessageFilterIndex *index;
+  int i, n;
+
+  n = 0;
+  for (i = 0; i < array->n_filters; i++)
+    {
+      if (member == NULL ?
+          array->filters[i]->member == NULL :
+          array->filters[i]->member != NULL &&
+          strcmp (array->filters[i]->member, member) == 0)
+        n += 1;
+    }
+
+  index = dbus_malloc (_DBUS_STRUCT_OFFSET (DBusMessageFilterIndex, filters) +
+                       (n + 1) * sizeof (int));
+  if (index == NULL)
+    return NULL;
+
+  index->n_filters = 0;
+  for (i = 0; i < array->n_filters; i++)
+    {
+      if (member == NULL ?
+          array->filters[i]->member == NULL :
+          array->filters[i]->member != NULL &&
+          strcmp (array->filters[i]->member, member) == 0)
+        {
+          index->filters[index->n_filters] = i;
+          index->n_filters += 1;
+        }
+    }
+
+  _dbus_assert (index->n_filters == n);
+
+  return index;
+}
+
+/* Indexes the filters of the array by the member they require, so
+ * dispatch only looks at the filters that can match
+ */
+static dbus_bool_t
+_dbus_message_filter_array_build_index (DBusMessageFilterArray *array)
+{
+  int i;
+
+  for (i = 0; i < array->n_filters; i++)
+    {
+      const char *member = array->filters[i]->member;
+      DBusMessageFilterIndex *index;
+
+      if (member == NULL)
+        continue;
+
+      if (array->by_member == NULL)
+        {
+          /* the keys belong to the filters */
+          array->by_member = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                   NULL, dbus_free);
+          if (array->by_member == NULL)
+            return FALSE;
+
+          array->any_member = _dbus_message_filter_index_new (array, NULL);
+          if (array->any_member == NULL)
+            return FALSE;
+        }
+      else if (_dbus_hash_table_lookup_string (array->by_member, member))
+        continue;
+
+      index = _dbus_message_filter_index_new (array, member);
+      if (index == NULL)
+        return FALSE;
+
+      if (!_dbus_hash_table_insert_string (array->by_member,
+                                           (char *) member, index))
+        {
+          dbus_free (index);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/**
+ * Creates a filter array holding the filters of old (which may be
+ * #NULL) that are still installed, except the one at index skip
+ * (-1 to skip none), followed by added (if not #NULL).
+ *
+ * @param old the array to copy
+ * @param skip index of a filter not to copy, or -1
+ * @param added filter to append, or #NULL
+ * @returns the new array, or #NULL if no memory
+ */
+static DBusMessageFilterArray *
+_dbus_message_filter_array_copy (DBusMessageFilterArray *old,
+                                 int                     skip,
+                                 DBusMessageFilter      *added)
+{
+  DBusMessageFilterArray *array;
+  int n_old, i;
+
+  n_old = old ? old->n_filters : 0;
+
+  array = dbus_malloc (_DBUS_STRUCT_OFFSET (DBusMessageFilterArray, filters) +
+                       (n_old + 1) * sizeof (DBusMessageFilter *));
+  if (array == NULL)
+    return NULL;
+
+  array->refcount.value = 1;
+  array->by_member = NULL;
+  array->any_member = NULL;
+  array->n_filters = 0;
+
+  for (i = 0; i < n_old; i++)
+    {
+      /* filters whose removal couldn't rebuild the array are dropped here */
+      if (i == skip || old->filters[i]->function == NULL)
+        continue;
+
+      array->filters[array->n_filters] =
+        _dbus_message_filter_ref (old->filters[i]);
+      array->n_filters += 1;
+    }
+
+  if (added != NULL)
+    {
+      array->filters[array->n_filters] = _dbus_message_filter_ref (added);
+      array->n_filters += 1;
+    }
+
+  if (!_dbus_message_filter_array_build_index (array))
+    {
+      _dbus_message_filter_array_unref (array);
+      return NULL;
+    }
+
+  return array;
+}
+
 /**
  * Acquires the connection lock.
  *
@@ -409,6 +640,36 @@ _dbus_connection_queue_received_message (DBusConnection *connection,
   return TRUE;
 }
 
+/**
+ * Gets the sizes of the connection's message queues, for
+ * statistics.  The incoming byte count covers every received message
+ * that is still alive, not only those waiting to be dispatched.
+ *
+ * @param connection the connection.
+ * @param in_messages return location for the number of messages
+ *        waiting to be dispatched
+ * @param in_bytes return location for the bytes of live received messages
+ * @param out_messages return location for the number of messages
+ *        waiting to be sent
+ * @param out_bytes return location for the bytes waiting to be sent
+ */
+void
+_dbus_connection_get_stats (DBusConnection *connection,
+                            int            *in_messages,
+                            long           *in_bytes,
+                            int            *out_messages,
+                            long           *out_bytes)
+{
+  CONNECTION_LOCK (connection);
+
+  *in_messages = connection->n_incoming;
+  *in_bytes = _dbus_transport_get_live_messages_size (connection->transport);
+  *out_messages = connection->n_outgoing;
+  *out_bytes = _dbus_counter_get_value (connection->outgoing_counter);
+
+  CONNECTION_UNLOCK (connection);
+}
+
 /**
  * Gets the locks so we can examine them
  *
@@ -575,6 +836,39 @@ _dbus_connection_get_message_to_send (DBusConnection *connection)
   return _dbus_list_get_last (&connection->outgoing_messages);
 }
 
+/**
+ * Gets the first few messages in the outgoing queue, in the order
+ * they will be sent, so a transport can write them in one go. As
+ * each is written, _dbus_connection_message_sent() must be called.
+ * Called with the connection lock held.
+ *
+ * @param connection the connection.
+ * @param messages array to store the messages in.
+ * @param max_messages size of the array.
+ * @returns the number of messages stored.
+ */
+int
+_dbus_connection_get_messages_to_send (DBusConnection  *connection,
+                                       DBusMessage    **messages,
+                                       int              max_messages)
+{
+  DBusList *link;
+  int n;
+
+  HAVE_LOCK_CHECK (connection);
+
+  n = 0;
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+  while (link != NULL && n < max_messages)
+    {
+      messages[n] = link->data;
+      n += 1;
+      link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+    }
+
+  return n;
+}
+
 /**
  * Notifies the connection that a message has been sent, so the
  * message can be removed from the outgoing queue.
@@ -651,6 +945,7 @@ protected_change_watch (DBusConnection         *connection,
 {
   DBusWatchList *watches;
   dbus_bool_t retval;
+  dbus_bool_t unlock;
   
   HAVE_LOCK_CHECK (connection);
 
@@ -659,33 +954,45 @@ protected_change_watch (DBusConnection         *connection,
    */
   
   watches = connection->watches;
-  if (watches)
+  if (watches == NULL)
+    return FALSE;
+
+  /* With an I/O thread, every sending thread changes the watches, and
+   * one of them would fail for no reason while we hid the list
+   * and called out unlocked. So the watch functions are called with
+   * the lock held then; dbus_connection_start_io_thread() documents
+   * that they must not call back into the connection.
+   */
+  unlock = !connection->io_thread_running;
+
+  if (unlock)
     {
       connection->watches = NULL;
       _dbus_connection_ref_unlocked (connection);
       CONNECTION_UNLOCK (connection);
+    }
 
-      if (add_function)
-        retval = (* add_function) (watches, watch);
-      else if (remove_function)
-        {
-          retval = TRUE;
-          (* remove_function) (watches, watch);
-        }
-      else
-        {
-          retval = TRUE;
-          (* toggle_function) (watches, watch, enabled);
-        }
-      
+  if (add_function)
+    retval = (* add_function) (watches, watch);
+  else if (remove_function)
+    {
+      retval = TRUE;
+      (* remove_function) (watches, watch);
+    }
+  else
+    {
+      retval = TRUE;
+      (* toggle_function) (watches, watch, enabled);
+    }
+
+  if (unlock)
+    {
       CONNECTION_LOCK (connection);
       connection->watches = watches;
       _dbus_connection_unref_unlocked (connection);
-
-      return retval;
     }
-  else
-    return FALSE;
+
+  return retval;
 }
      
 
@@ -772,6 +1079,7 @@ protected_change_timeout (DBusConnection           *connection,
 {
   DBusTimeoutList *timeouts;
   dbus_bool_t retval;
+  dbus_bool_t unlock;
   
   HAVE_LOCK_CHECK (connection);
 
@@ -780,33 +1088,45 @@ protected_change_timeout (DBusConnection           *connection,
    */
   
   timeouts = connection->timeouts;
-  if (timeouts)
+  if (timeouts == NULL)
+    return FALSE;
+
+  /* With an I/O thread, every sending thread changes the timeouts, and
+   * one of them would fail for no reason while we hid the list
+   * and called out unlocked. So the timeout functions are called with
+   * the lock held then; dbus_connection_start_io_thread() documents
+   * that they must not call back into the connection.
+   */
+  unlock = !connection->io_thread_running;
+
+  if (unlock)
     {
       connection->timeouts = NULL;
       _dbus_connection_ref_unlocked (connection);
       CONNECTION_UNLOCK (connection);
+    }
 
-      if (add_function)
-        retval = (* add_function) (timeouts, timeout);
-      else if (remove_function)
-        {
-          retval = TRUE;
-          (* remove_function) (timeouts, timeout);
-        }
-      else
-        {
-          retval = TRUE;
-          (* toggle_function) (timeouts, timeout, enabled);
-        }
-      
+  if (add_function)
+    retval = (* add_function) (timeouts, timeout);
+  else if (remove_function)
+    {
+      retval = TRUE;
+      (* remove_function) (timeouts, timeout);
+    }
+  else
+    {
+      retval = TRUE;
+      (* toggle_function) (timeouts, timeout, enabled);
+    }
+
+  if (unlock)
+    {
       CONNECTION_LOCK (connection);
       connection->timeouts = timeouts;
       _dbus_connection_unref_unlocked (connection);
-
-      return retval;
     }
-  else
-    return FALSE;
+
+  return retval;
 }
 
 /**
@@ -1073,7 +1393,8 @@ _dbus_connection_acquire_io_path (DBusConnection *connection,
 /**
  * Release the I/O path when you're done with it. Only call
  * after you've acquired the I/O. Wakes up at most one thread
- * currently waiting to acquire the I/O path.
+ * currently waiting to acquire the I/O path, or all of the
+ * threads waiting on the I/O thread if there is one.
  *
  * @param connection the connection.
  */
@@ -1091,12 +1412,101 @@ _dbus_connection_release_io_path (DBusConnection *connection)
                  _DBUS_FUNCTION_NAME, connection->io_path_acquired);
   
   connection->io_path_acquired = FALSE;
-  _dbus_condvar_wake_one (connection->io_path_cond);
+  connection->io_path_generation += 1;
+
+  /* With an I/O thread, everyone waiting is waiting for it to get
+   * something done, not for the io path itself
+   */
+  if (connection->io_thread_running)
+    _dbus_condvar_wake_all (connection->io_path_cond);
+  else
+    _dbus_condvar_wake_one (connection->io_path_cond);
 
   _dbus_verbose ("%s unlocking io_path_mutex\n", _DBUS_FUNCTION_NAME);
   _dbus_mutex_unlock (connection->io_path_mutex);
 }
 
+/* Called with the connection lock held */
+static void
+_dbus_connection_wakeup_io_thread_unlocked (DBusConnection *connection)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->io_thread_signaled)
+    return;
+
+  _dbus_wakeup_pipe_signal (connection->io_thread_write_fd);
+  connection->io_thread_signaled = TRUE;
+}
+
+/**
+ * Stands in for an iteration when an I/O thread owns the transport:
+ * asks the I/O thread to write if there is anything to write, and
+ * if blocking, waits until the I/O thread has finished an iteration
+ * (or the timeout passes) so the caller can look at the queues
+ * again.
+ *
+ * Called with connection lock held.
+ *
+ * @param connection the connection.
+ * @param pending the pending call that should be checked or NULL
+ * @param flags iteration flags.
+ * @param timeout_milliseconds maximum blocking time, or -1 for no limit.
+ */
+static void
+_dbus_connection_wait_for_io_thread_unlocked (DBusConnection  *connection,
+                                              DBusPendingCall *pending,
+                                              unsigned int     flags,
+                                              int              timeout_milliseconds)
+{
+  unsigned long generation;
+
+  HAVE_LOCK_CHECK (connection);
+
+  if (flags & DBUS_ITERATION_DO_WRITING)
+    _dbus_connection_wakeup_io_thread_unlocked (connection);
+
+  if (!(flags & DBUS_ITERATION_BLOCK))
+    return;
+
+  if (pending != NULL &&
+      (_dbus_pending_call_get_completed_unlocked (pending) ||
+       _dbus_connection_peek_for_reply_unlocked (connection,
+                                                 _dbus_pending_call_get_reply_serial_unlocked (pending))))
+    return;
+
+  /* We don't want the connection to vanish */
+  _dbus_connection_ref_unlocked (connection);
+
+  /* Read the generation before dropping the connection lock, so an
+   * iteration that finishes in between can't be missed
+   */
+  _dbus_mutex_lock (connection->io_path_mutex);
+  generation = connection->io_path_generation;
+
+  CONNECTION_UNLOCK (connection);
+
+  if (timeout_milliseconds == -1)
+    {
+      while (generation == connection->io_path_generation)
+        _dbus_condvar_wait (connection->io_path_cond,
+                            connection->io_path_mutex);
+    }
+  else if (generation == connection->io_path_generation)
+    {
+      /* callers recheck and come back with the time that is left */
+      _dbus_condvar_wait_timeout (connection->io_path_cond,
+                                  connection->io_path_mutex,
+                                  timeout_milliseconds);
+    }
+
+  _dbus_mutex_unlock (connection->io_path_mutex);
+
+  CONNECTION_LOCK (connection);
+
+  _dbus_connection_unref_unlocked (connection);
+}
+
 /**
  * Queues incoming messages and sends outgoing messages for this
  * connection, optionally blocking in the process. Each call to
@@ -1145,6 +1555,14 @@ _dbus_connection_do_iteration_unlocked (DBusConnection *connection,
   if (connection->n_outgoing == 0)
     flags &= ~DBUS_ITERATION_DO_WRITING;
 
+  if (connection->io_thread_running)
+    {
+      _dbus_connection_wait_for_io_thread_unlocked (connection, pending,
+                                                    flags, timeout_milliseconds);
+      _dbus_verbose ("%s end\n", _DBUS_FUNCTION_NAME);
+      return;
+    }
+
   if (_dbus_connection_acquire_io_path (connection,
 					(flags & DBUS_ITERATION_BLOCK) ? timeout_milliseconds : 0))
     {
@@ -1234,6 +1652,10 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   _dbus_mutex_new_at_location (&connection->dispatch_mutex);
   if (connection->dispatch_mutex == NULL)
     goto error;
+
+  _dbus_mutex_new_at_location (&connection->slot_mutex);
+  if (connection->slot_mutex == NULL)
+    goto error;
   
   _dbus_condvar_new_at_location (&connection->dispatch_cond);
   if (connection->dispatch_cond == NULL)
@@ -1271,12 +1693,14 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   connection->timeouts = timeout_list;
   connection->pending_replies = pending_replies;
   connection->outgoing_counter = outgoing_counter;
-  connection->filter_list = NULL;
+  connection->filters = NULL;
   connection->last_dispatch_status = DBUS_DISPATCH_COMPLETE; /* so we're notified first time there's data */
   connection->objects = objects;
   connection->exit_on_disconnect = FALSE;
   connection->shareable = FALSE;
   connection->route_peer_messages = FALSE;
+  connection->io_thread_read_fd = -1;
+  connection->io_thread_write_fd = -1;
   connection->disconnected_message_arrived = FALSE;
   connection->disconnected_message_processed = FALSE;
   
@@ -1319,6 +1743,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
       _dbus_mutex_free_at_location (&connection->mutex);
       _dbus_mutex_free_at_location (&connection->io_path_mutex);
       _dbus_mutex_free_at_location (&connection->dispatch_mutex);
+      _dbus_mutex_free_at_location (&connection->slot_mutex);
       dbus_free (connection);
     }
   if (pending_replies)
@@ -1884,19 +2309,80 @@ _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
   return NULL;
 }
 
-/* Called with lock held, does not update dispatch status */
+/*
+ * Whether a message goes in the priority lane of the outgoing queue
+ * when dbus_connection_set_prioritize_replies() is enabled.
+ */
+static dbus_bool_t
+_dbus_message_is_high_priority (DBusMessage *message)
+{
+  int type;
+  const char *sender;
+
+  type = dbus_message_get_type (message);
+  if (type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      type == DBUS_MESSAGE_TYPE_ERROR)
+    return TRUE;
+
+  sender = dbus_message_get_sender (message);
+  
+  return sender != NULL && strcmp (sender, DBUS_SERVICE_DBUS) == 0;
+}
+
+/*
+ * Puts a link at the back of the outgoing queue, or if we are
+ * prioritizing replies and the message is high priority, behind the
+ * other high priority messages but ahead of everything else.
+ *
+ * The queue is sent from the end of the list, and the message at the
+ * very end may already be partially written, so it always stays put.
+ * Messages within each lane keep their relative order.
+ */
 static void
-_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
-                                                       DBusPreallocatedSend *preallocated,
-                                                       DBusMessage          *message,
-                                                       dbus_uint32_t        *client_serial)
+_dbus_connection_queue_outgoing_link (DBusConnection *connection,
+                                      DBusList       *link)
+{
+  DBusList *before;
+  
+  if (!connection->prioritize_replies ||
+      connection->outgoing_messages == NULL ||
+      !_dbus_message_is_high_priority (link->data))
+    {
+      _dbus_list_prepend_link (&connection->outgoing_messages, link);
+      return;
+    }
+
+  before = _dbus_list_get_last_link (&connection->outgoing_messages);
+  while (before != connection->outgoing_messages)
+    {
+      DBusList *prev = _dbus_list_get_prev_link (&connection->outgoing_messages,
+                                                 before);
+
+      if (!_dbus_message_is_high_priority (prev->data))
+        break;
+      
+      before = prev;
+    }
+
+  _dbus_list_insert_before_link (&connection->outgoing_messages,
+                                 before, link);
+}
+
+/* Called with lock held, does not update dispatch status; only
+ * queues the message, see _dbus_connection_kick_outgoing_unlocked()
+ */
+static void
+_dbus_connection_queue_preallocated_unlocked (DBusConnection       *connection,
+                                              DBusPreallocatedSend *preallocated,
+                                              DBusMessage          *message,
+                                              dbus_uint32_t        *client_serial)
 {
   dbus_uint32_t serial;
   const char *sig;
 
   preallocated->queue_link->data = message;
-  _dbus_list_prepend_link (&connection->outgoing_messages,
-                           preallocated->queue_link);
+  _dbus_connection_queue_outgoing_link (connection,
+                                        preallocated->queue_link);
 
   _dbus_message_add_size_counter_link (message,
                                        preallocated->counter_link);
@@ -1946,6 +2432,22 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
                  message, dbus_message_get_serial (message));
   
   _dbus_message_lock (message);
+}
+
+/* Called with lock held, does not update dispatch status; starts
+ * writing whatever has been queued
+ */
+static void
+_dbus_connection_kick_outgoing_unlocked (DBusConnection *connection)
+{
+  /* The I/O thread does the writing if there is one; we only make
+   * sure it knows there is something to write
+   */
+  if (connection->io_thread_running)
+    {
+      _dbus_connection_wakeup_io_thread_unlocked (connection);
+      return;
+    }
 
   /* Now we need to run an iteration to hopefully just write the messages
    * out immediately, and otherwise get them queued up
@@ -1960,6 +2462,18 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
     _dbus_connection_wakeup_mainloop (connection);
 }
 
+/* Called with lock held, does not update dispatch status */
+static void
+_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
+                                                       DBusPreallocatedSend *preallocated,
+                                                       DBusMessage          *message,
+                                                       dbus_uint32_t        *client_serial)
+{
+  _dbus_connection_queue_preallocated_unlocked (connection, preallocated,
+                                                message, client_serial);
+  _dbus_connection_kick_outgoing_unlocked (connection);
+}
+
 static void
 _dbus_connection_send_preallocated_and_unlock (DBusConnection       *connection,
 					       DBusPreallocatedSend *preallocated,
@@ -2014,6 +2528,60 @@ _dbus_connection_send_and_unlock (DBusConnection *connection,
   return TRUE;
 }
 
+/**
+ * Refuses a message the transport has just read instead of queueing
+ * it. If the message is a method call expecting a reply, an error
+ * reply is queued to go back to the sender; the message itself, and
+ * any unix fds it carries, are dropped.
+ *
+ * @param connection the connection, locked
+ * @param link link holding the message, ownership is taken on success
+ * @param error_name name of the error to reply with
+ * @param error_message message of the error to reply with
+ * @returns #FALSE if there was not enough memory for the reply
+ */
+dbus_bool_t
+_dbus_connection_reject_received_message_link (DBusConnection *connection,
+                                               DBusList       *link,
+                                               const char     *error_name,
+                                               const char     *error_message)
+{
+  DBusMessage *message;
+  DBusMessage *reply;
+  DBusPreallocatedSend *preallocated;
+
+  HAVE_LOCK_CHECK (connection);
+
+  message = link->data;
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+      !dbus_message_get_no_reply (message))
+    {
+      reply = dbus_message_new_error (message, error_name, error_message);
+      if (reply == NULL)
+        return FALSE;
+
+      preallocated = _dbus_connection_preallocate_send_unlocked (connection);
+      if (preallocated == NULL)
+        {
+          dbus_message_unref (reply);
+          return FALSE;
+        }
+
+      _dbus_connection_queue_preallocated_unlocked (connection, preallocated,
+                                                    reply, NULL);
+      dbus_message_unref (reply);
+    }
+
+  _dbus_verbose ("Message %p (serial %u) rejected with %s\n",
+                 message, dbus_message_get_serial (message), error_name);
+
+  _dbus_list_free_link (link);
+  dbus_message_unref (message);
+
+  return TRUE;
+}
+
 /**
  * Used internally to handle the semantics of dbus_server_set_new_connection_function().
  * If the new connection function does not ref the connection, we want to close it.
@@ -2556,7 +3124,7 @@ free_outgoing_message (void *element,
 static void
 _dbus_connection_last_unref (DBusConnection *connection)
 {
-  DBusList *link;
+  int i;
 
   _dbus_verbose ("Finalizing connection %p\n", connection);
   
@@ -2583,19 +3151,14 @@ _dbus_connection_last_unref (DBusConnection *connection)
 
   _dbus_data_slot_list_free (&connection->slot_list);
   
-  link = _dbus_list_get_first_link (&connection->filter_list);
-  while (link != NULL)
+  if (connection->filters != NULL)
     {
-      DBusMessageFilter *filter = link->data;
-      DBusList *next = _dbus_list_get_next_link (&connection->filter_list, link);
+      for (i = 0; i < connection->filters->n_filters; i++)
+        connection->filters->filters[i]->function = NULL;
 
-      filter->function = NULL;
-      _dbus_message_filter_unref (filter); /* calls app callback */
-      link->data = NULL;
-      
-      link = next;
+      _dbus_message_filter_array_unref (connection->filters); /* calls app callback */
+      connection->filters = NULL;
     }
-  _dbus_list_clear (&connection->filter_list);
   
   /* ---- Done with stuff that invokes application callbacks */
 
@@ -2604,8 +3167,6 @@ _dbus_connection_last_unref (DBusConnection *connection)
   _dbus_hash_table_unref (connection->pending_replies);
   connection->pending_replies = NULL;
   
-  _dbus_list_clear (&connection->filter_list);
-  
   _dbus_list_foreach (&connection->outgoing_messages,
                       free_outgoing_message,
 		      connection);
@@ -2620,6 +3181,10 @@ _dbus_connection_last_unref (DBusConnection *connection)
 
   _dbus_transport_unref (connection->transport);
 
+  if (connection->io_thread_read_fd >= 0)
+    _dbus_wakeup_pipe_close (connection->io_thread_read_fd,
+                             connection->io_thread_write_fd);
+
   if (connection->disconnect_message_link)
     {
       DBusMessage *message = connection->disconnect_message_link->data;
@@ -2635,6 +3200,8 @@ _dbus_connection_last_unref (DBusConnection *connection)
   _dbus_mutex_free_at_location (&connection->io_path_mutex);
   _dbus_mutex_free_at_location (&connection->dispatch_mutex);
 
+  _dbus_mutex_free_at_location (&connection->slot_mutex);
+
   _dbus_mutex_free_at_location (&connection->mutex);
   
   dbus_free (connection);
@@ -2730,6 +3297,10 @@ _dbus_connection_close_possibly_shared_and_unlock (DBusConnection *connection)
   
   _dbus_transport_disconnect (connection->transport);
 
+  /* Get the I/O thread out of its poll so it notices and exits */
+  if (connection->io_thread_running)
+    _dbus_connection_wakeup_io_thread_unlocked (connection);
+
   /* This has the side effect of queuing the disconnect message link
    * (unless we don't have enough memory, possibly, so don't assert it).
    * After the disconnect message link is queued, dbus_bus_get/dbus_connection_open
@@ -2867,6 +3438,50 @@ dbus_connection_get_is_authenticated (DBusConnection *connection)
   return res;
 }
 
+/**
+ * Tests whether a certain type can be send via the connection. This
+ * will always return TRUE for all types, with the exception of
+ * DBUS_TYPE_UNIX_FD. The function will return TRUE for
+ * DBUS_TYPE_UNIX_FD only on systems that know Unix file descriptors
+ * and can send them via the chosen transport and when the remote side
+ * supports this.
+ *
+ * This function can be used to do runtime checking for types that
+ * might be unknown to the specific D-Bus client implementation
+ * version, i.e. it will return FALSE for all types this
+ * implementation does not know.
+ *
+ * @param connection the connection
+ * @param type the type to check
+ * @returns TRUE if the type may be send via the connection
+ */
+dbus_bool_t
+dbus_connection_can_send_type (DBusConnection *connection,
+                               int             type)
+{
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+
+  if (!_dbus_type_is_valid (type))
+    return FALSE;
+
+  if (type != DBUS_TYPE_UNIX_FD)
+    return TRUE;
+
+#ifdef HAVE_UNIX_FD_PASSING
+  {
+    dbus_bool_t b;
+
+    CONNECTION_LOCK (connection);
+    b = _dbus_transport_can_pass_unix_fd (connection->transport);
+    CONNECTION_UNLOCK (connection);
+
+    return b;
+  }
+#endif
+
+  return FALSE;
+}
+
 /**
  * Set whether _exit() should be called when the connection receives a
  * disconnect signal. The call to _exit() comes after any handlers for
@@ -2940,6 +3555,60 @@ dbus_connection_free_preallocated_send (DBusConnection       *connection,
   dbus_free (preallocated);
 }
 
+#ifdef HAVE_UNIX_FD_PASSING
+/*
+ * Sending unix fds on a connection that can't pass them is a bug in
+ * the application, which should have checked
+ * dbus_connection_can_send_type(); warn and refuse the message.
+ */
+static dbus_bool_t
+_dbus_connection_check_unix_fds_unlocked (DBusConnection *connection,
+                                          DBusMessage    *message)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (_dbus_transport_can_pass_unix_fd (connection->transport) ||
+      !dbus_message_contains_unix_fds (message))
+    return TRUE;
+
+#ifndef DBUS_DISABLE_CHECKS
+  _dbus_warn_check_failed ("Message %p contains unix file descriptors, but connection %p can't pass them. "
+                           "Check dbus_connection_can_send_type() before sending them.\n",
+                           message, connection);
+#endif
+
+  return FALSE;
+}
+
+/*
+ * Answers a method call we can't send because it carries unix fds,
+ * as if the remote side had replied with an error.
+ */
+static dbus_bool_t
+_dbus_connection_queue_unix_fd_error_unlocked (DBusConnection *connection,
+                                               DBusMessage    *message)
+{
+  DBusMessage *reply;
+  DBusList *link;
+
+  reply = dbus_message_new_error (message, DBUS_ERROR_NOT_SUPPORTED,
+                                  "Cannot send file descriptors on this connection");
+  if (reply == NULL)
+    return FALSE;
+
+  link = _dbus_list_alloc_link (reply);
+  if (link == NULL)
+    {
+      dbus_message_unref (reply);
+      return FALSE;
+    }
+
+  _dbus_connection_queue_synthesized_message_link (connection, link);
+
+  return TRUE;
+}
+#endif /* HAVE_UNIX_FD_PASSING */
+
 /**
  * Sends a message using preallocated resources. This function cannot fail.
  * It works identically to dbus_connection_send() in other respects.
@@ -2947,6 +3616,11 @@ dbus_connection_free_preallocated_send (DBusConnection       *connection,
  * This function "consumes" the preallocated resources, they need not
  * be freed separately.
  *
+ * As with dbus_connection_send(), the message must not contain unix
+ * file descriptors unless dbus_connection_can_send_type() says the
+ * connection can pass them; if it does, a warning is printed and the
+ * message is dropped.
+ *
  * @param connection the connection
  * @param preallocated the preallocated resources
  * @param message the message to send
@@ -2969,6 +3643,16 @@ dbus_connection_send_preallocated (DBusConnection       *connection,
                          dbus_message_get_member (message) != NULL));
   
   CONNECTION_LOCK (connection);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (!_dbus_connection_check_unix_fds_unlocked (connection, message))
+    {
+      CONNECTION_UNLOCK (connection);
+      dbus_connection_free_preallocated_send (connection, preallocated);
+      return;
+    }
+#endif
+
   _dbus_connection_send_preallocated_and_unlock (connection,
 						 preallocated,
 						 message, client_serial);
@@ -3010,6 +3694,13 @@ _dbus_connection_send_unlocked_no_update (DBusConnection *connection,
  *
  * The message serial is used by the remote application to send a
  * reply; see dbus_message_get_serial() or the D-Bus specification.
+ *
+ * A message containing unix file descriptors can only be sent if
+ * dbus_connection_can_send_type() returns #TRUE for
+ * #DBUS_TYPE_UNIX_FD. Sending one anyway is a bug in the
+ * application: a warning is printed, nothing is sent and #FALSE is
+ * returned, so check first rather than taking #FALSE to mean the
+ * connection is out of memory.
  * 
  * @param connection the connection.
  * @param message the message to write.
@@ -3026,11 +3717,104 @@ dbus_connection_send (DBusConnection *connection,
 
   CONNECTION_LOCK (connection);
 
+#ifdef HAVE_UNIX_FD_PASSING
+  if (!_dbus_connection_check_unix_fds_unlocked (connection, message))
+    {
+      CONNECTION_UNLOCK (connection);
+      return FALSE;
+    }
+#endif
+
   return _dbus_connection_send_and_unlock (connection,
 					   message,
 					   serial);
 }
 
+/**
+ * Adds several messages to the outgoing message queue, as if
+ * dbus_connection_send() were called on each of them in order, but
+ * taking the connection lock, trying to write and waking up the main
+ * loop (or the I/O thread) only once for the whole batch. Useful
+ * when emitting many signals at once.
+ *
+ * Either all of the messages are queued or none are: if there isn't
+ * enough memory for all of them, nothing is sent and #FALSE is
+ * returned. The same happens, with a warning, if one of them
+ * contains unix file descriptors that the connection can't pass; see
+ * dbus_connection_send().
+ *
+ * @param connection the connection.
+ * @param messages the messages to write, in the order to send them.
+ * @param n_messages number of messages.
+ * @param serials return location for the message serials, with room for n_messages, or #NULL if you don't care
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+dbus_connection_send_batch (DBusConnection  *connection,
+                            DBusMessage    **messages,
+                            int              n_messages,
+                            dbus_uint32_t   *serials)
+{
+  DBusPreallocatedSend **preallocated;
+  DBusDispatchStatus status;
+  int i;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (n_messages >= 0, FALSE);
+  _dbus_return_val_if_fail (messages != NULL || n_messages == 0, FALSE);
+
+  if (n_messages == 0)
+    return TRUE;
+
+  preallocated = dbus_new (DBusPreallocatedSend*, n_messages);
+  if (preallocated == NULL)
+    return FALSE;
+
+  CONNECTION_LOCK (connection);
+
+  for (i = 0; i < n_messages; i++)
+    {
+#ifdef HAVE_UNIX_FD_PASSING
+      if (!_dbus_connection_check_unix_fds_unlocked (connection, messages[i]))
+        break;
+#endif
+
+      preallocated[i] = _dbus_connection_preallocate_send_unlocked (connection);
+      if (preallocated[i] == NULL)
+        break;
+    }
+
+  if (i < n_messages)
+    {
+      while (i > 0)
+        {
+          i -= 1;
+          dbus_connection_free_preallocated_send (connection, preallocated[i]);
+        }
+
+      CONNECTION_UNLOCK (connection);
+      dbus_free (preallocated);
+      return FALSE;
+    }
+
+  for (i = 0; i < n_messages; i++)
+    _dbus_connection_queue_preallocated_unlocked (connection,
+                                                  preallocated[i],
+                                                  messages[i],
+                                                  serials ? &serials[i] : NULL);
+
+  _dbus_connection_kick_outgoing_unlocked (connection);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* this calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+  dbus_free (preallocated);
+
+  return TRUE;
+}
+
 static dbus_bool_t
 reply_handler_timeout (void *data)
 {
@@ -3082,6 +3866,12 @@ reply_handler_timeout (void *data)
  * timeout to mean "very long timeout." libdbus clamps an INT_MAX
  * timeout down to a few hours timeout though.
  *
+ * If the message contains unix file descriptors and the connection
+ * can't pass them (see dbus_connection_can_send_type()), the message
+ * is not sent; instead the #DBusPendingCall gets a
+ * #DBUS_ERROR_NOT_SUPPORTED error reply, generated in-process like
+ * the timeout error.
+ *
  * @warning if the connection is disconnected, the #DBusPendingCall
  * will be set to #NULL, so be careful with this.
  * 
@@ -3149,6 +3939,20 @@ dbus_connection_send_with_reply (DBusConnection     *connection,
 						      pending))
     goto error;
  
+#ifdef HAVE_UNIX_FD_PASSING
+  if (!_dbus_transport_can_pass_unix_fd (connection->transport) &&
+      dbus_message_contains_unix_fds (message))
+    {
+      /* The message can't go out, so the reply is an error from us */
+      if (!_dbus_connection_queue_unix_fd_error_unlocked (connection, message))
+        {
+          _dbus_connection_detach_pending_call_and_unlock (connection,
+                                                           pending);
+          goto error_unlocked;
+        }
+    }
+  else
+#endif
   if (!_dbus_connection_send_unlocked_no_update (connection, message, NULL))
     {
       _dbus_connection_detach_pending_call_and_unlock (connection,
@@ -3196,8 +4000,10 @@ dbus_connection_send_with_reply (DBusConnection     *connection,
  * received, it is converted to a #DBusError and returned as an error,
  * then the reply message is deleted and #NULL is returned. If
  * something else goes wrong, result is set to whatever is
- * appropriate, such as #DBUS_ERROR_NO_MEMORY or
- * #DBUS_ERROR_DISCONNECTED.
+ * appropriate, such as #DBUS_ERROR_NO_MEMORY,
+ * #DBUS_ERROR_DISCONNECTED, or #DBUS_ERROR_NOT_SUPPORTED for a
+ * message with unix file descriptors on a connection that can't
+ * pass them.
  *
  * @warning While this function blocks the calling thread will not be
  * processing the incoming message queue. This means you can end up
@@ -3863,15 +4669,6 @@ _dbus_connection_release_dispatch (DBusConnection *connection)
   _dbus_mutex_unlock (connection->dispatch_mutex);
 }
 
-static void
-_dbus_connection_failed_pop (DBusConnection *connection,
-			     DBusList       *message_link)
-{
-  _dbus_list_prepend_link (&connection->incoming_messages,
-			   message_link);
-  connection->n_incoming += 1;
-}
-
 /* Note this may be called multiple times since we don't track whether we already did it */
 static void
 notify_disconnected_unlocked (DBusConnection *connection)
@@ -4236,7 +5033,8 @@ DBusDispatchStatus
 dbus_connection_dispatch (DBusConnection *connection)
 {
   DBusMessage *message;
-  DBusList *link, *filter_list_copy, *message_link;
+  DBusList *message_link;
+  DBusMessageFilterArray *filters;
   DBusHandlerResult result;
   DBusPendingCall *pending;
   dbus_int32_t reply_serial;
@@ -4322,59 +5120,75 @@ dbus_connection_dispatch (DBusConnection *connection)
   if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
     goto out;
  
-  if (!_dbus_list_copy (&connection->filter_list, &filter_list_copy))
-    {
-      _dbus_connection_release_dispatch (connection);
-      HAVE_LOCK_CHECK (connection);
-      
-      _dbus_connection_failed_pop (connection, message_link);
-
-      /* unlocks and calls user code */
-      _dbus_connection_update_dispatch_status_and_unlock (connection,
-                                                          DBUS_DISPATCH_NEED_MEMORY);
-
-      if (pending)
-        dbus_pending_call_unref (pending);
-      dbus_connection_unref (connection);
-      
-      return DBUS_DISPATCH_NEED_MEMORY;
-    }
-  
-  _dbus_list_foreach (&filter_list_copy,
-		      (DBusForeachFunction)_dbus_message_filter_ref,
-		      NULL);
+  /* Filters added or removed by the callbacks install a new array,
+   * so the one we reference here stays as it is
+   */
+  filters = connection->filters;
+  if (filters != NULL)
+    _dbus_message_filter_array_ref (filters);
 
   /* We're still protected from dispatch() reentrancy here
    * since we acquired the dispatcher
    */
   CONNECTION_UNLOCK (connection);
   
-  link = _dbus_list_get_first_link (&filter_list_copy);
-  while (link != NULL)
+  if (filters != NULL)
     {
-      DBusMessageFilter *filter = link->data;
-      DBusList *next = _dbus_list_get_next_link (&filter_list_copy, link);
+      DBusMessageFilterIndex *with_member;
+      int i, j;
 
-      if (filter->function == NULL)
+      /* Run the filters requiring no member and the ones requiring
+       * the message's member, merging the two lists so they still
+       * run in the order they were added
+       */
+      with_member = NULL;
+      if (filters->by_member != NULL &&
+          dbus_message_get_member (message) != NULL)
+        with_member = _dbus_hash_table_lookup_string (filters->by_member,
+                                                      dbus_message_get_member (message));
+
+      i = 0;
+      j = 0;
+      while (TRUE)
         {
-          _dbus_verbose ("  filter was removed in a callback function\n");
-          link = next;
-          continue;
-        }
+          DBusMessageFilter *filter;
 
-      _dbus_verbose ("  running filter on message %p\n", message);
-      result = (* filter->function) (connection, message, filter->user_data);
+          if (filters->by_member == NULL)
+            {
+              if (i >= filters->n_filters)
+                break;
+              filter = filters->filters[i++];
+            }
+          else if (i < filters->any_member->n_filters &&
+                   (with_member == NULL || j >= with_member->n_filters ||
+                    filters->any_member->filters[i] < with_member->filters[j]))
+            filter = filters->filters[filters->any_member->filters[i++]];
+          else if (with_member != NULL && j < with_member->n_filters)
+            filter = filters->filters[with_member->filters[j++]];
+          else
+            break;
+
+          if (filter->function == NULL)
+            {
+              _dbus_verbose ("  filter was removed in a callback function\n");
+              continue;
+            }
 
-      if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
-	break;
+          if ((filter->interface != NULL &&
+               !dbus_message_has_interface (message, filter->interface)) ||
+              (filter->path != NULL &&
+               !dbus_message_has_path (message, filter->path)))
+            continue;
 
-      link = next;
-    }
+          _dbus_verbose ("  running filter on message %p\n", message);
+          result = (* filter->function) (connection, message, filter->user_data);
 
-  _dbus_list_foreach (&filter_list_copy,
-		      (DBusForeachFunction)_dbus_message_filter_unref,
-		      NULL);
-  _dbus_list_clear (&filter_list_copy);
+          if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
+            break;
+        }
+
+      _dbus_message_filter_array_unref (filters);
+    }
   
   CONNECTION_LOCK (connection);
 
@@ -4554,6 +5368,10 @@ dbus_connection_dispatch (DBusConnection *connection)
  * dbus_watch_handle() cannot be called during the
  * DBusAddWatchFunction, as the connection will not be ready to handle
  * that watch yet.
+ *
+ * The watch functions may be called with the connection lock held,
+ * so they must not call DBusConnection methods other than
+ * dbus_connection_get_data().
  * 
  * It is not allowed to reference a DBusWatch after it has been passed
  * to remove_function.
@@ -4652,6 +5470,10 @@ dbus_connection_set_watch_functions (DBusConnection              *connection,
  * given remove_function.  The timer interval may change whenever the
  * timeout is added, removed, or toggled.
  *
+ * As with the watch functions, the timeout functions may be called
+ * with the connection lock held, so they must not call
+ * DBusConnection methods other than dbus_connection_get_data().
+ *
  * @param connection the connection.
  * @param add_function function to add a timeout.
  * @param remove_function function to remove a timeout.
@@ -4791,6 +5613,143 @@ dbus_connection_set_dispatch_status_function (DBusConnection             *connec
     (*old_free_data) (old_data);
 }
 
+static void
+io_thread_main (void *data)
+{
+  DBusConnection *connection = data;
+  DBusDispatchStatus status;
+  unsigned int flags;
+
+  CONNECTION_LOCK (connection);
+
+  _dbus_verbose ("I/O thread for %p started\n", connection);
+
+  while (_dbus_connection_get_is_connected_unlocked (connection))
+    {
+      /* anything queued from here on signals us again */
+      connection->io_thread_signaled = FALSE;
+
+      flags = DBUS_ITERATION_DO_READING | DBUS_ITERATION_BLOCK;
+      if (connection->n_outgoing > 0)
+        flags |= DBUS_ITERATION_DO_WRITING;
+
+      if (_dbus_connection_acquire_io_path (connection, -1))
+        {
+          _dbus_transport_do_iteration (connection->transport, flags, -1);
+          _dbus_connection_release_io_path (connection);
+        }
+
+      status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+      /* this calls out to user code */
+      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+      CONNECTION_LOCK (connection);
+    }
+
+  _dbus_verbose ("I/O thread for %p exiting\n", connection);
+
+  connection->io_thread_running = FALSE;
+
+  /* Anyone still waiting for us does their own I/O from now on */
+  _dbus_mutex_lock (connection->io_path_mutex);
+  connection->io_path_generation += 1;
+  _dbus_condvar_wake_all (connection->io_path_cond);
+  _dbus_mutex_unlock (connection->io_path_mutex);
+
+  CONNECTION_UNLOCK (connection);
+
+  dbus_connection_unref (connection);
+}
+
+/**
+ * Starts a thread that does all reading and writing for the
+ * connection from then on, until the connection is closed or
+ * disconnected.
+ *
+ * Without it, whichever thread gets to the connection first does the
+ * socket I/O: a thread calling dbus_connection_send() may end up
+ * writing everyone's messages, and threads blocking for replies take
+ * turns reading. With the I/O thread, dbus_connection_send() only
+ * queues the message and wakes the I/O thread, and threads blocking
+ * in dbus_connection_flush() or
+ * dbus_connection_send_with_reply_and_block() just wait for it.
+ *
+ * The I/O thread calls the dispatch status function (see
+ * dbus_connection_set_dispatch_status_function()) when messages
+ * arrive; it still doesn't dispatch them, that is up to the
+ * application. Since the I/O thread watches the connection's socket
+ * itself, any watch functions are removed, and the application must
+ * not set new ones. Timeout functions are still used, but from then
+ * on they are called with the connection locked, so they must not
+ * call back into the connection.
+ *
+ * dbus_threads_init() or dbus_threads_init_default() must have been
+ * called first. The thread holds a reference to the connection
+ * until it exits, so a private connection must be closed with
+ * dbus_connection_close() as usual.
+ *
+ * Does nothing if the thread is already running.
+ *
+ * @param connection the connection
+ * @returns #FALSE if there wasn't enough memory or the thread could not be started
+ */
+dbus_bool_t
+dbus_connection_start_io_thread (DBusConnection *connection)
+{
+  DBusError error;
+  int read_fd, write_fd;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (_dbus_threads_initialized (), FALSE);
+
+  /* the I/O thread owns the socket from now on */
+  dbus_connection_set_watch_functions (connection, NULL, NULL, NULL,
+                                       NULL, NULL);
+
+  CONNECTION_LOCK (connection);
+
+  if (connection->io_thread_running)
+    {
+      CONNECTION_UNLOCK (connection);
+      return TRUE;
+    }
+
+  if (connection->io_thread_read_fd < 0)
+    {
+      dbus_error_init (&error);
+      if (!_dbus_wakeup_pipe_open (&read_fd, &write_fd, &error))
+        {
+          _dbus_verbose ("Could not create I/O thread wakeup pipe: %s\n",
+                         error.message);
+          dbus_error_free (&error);
+          CONNECTION_UNLOCK (connection);
+          return FALSE;
+        }
+
+      connection->io_thread_read_fd = read_fd;
+      connection->io_thread_write_fd = write_fd;
+      _dbus_transport_set_wakeup_pipe (connection->transport,
+                                       read_fd, write_fd);
+    }
+
+  _dbus_connection_ref_unlocked (connection);
+  connection->io_thread_running = TRUE;
+  connection->io_thread_signaled = FALSE;
+
+  if (!_dbus_thread_start (io_thread_main, connection))
+    {
+      connection->io_thread_running = FALSE;
+      _dbus_connection_unref_unlocked (connection);
+      CONNECTION_UNLOCK (connection);
+      return FALSE;
+    }
+
+  CONNECTION_UNLOCK (connection);
+
+  return TRUE;
+}
+
 /**
  * Get the UNIX file descriptor of the connection, if any.  This can
  * be used for SELinux access control checks with getpeercon() for
@@ -5021,6 +5980,71 @@ dbus_connection_set_route_peer_messages (DBusConnection             *connection,
   CONNECTION_UNLOCK (connection);
 }
 
+/**
+ * Normally the outgoing message queue is strictly first-in,
+ * first-out. If reply prioritization is enabled, method returns,
+ * errors and messages from the bus driver (sender
+ * #DBUS_SERVICE_DBUS) are queued ahead of any other messages that
+ * have not started to be written yet, so a reply does not have to
+ * wait behind a large backlog of signals.
+ *
+ * Messages within each of the two classes are still sent in the
+ * order they were queued, but a reply may now overtake a signal
+ * queued before it. Since that breaks the usual guarantee that
+ * messages from one sender arrive in order, this is meant for the
+ * message bus, where the queue holds messages from many different
+ * senders; don't set it unless you know the peer can cope.
+ *
+ * @param connection the connection
+ * @param value #TRUE to send replies ahead of other queued messages
+ */
+void
+dbus_connection_set_prioritize_replies (DBusConnection             *connection,
+                                        dbus_bool_t                 value)
+{
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  connection->prioritize_replies = value != FALSE;
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Makes a newly opened client connection pipeline its
+ * authentication handshake. Normally the client sends AUTH, waits
+ * for the server's OK, sends BEGIN and only then its first message,
+ * so the reply to that message is two round trips away. Pipelined,
+ * the credentials byte, AUTH EXTERNAL, BEGIN and whatever messages
+ * are already queued (typically the Hello call made by
+ * dbus_bus_register()) go out together in a single write, and the
+ * server's OK is picked up in front of its reply.
+ *
+ * This must be called before the connection has done any I/O, for
+ * example right after dbus_connection_open_private() and before
+ * dbus_bus_register(). Only the EXTERNAL mechanism can be
+ * pipelined, and since BEGIN has already gone out there's no
+ * falling back to another mechanism: if the server doesn't accept
+ * EXTERNAL, the connection is simply disconnected. Messages
+ * carrying unix fds can't be sent until the server has answered.
+ *
+ * @param connection the connection
+ * @returns #FALSE if no memory, or if the connection is a server
+ * connection or has already started authenticating
+ */
+dbus_bool_t
+dbus_connection_set_pipelined_auth (DBusConnection *connection)
+{
+  dbus_bool_t retval;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+
+  CONNECTION_LOCK (connection);
+  retval = _dbus_transport_set_pipelined_auth (connection->transport);
+  CONNECTION_UNLOCK (connection);
+
+  return retval;
+}
+
 /**
  * Adds a message filter. Filters are handlers that are run on all
  * incoming messages, prior to the objects registered with
@@ -5047,10 +6071,48 @@ dbus_connection_add_filter (DBusConnection            *connection,
                             DBusHandleMessageFunction  function,
                             void                      *user_data,
                             DBusFreeFunction           free_data_function)
+{
+  return dbus_connection_add_filter_for (connection, NULL, NULL, NULL,
+                                         function, user_data,
+                                         free_data_function);
+}
+
+/**
+ * Adds a message filter that only runs on messages with the given
+ * path, interface and member. #NULL for any of them matches all
+ * messages. Otherwise this is the same as
+ * dbus_connection_add_filter(), and the filter is removed with
+ * dbus_connection_remove_filter().
+ *
+ * The connection indexes filters by member, so a connection with
+ * many filters for different members only looks at the ones that
+ * can match a message instead of calling each of them.
+ *
+ * @param connection the connection
+ * @param path the object path messages must have, or #NULL
+ * @param interface the interface messages must have, or #NULL
+ * @param member the member messages must have, or #NULL
+ * @param function function to handle messages
+ * @param user_data user data to pass to the function
+ * @param free_data_function function to use for freeing user data
+ * @returns #TRUE on success, #FALSE if not enough memory.
+ */
+dbus_bool_t
+dbus_connection_add_filter_for (DBusConnection            *connection,
+                                const char                *path,
+                                const char                *interface,
+                                const char                *member,
+                                DBusHandleMessageFunction  function,
+                                void                      *user_data,
+                                DBusFreeFunction           free_data_function)
 {
   DBusMessageFilter *filter;
+  DBusMessageFilterArray *filters;
   
   _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (path == NULL || _dbus_check_is_valid_path (path), FALSE);
+  _dbus_return_val_if_fail (interface == NULL || _dbus_check_is_valid_interface (interface), FALSE);
+  _dbus_return_val_if_fail (member == NULL || _dbus_check_is_valid_member (member), FALSE);
   _dbus_return_val_if_fail (function != NULL, FALSE);
 
   filter = dbus_new0 (DBusMessageFilter, 1);
@@ -5058,17 +6120,35 @@ dbus_connection_add_filter (DBusConnection            *connection,
     return FALSE;
 
   filter->refcount.value = 1;
+
+  if ((path != NULL && (filter->path = _dbus_strdup (path)) == NULL) ||
+      (interface != NULL && (filter->interface = _dbus_strdup (interface)) == NULL) ||
+      (member != NULL && (filter->member = _dbus_strdup (member)) == NULL))
+    {
+      _dbus_message_filter_unref (filter);
+      return FALSE;
+    }
   
   CONNECTION_LOCK (connection);
 
-  if (!_dbus_list_append (&connection->filter_list,
-                          filter))
+  filters = _dbus_message_filter_array_copy (connection->filters, -1, filter);
+  if (filters == NULL)
     {
       _dbus_message_filter_unref (filter);
       CONNECTION_UNLOCK (connection);
       return FALSE;
     }
 
+  /* the array holds the filter now; the old array only references
+   * filters that are also in the new one or were removed already, so
+   * dropping it doesn't call application code
+   */
+  _dbus_message_filter_unref (filter);
+
+  if (connection->filters != NULL)
+    _dbus_message_filter_array_unref (connection->filters);
+  connection->filters = filters;
+
   /* Fill in filter after all memory allocated,
    * so we don't run the free_user_data_function
    * if the add_filter() fails
@@ -5099,8 +6179,9 @@ dbus_connection_remove_filter (DBusConnection            *connection,
                                DBusHandleMessageFunction  function,
                                void                      *user_data)
 {
-  DBusList *link;
+  DBusMessageFilterArray *filters;
   DBusMessageFilter *filter;
+  int i;
   
   _dbus_return_if_fail (connection != NULL);
   _dbus_return_if_fail (function != NULL);
@@ -5109,21 +6190,35 @@ dbus_connection_remove_filter (DBusConnection            *connection,
 
   filter = NULL;
   
-  link = _dbus_list_get_last_link (&connection->filter_list);
-  while (link != NULL)
+  i = connection->filters ? connection->filters->n_filters : 0;
+  while (--i >= 0)
     {
-      filter = link->data;
-
-      if (filter->function == function &&
-          filter->user_data == user_data)
+      if (connection->filters->filters[i]->function == function &&
+          connection->filters->filters[i]->user_data == user_data)
         {
-          _dbus_list_remove_link (&connection->filter_list, link);
+          /* keep it alive for the free function below */
+          filter = _dbus_message_filter_ref (connection->filters->filters[i]);
           filter->function = NULL;
-          
           break;
         }
-        
-      link = _dbus_list_get_prev_link (&connection->filter_list, link);
+    }
+
+  if (filter != NULL)
+    {
+      if (connection->filters->n_filters == 1)
+        filters = NULL;
+      else
+        filters = _dbus_message_filter_array_copy (connection->filters, i, NULL);
+
+      /* If there's no memory for a new array the filter stays in the
+       * old one, but it won't run since its function is NULL and the
+       * next copy drops it
+       */
+      if (filters != NULL || connection->filters->n_filters == 1)
+        {
+          _dbus_message_filter_array_unref (connection->filters);
+          connection->filters = filters;
+        }
     }
   
   CONNECTION_UNLOCK (connection);
@@ -5405,14 +6500,14 @@ dbus_connection_set_data (DBusConnection   *connection,
   _dbus_return_val_if_fail (connection != NULL, FALSE);
   _dbus_return_val_if_fail (slot >= 0, FALSE);
   
-  CONNECTION_LOCK (connection);
+  SLOTS_LOCK (connection);
 
   retval = _dbus_data_slot_list_set (&slot_allocator,
                                      &connection->slot_list,
                                      slot, data, free_data_func,
                                      &old_free_func, &old_data);
   
-  CONNECTION_UNLOCK (connection);
+  SLOTS_UNLOCK (connection);
 
   if (retval)
     {
@@ -5439,14 +6534,17 @@ dbus_connection_get_data (DBusConnection   *connection,
   void *res;
 
   _dbus_return_val_if_fail (connection != NULL, NULL);
-  
-  CONNECTION_LOCK (connection);
+
+  /* Only takes the slot lock, so this may be called with the
+   * connection lock held, e.g. from watch and timeout functions
+   */
+  SLOTS_LOCK (connection);
 
   res = _dbus_data_slot_list_get (&slot_allocator,
                                   &connection->slot_list,
                                   slot);
   
-  CONNECTION_UNLOCK (connection);
+  SLOTS_UNLOCK (connection);
 
   return res;
 }
@@ -5558,6 +6656,51 @@ dbus_connection_get_max_received_size (DBusConnection *connection)
   return res;
 }
 
+/**
+ * Sets the maximum total number of unix fds that can be held by all
+ * messages received on this connection. Messages count toward the
+ * maximum until they are finalized.
+ *
+ * Unlike dbus_connection_set_max_received_size(), this is checked as
+ * each message is read: a message whose fds would take the total
+ * over the maximum is not queued at all. Its fds are closed and, if
+ * it is a method call expecting a reply, the sender gets a
+ * #DBUS_ERROR_LIMITS_EXCEEDED error.
+ *
+ * @param connection the connection
+ * @param n the maximum number of unix fds in all outstanding messages
+ */
+void
+dbus_connection_set_max_received_unix_fds (DBusConnection *connection,
+                                           long            n)
+{
+  _dbus_return_if_fail (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_max_received_unix_fds (connection->transport,
+                                             n);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Gets the value set by dbus_connection_set_max_received_unix_fds().
+ *
+ * @param connection the connection
+ * @returns the max number of unix fds in all live messages
+ */
+long
+dbus_connection_get_max_received_unix_fds (DBusConnection *connection)
+{
+  long res;
+
+  _dbus_return_val_if_fail (connection != NULL, 0);
+
+  CONNECTION_LOCK (connection);
+  res = _dbus_transport_get_max_received_unix_fds (connection->transport);
+  CONNECTION_UNLOCK (connection);
+  return res;
+}
+
 /**
  * Gets the approximate size in bytes of all messages in the outgoing
  * message queue. The size is approximate in that you shouldn't use
@@ -5582,3 +6725,290 @@ dbus_connection_get_outgoing_size (DBusConnection *connection)
 }
 
 /** @} */
+
+#ifdef DBUS_BUILD_TESTS
+#include "dbus-test.h"
+#include "dbus-server.h"
+
+#define N_TEST_FILTERS 8
+
+typedef struct FilterTestData FilterTestData;
+
+/* Each test filter appends its name to the record when it runs */
+typedef struct
+{
+  FilterTestData *test;
+  char name;
+} TestFilter;
+
+struct FilterTestData
+{
+  DBusConnection *connection;
+  DBusString record;
+  TestFilter filters[N_TEST_FILTERS]; /* named 'a', 'b', ... */
+};
+
+#define TEST_INTERFACE "org.freedesktop.DBus.Test"
+#define OTHER_TEST_INTERFACE "org.freedesktop.DBus.Test.Other"
+
+static TestFilter *
+test_filter (FilterTestData *test,
+             char            name)
+{
+  _dbus_assert (name >= 'a' && name < 'a' + N_TEST_FILTERS);
+
+  return &test->filters[name - 'a'];
+}
+
+static DBusHandlerResult
+record_filter (DBusConnection *connection,
+               DBusMessage    *message,
+               void           *user_data)
+{
+  TestFilter *filter = user_data;
+
+  if (!_dbus_string_append_byte (&filter->test->record, filter->name))
+    _dbus_assert_not_reached ("no memory to record filter");
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Filter A rearranges the filters while the message is being
+ * dispatched: it removes itself and B, and adds D
+ */
+static DBusHandlerResult
+rearranging_filter (DBusConnection *connection,
+                    DBusMessage    *message,
+                    void           *user_data)
+{
+  TestFilter *filter = user_data;
+
+  record_filter (connection, message, user_data);
+
+  dbus_connection_remove_filter (connection, rearranging_filter, filter);
+  dbus_connection_remove_filter (connection, record_filter,
+                                 test_filter (filter->test, 'b'));
+
+  if (!dbus_connection_add_filter (connection, record_filter,
+                                   test_filter (filter->test, 'd'), NULL))
+    _dbus_assert_not_reached ("no memory to add filter");
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Filter A removes itself and the filters B and C that were added
+ * after it, one requiring the same member and one requiring none
+ */
+static DBusHandlerResult
+removing_filter (DBusConnection *connection,
+                 DBusMessage    *message,
+                 void           *user_data)
+{
+  TestFilter *filter = user_data;
+
+  record_filter (connection, message, user_data);
+
+  dbus_connection_remove_filter (connection, removing_filter, filter);
+  dbus_connection_remove_filter (connection, record_filter,
+                                 test_filter (filter->test, 'b'));
+  dbus_connection_remove_filter (connection, record_filter,
+                                 test_filter (filter->test, 'c'));
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static void
+add_test_filter (FilterTestData            *test,
+                 const char                *path,
+                 const char                *interface,
+                 const char                *member,
+                 DBusHandleMessageFunction  function,
+                 char                       name)
+{
+  if (!dbus_connection_add_filter_for (test->connection, path, interface, member,
+                                       function, test_filter (test, name), NULL))
+    _dbus_assert_not_reached ("no memory to add filter");
+}
+
+/* Queues a signal as if it had been received, dispatches it and
+ * checks which filters ran, in order
+ */
+static void
+dispatch_test_signal (FilterTestData *test,
+                      const char     *path,
+                      const char     *interface,
+                      const char     *member,
+                      const char     *expected)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal (path, interface, member);
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory to create message");
+
+  CONNECTION_LOCK (test->connection);
+  if (!_dbus_connection_queue_received_message (test->connection, message))
+    _dbus_assert_not_reached ("no memory to queue message");
+  CONNECTION_UNLOCK (test->connection);
+
+  dbus_message_unref (message);
+
+  _dbus_string_set_length (&test->record, 0);
+
+  while (dbus_connection_dispatch (test->connection) == DBUS_DISPATCH_DATA_REMAINS)
+    ;
+
+  if (!_dbus_string_equal_c_str (&test->record, expected))
+    {
+      _dbus_warn ("Filters \"%s\" ran on %s.%s at %s, expected \"%s\"\n",
+                  _dbus_string_get_const_data (&test->record),
+                  interface, member, path, expected);
+      _dbus_assert_not_reached ("wrong filters ran");
+    }
+}
+
+static void
+check_filters_changed_during_dispatch (FilterTestData *test)
+{
+  add_test_filter (test, NULL, NULL, NULL, rearranging_filter, 'a');
+  add_test_filter (test, NULL, NULL, NULL, record_filter, 'b');
+  add_test_filter (test, NULL, NULL, NULL, record_filter, 'c');
+
+  /* B was removed before its turn, D was added too late */
+  dispatch_test_signal (test, "/", TEST_INTERFACE, "Signal", "ac");
+
+  /* now it's just the survivors, in the order they were added */
+  dispatch_test_signal (test, "/", TEST_INTERFACE, "Signal", "cd");
+
+  dbus_connection_remove_filter (test->connection, record_filter,
+                                 test_filter (test, 'c'));
+  dbus_connection_remove_filter (test->connection, record_filter,
+                                 test_filter (test, 'd'));
+
+  dispatch_test_signal (test, "/", TEST_INTERFACE, "Signal", "");
+}
+
+static void
+check_filters_for_messages (FilterTestData *test)
+{
+  char name;
+
+  /* Filters requiring a member are indexed separately from the
+   * others, but all of them must still run in the order they were
+   * added
+   */
+  add_test_filter (test, NULL, NULL, NULL, record_filter, 'a');
+  add_test_filter (test, NULL, NULL, "Ping", record_filter, 'b');
+  add_test_filter (test, NULL, NULL, NULL, record_filter, 'c');
+  add_test_filter (test, "/a", TEST_INTERFACE, "Ping", record_filter, 'd');
+  add_test_filter (test, NULL, OTHER_TEST_INTERFACE, NULL, record_filter, 'e');
+  add_test_filter (test, "/b", NULL, NULL, record_filter, 'f');
+  add_test_filter (test, NULL, NULL, "Pong", record_filter, 'g');
+
+  dispatch_test_signal (test, "/", TEST_INTERFACE, "Ping", "abc");
+  dispatch_test_signal (test, "/a", TEST_INTERFACE, "Ping", "abcd");
+  dispatch_test_signal (test, "/a", OTHER_TEST_INTERFACE, "Ping", "abce");
+  dispatch_test_signal (test, "/a", TEST_INTERFACE, "Pong", "acg");
+  dispatch_test_signal (test, "/b", OTHER_TEST_INTERFACE, "Pong", "acefg");
+  dispatch_test_signal (test, "/b", TEST_INTERFACE, "Other", "acf");
+
+  for (name = 'a'; name <= 'g'; name++)
+    dbus_connection_remove_filter (test->connection, record_filter,
+                                   test_filter (test, name));
+
+  dispatch_test_signal (test, "/a", TEST_INTERFACE, "Ping", "");
+
+  /* An indexed filter removes itself, a later filter for the same
+   * member and a later filter for any member
+   */
+  add_test_filter (test, NULL, NULL, "Remove", removing_filter, 'a');
+  add_test_filter (test, NULL, NULL, "Remove", record_filter, 'b');
+  add_test_filter (test, NULL, NULL, NULL, record_filter, 'c');
+  add_test_filter (test, NULL, NULL, "Remove", record_filter, 'd');
+
+  dispatch_test_signal (test, "/", TEST_INTERFACE, "Remove", "ad");
+  dispatch_test_signal (test, "/", TEST_INTERFACE, "Remove", "d");
+
+  dbus_connection_remove_filter (test->connection, record_filter,
+                                 test_filter (test, 'd'));
+
+  dispatch_test_signal (test, "/", TEST_INTERFACE, "Remove", "");
+}
+
+static void
+accept_test_connection (DBusServer     *server,
+                        DBusConnection *new_connection,
+                        void           *data)
+{
+  DBusConnection **server_side = data;
+
+  _dbus_assert (*server_side == NULL);
+  *server_side = dbus_connection_ref (new_connection);
+}
+
+/**
+ * @ingroup DBusConnectionInternals
+ * Unit test for DBusConnection. The client connection is
+ * authenticated over a debug pipe, then messages are fed to it with
+ * _dbus_connection_queue_received_message().
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_connection_test (void)
+{
+  DBusServer *server;
+  DBusConnection *server_side;
+  FilterTestData test;
+  DBusError error;
+  int i;
+
+  dbus_error_init (&error);
+  server_side = NULL;
+
+  server = dbus_server_listen ("debug-pipe:name=connection-test", &error);
+  if (server == NULL)
+    _dbus_assert_not_reached ("could not listen on debug pipe");
+
+  dbus_server_set_new_connection_function (server, accept_test_connection,
+                                           &server_side, NULL);
+
+  test.connection = dbus_connection_open_private ("debug-pipe:name=connection-test", &error);
+  if (test.connection == NULL)
+    _dbus_assert_not_reached ("could not open debug pipe");
+
+  _dbus_assert (server_side != NULL);
+
+  while (!dbus_connection_get_is_authenticated (test.connection) ||
+         !dbus_connection_get_is_authenticated (server_side))
+    {
+      dbus_connection_read_write (test.connection, 0);
+      dbus_connection_read_write (server_side, 0);
+    }
+
+  if (!_dbus_string_init (&test.record))
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < N_TEST_FILTERS; i++)
+    {
+      test.filters[i].test = &test;
+      test.filters[i].name = 'a' + i;
+    }
+
+  check_filters_changed_during_dispatch (&test);
+  check_filters_for_messages (&test);
+
+  _dbus_string_free (&test.record);
+
+  dbus_connection_close (test.connection);
+  dbus_connection_unref (test.connection);
+
+  dbus_connection_close (server_side);
+  dbus_connection_unref (server_side);
+
+  dbus_server_disconnect (server);
+  dbus_server_unref (server);
+
+  return TRUE;
+}
+#endif /* DBUS_BUILD_TESTS */
@@ -164,6 +164,8 @@ void               dbus_connection_unref                        (DBusConnection
 void               dbus_connection_close                        (DBusConnection             *connection);
 dbus_bool_t        dbus_connection_get_is_connected             (DBusConnection             *connection);
 dbus_bool_t        dbus_connection_get_is_authenticated         (DBusConnection             *connection);
+dbus_bool_t        dbus_connection_can_send_type                (DBusConnection             *connection,
+                                                                 int                         type);
 void               dbus_connection_set_exit_on_disconnect       (DBusConnection             *connection,
                                                                  dbus_bool_t                 exit_on_disconnect);
 void               dbus_connection_flush                        (DBusConnection             *connection);
@@ -185,6 +187,10 @@ dbus_bool_t        dbus_connection_has_messages_to_send         (DBusConnection
 dbus_bool_t        dbus_connection_send                         (DBusConnection             *connection,
                                                                  DBusMessage                *message,
                                                                  dbus_uint32_t              *client_serial);
+dbus_bool_t        dbus_connection_send_batch                   (DBusConnection             *connection,
+                                                                 DBusMessage               **messages,
+                                                                 int                         n_messages,
+                                                                 dbus_uint32_t              *serials);
 dbus_bool_t        dbus_connection_send_with_reply              (DBusConnection             *connection,
                                                                  DBusMessage                *message,
                                                                  DBusPendingCall           **pending_return,
@@ -213,6 +219,7 @@ void               dbus_connection_set_dispatch_status_function (DBusConnection
                                                                  DBusDispatchStatusFunction  function,
                                                                  void                       *data,
                                                                  DBusFreeFunction            free_data_function);
+dbus_bool_t        dbus_connection_start_io_thread              (DBusConnection             *connection);
 dbus_bool_t        dbus_connection_get_unix_user                (DBusConnection             *connection,
                                                                  unsigned long              *uid);
 dbus_bool_t        dbus_connection_get_unix_process_id          (DBusConnection             *connection,
@@ -223,6 +230,9 @@ void               dbus_connection_set_unix_user_function       (DBusConnection
                                                                  DBusFreeFunction            free_data_function);
 void               dbus_connection_set_route_peer_messages      (DBusConnection             *connection,
                                                                  dbus_bool_t                 value);
+void               dbus_connection_set_prioritize_replies       (DBusConnection             *connection,
+                                                                 dbus_bool_t                 value);
+dbus_bool_t        dbus_connection_set_pipelined_auth           (DBusConnection             *connection);
 
 
 /* Filters */
@@ -231,6 +241,13 @@ dbus_bool_t dbus_connection_add_filter    (DBusConnection            *connection
                                            DBusHandleMessageFunction  function,
                                            void                      *user_data,
                                            DBusFreeFunction           free_data_function);
+dbus_bool_t dbus_connection_add_filter_for (DBusConnection            *connection,
+                                            const char                *path,
+                                            const char                *interface,
+                                            const char                *member,
+                                            DBusHandleMessageFunction  function,
+                                            void                      *user_data,
+                                            DBusFreeFunction           free_data_function);
 void        dbus_connection_remove_filter (DBusConnection            *connection,
                                            DBusHandleMessageFunction  function,
                                            void                      *user_data);
@@ -254,6 +271,9 @@ long dbus_connection_get_max_message_size  (DBusConnection *connection);
 void dbus_connection_set_max_received_size (DBusConnection *connection,
                                             long            size);
 long dbus_connection_get_max_received_size (DBusConnection *connection);
+void dbus_connection_set_max_received_unix_fds (DBusConnection *connection,
+                                                long            n);
+long dbus_connection_get_max_received_unix_fds (DBusConnection *connection);
 long dbus_connection_get_outgoing_size     (DBusConnection *connection);
 
 DBusPreallocatedSend* dbus_connection_preallocate_send       (DBusConnection       *connection);
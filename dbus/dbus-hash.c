@@ -147,6 +147,7 @@ struct DBusHashEntry
                            */
   void *key;              /**< Hash key */
   void *value;            /**< Hash value */
+  unsigned int hash;      /**< Hash of the key, for string keys */
 };
 
 /**
@@ -238,6 +239,7 @@ static DBusHashEntry* find_two_strings_function (DBusHashTable          *table,
                                                  DBusHashEntry        ***bucket,
                                                  DBusPreallocatedHash   *preallocated);
 #endif
+static void           init_hash_seed            (void);
 static unsigned int   string_hash               (const char             *str);
 #ifdef DBUS_BUILD_TESTS
 static unsigned int   two_strings_hash          (const char             *str);
@@ -331,10 +333,12 @@ _dbus_hash_table_new (DBusHashType     type,
       table->find_function = find_direct_function;
       break;
     case DBUS_HASH_STRING:
+      init_hash_seed ();
       table->find_function = find_string_function;
       break;
     case DBUS_HASH_TWO_STRINGS:
 #ifdef DBUS_BUILD_TESTS
+      init_hash_seed ();
       table->find_function = find_two_strings_function;
 #endif
       break;
@@ -805,11 +809,13 @@ add_allocated_entry (DBusHashTable   *table,
                      DBusHashEntry   *entry,
                      unsigned int     idx,
                      void            *key,
+                     unsigned int     hash,
                      DBusHashEntry ***bucket)
 {
   DBusHashEntry **b;  
   
   entry->key = key;
+  entry->hash = hash;
   
   b = &(table->buckets[idx]);
   entry->next = *b;
@@ -832,6 +838,7 @@ static DBusHashEntry*
 add_entry (DBusHashTable        *table, 
            unsigned int          idx,
            void                 *key,
+           unsigned int          hash,
            DBusHashEntry      ***bucket,
            DBusPreallocatedHash *preallocated)
 {
@@ -852,25 +859,100 @@ add_entry (DBusHashTable        *table,
       entry = (DBusHashEntry*) preallocated;
     }
 
-  add_allocated_entry (table, entry, idx, key, bucket);
+  add_allocated_entry (table, entry, idx, key, hash, bucket);
 
   return entry;
 }
 
-/* This is g_str_hash from GLib which was
- * extensively discussed/tested/profiled
+/* String keys mostly come from other processes (bus names, match
+ * rules, object paths), so a hash an attacker can predict would let
+ * them pile everything into one bucket.  Strings are hashed with
+ * HalfSipHash-1-3, keyed by a secret picked once per process.
  */
+static dbus_uint32_t hash_seed[2];
+static dbus_bool_t hash_seed_initialized = FALSE;
+_DBUS_DEFINE_GLOBAL_LOCK (hash_seed);
+
+static void
+init_hash_seed (void)
+{
+  _DBUS_LOCK (hash_seed);
+
+  if (!hash_seed_initialized)
+    {
+      _dbus_generate_random_bytes_buffer ((char *) hash_seed,
+                                          sizeof (hash_seed));
+      hash_seed_initialized = TRUE;
+    }
+
+  _DBUS_UNLOCK (hash_seed);
+}
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (32 - (b))))
+
+#define SIP_ROUND(v0, v1, v2, v3)                               \
+  do {                                                          \
+    v0 += v1; v1 = SIP_ROTL (v1, 5); v1 ^= v0;                  \
+    v0 = SIP_ROTL (v0, 16);                                     \
+    v2 += v3; v3 = SIP_ROTL (v3, 8); v3 ^= v2;                  \
+    v0 += v3; v3 = SIP_ROTL (v3, 7); v3 ^= v0;                  \
+    v2 += v1; v1 = SIP_ROTL (v1, 13); v1 ^= v2;                 \
+    v2 = SIP_ROTL (v2, 16);                                     \
+  } while (0)
+
 static unsigned int
-string_hash (const char *str)
+seeded_hash (const char *data,
+             size_t      len)
 {
-  const char *p = str;
-  unsigned int h = *p;
+  const unsigned char *p = (const unsigned char *) data;
+  const unsigned char *end = p + (len & ~(size_t) 3);
+  dbus_uint32_t v0, v1, v2, v3;
+  dbus_uint32_t m;
+
+  v0 = hash_seed[0];
+  v1 = hash_seed[1];
+  v2 = 0x6c796765 ^ hash_seed[0];
+  v3 = 0x74656462 ^ hash_seed[1];
+
+  for (; p != end; p += 4)
+    {
+      m = (dbus_uint32_t) p[0] | ((dbus_uint32_t) p[1] << 8) |
+        ((dbus_uint32_t) p[2] << 16) | ((dbus_uint32_t) p[3] << 24);
+      v3 ^= m;
+      SIP_ROUND (v0, v1, v2, v3);
+      v0 ^= m;
+    }
+
+  m = (dbus_uint32_t) len << 24;
+  switch (len & 3)
+    {
+    case 3:
+      m |= (dbus_uint32_t) p[2] << 16;
+      /* fall through */
+    case 2:
+      m |= (dbus_uint32_t) p[1] << 8;
+      /* fall through */
+    case 1:
+      m |= (dbus_uint32_t) p[0];
+      break;
+    }
+
+  v3 ^= m;
+  SIP_ROUND (v0, v1, v2, v3);
+  v0 ^= m;
+
+  v2 ^= 0xff;
+  SIP_ROUND (v0, v1, v2, v3);
+  SIP_ROUND (v0, v1, v2, v3);
+  SIP_ROUND (v0, v1, v2, v3);
 
-  if (h)
-    for (p += 1; *p != '\0'; p++)
-      h = (h << 5) - h + *p;
+  return v1 ^ v3;
+}
 
-  return h;
+static unsigned int
+string_hash (const char *str)
+{
+  return seeded_hash (str, strlen (str));
 }
 
 #ifdef DBUS_BUILD_TESTS
@@ -880,17 +962,12 @@ string_hash (const char *str)
 static unsigned int
 two_strings_hash (const char *str)
 {
-  const char *p = str;
-  unsigned int h = *p;
+  size_t len;
 
-  if (h)
-    for (p += 1; *p != '\0'; p++)
-      h = (h << 5) - h + *p;
+  len = strlen (str) + 1;
+  len += strlen (str + len);
 
-  for (p += 1; *p != '\0'; p++)
-    h = (h << 5) - h + *p;
-  
-  return h;
+  return seeded_hash (str, len);
 }
 #endif /* DBUS_BUILD_TESTS */
 
@@ -900,6 +977,7 @@ typedef int (* KeyCompareFunc) (const void *key_a, const void *key_b);
 static DBusHashEntry*
 find_generic_function (DBusHashTable        *table,
                        void                 *key,
+                       unsigned int          hash,
                        unsigned int          idx,
                        KeyCompareFunc        compare_func,
                        dbus_bool_t           create_if_not_found,
@@ -916,7 +994,8 @@ find_generic_function (DBusHashTable        *table,
   while (entry != NULL)
     {
       if ((compare_func == NULL && key == entry->key) ||
-          (compare_func != NULL && (* compare_func) (key, entry->key) == 0))
+          (compare_func != NULL && hash == entry->hash &&
+           (* compare_func) (key, entry->key) == 0))
         {
           if (bucket)
             *bucket = &(table->buckets[idx]);
@@ -931,7 +1010,7 @@ find_generic_function (DBusHashTable        *table,
     }
 
   if (create_if_not_found)
-    entry = add_entry (table, idx, key, bucket, preallocated);
+    entry = add_entry (table, idx, key, hash, bucket, preallocated);
   else if (preallocated)
     _dbus_hash_table_free_preallocated_entry (table, preallocated);
   
@@ -945,11 +1024,11 @@ find_string_function (DBusHashTable        *table,
                       DBusHashEntry      ***bucket,
                       DBusPreallocatedHash *preallocated)
 {
-  unsigned int idx;
+  unsigned int hash;
   
-  idx = string_hash (key) & table->mask;
+  hash = string_hash (key);
 
-  return find_generic_function (table, key, idx,
+  return find_generic_function (table, key, hash, hash & table->mask,
                                 (KeyCompareFunc) strcmp, create_if_not_found, bucket,
                                 preallocated);
 }
@@ -982,11 +1061,11 @@ find_two_strings_function (DBusHashTable        *table,
                            DBusHashEntry      ***bucket,
                            DBusPreallocatedHash *preallocated)
 {
-  unsigned int idx;
+  unsigned int hash;
   
-  idx = two_strings_hash (key) & table->mask;
+  hash = two_strings_hash (key);
 
-  return find_generic_function (table, key, idx,
+  return find_generic_function (table, key, hash, hash & table->mask,
                                 (KeyCompareFunc) two_strings_cmp, create_if_not_found, bucket,
                                 preallocated);
 }
@@ -1004,7 +1083,7 @@ find_direct_function (DBusHashTable        *table,
   idx = RANDOM_INDEX (table, key) & table->mask;
 
 
-  return find_generic_function (table, key, idx,
+  return find_generic_function (table, key, 0, idx,
                                 NULL, create_if_not_found, bucket,
                                 preallocated);
 }
@@ -1104,15 +1183,9 @@ rebuild_table (DBusHashTable *table)
           switch (table->key_type)
             {
             case DBUS_HASH_STRING:
-              idx = string_hash (entry->key) & table->mask;
-              break;
             case DBUS_HASH_TWO_STRINGS:
-#ifdef DBUS_BUILD_TESTS
-              idx = two_strings_hash (entry->key) & table->mask;
-#else
-              idx = 0;
-              _dbus_assert_not_reached ("two-strings is not enabled");
-#endif
+              /* no need to hash the string again */
+              idx = entry->hash & table->mask;
               break;
             case DBUS_HASH_INT:
             case DBUS_HASH_ULONG:
@@ -1729,6 +1802,159 @@ count_entries (DBusHashTable *table)
   return count;
 }
 
+static int
+longest_chain (DBusHashTable *table)
+{
+  DBusHashEntry *entry;
+  int longest;
+  int i;
+
+  longest = 0;
+  for (i = 0; i < table->n_buckets; i++)
+    {
+      int len;
+
+      len = 0;
+      for (entry = table->buckets[i]; entry != NULL; entry = entry->next)
+        ++len;
+
+      if (len > longest)
+        longest = len;
+    }
+
+  return longest;
+}
+
+/* "Aa" and "BB" have the same h * 31 + c hash, so every string made
+ * of 12 of them collided with the old string hash.
+ */
+static void
+check_colliding_keys (void)
+{
+#define N_COLLIDING_KEYS 4096
+  DBusHashTable *table;
+  char key[25];
+  int i, j;
+
+  table = _dbus_hash_table_new (DBUS_HASH_STRING, dbus_free, NULL);
+  if (table == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < N_COLLIDING_KEYS; i++)
+    {
+      char *copy;
+
+      for (j = 0; j < 12; j++)
+        memcpy (key + j * 2, (i & (1 << j)) ? "BB" : "Aa", 2);
+      key[24] = '\0';
+
+      copy = _dbus_strdup (key);
+      if (copy == NULL ||
+          !_dbus_hash_table_insert_string (table, copy, _DBUS_INT_TO_POINTER (i + 1)))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  _dbus_assert (_dbus_hash_table_get_n_entries (table) == N_COLLIDING_KEYS);
+
+  /* with 4096 buckets a fair hash gives chains of a handful */
+  printf ("Longest chain for %d colliding keys: %d\n",
+          N_COLLIDING_KEYS, longest_chain (table));
+  _dbus_assert (longest_chain (table) < 32);
+
+  _dbus_hash_table_unref (table);
+}
+
+static double
+elapsed_since (long start_sec,
+               long start_usec)
+{
+  long sec, usec;
+
+  _dbus_get_current_time (&sec, &usec);
+
+  return (sec - start_sec) + (usec - start_usec) / 1000000.0;
+}
+
+static void
+benchmark_hash_table (void)
+{
+#define N_BENCHMARK_KEYS 1000000
+/* visits every key once, but not in the order they were inserted,
+ * like real lookups would
+ */
+#define SCATTER(i) ((int) (((long long) (i) * 611953) % N_BENCHMARK_KEYS))
+  DBusHashTable *strings;
+  DBusHashTable *ulongs;
+  char **keys;
+  long sec, usec;
+  double insert, lookup, remove;
+  int i;
+
+  keys = dbus_new (char *, N_BENCHMARK_KEYS);
+  strings = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  ulongs = _dbus_hash_table_new (DBUS_HASH_ULONG, NULL, NULL);
+  if (keys == NULL || strings == NULL || ulongs == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    {
+      keys[i] = dbus_malloc (32);
+      if (keys[i] == NULL)
+        _dbus_assert_not_reached ("no memory");
+      sprintf (keys[i], "org.freedesktop.Test%d", i);
+    }
+
+  _dbus_get_current_time (&sec, &usec);
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    if (!_dbus_hash_table_insert_string (strings, keys[i], keys[i]))
+      _dbus_assert_not_reached ("no memory");
+  insert = elapsed_since (sec, usec);
+
+  _dbus_get_current_time (&sec, &usec);
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    if (_dbus_hash_table_lookup_string (strings, keys[SCATTER (i)]) != keys[SCATTER (i)])
+      _dbus_assert_not_reached ("lost a key");
+  lookup = elapsed_since (sec, usec);
+
+  _dbus_get_current_time (&sec, &usec);
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    if (!_dbus_hash_table_remove_string (strings, keys[SCATTER (i)]))
+      _dbus_assert_not_reached ("lost a key");
+  remove = elapsed_since (sec, usec);
+
+  printf ("%d string keys: insert %.0f ns, lookup %.0f ns, remove %.0f ns\n",
+          N_BENCHMARK_KEYS, insert * 1e9 / N_BENCHMARK_KEYS,
+          lookup * 1e9 / N_BENCHMARK_KEYS, remove * 1e9 / N_BENCHMARK_KEYS);
+
+  _dbus_get_current_time (&sec, &usec);
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    if (!_dbus_hash_table_insert_ulong (ulongs, i, keys[i]))
+      _dbus_assert_not_reached ("no memory");
+  insert = elapsed_since (sec, usec);
+
+  _dbus_get_current_time (&sec, &usec);
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    if (_dbus_hash_table_lookup_ulong (ulongs, SCATTER (i)) != keys[SCATTER (i)])
+      _dbus_assert_not_reached ("lost a key");
+  lookup = elapsed_since (sec, usec);
+
+  _dbus_get_current_time (&sec, &usec);
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    if (!_dbus_hash_table_remove_ulong (ulongs, SCATTER (i)))
+      _dbus_assert_not_reached ("lost a key");
+  remove = elapsed_since (sec, usec);
+
+  printf ("%d ulong keys: insert %.0f ns, lookup %.0f ns, remove %.0f ns\n",
+          N_BENCHMARK_KEYS, insert * 1e9 / N_BENCHMARK_KEYS,
+          lookup * 1e9 / N_BENCHMARK_KEYS, remove * 1e9 / N_BENCHMARK_KEYS);
+
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    dbus_free (keys[i]);
+  dbus_free (keys);
+  _dbus_hash_table_unref (strings);
+  _dbus_hash_table_unref (ulongs);
+}
+
 /* Copy the foo\0bar\0 double string thing */
 static char*
 _dbus_strdup2 (const char *str)
@@ -1798,6 +2024,9 @@ _dbus_hash_test (void)
       ++i;
     }
   printf ("... done.\n");
+
+  check_colliding_keys ();
+  benchmark_hash_table ();
   
   table1 = _dbus_hash_table_new (DBUS_HASH_STRING,
                                  dbus_free, dbus_free);
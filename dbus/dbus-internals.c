@@ -519,6 +519,64 @@ _dbus_string_array_contains (const char **array,
   return FALSE;
 }
 
+/**
+ * Records a duration in a histogram. Negative durations (the clock
+ * went backward) are counted as zero.
+ *
+ * @param histogram the histogram
+ * @param usec the duration in microseconds
+ */
+void
+_dbus_histogram_add (DBusHistogram *histogram,
+                     long           usec)
+{
+  unsigned long v;
+  int bucket;
+
+  v = usec > 0 ? (unsigned long) usec : 0;
+
+  bucket = 0;
+  while (v != 0 && bucket < _DBUS_HISTOGRAM_N_BUCKETS - 1)
+    {
+      v >>= 1;
+      ++bucket;
+    }
+
+  histogram->buckets[bucket] += 1;
+  histogram->count += 1;
+
+  if (usec > 0 && (unsigned long) usec > histogram->max_usec)
+    histogram->max_usec = usec;
+}
+
+/**
+ * Computes the number of microseconds between two times as returned
+ * by _dbus_get_current_time(), clamped to the range of a long.
+ *
+ * @param orig_tv_sec seconds component of the earlier time
+ * @param orig_tv_usec microseconds component of the earlier time
+ * @param now_tv_sec seconds component of the later time
+ * @param now_tv_usec microseconds component of the later time
+ * @returns elapsed microseconds, may be negative if the clock went backward
+ */
+long
+_dbus_usec_since (long orig_tv_sec,
+                  long orig_tv_usec,
+                  long now_tv_sec,
+                  long now_tv_usec)
+{
+  long sec;
+
+  sec = now_tv_sec - orig_tv_sec;
+
+  if (sec > (_DBUS_INT_MAX / _DBUS_USEC_PER_SECOND) - 1)
+    return _DBUS_INT_MAX;
+  else if (sec < -(_DBUS_INT_MAX / _DBUS_USEC_PER_SECOND) + 1)
+    return -_DBUS_INT_MAX;
+
+  return sec * _DBUS_USEC_PER_SECOND + (now_tv_usec - orig_tv_usec);
+}
+
 /**
  * Generates a new UUID. If you change how this is done,
  * there's some text about it in the spec that should also change.
@@ -796,6 +854,8 @@ _dbus_header_field_to_string (int header_field)
       return "sender";
     case DBUS_HEADER_FIELD_SIGNATURE:
       return "signature";
+    case DBUS_HEADER_FIELD_UNIX_FDS:
+      return "unix-fds";
     default:
       return "unknown";
     }
@@ -200,6 +200,28 @@ dbus_bool_t _dbus_string_array_contains (const char **array,
                                          const char  *str);
 char**      _dbus_dup_string_array      (const char **array);
 
+/** Number of buckets in a #DBusHistogram; the last one catches everything larger */
+#define _DBUS_HISTOGRAM_N_BUCKETS 24
+
+/**
+ * Cheap log2-bucketed histogram of durations in microseconds.
+ * Bucket 0 counts values below 1us, bucket n counts values in
+ * [2^(n-1), 2^n) us, and the last bucket counts everything above.
+ */
+typedef struct
+{
+  unsigned long count;                                /**< Number of samples */
+  unsigned long max_usec;                             /**< Largest sample seen */
+  unsigned long buckets[_DBUS_HISTOGRAM_N_BUCKETS];   /**< Sample counts per bucket */
+} DBusHistogram;
+
+void        _dbus_histogram_add         (DBusHistogram *histogram,
+                                         long           usec);
+long        _dbus_usec_since            (long           orig_tv_sec,
+                                         long           orig_tv_usec,
+                                         long           now_tv_sec,
+                                         long           now_tv_usec);
+
 #define _DBUS_INT16_MIN	 ((dbus_int16_t) 0x8000)
 #define _DBUS_INT16_MAX	 ((dbus_int16_t) 0x7fff)
 #define _DBUS_UINT16_MAX ((dbus_uint16_t)0xffff)
@@ -305,7 +327,9 @@ _DBUS_DECLARE_GLOBAL_LOCK (shared_connections);
 _DBUS_DECLARE_GLOBAL_LOCK (win_fds);
 _DBUS_DECLARE_GLOBAL_LOCK (sid_atom_cache);
 _DBUS_DECLARE_GLOBAL_LOCK (machine_uuid);
-#define _DBUS_N_GLOBAL_LOCKS (15)
+_DBUS_DECLARE_GLOBAL_LOCK (keyrings);
+_DBUS_DECLARE_GLOBAL_LOCK (hash_seed);
+#define _DBUS_N_GLOBAL_LOCKS (17)
 
 dbus_bool_t _dbus_threads_init_debug (void);
 
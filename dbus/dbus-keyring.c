@@ -26,7 +26,9 @@
 #include "dbus-protocol.h"
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-hash.h>
 #include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-threads-internal.h>
 
 /**
  * @defgroup DBusKeyring keyring class
@@ -44,6 +46,11 @@
  * by a single server instance for a fixed period of time, then
  * discarded). Also, the keys are not sent over the wire.
  *
+ * Keyrings are shared by everyone in the process asking for the same
+ * user and context, and the file is only read again when it changed
+ * on disk since the last time, so authenticating many connections
+ * doesn't mean reading the file for each of them.
+ *
  * @todo there's a memory leak on some codepath in here, I saw it once
  * when running make check - probably some specific initial cookies
  * present in the cookie file, then depending on what we do with them.
@@ -115,8 +122,14 @@ struct DBusKeyring
   DBusString directory;     /**< Directory the below two items are inside */
   DBusString filename;      /**< Keyring filename */
   DBusString filename_lock; /**< Name of lockfile */
+  DBusString filename_guard; /**< Name of file writers fcntl() lock */
   DBusKey *keys; /**< Keys loaded from the file */
   int n_keys;    /**< Number of keys */
+  int guard_fd;  /**< File descriptor holding the guard lock, or -1 */
+  DBusStat file_stat;         /**< The file as it was when keys were loaded */
+  dbus_bool_t have_file_stat; /**< Whether the file existed then */
+  int n_loads;   /**< Number of times the file was read */
+  DBusMutex *mutex; /**< Protects the keys and the file state */
 };
 
 static DBusKeyring*
@@ -137,15 +150,27 @@ _dbus_keyring_new (void)
   if (!_dbus_string_init (&keyring->filename_lock))
     goto out_3;
 
-  if (!_dbus_string_init (&keyring->username))
+  if (!_dbus_string_init (&keyring->filename_guard))
     goto out_4;
+
+  if (!_dbus_string_init (&keyring->username))
+    goto out_5;
+
+  _dbus_mutex_new_at_location (&keyring->mutex);
+  if (keyring->mutex == NULL)
+    goto out_6;
   
   keyring->refcount = 1;
   keyring->keys = NULL;
   keyring->n_keys = 0;
+  keyring->guard_fd = -1;
 
   return keyring;
 
+ out_6:
+  _dbus_string_free (&keyring->username);
+ out_5:
+  _dbus_string_free (&keyring->filename_guard);
  out_4:
   _dbus_string_free (&keyring->filename_lock);
  out_3:
@@ -176,20 +201,26 @@ free_keys (DBusKey *keys,
   dbus_free (keys);
 }
 
-/* Our locking scheme is highly unreliable.  However, there is
- * unfortunately no reliable locking scheme in user home directories;
- * between bugs in Linux NFS, people using Tru64 or other total crap
- * NFS, AFS, random-file-system-of-the-week, and so forth, fcntl() in
- * homedirs simply generates tons of bug reports. This has been
- * learned through hard experience with GConf, unfortunately.
+/* The keyring is locked by creating the lock file exclusively and
+ * deleting it again when done, polling while someone else has it.
+ * fcntl() in homedirs is not something to rely on: between bugs in
+ * Linux NFS, people using Tru64 or other total crap NFS, AFS,
+ * random-file-system-of-the-week, and so forth, it generates tons of
+ * bug reports. This has been learned through hard experience with
+ * GConf, unfortunately. The lock file is unreliable too but works
+ * for the kind of lock we have here, which we don't expect to hold
+ * for any length of time.  Crashing while we hold it should be
+ * unlikely, and timing out such that we delete a stale lock should
+ * also be unlikely except when the filesystem is running really
+ * slowly.  Stuff might break in corner cases but as long as it's not
+ * a security-level breakage it should be OK.
  *
- * This bad hack might work better for the kind of lock we have here,
- * which we don't expect to hold for any length of time.  Crashing
- * while we hold it should be unlikely, and timing out such that we
- * delete a stale lock should also be unlikely except when the
- * filesystem is running really slowly.  Stuff might break in corner
- * cases but as long as it's not a security-level breakage it should
- * be OK.
+ * The lock file is also what older versions of this code look for,
+ * so it has to stay the real lock. Before taking it, writers wait
+ * for an fcntl() lock on a separate guard file where the file system
+ * supports that; writers from this version then line up in the
+ * kernel instead of sleeping in the polling loop, and normally find
+ * the lock file free. The guard is only ever an optimization.
  */
 
 /** Maximum number of timeouts waiting for lock before we decide it's stale */
@@ -198,7 +229,7 @@ free_keys (DBusKey *keys,
 #define LOCK_TIMEOUT_MILLISECONDS 250
 
 static dbus_bool_t
-_dbus_keyring_lock (DBusKeyring *keyring)
+lock_with_lock_file (DBusKeyring *keyring)
 {
   int n_timeouts;
   
@@ -251,10 +282,45 @@ _dbus_keyring_lock (DBusKeyring *keyring)
   return TRUE;
 }
 
+static void
+release_guard (DBusKeyring *keyring)
+{
+  if (keyring->guard_fd >= 0)
+    {
+      _dbus_unlock_file (keyring->guard_fd);
+      keyring->guard_fd = -1;
+    }
+}
+
+static dbus_bool_t
+_dbus_keyring_lock (DBusKeyring *keyring)
+{
+  DBusError error;
+
+  dbus_error_init (&error);
+  keyring->guard_fd = _dbus_lock_file_blocking (&keyring->filename_guard,
+                                                &error);
+  if (keyring->guard_fd < 0)
+    {
+      _dbus_verbose ("No guard lock on keyring, polling for the lock file only: %s\n",
+                     error.message);
+      dbus_error_free (&error);
+    }
+
+  if (!lock_with_lock_file (keyring))
+    {
+      release_guard (keyring);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
 _dbus_keyring_unlock (DBusKeyring *keyring)
 {
   DBusError error;
+
   dbus_error_init (&error);
   if (!_dbus_delete_file (&keyring->filename_lock, &error))
     {
@@ -262,6 +328,9 @@ _dbus_keyring_unlock (DBusKeyring *keyring)
                   error.message);
       dbus_error_free (&error);
     }
+
+  /* Only let the next writer in once the lock file is gone */
+  release_guard (keyring);
 }
 
 static DBusKey*
@@ -412,6 +481,8 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   int i;
   long now;
   DBusError tmp_error;
+  DBusStat file_stat;
+  dbus_bool_t have_file_stat;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   
@@ -450,6 +521,12 @@ _dbus_keyring_reload (DBusKeyring *keyring,
       have_lock = TRUE;
     }
 
+  /* Look before reading, so a change that sneaks in between is
+   * seen next time rather than missed
+   */
+  have_file_stat = _dbus_stat (&keyring->filename, &file_stat, NULL);
+  keyring->n_loads += 1;
+
   dbus_error_init (&tmp_error);
   if (!_dbus_file_get_contents (&contents, 
                                 &keyring->filename,
@@ -613,6 +690,9 @@ _dbus_keyring_reload (DBusKeyring *keyring,
       if (!_dbus_string_save_to_file (&contents, &keyring->filename,
                                       error))
         goto out;
+
+      /* we hold the lock, so this is what we just wrote */
+      have_file_stat = _dbus_stat (&keyring->filename, &file_stat, NULL);
     }
 
   if (keyring->keys)
@@ -621,6 +701,9 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   keyring->n_keys = n_keys;
   keys = NULL;
   n_keys = 0;
+
+  keyring->file_stat = file_stat;
+  keyring->have_file_stat = have_file_stat;
   
   retval = TRUE;  
   
@@ -657,6 +740,132 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   return retval;
 }
 
+/**
+ * Checks whether the keyring file is different from the one we
+ * last loaded keys from. Rewrites go through a rename, so comparing
+ * the inode catches several changes in the same second.
+ *
+ * @param keyring the keyring
+ * @returns #TRUE if the file changed
+ */
+static dbus_bool_t
+keyring_file_changed (DBusKeyring *keyring)
+{
+  DBusStat sb;
+
+  if (!_dbus_stat (&keyring->filename, &sb, NULL))
+    return keyring->have_file_stat;
+
+  if (!keyring->have_file_stat)
+    return TRUE;
+
+  return sb.ino != keyring->file_stat.ino ||
+    sb.mtime != keyring->file_stat.mtime ||
+    sb.size != keyring->file_stat.size;
+}
+
+/**
+ * Reloads the keyring, but only if the file changed since the keys
+ * were last loaded; otherwise the keys we have are current.
+ *
+ * @param keyring the keyring
+ * @param error return location for errors
+ * @returns #FALSE if there was an error reloading
+ */
+static dbus_bool_t
+reload_if_changed (DBusKeyring *keyring,
+                   DBusError   *error)
+{
+  if (!keyring_file_changed (keyring))
+    return TRUE;
+
+  _dbus_verbose ("Keyring file %s changed, reloading\n",
+                 _dbus_string_get_const_data (&keyring->filename));
+
+  return _dbus_keyring_reload (keyring, FALSE, error);
+}
+
+static void
+keyring_unref_unlocked (DBusKeyring *keyring)
+{
+  keyring->refcount -= 1;
+
+  if (keyring->refcount == 0)
+    {
+      _dbus_string_free (&keyring->username);
+      _dbus_string_free (&keyring->filename);
+      _dbus_string_free (&keyring->filename_lock);
+      _dbus_string_free (&keyring->filename_guard);
+      _dbus_string_free (&keyring->directory);
+      free_keys (keyring->keys, keyring->n_keys);
+      _dbus_mutex_free_at_location (&keyring->mutex);
+      dbus_free (keyring);      
+    }
+}
+
+/* Hash table value free function; gets called with NULL too */
+static void
+free_cached_keyring (void *data)
+{
+  DBusKeyring *keyring = data;
+
+  if (keyring != NULL)
+    keyring_unref_unlocked (keyring);
+}
+
+/* Keyrings in use by the process, by filename. Also protects their
+ * refcounts; the keys are under each keyring's own mutex, so reading
+ * one keyring file doesn't hold up everyone else.
+ */
+_DBUS_DEFINE_GLOBAL_LOCK (keyrings);
+static DBusHashTable *keyrings = NULL;
+
+static void
+shutdown_keyrings (void *data)
+{
+  _DBUS_LOCK (keyrings);
+
+  _dbus_hash_table_unref (keyrings);
+  keyrings = NULL;
+
+  _DBUS_UNLOCK (keyrings);
+}
+
+/* Called with the keyrings lock held; failing just means the
+ * keyring isn't shared.
+ */
+static void
+cache_keyring (DBusKeyring *keyring)
+{
+  char *filename;
+
+  if (keyrings == NULL)
+    {
+      keyrings = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                       dbus_free,
+                                       free_cached_keyring);
+      if (keyrings == NULL)
+        return;
+
+      if (!_dbus_register_shutdown_func (shutdown_keyrings, NULL))
+        {
+          _dbus_hash_table_unref (keyrings);
+          keyrings = NULL;
+          return;
+        }
+    }
+
+  if (!_dbus_string_copy_data (&keyring->filename, &filename))
+    return;
+
+  keyring->refcount += 1;
+  if (!_dbus_hash_table_insert_string (keyrings, filename, keyring))
+    {
+      keyring->refcount -= 1;
+      dbus_free (filename);
+    }
+}
+
 /** @} */ /* end of internals */
 
 /**
@@ -674,7 +883,9 @@ _dbus_keyring_reload (DBusKeyring *keyring,
 DBusKeyring *
 _dbus_keyring_ref (DBusKeyring *keyring)
 {
+  _DBUS_LOCK (keyrings);
   keyring->refcount += 1;
+  _DBUS_UNLOCK (keyrings);
 
   return keyring;
 }
@@ -688,39 +899,21 @@ _dbus_keyring_ref (DBusKeyring *keyring)
 void
 _dbus_keyring_unref (DBusKeyring *keyring)
 {
-  keyring->refcount -= 1;
-
-  if (keyring->refcount == 0)
-    {
-      _dbus_string_free (&keyring->username);
-      _dbus_string_free (&keyring->filename);
-      _dbus_string_free (&keyring->filename_lock);
-      _dbus_string_free (&keyring->directory);
-      free_keys (keyring->keys, keyring->n_keys);
-      dbus_free (keyring);      
-    }
+  _DBUS_LOCK (keyrings);
+  keyring_unref_unlocked (keyring);
+  _DBUS_UNLOCK (keyrings);
 }
 
-/**
- * Creates a new keyring that lives in the ~/.dbus-keyrings
- * directory of the given user. If the username is #NULL,
- * uses the user owning the current process.
- *
- * @param username username to get keyring for, or #NULL
- * @param context which keyring to get
- * @param error return location for errors
- * @returns the keyring or #NULL on error
- */
-DBusKeyring*
-_dbus_keyring_new_homedir (const DBusString *username,
-                           const DBusString *context,
-                           DBusError        *error)
+/* Sets up a keyring for the given user, without loading it */
+static DBusKeyring*
+keyring_new_for_user (const DBusString *username,
+                      const DBusString *context,
+                      DBusError        *error)
 {
   DBusString homedir;
   DBusKeyring *keyring;
   dbus_bool_t error_set;
   DBusString dotdir;
-  DBusError tmp_error;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -829,6 +1022,88 @@ _dbus_keyring_new_homedir (const DBusString *username,
   if (!_dbus_string_append (&keyring->filename_lock, ".lock"))
     goto failed;
 
+  if (!_dbus_string_copy (&keyring->filename, 0,
+                          &keyring->filename_guard, 0))
+    goto failed;
+
+  if (!_dbus_string_append (&keyring->filename_guard, ".guard"))
+    goto failed;
+
+  _dbus_string_free (&homedir);
+  
+  return keyring;
+  
+ failed:
+  if (!error_set)
+    dbus_set_error_const (error,
+                          DBUS_ERROR_NO_MEMORY,
+                          NULL);
+  if (keyring)
+    _dbus_keyring_unref (keyring);
+  _dbus_string_free (&homedir);
+  return NULL;
+
+}
+
+/**
+ * Gets the keyring that lives in the ~/.dbus-keyrings
+ * directory of the given user. If the username is #NULL,
+ * uses the user owning the current process.
+ *
+ * The keyring is shared with anyone else in the process using
+ * the same one, and its file is only read again if it changed.
+ *
+ * @param username username to get keyring for, or #NULL
+ * @param context which keyring to get
+ * @param error return location for errors
+ * @returns the keyring or #NULL on error
+ */
+DBusKeyring*
+_dbus_keyring_new_homedir (const DBusString *username,
+                           const DBusString *context,
+                           DBusError        *error)
+{
+  DBusKeyring *keyring;
+  DBusKeyring *cached;
+  DBusError tmp_error;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  keyring = keyring_new_for_user (username, context, error);
+  if (keyring == NULL)
+    return NULL;
+
+  _DBUS_LOCK (keyrings);
+
+  cached = NULL;
+  if (keyrings != NULL)
+    cached = _dbus_hash_table_lookup_string (keyrings,
+                                             _dbus_string_get_const_data (&keyring->filename));
+
+  if (cached != NULL &&
+      _dbus_string_equal (&cached->username, &keyring->username))
+    {
+      keyring_unref_unlocked (keyring);
+      keyring = cached;
+      keyring->refcount += 1;
+      _DBUS_UNLOCK (keyrings);
+
+      _dbus_mutex_lock (keyring->mutex);
+      dbus_error_init (&tmp_error);
+      if (!reload_if_changed (keyring, &tmp_error))
+        {
+          _dbus_verbose ("didn't reload keyring: %s\n",
+                         tmp_error.message);
+          dbus_error_free (&tmp_error);
+        }
+      _dbus_mutex_unlock (keyring->mutex);
+
+      return keyring;
+    }
+
+  _DBUS_UNLOCK (keyrings);
+
+  /* Nobody else can see this keyring yet, so no need to lock it */
   dbus_error_init (&tmp_error);
   if (!_dbus_keyring_reload (keyring, FALSE, &tmp_error))
     {
@@ -850,20 +1125,22 @@ _dbus_keyring_new_homedir (const DBusString *username,
       dbus_error_free (&tmp_error);
     }
 
-  _dbus_string_free (&homedir);
-  
-  return keyring;
-  
- failed:
-  if (!error_set)
-    dbus_set_error_const (error,
-                          DBUS_ERROR_NO_MEMORY,
-                          NULL);
-  if (keyring)
-    _dbus_keyring_unref (keyring);
-  _dbus_string_free (&homedir);
-  return NULL;
+  if (cached == NULL)
+    {
+      _DBUS_LOCK (keyrings);
+
+      /* Another thread may have loaded it meanwhile; then we keep
+       * ours to ourselves
+       */
+      if (keyrings == NULL ||
+          _dbus_hash_table_lookup_string (keyrings,
+                                          _dbus_string_get_const_data (&keyring->filename)) == NULL)
+        cache_keyring (keyring);
 
+      _DBUS_UNLOCK (keyrings);
+    }
+
+  return keyring;
 }
 
 /**
@@ -979,30 +1256,53 @@ _dbus_keyring_get_best_key (DBusKeyring  *keyring,
                             DBusError    *error)
 {
   DBusKey *key;
+  DBusError tmp_error;
+  int id;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  _dbus_mutex_lock (keyring->mutex);
+
+  /* Someone else may have added a key since we loaded */
+  dbus_error_init (&tmp_error);
+  if (!reload_if_changed (keyring, &tmp_error))
+    {
+      _dbus_verbose ("didn't reload keyring: %s\n",
+                     tmp_error.message);
+      dbus_error_free (&tmp_error);
+    }
   
   key = find_recent_key (keyring);
   if (key)
-    return key->id;
+    {
+      id = key->id;
+      goto out;
+    }
 
   /* All our keys are too old, or we've never loaded the
    * keyring. Create a new one.
    */
   if (!_dbus_keyring_reload (keyring, TRUE,
                              error))
-    return -1;
+    {
+      id = -1;
+      goto out;
+    }
 
   key = find_recent_key (keyring);
   if (key)
-    return key->id;
+    id = key->id;
   else
     {
       dbus_set_error_const (error,
                             DBUS_ERROR_FAILED,
                             "No recent-enough key found in keyring, and unable to create a new key");
-      return -1;
+      id = -1;
     }
+
+ out:
+  _dbus_mutex_unlock (keyring->mutex);
+  return id;
 }
 
 /**
@@ -1025,7 +1325,7 @@ _dbus_keyring_is_for_user (DBusKeyring       *keyring,
  * Gets the hex-encoded secret key for the given ID.
  * Returns #FALSE if not enough memory. Returns #TRUE
  * but empty key on any other error such as unknown
- * key ID.
+ * or expired key ID.
  *
  * @param keyring the keyring
  * @param key_id the key ID
@@ -1038,16 +1338,43 @@ _dbus_keyring_get_hex_key (DBusKeyring       *keyring,
                            DBusString        *hex_key)
 {
   DBusKey *key;
+  DBusError tmp_error;
+  long tv_sec, tv_usec;
+  dbus_bool_t retval;
+
+  _dbus_mutex_lock (keyring->mutex);
 
   key = find_key_by_id (keyring->keys,
                         keyring->n_keys,
                         key_id);
   if (key == NULL)
-    return TRUE; /* had enough memory, so TRUE */
+    {
+      /* The other side may be using a key newer than our copy */
+      dbus_error_init (&tmp_error);
+      if (!reload_if_changed (keyring, &tmp_error))
+        {
+          _dbus_verbose ("didn't reload keyring: %s\n",
+                         tmp_error.message);
+          dbus_error_free (&tmp_error);
+        }
+
+      key = find_key_by_id (keyring->keys,
+                            keyring->n_keys,
+                            key_id);
+    }
 
-  return _dbus_string_hex_encode (&key->secret, 0,
-                                  hex_key,
-                                  _dbus_string_get_length (hex_key));
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  if (key == NULL ||
+      (tv_sec - EXPIRE_KEYS_TIMEOUT_SECONDS) > key->creation_time)
+    retval = TRUE; /* had enough memory, so TRUE */
+  else
+    retval = _dbus_string_hex_encode (&key->secret, 0,
+                                      hex_key,
+                                      _dbus_string_get_length (hex_key));
+
+  _dbus_mutex_unlock (keyring->mutex);
+  return retval;
 }
 
 /** @} */ /* end of exposed API */
@@ -1062,7 +1389,10 @@ _dbus_keyring_test (void)
   DBusString context;
   DBusKeyring *ring1;
   DBusKeyring *ring2;
+  DBusKeyring *ring3;
+  DBusString hex_key;
   int id;
+  int n_loads;
   DBusError error;
   int i;
 
@@ -1121,9 +1451,16 @@ _dbus_keyring_test (void)
       goto failure;
     }
 
-  ring2 = _dbus_keyring_new_homedir (NULL, &context, &error);
+  /* bypass the cache, so the keys really come from the file */
+  ring2 = keyring_new_for_user (NULL, &context, &error);
   _dbus_assert (ring2);
   _dbus_assert (error.name == NULL);
+  if (!_dbus_keyring_reload (ring2, FALSE, &error))
+    {
+      fprintf (stderr, "Could not reload keyring: %s\n", error.message);
+      dbus_error_free (&error);
+      goto failure;
+    }
   
   if (ring1->n_keys != ring2->n_keys)
     {
@@ -1163,6 +1500,75 @@ _dbus_keyring_test (void)
 
   printf (" %d keys in test\n", ring1->n_keys);
 
+  /* Asking again gets the same keyring, without reading the
+   * unchanged file again
+   */
+  n_loads = ring1->n_loads;
+  ring3 = _dbus_keyring_new_homedir (NULL, &context, &error);
+  _dbus_assert (ring3 == ring1);
+  _dbus_assert (error.name == NULL);
+  _dbus_keyring_unref (ring3);
+
+  if (_dbus_keyring_get_best_key (ring1, &error) != id)
+    _dbus_assert_not_reached ("best key changed");
+  if (ring1->n_loads != n_loads)
+    {
+      fprintf (stderr, "Unchanged keyring file was read again\n");
+      goto failure;
+    }
+
+  /* A key added behind our back is picked up when asked for */
+  if (!_dbus_keyring_reload (ring2, TRUE, &error))
+    {
+      fprintf (stderr, "Could not add key: %s\n", error.message);
+      dbus_error_free (&error);
+      goto failure;
+    }
+
+  if (!_dbus_string_init (&hex_key))
+    _dbus_assert_not_reached ("no memory");
+  if (!_dbus_keyring_get_hex_key (ring1,
+                                  ring2->keys[ring2->n_keys - 1].id,
+                                  &hex_key))
+    _dbus_assert_not_reached ("no memory");
+  i = _dbus_string_get_length (&hex_key);
+  _dbus_string_free (&hex_key);
+
+  if (i == 0)
+    {
+      fprintf (stderr, "Key added to the file was not found\n");
+      goto failure;
+    }
+  if (ring1->n_loads != n_loads + 1)
+    {
+      fprintf (stderr, "Keyring file read %d times, expected once\n",
+               ring1->n_loads - n_loads);
+      goto failure;
+    }
+
+  /* Writers that only know about the lock file are kept out while
+   * we hold the lock, and let in once we drop it
+   */
+  if (!_dbus_keyring_lock (ring2))
+    {
+      fprintf (stderr, "Could not lock keyring\n");
+      goto failure;
+    }
+  if (_dbus_create_file_exclusively (&ring2->filename_lock, &error))
+    _dbus_assert_not_reached ("lock file was not there while locked");
+  dbus_error_free (&error);
+  _dbus_keyring_unlock (ring2);
+
+  if (!_dbus_create_file_exclusively (&ring2->filename_lock, &error))
+    {
+      fprintf (stderr, "Lock file left behind after unlock: %s\n",
+               error.message);
+      dbus_error_free (&error);
+      goto failure;
+    }
+  if (!_dbus_delete_file (&ring2->filename_lock, &error))
+    _dbus_assert_not_reached ("could not delete lock file");
+
   /* Test ref/unref */
   _dbus_keyring_ref (ring1);
   _dbus_keyring_ref (ring2);
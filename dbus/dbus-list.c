@@ -47,14 +47,131 @@ _DBUS_DEFINE_GLOBAL_LOCK (list);
  * @{
  */
 
-/* the mem pool is probably a speed hit, with the thread
- * lock, though it does still save memory - unknown.
+/* Taking the list lock for every link made it one of the most
+ * contended locks once several threads send and receive, so each
+ * thread keeps a few free links of its own and moves them to and from
+ * the shared pool LINK_CACHE_BATCH at a time.
  */
+#define LINK_CACHE_BATCH 32
+
+typedef struct
+{
+  DBusList *links; /**< Free links, chained through next */
+  int n_links;     /**< Number of links */
+} LinkCache;
+
+static DBusThreadLocal *link_caches = NULL;
+
+/* called with the list lock held */
+static void
+return_cached_links (LinkCache *cache,
+                     int        n_links)
+{
+  while (n_links-- > 0 && cache->links != NULL)
+    {
+      DBusList *link = cache->links;
+
+      cache->links = link->next;
+      cache->n_links -= 1;
+
+      if (_dbus_mem_pool_dealloc (list_pool, link))
+        {
+          _dbus_mem_pool_free (list_pool);
+          list_pool = NULL;
+        }
+    }
+}
+
+/* run when a thread exits, and for the shutting down thread */
+static void
+free_link_cache (void *data)
+{
+  LinkCache *cache = data;
+
+  _DBUS_LOCK (list);
+  return_cached_links (cache, cache->n_links);
+  _DBUS_UNLOCK (list);
+
+  dbus_free (cache);
+}
+
+static void
+shutdown_link_caches (void *data)
+{
+  LinkCache *cache;
+
+  cache = _dbus_thread_local_get (link_caches);
+  if (cache != NULL)
+    free_link_cache (cache);
+
+  _dbus_thread_local_free (link_caches);
+  link_caches = NULL;
+}
+
+/* Only ever set under the list lock, and once set only changes at
+ * shutdown, so it's fine to look without the lock.
+ */
+static LinkCache*
+get_link_cache (void)
+{
+  if (link_caches == NULL)
+    return NULL;
+
+  return _dbus_thread_local_get (link_caches);
+}
+
+/* called with the list lock held; failing just means no cache */
+static LinkCache*
+create_link_cache (void)
+{
+  LinkCache *cache;
+
+  if (link_caches == NULL)
+    {
+      link_caches = _dbus_thread_local_new (free_link_cache);
+      if (link_caches == NULL)
+        return NULL;
+
+      if (!_dbus_register_shutdown_func (shutdown_link_caches, NULL))
+        {
+          _dbus_thread_local_free (link_caches);
+          link_caches = NULL;
+          return NULL;
+        }
+    }
+
+  cache = dbus_new0 (LinkCache, 1);
+  if (cache == NULL)
+    return NULL;
+
+  if (!_dbus_thread_local_set (link_caches, cache))
+    {
+      dbus_free (cache);
+      return NULL;
+    }
+
+  return cache;
+}
+
 static DBusList*
 alloc_link (void *data)
 {
+  LinkCache *cache;
   DBusList *link;
 
+  cache = get_link_cache ();
+  if (cache != NULL && cache->links != NULL)
+    {
+      link = cache->links;
+      cache->links = link->next;
+      cache->n_links -= 1;
+
+      link->next = NULL;
+      link->data = data;
+
+      return link;
+    }
+
   _DBUS_LOCK (list);
 
   if (list_pool == NULL)
@@ -82,7 +199,26 @@ alloc_link (void *data)
     }
 
   if (link)
-    link->data = data;
+    {
+      link->data = data;
+
+      /* take some more for next time while we have the lock */
+      if (cache == NULL)
+        cache = create_link_cache ();
+
+      while (cache != NULL && cache->n_links < LINK_CACHE_BATCH)
+        {
+          DBusList *extra;
+
+          extra = _dbus_mem_pool_alloc (list_pool);
+          if (extra == NULL)
+            break;
+
+          extra->next = cache->links;
+          cache->links = extra;
+          cache->n_links += 1;
+        }
+    }
   
   _DBUS_UNLOCK (list);
 
@@ -92,6 +228,26 @@ alloc_link (void *data)
 static void
 free_link (DBusList *link)
 {  
+  LinkCache *cache;
+
+  cache = get_link_cache ();
+  if (cache != NULL)
+    {
+      link->prev = NULL;
+      link->data = NULL;
+      link->next = cache->links;
+      cache->links = link;
+      cache->n_links += 1;
+
+      if (cache->n_links <= 2 * LINK_CACHE_BATCH)
+        return;
+
+      _DBUS_LOCK (list);
+      return_cached_links (cache, LINK_CACHE_BATCH);
+      _DBUS_UNLOCK (list);
+      return;
+    }
+
   _DBUS_LOCK (list);
   if (_dbus_mem_pool_dealloc (list_pool, link))
     {
@@ -60,6 +60,11 @@ struct DBusLoop
   int timeout_count;
   int depth; /**< number of recursive runs */
   DBusList *need_dispatch;
+  int dispatch_quantum; /**< max messages per connection per dispatch round, 0 for no limit */
+  DBusLoopStats stats;  /**< where the loop spends its time */
+  long stall_threshold_usec; /**< callbacks running this long are reported, 0 for never */
+  DBusLoopStallFunction stall_function; /**< reports stalls */
+  void *stall_data;     /**< data for stall_function */
 };
 
 typedef enum
@@ -459,38 +464,192 @@ check_timeout (unsigned long    tv_sec,
   return *timeout == 0;
 }
 
+/**
+ * Sets how many messages each connection may dispatch per round of
+ * _dbus_loop_dispatch(). With a quantum of zero (the default), every
+ * queued connection is drained completely before the next one is
+ * looked at, so a single busy connection can hold up all the others.
+ *
+ * With a nonzero quantum the connections are served round-robin: each
+ * one gets at most @p quantum messages, and any connection that still
+ * has data afterward goes to the back of the queue for the next main
+ * loop iteration. Since the loop never blocks while connections are
+ * waiting to be dispatched, this only costs an extra nonblocking poll
+ * in exchange for letting other connections be read and dispatched in
+ * between.
+ *
+ * @param loop the loop
+ * @param quantum max messages per connection per round, or 0
+ */
+void
+_dbus_loop_set_dispatch_quantum (DBusLoop *loop,
+                                 int       quantum)
+{
+  _dbus_assert (quantum >= 0);
+  
+  loop->dispatch_quantum = quantum;
+}
+
+/**
+ * Sets a function to be told about any single watch, timeout or
+ * connection dispatch that runs for threshold_usec or longer, so that
+ * whatever stalls the loop can be found.
+ *
+ * @param loop the loop
+ * @param threshold_usec stall threshold, or 0 to report nothing
+ * @param function function to call, or #NULL
+ * @param data data for the function
+ */
+void
+_dbus_loop_set_stall_function (DBusLoop              *loop,
+                               long                   threshold_usec,
+                               DBusLoopStallFunction  function,
+                               void                  *data)
+{
+  _dbus_assert (threshold_usec >= 0);
+
+  loop->stall_threshold_usec = threshold_usec;
+  loop->stall_function = function;
+  loop->stall_data = data;
+}
+
+/**
+ * Gets histograms of the time spent in the loop.
+ *
+ * @param loop the loop
+ * @returns the statistics, owned by the loop
+ */
+const DBusLoopStats*
+_dbus_loop_get_stats (DBusLoop *loop)
+{
+  return &loop->stats;
+}
+
+/* Records the time since the given start for one callback, reports
+ * it if it stalled the loop, and moves the start up to now so the
+ * next callback can be timed from there.
+ */
+static void
+callback_finished (DBusLoop      *loop,
+                   DBusHistogram *histogram,
+                   const char    *kind,
+                   int            fd,
+                   void          *callback_data,
+                   long          *tv_sec,
+                   long          *tv_usec)
+{
+  long now_sec, now_usec;
+  long usec;
+
+  _dbus_get_current_time (&now_sec, &now_usec);
+  usec = _dbus_usec_since (*tv_sec, *tv_usec, now_sec, now_usec);
+
+  _dbus_histogram_add (histogram, usec);
+
+  if (loop->stall_threshold_usec > 0 && usec >= loop->stall_threshold_usec)
+    {
+      loop->stats.n_stalls += 1;
+
+      if (loop->stall_function != NULL)
+        (* loop->stall_function) (kind, fd, callback_data, usec,
+                                  loop->stall_data);
+    }
+
+  *tv_sec = now_sec;
+  *tv_usec = now_usec;
+}
+
 dbus_bool_t
 _dbus_loop_dispatch (DBusLoop *loop)
 {
-
+  DBusList *round;
+  long tv_sec, tv_usec;
+  
 #if MAINLOOP_SPEW
   _dbus_verbose ("  %d connections to dispatch\n", _dbus_list_get_length (&loop->need_dispatch));
 #endif
   
   if (loop->need_dispatch == NULL)
     return FALSE;
-  
- next:
-  while (loop->need_dispatch != NULL)
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  if (loop->dispatch_quantum == 0)
     {
-      DBusConnection *connection = _dbus_list_pop_first (&loop->need_dispatch);
-      
-      while (TRUE)
+    next:
+      while (loop->need_dispatch != NULL)
         {
-          DBusDispatchStatus status;
+          DBusConnection *connection = _dbus_list_pop_first (&loop->need_dispatch);
+      
+          while (TRUE)
+            {
+              DBusDispatchStatus status;
           
+              status = dbus_connection_dispatch (connection);
+
+              callback_finished (loop, &loop->stats.dispatch, "dispatch",
+                                 -1, connection, &tv_sec, &tv_usec);
+
+              if (status == DBUS_DISPATCH_COMPLETE)
+                {
+                  dbus_connection_unref (connection);
+                  goto next;
+                }
+              else
+                {
+                  if (status == DBUS_DISPATCH_NEED_MEMORY)
+                    _dbus_wait_for_memory ();
+                }
+            }
+        }
+
+      return TRUE;
+    }
+
+  /* Take the connections that are queued right now as this round;
+   * anything queued while we dispatch (or requeued because it used up
+   * its quantum) waits for the next round.
+   */
+  round = loop->need_dispatch;
+  loop->need_dispatch = NULL;
+  
+  while (round != NULL)
+    {
+      DBusList *link = _dbus_list_pop_first_link (&round);
+      DBusConnection *connection = link->data;
+      DBusDispatchStatus status;
+      int remaining;
+
+      remaining = loop->dispatch_quantum;
+      status = DBUS_DISPATCH_DATA_REMAINS;
+      while (remaining > 0)
+        {
           status = dbus_connection_dispatch (connection);
 
+          callback_finished (loop, &loop->stats.dispatch, "dispatch",
+                             -1, connection, &tv_sec, &tv_usec);
+
           if (status == DBUS_DISPATCH_COMPLETE)
-            {
-              dbus_connection_unref (connection);
-              goto next;
-            }
+            break;
+          else if (status == DBUS_DISPATCH_NEED_MEMORY)
+            _dbus_wait_for_memory ();
           else
-            {
-              if (status == DBUS_DISPATCH_NEED_MEMORY)
-                _dbus_wait_for_memory ();
-            }
+            remaining -= 1;
+        }
+
+      if (status == DBUS_DISPATCH_COMPLETE)
+        {
+          _dbus_list_free_link (link);
+          dbus_connection_unref (connection);
+        }
+      else
+        {
+#if MAINLOOP_SPEW
+          _dbus_verbose ("  connection %p used up its quantum, requeueing\n",
+                         connection);
+#endif
+          /* reuse the link so requeueing can't fail, and keep our ref */
+          _dbus_list_append_link (&loop->need_dispatch, link);
         }
     }
 
@@ -532,9 +691,15 @@ _dbus_loop_iterate (DBusLoop     *loop,
   long timeout;
   dbus_bool_t oom_watch_pending;
   int orig_depth;
+  long start_tv_sec, start_tv_usec;
+  long poll_tv_sec, poll_tv_usec;
+  long tv_sec, tv_usec;
+  long poll_usec;
   
   retval = FALSE;      
 
+  _dbus_get_current_time (&start_tv_sec, &start_tv_usec);
+
   fds = NULL;
   watches_for_fds = NULL;
   n_fds = 0;
@@ -546,6 +711,8 @@ _dbus_loop_iterate (DBusLoop     *loop,
                  block, loop->depth, loop->timeout_count, loop->watch_count);
 #endif
   
+  poll_usec = 0;
+
   if (loop->callbacks == NULL)
     goto next_iteration;
 
@@ -640,9 +807,6 @@ _dbus_loop_iterate (DBusLoop     *loop,
   timeout = -1;
   if (loop->timeout_count > 0)
     {
-      unsigned long tv_sec;
-      unsigned long tv_usec;
-      
       _dbus_get_current_time (&tv_sec, &tv_usec);
           
       link = _dbus_list_get_first_link (&loop->callbacks);
@@ -704,17 +868,18 @@ _dbus_loop_iterate (DBusLoop     *loop,
   _dbus_verbose ("  polling on %d descriptors timeout %ld\n", n_fds, timeout);
 #endif
   
+  _dbus_get_current_time (&poll_tv_sec, &poll_tv_usec);
+
   n_ready = _dbus_poll (fds, n_fds, timeout);
 
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  poll_usec = _dbus_usec_since (poll_tv_sec, poll_tv_usec, tv_sec, tv_usec);
+  _dbus_histogram_add (&loop->stats.poll_wait, poll_usec);
+
   initial_serial = loop->callback_list_serial;
 
   if (loop->timeout_count > 0)
     {
-      unsigned long tv_sec;
-      unsigned long tv_usec;
-
-      _dbus_get_current_time (&tv_sec, &tv_usec);
-
       /* It'd be nice to avoid this O(n) thingy here */
       link = _dbus_list_get_first_link (&loop->callbacks);
       while (link != NULL)
@@ -737,6 +902,9 @@ _dbus_loop_iterate (DBusLoop     *loop,
               if (check_timeout (tv_sec, tv_usec,
                                  tcb, &msecs_remaining))
                 {
+                  /* the callback may remove itself */
+                  void *callback_data = cb->data;
+
                   /* Save last callback time and fire this timeout */
                   tcb->last_tv_sec = tv_sec;
                   tcb->last_tv_usec = tv_usec;
@@ -748,6 +916,10 @@ _dbus_loop_iterate (DBusLoop     *loop,
                   (* tcb->function) (tcb->timeout,
                                      cb->data);
 
+                  callback_finished (loop, &loop->stats.timeout, "timeout",
+                                     -1, callback_data,
+                                     &tv_sec, &tv_usec);
+
                   retval = TRUE;
                 }
               else
@@ -812,6 +984,11 @@ _dbus_loop_iterate (DBusLoop     *loop,
                                           ((Callback*)wcb)->data))
                     wcb->last_iteration_oom = TRUE;
 
+                  /* we hold a ref on wcb, but the watch may be gone */
+                  callback_finished (loop, &loop->stats.watch, "watch",
+                                     fds[i].fd, ((Callback*)wcb)->data,
+                                     &tv_sec, &tv_usec);
+
 #if MAINLOOP_SPEW
                   _dbus_verbose ("  Invoked watch, oom = %d\n",
                                  wcb->last_iteration_oom);
@@ -847,6 +1024,12 @@ _dbus_loop_iterate (DBusLoop     *loop,
   
   if (_dbus_loop_dispatch (loop))
     retval = TRUE;
+
+  /* everything but the poll wait */
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  _dbus_histogram_add (&loop->stats.iteration,
+                       _dbus_usec_since (start_tv_sec, start_tv_usec,
+                                         tv_sec, tv_usec) - poll_usec);
   
 #if MAINLOOP_SPEW
   _dbus_verbose ("Returning %d\n", retval);
@@ -27,6 +27,7 @@
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 
 #include <dbus/dbus.h>
+#include <dbus/dbus-internals.h>
 
 typedef struct DBusLoop DBusLoop;
 
@@ -36,6 +37,31 @@ typedef dbus_bool_t (* DBusWatchFunction)   (DBusWatch     *watch,
 typedef void        (* DBusTimeoutFunction) (DBusTimeout   *timeout,
                                              void          *data);
 
+/**
+ * Called when a single callback ran for longer than the stall
+ * threshold. kind is "watch", "timeout" or "dispatch"; fd is the
+ * watched descriptor or -1; callback_data is the data the callback
+ * was added with, or the connection for a dispatch.
+ */
+typedef void        (* DBusLoopStallFunction) (const char  *kind,
+                                               int          fd,
+                                               void        *callback_data,
+                                               long         usec,
+                                               void        *data);
+
+/**
+ * Time spent in the main loop, in microseconds
+ */
+typedef struct
+{
+  DBusHistogram iteration; /**< Each iteration, not counting the poll wait */
+  DBusHistogram poll_wait; /**< Time blocked in poll() */
+  DBusHistogram watch;     /**< Each watch callback */
+  DBusHistogram timeout;   /**< Each timeout callback */
+  DBusHistogram dispatch;  /**< Each message dispatched from a connection */
+  unsigned long n_stalls;  /**< Callbacks that ran past the stall threshold */
+} DBusLoopStats;
+
 DBusLoop*   _dbus_loop_new            (void);
 DBusLoop*   _dbus_loop_ref            (DBusLoop            *loop);
 void        _dbus_loop_unref          (DBusLoop            *loop);
@@ -60,6 +86,13 @@ void        _dbus_loop_remove_timeout (DBusLoop            *loop,
 
 dbus_bool_t _dbus_loop_queue_dispatch (DBusLoop            *loop,
                                        DBusConnection      *connection);
+void        _dbus_loop_set_dispatch_quantum (DBusLoop            *loop,
+                                             int                  quantum);
+void        _dbus_loop_set_stall_function   (DBusLoop              *loop,
+                                             long                   threshold_usec,
+                                             DBusLoopStallFunction  function,
+                                             void                  *data);
+const DBusLoopStats* _dbus_loop_get_stats   (DBusLoop              *loop);
 
 void        _dbus_loop_run            (DBusLoop            *loop);
 void        _dbus_loop_quit           (DBusLoop            *loop);
@@ -81,7 +81,8 @@ _dbus_header_field_types[DBUS_HEADER_FIELD_LAST+1] = {
   { DBUS_HEADER_FIELD_REPLY_SERIAL, DBUS_TYPE_UINT32 },
   { DBUS_HEADER_FIELD_DESTINATION, DBUS_TYPE_STRING },
   { DBUS_HEADER_FIELD_SENDER, DBUS_TYPE_STRING },
-  { DBUS_HEADER_FIELD_SIGNATURE, DBUS_TYPE_SIGNATURE }
+  { DBUS_HEADER_FIELD_SIGNATURE, DBUS_TYPE_SIGNATURE },
+  { DBUS_HEADER_FIELD_UNIX_FDS, DBUS_TYPE_UINT32 }
 };
 
 /** Macro to look up the correct type for a field */
@@ -495,6 +496,32 @@ _dbus_header_copy (const DBusHeader *header,
   return TRUE;
 }
 
+/**
+ * Replaces the contents of dest, which must already be initialized,
+ * with a copy of the given header. Unlike _dbus_header_copy() this
+ * reuses the storage dest already has, so it's cheap for messages
+ * that came out of the message cache. The serial is copied as-is.
+ *
+ * @param header header to copy
+ * @param dest initialized header to overwrite
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_header_copy_into (const DBusHeader *header,
+                        DBusHeader       *dest)
+{
+  _dbus_string_set_length (&dest->data, 0);
+
+  if (!_dbus_string_copy (&header->data, 0, &dest->data, 0))
+    return FALSE;
+
+  memcpy (dest->fields, header->fields, sizeof (dest->fields));
+  dest->padding = header->padding;
+  dest->byte_order = header->byte_order;
+
+  return TRUE;
+}
+
 /**
  * Fills in the primary fields of the header, so the header is ready
  * for use. #NULL may be specified for some or all of the fields to
@@ -893,6 +920,14 @@ load_and_validate_field (DBusHeader     *header,
       string_validation_func = NULL;
       break;
 
+    case DBUS_HEADER_FIELD_UNIX_FDS:
+      /* Checked against the descriptors that actually arrived by the loader */
+      if (v_UINT32 > DBUS_MAXIMUM_MESSAGE_UNIX_FDS)
+        {
+          return DBUS_INVALID_TOO_MANY_UNIX_FDS;
+        }
+      break;
+
     default:
       _dbus_assert_not_reached ("unknown field shouldn't be seen here");
       break;
@@ -78,6 +78,8 @@ dbus_bool_t   _dbus_header_create                 (DBusHeader        *header,
                                                    const char        *error_name);
 dbus_bool_t   _dbus_header_copy                   (const DBusHeader  *header,
                                                    DBusHeader        *dest);
+dbus_bool_t   _dbus_header_copy_into              (const DBusHeader  *header,
+                                                   DBusHeader        *dest);
 int           _dbus_header_get_message_type       (DBusHeader        *header);
 void          _dbus_header_set_serial             (DBusHeader        *header,
                                                    dbus_uint32_t      serial);
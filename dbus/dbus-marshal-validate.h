@@ -118,6 +118,8 @@ typedef enum
   DBUS_INVALID_DICT_ENTRY_NOT_INSIDE_ARRAY = 54,
   DBUS_INVALID_DICT_KEY_MUST_BE_BASIC_TYPE = 55,
   DBUS_INVALID_NESTED_TOO_DEEPLY = 57,
+  DBUS_INVALID_TOO_MANY_UNIX_FDS = 58,
+  DBUS_INVALID_MISSING_UNIX_FDS = 59,
   DBUS_VALIDITY_LAST
 } DBusValidity;
 
@@ -67,6 +67,14 @@ struct DBusFreedElement
  */
 #define ELEMENT_PADDING 4
 
+/**
+ * Blocks start at 16 elements and double in size until they hold at
+ * least this many bytes of elements; after that every new block is
+ * the same size.  Capping the size means a mostly-free pool is made
+ * of many small blocks, so it can hand whole blocks back to malloc().
+ */
+#define MAX_BLOCK_SIZE 4096
+
 /**
  * Typedef for DBusMemBlock so the struct can recursively
  * point to itself.
@@ -76,16 +84,25 @@ typedef struct DBusMemBlock DBusMemBlock;
 /**
  * DBusMemBlock object represents a single malloc()-returned
  * block that gets chunked up into objects in the memory pool.
+ * Each block keeps its own free list, so that once every element
+ * of a block has been freed the block itself can be freed.
  */
 struct DBusMemBlock
 {
-  DBusMemBlock *next;  /**< next block in the list, which is already used up;
-                        *   only saved so we can free all the blocks
-                        *   when we free the mem pool.
+  DBusMemBlock *next;  /**< next block in the pool's list of blocks with
+                        *   free space, or of spare empty blocks (or, with
+                        *   mem pools disabled for debugging, of all blocks)
                         */
+  DBusMemBlock *prev;  /**< previous block in the list of blocks with
+                        *   free space
+                        */
+
+  DBusFreedElement *free_elements; /**< elements freed back to this block */
+  int n_elements;      /**< number of elements the block can hold */
+  int n_allocated;     /**< number of elements currently allocated */
 
   /* this is a long so that "elements" is aligned */
-  long used_so_far;     /**< bytes of this block already allocated as elements. */
+  long used_so_far;     /**< bytes of this block already carved into elements */
   
   unsigned char elements[ELEMENT_PADDING]; /**< the block data, actually allocated to required size */
 };
@@ -99,11 +116,176 @@ struct DBusMemPool
   int block_size;                  /**< size of most recently allocated block */
   unsigned int zero_elements : 1;  /**< whether to zero-init allocated elements */
 
-  DBusFreedElement *free_elements; /**< a free list of elements to recycle */
-  DBusMemBlock *blocks;            /**< blocks of memory from malloc() */
+  DBusMemBlock *partial_blocks;    /**< blocks with at least one free element */
+  DBusMemBlock **blocks;           /**< all blocks from malloc(), sorted by address */
+  int n_blocks;                    /**< number of blocks in the blocks array */
+  int n_blocks_allocated;          /**< size of the blocks array */
+  DBusMemBlock *spare_blocks;      /**< empty blocks kept back from free() */
+  int n_spare_blocks;              /**< length of the spare_blocks list */
   int allocated_elements;          /**< Count of outstanding allocated elements */
+  unsigned long bytes_retained;    /**< bytes of block memory held by the pool */
+
+#ifdef DBUS_BUILD_TESTS
+  DBusMemBlock *debug_blocks;      /**< per-element blocks when mem pools are disabled */
+#endif
 };
 
+/**
+ * Size of the malloc() block needed for a DBusMemBlock
+ * holding the given number of bytes of elements.
+ */
+#define BLOCK_ALLOC_SIZE(bytes) (sizeof (DBusMemBlock) - ELEMENT_PADDING + (bytes))
+
+static void
+partial_list_prepend (DBusMemPool  *pool,
+                      DBusMemBlock *block)
+{
+  block->prev = NULL;
+  block->next = pool->partial_blocks;
+  if (pool->partial_blocks)
+    pool->partial_blocks->prev = block;
+  pool->partial_blocks = block;
+}
+
+static void
+partial_list_remove (DBusMemPool  *pool,
+                     DBusMemBlock *block)
+{
+  if (block->prev)
+    block->prev->next = block->next;
+  else
+    pool->partial_blocks = block->next;
+
+  if (block->next)
+    block->next->prev = block->prev;
+
+  block->next = NULL;
+  block->prev = NULL;
+}
+
+/* Returns the index of the last block starting at or below element,
+ * or -1 if there is none.
+ */
+static int
+find_block_index (DBusMemPool *pool,
+                  const void  *element)
+{
+  int low;
+  int high;
+
+  low = 0;
+  high = pool->n_blocks - 1;
+
+  while (low <= high)
+    {
+      int mid = low + (high - low) / 2;
+
+      if ((const unsigned char *) pool->blocks[mid] <=
+          (const unsigned char *) element)
+        low = mid + 1;
+      else
+        high = mid - 1;
+    }
+
+  return high;
+}
+
+static DBusMemBlock*
+new_block (DBusMemPool *pool)
+{
+  DBusMemBlock *block;
+  int index;
+#ifdef DBUS_BUILD_TESTS
+  int saved_counter;
+#endif
+
+  if (pool->block_size < MAX_BLOCK_SIZE)
+    {
+      /* use a larger block size for our next block */
+      pool->block_size *= 2;
+      _dbus_assert ((pool->block_size %
+                     pool->element_size) == 0);
+    }
+
+#ifdef DBUS_BUILD_TESTS
+  /* We save/restore the counter, so that memory pools won't
+   * cause a given function to have different number of
+   * allocations on different invocations. i.e.  when testing
+   * we want consistent alloc patterns. So we skip our
+   * malloc here for purposes of failed alloc simulation.
+   */
+  saved_counter = _dbus_get_fail_alloc_counter ();
+  _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
+#endif
+
+  block = NULL;
+
+  if (pool->n_blocks == pool->n_blocks_allocated)
+    {
+      DBusMemBlock **blocks;
+      int new_size;
+
+      new_size = pool->n_blocks_allocated == 0 ? 8 : pool->n_blocks_allocated * 2;
+      blocks = dbus_realloc (pool->blocks, new_size * sizeof (DBusMemBlock*));
+      if (blocks == NULL)
+        goto out;
+
+      pool->blocks = blocks;
+      pool->n_blocks_allocated = new_size;
+    }
+
+  if (pool->zero_elements)
+    block = dbus_malloc0 (BLOCK_ALLOC_SIZE (pool->block_size));
+  else
+    block = dbus_malloc (BLOCK_ALLOC_SIZE (pool->block_size));
+
+  if (block == NULL)
+    goto out;
+
+  block->next = NULL;
+  block->prev = NULL;
+  block->free_elements = NULL;
+  block->n_elements = pool->block_size / pool->element_size;
+  block->n_allocated = 0;
+  block->used_so_far = 0;
+
+  index = find_block_index (pool, block) + 1;
+  memmove (&pool->blocks[index + 1], &pool->blocks[index],
+           (pool->n_blocks - index) * sizeof (DBusMemBlock*));
+  pool->blocks[index] = block;
+  pool->n_blocks += 1;
+  pool->bytes_retained += BLOCK_ALLOC_SIZE (pool->block_size);
+
+  partial_list_prepend (pool, block);
+
+ out:
+#ifdef DBUS_BUILD_TESTS
+  _dbus_set_fail_alloc_counter (saved_counter);
+  _dbus_assert (saved_counter == _dbus_get_fail_alloc_counter ());
+#endif
+
+  return block;
+}
+
+static void
+release_block (DBusMemPool *pool,
+               int          index)
+{
+  DBusMemBlock *block;
+
+  block = pool->blocks[index];
+
+  _dbus_assert (block->n_allocated == 0);
+
+  memmove (&pool->blocks[index], &pool->blocks[index + 1],
+           (pool->n_blocks - index - 1) * sizeof (DBusMemBlock*));
+  pool->n_blocks -= 1;
+  pool->bytes_retained -=
+    BLOCK_ALLOC_SIZE (block->n_elements * pool->element_size);
+
+  dbus_free (block);
+}
+
 /** @} */
 
 /**
@@ -119,6 +301,12 @@ struct DBusMemPool
  * avoiding per-malloc-block memory overhead when allocating a lot of
  * small objects that are all the same size. They are slightly
  * faster than calling malloc() also.
+ *
+ * The pool carves blocks ("slabs") of memory into elements.  When
+ * every element of a block has been freed the block is returned to
+ * the system, apart from a few spare blocks kept so that a pool
+ * hovering at a block boundary does not malloc() and free() on every
+ * call.
  */
 
 /**
@@ -162,10 +350,9 @@ _dbus_mem_pool_new (int element_size,
   pool->allocated_elements = 0;
   
   /* pick a size for the first block; it increases
-   * for each block we need to allocate. This is
-   * actually half the initial block size
-   * since _dbus_mem_pool_alloc() unconditionally
-   * doubles it prior to creating a new block.  */
+   * for each block we need to allocate, up to MAX_BLOCK_SIZE.
+   * This is actually half the initial block size
+   * since new_block() doubles it prior to creating a new block.  */
   pool->block_size = pool->element_size * 8;
 
   _dbus_assert ((pool->block_size %
@@ -182,18 +369,28 @@ _dbus_mem_pool_new (int element_size,
 void
 _dbus_mem_pool_free (DBusMemPool *pool)
 {
-  DBusMemBlock *block;
+  int i;
 
-  block = pool->blocks;
-  while (block != NULL)
-    {
-      DBusMemBlock *next = block->next;
+#ifdef DBUS_BUILD_TESTS
+  {
+    DBusMemBlock *block;
 
-      dbus_free (block);
+    block = pool->debug_blocks;
+    while (block != NULL)
+      {
+        DBusMemBlock *next = block->next;
 
-      block = next;
-    }
+        dbus_free (block);
+
+        block = next;
+      }
+  }
+#endif
+
+  for (i = 0; i < pool->n_blocks; i++)
+    dbus_free (pool->blocks[i]);
 
+  dbus_free (pool->blocks);
   dbus_free (pool);
 }
 
@@ -220,8 +417,7 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
        * should vanish)
        */
       
-      alloc_size = sizeof (DBusMemBlock) - ELEMENT_PADDING +
-        pool->element_size;
+      alloc_size = BLOCK_ALLOC_SIZE (pool->element_size);
       
       if (pool->zero_elements)
         block = dbus_malloc0 (alloc_size);
@@ -230,9 +426,10 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
 
       if (block != NULL)
         {
-          block->next = pool->blocks;
-          pool->blocks = block;
+          block->next = pool->debug_blocks;
+          pool->debug_blocks = block;
           pool->allocated_elements += 1;
+          pool->bytes_retained += alloc_size;
 
           return (void*) &block->elements[0];
         }
@@ -242,85 +439,59 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
   else
 #endif
     {
+      DBusMemBlock *block;
+      void *element;
+
       if (_dbus_decrement_fail_alloc_counter ())
         {
           _dbus_verbose (" FAILING mempool alloc\n");
           return NULL;
         }
-      else if (pool->free_elements)
+
+      /* Fill partly used blocks before touching the spare, so that
+       * blocks which are draining get a chance to empty completely.
+       */
+      block = pool->partial_blocks;
+      if (block == NULL && pool->spare_blocks != NULL)
+        {
+          block = pool->spare_blocks;
+          pool->spare_blocks = block->next;
+          pool->n_spare_blocks -= 1;
+          partial_list_prepend (pool, block);
+        }
+      else if (block == NULL)
         {
-          DBusFreedElement *element = pool->free_elements;
+          block = new_block (pool);
+          if (block == NULL)
+            return NULL;
+        }
 
-          pool->free_elements = pool->free_elements->next;
+      if (block->free_elements)
+        {
+          DBusFreedElement *freed = block->free_elements;
+
+          block->free_elements = freed->next;
 
           if (pool->zero_elements)
-            memset (element, '\0', pool->element_size);
+            memset (freed, '\0', pool->element_size);
 
-          pool->allocated_elements += 1;
-          
-          return element;
+          element = freed;
         }
       else
         {
-          void *element;
-      
-          if (pool->blocks == NULL ||
-              pool->blocks->used_so_far == pool->block_size)
-            {
-              /* Need a new block */
-              DBusMemBlock *block;
-              int alloc_size;
-#ifdef DBUS_BUILD_TESTS
-              int saved_counter;
-#endif
-          
-              if (pool->block_size <= _DBUS_INT_MAX / 4) /* avoid overflow */
-                {
-                  /* use a larger block size for our next block */
-                  pool->block_size *= 2;
-                  _dbus_assert ((pool->block_size %
-                                 pool->element_size) == 0);
-                }
-
-              alloc_size = sizeof (DBusMemBlock) - ELEMENT_PADDING + pool->block_size;
+          /* fresh memory, zeroed by dbus_malloc0() if need be */
+          element = &block->elements[block->used_so_far];
+          block->used_so_far += pool->element_size;
+        }
 
-#ifdef DBUS_BUILD_TESTS
-              /* We save/restore the counter, so that memory pools won't
-               * cause a given function to have different number of
-               * allocations on different invocations. i.e.  when testing
-               * we want consistent alloc patterns. So we skip our
-               * malloc here for purposes of failed alloc simulation.
-               */
-              saved_counter = _dbus_get_fail_alloc_counter ();
-              _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
-#endif
-          
-              if (pool->zero_elements)
-                block = dbus_malloc0 (alloc_size);
-              else
-                block = dbus_malloc (alloc_size);
+      block->n_allocated += 1;
 
-#ifdef DBUS_BUILD_TESTS
-              _dbus_set_fail_alloc_counter (saved_counter);
-              _dbus_assert (saved_counter == _dbus_get_fail_alloc_counter ());
-#endif
-          
-              if (block == NULL)
-                return NULL;
+      if (block->n_allocated == block->n_elements)
+        partial_list_remove (pool, block);
 
-              block->used_so_far = 0;
-              block->next = pool->blocks;
-              pool->blocks = block;          
-            }
-      
-          element = &pool->blocks->elements[pool->blocks->used_so_far];
-          
-          pool->blocks->used_so_far += pool->element_size;
+      pool->allocated_elements += 1;
 
-          pool->allocated_elements += 1;
-          
-          return element;
-        }
+      return element;
     }
 }
 
@@ -345,7 +516,7 @@ _dbus_mem_pool_dealloc (DBusMemPool *pool,
       /* mmm, fast. ;-) debug-only code, so doesn't matter. */
       
       prev = NULL;
-      block = pool->blocks;
+      block = pool->debug_blocks;
 
       while (block != NULL)
         {
@@ -354,17 +525,18 @@ _dbus_mem_pool_dealloc (DBusMemPool *pool,
               if (prev)
                 prev->next = block->next;
               else
-                pool->blocks = block->next;
+                pool->debug_blocks = block->next;
               
               dbus_free (block);
 
               _dbus_assert (pool->allocated_elements > 0);
               pool->allocated_elements -= 1;
+              pool->bytes_retained -= BLOCK_ALLOC_SIZE (pool->element_size);
               
               if (pool->allocated_elements == 0)
-                _dbus_assert (pool->blocks == NULL);
+                _dbus_assert (pool->debug_blocks == NULL);
               
-              return pool->blocks == NULL;
+              return pool->debug_blocks == NULL;
             }
           prev = block;
           block = block->next;
@@ -376,12 +548,58 @@ _dbus_mem_pool_dealloc (DBusMemPool *pool,
   else
 #endif
     {
+      DBusMemBlock *block;
       DBusFreedElement *freed;
-      
+
+      /* Elements usually go back to the block they were most
+       * recently allocated from, so try that before searching.
+       */
+      block = pool->partial_blocks;
+      if (block == NULL ||
+          (unsigned char*) element < block->elements ||
+          (unsigned char*) element >= block->elements + block->used_so_far)
+        {
+          int index;
+
+          index = find_block_index (pool, element);
+          _dbus_assert (index >= 0);
+          block = pool->blocks[index];
+        }
+
+      _dbus_assert ((unsigned char*) element >= block->elements);
+      _dbus_assert ((unsigned char*) element < block->elements + block->used_so_far);
+      _dbus_assert (block->n_allocated > 0);
+
+      if (block->n_allocated == block->n_elements)
+        partial_list_prepend (pool, block);
+
       freed = element;
-      freed->next = pool->free_elements;
-      pool->free_elements = freed;
-      
+      freed->next = block->free_elements;
+      block->free_elements = freed;
+      block->n_allocated -= 1;
+
+      if (block->n_allocated == 0)
+        {
+          partial_list_remove (pool, block);
+
+          block->next = pool->spare_blocks;
+          pool->spare_blocks = block;
+          pool->n_spare_blocks += 1;
+
+          /* Keep a few empty blocks so that a pool hovering around a
+           * block boundary doesn't malloc() and free() all the time,
+           * but no more than a quarter of the blocks in use.
+           */
+          while (pool->n_spare_blocks >
+                 1 + (pool->n_blocks - pool->n_spare_blocks) / 4)
+            {
+              block = pool->spare_blocks;
+              pool->spare_blocks = block->next;
+              pool->n_spare_blocks -= 1;
+              release_block (pool, find_block_index (pool, block));
+            }
+        }
+
       _dbus_assert (pool->allocated_elements > 0);
       pool->allocated_elements -= 1;
       
@@ -389,6 +607,28 @@ _dbus_mem_pool_dealloc (DBusMemPool *pool,
     }
 }
 
+/**
+ * Fills in statistics about the memory held by the pool, for
+ * monitoring.
+ *
+ * @param pool the memory pool
+ * @param stats return location for the statistics
+ */
+void
+_dbus_mem_pool_get_stats (DBusMemPool      *pool,
+                          DBusMemPoolStats *stats)
+{
+  stats->element_size = pool->element_size;
+  stats->live_elements = pool->allocated_elements;
+  stats->n_blocks = pool->n_blocks;
+  stats->bytes_retained = pool->bytes_retained;
+
+#ifdef DBUS_BUILD_TESTS
+  if (_dbus_disable_mem_pools ())
+    stats->n_blocks = pool->allocated_elements;
+#endif
+}
+
 /** @} */
 
 #ifdef DBUS_BUILD_TESTS
@@ -553,6 +793,83 @@ time_for_size (int size)
                  N_ITERATIONS, (end - start) / (double) CLOCKS_PER_SEC);
 }
 
+#define N_RELEASE_ELEMENTS 50000
+#define N_SURVIVORS 10
+
+static void
+check_blocks_released (int size)
+{
+  void **elements;
+  DBusMemPoolStats stats;
+  DBusMemPool *pool;
+  unsigned long peak_bytes;
+  int i;
+  int j;
+
+  elements = dbus_new (void*, N_RELEASE_ELEMENTS);
+  pool = _dbus_mem_pool_new (size, TRUE);
+  _dbus_assert (elements != NULL && pool != NULL);
+
+  for (i = 0; i < N_RELEASE_ELEMENTS; i++)
+    {
+      elements[i] = _dbus_mem_pool_alloc (pool);
+      _dbus_assert (elements[i] != NULL);
+      memset (elements[i], 'x', size);
+    }
+
+  _dbus_mem_pool_get_stats (pool, &stats);
+  _dbus_assert (stats.live_elements == N_RELEASE_ELEMENTS);
+  _dbus_assert (stats.n_blocks > N_SURVIVORS + 1);
+  peak_bytes = stats.bytes_retained;
+
+  /* free everything but a handful of elements spread across the
+   * pool, in an order that doesn't match allocation order
+   */
+  for (i = 0; i < 7; i++)
+    for (j = i; j < N_RELEASE_ELEMENTS; j += 7)
+      {
+        if (j % (N_RELEASE_ELEMENTS / N_SURVIVORS) == 0)
+          continue;
+
+        _dbus_assert (!_dbus_mem_pool_dealloc (pool, elements[j]));
+        elements[j] = NULL;
+      }
+
+  /* each survivor pins at most one block, plus the spares */
+  _dbus_mem_pool_get_stats (pool, &stats);
+  _dbus_verbose ("  %d-byte elements: %lu bytes at peak, %lu with %d left\n",
+                 size, peak_bytes, stats.bytes_retained, stats.live_elements);
+  _dbus_assert (stats.live_elements == N_SURVIVORS);
+  _dbus_assert (stats.n_blocks <= N_SURVIVORS + 1 + N_SURVIVORS / 4);
+  _dbus_assert (stats.bytes_retained < peak_bytes / 4);
+
+  /* freed memory is handed out again, zeroed */
+  for (i = 0; i < N_RELEASE_ELEMENTS; i++)
+    {
+      if (elements[i] == NULL)
+        {
+          elements[i] = _dbus_mem_pool_alloc (pool);
+          _dbus_assert (elements[i] != NULL);
+          for (j = 0; j < size; j++)
+            _dbus_assert (((unsigned char*) elements[i])[j] == '\0');
+          memset (elements[i], 'x', size);
+        }
+    }
+
+  for (i = 0; i < N_RELEASE_ELEMENTS; i++)
+    {
+      if (_dbus_mem_pool_dealloc (pool, elements[i]))
+        _dbus_assert (i == N_RELEASE_ELEMENTS - 1);
+    }
+
+  _dbus_mem_pool_get_stats (pool, &stats);
+  _dbus_assert (stats.live_elements == 0);
+  _dbus_assert (stats.n_blocks <= 1);
+
+  _dbus_mem_pool_free (pool);
+  dbus_free (elements);
+}
+
 /**
  * @ingroup DBusMemPoolInternals
  * Unit test for DBusMemPool
@@ -568,6 +885,7 @@ _dbus_mem_pool_test (void)
   while (i < _DBUS_N_ELEMENTS (element_sizes))
     {
       time_for_size (element_sizes[i]);
+      check_blocks_released (element_sizes[i]);
       ++i;
     }
   
@@ -32,12 +32,25 @@ DBUS_BEGIN_DECLS
 
 typedef struct DBusMemPool DBusMemPool;
 
+/**
+ * Memory usage of a DBusMemPool, see _dbus_mem_pool_get_stats()
+ */
+typedef struct
+{
+  int element_size;             /**< size of each element, after alignment */
+  int live_elements;            /**< elements currently allocated */
+  int n_blocks;                 /**< blocks of memory held by the pool */
+  unsigned long bytes_retained; /**< total size of those blocks */
+} DBusMemPoolStats;
+
 DBusMemPool* _dbus_mem_pool_new     (int          element_size,
                                      dbus_bool_t  zero_elements);
 void         _dbus_mem_pool_free    (DBusMemPool *pool);
 void*        _dbus_mem_pool_alloc   (DBusMemPool *pool);
 dbus_bool_t  _dbus_mem_pool_dealloc (DBusMemPool *pool,
                                      void        *element);
+void         _dbus_mem_pool_get_stats (DBusMemPool      *pool,
+                                       DBusMemPoolStats *stats);
 
 DBUS_END_DECLS
 
@@ -26,6 +26,7 @@
 #include <dbus/dbus-message.h>
 #include <dbus/dbus-resources.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-object-tree.h>
 
 DBUS_BEGIN_DECLS
 
@@ -33,7 +34,15 @@ typedef struct DBusMessageLoader DBusMessageLoader;
 
 void _dbus_message_get_network_data  (DBusMessage       *message,
 				      const DBusString **header,
-				      const DBusString **body);
+				      const DBusString **body,
+				      const DBusString **borrowed);
+int  _dbus_message_get_size          (DBusMessage       *message);
+void _dbus_message_get_unix_fds      (DBusMessage       *message,
+                                      const int        **fds,
+                                      unsigned          *n_fds);
+unsigned _dbus_message_get_n_unix_fds (DBusMessage      *message);
+dbus_bool_t _dbus_message_get_path_view (DBusMessage         *message,
+                                         const DBusPathView **view);
 
 void        _dbus_message_lock                  (DBusMessage  *message);
 void        _dbus_message_unlock                (DBusMessage  *message);
@@ -56,6 +65,12 @@ void               _dbus_message_loader_get_buffer            (DBusMessageLoader
 void               _dbus_message_loader_return_buffer         (DBusMessageLoader  *loader,
                                                                DBusString         *buffer,
                                                                int                 bytes_read);
+dbus_bool_t        _dbus_message_loader_get_unix_fds          (DBusMessageLoader  *loader,
+                                                               int               **fds,
+                                                               unsigned           *max_n_fds);
+void               _dbus_message_loader_return_unix_fds       (DBusMessageLoader  *loader,
+                                                               int                *fds,
+                                                               unsigned            n_fds);
 dbus_bool_t        _dbus_message_loader_queue_messages        (DBusMessageLoader  *loader);
 DBusMessage*       _dbus_message_loader_peek_message          (DBusMessageLoader  *loader);
 DBusMessage*       _dbus_message_loader_pop_message           (DBusMessageLoader  *loader);
@@ -68,6 +83,9 @@ dbus_bool_t        _dbus_message_loader_get_is_corrupted      (DBusMessageLoader
 void               _dbus_message_loader_set_max_message_size  (DBusMessageLoader  *loader,
                                                                long                size);
 long               _dbus_message_loader_get_max_message_size  (DBusMessageLoader  *loader);
+void               _dbus_message_loader_set_max_message_unix_fds (DBusMessageLoader  *loader,
+                                                                  long                n);
+long               _dbus_message_loader_get_max_message_unix_fds (DBusMessageLoader  *loader);
 
 DBUS_END_DECLS
 
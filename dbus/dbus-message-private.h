@@ -65,6 +65,9 @@ struct DBusMessageLoader
 
   DBusList *messages;  /**< Complete messages. */
 
+  DBusMessage *partial; /**< Message whose body is being read in place, or #NULL */
+  int partial_body_len; /**< Body length claimed by the partial message's header */
+
   long max_message_size; /**< Maximum size of a message */
 
   unsigned int buffer_outstanding : 1; /**< Someone is using the buffer to read */
@@ -72,12 +75,31 @@ struct DBusMessageLoader
   unsigned int corrupted : 1; /**< We got broken data, and are no longer working */
 
   DBusValidity corruption_reason; /**< why we were corrupted */
+
+  long max_message_unix_fds; /**< Maximum unix fds in a message */
+
+#ifdef HAVE_UNIX_FD_PASSING
+  unsigned int unix_fds_outstanding : 1; /**< Someone is using the unix fd array to read */
+
+  int *unix_fds; /**< File descriptors that have been read from the transport but haven't been attached to any message yet */
+  unsigned n_unix_fds; /**< Number of valid file descriptors in array */
+  unsigned n_unix_fds_allocated; /**< Number of file descriptors this array has space for */
+#endif
 };
 
 
 /** How many bits are in the changed_stamp used to validate iterators */
 #define CHANGED_STAMP_BITS 21
 
+/** Header bytes stored in the DBusMessage allocation itself; enough for a typical method call */
+#define MESSAGE_INLINE_HEADER_SIZE 256
+
+/** Body bytes stored in the DBusMessage allocation itself */
+#define MESSAGE_INLINE_BODY_SIZE 128
+
+/** Path components whose offsets fit in the DBusMessage allocation itself */
+#define MESSAGE_INLINE_PATH_COMPONENTS 15
+
 /**
  * @brief Internals of DBusMessage
  *
@@ -97,12 +119,17 @@ struct DBusMessage
 
   unsigned int locked : 1; /**< Message being sent, no modifications allowed. */
 
+  unsigned int path_view_valid : 1; /**< path_view describes the current path field */
+
 #ifndef DBUS_DISABLE_CHECKS
   unsigned int in_cache : 1; /**< Has been "freed" since it's in the cache (this is a debug feature) */
 #endif
   
   DBusList *size_counters;   /**< 0-N DBusCounter used to track message size. */
   long size_counter_delta;   /**< Size we incremented the size counters by.   */
+#ifdef HAVE_UNIX_FD_PASSING
+  long unix_fd_counter_delta; /**< Number of unix fds we incremented the size counters by. */
+#endif
 
   dbus_uint32_t changed_stamp : CHANGED_STAMP_BITS; /**< Incremented when iterators are invalidated. */
 
@@ -111,6 +138,22 @@ struct DBusMessage
 #ifndef DBUS_DISABLE_CHECKS
   int generation; /**< _dbus_current_generation when message was created */
 #endif
+
+#ifdef HAVE_UNIX_FD_PASSING
+  int *unix_fds; /**< Unix file descriptors associated with this message; closed when the message is freed, so they are always dup()ed on the way in and out */
+  unsigned n_unix_fds; /**< Number of valid fds in the array */
+  unsigned n_unix_fds_allocated; /**< Allocated size of the array */
+#endif
+
+  DBusString borrowed; /**< Caller-owned array elements that follow body on the wire, see dbus_message_iter_append_borrowed_array() */
+  DBusFreeFunction borrowed_free_function; /**< Called once the message is done with borrowed */
+  void *borrowed_free_data; /**< Data passed to borrowed_free_function */
+
+  unsigned char inline_header[MESSAGE_INLINE_HEADER_SIZE]; /**< header.data until it outgrows it */
+  DBusPathView path_view; /**< Components of the path, if path_view_valid */
+  int inline_path_starts[MESSAGE_INLINE_PATH_COMPONENTS + 1]; /**< path_view.starts for paths that aren't deep */
+
+  unsigned char inline_body[MESSAGE_INLINE_BODY_SIZE]; /**< body until it outgrows it */
 };
 
 dbus_bool_t _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
@@ -27,6 +27,9 @@
 #include "dbus-message-private.h"
 #include "dbus-marshal-recursive.h"
 #include "dbus-string.h"
+#ifdef HAVE_UNIX_FD_PASSING
+#include "dbus-sysdeps-unix.h"
+#endif
 
 /**
  * @addtogroup DBusMessage
@@ -889,6 +892,587 @@ verify_test_message (DBusMessage *message)
     _dbus_assert_not_reached ("Didn't reach end of arguments");
 }
 
+/* Reads done by the socket transport are at most this big */
+#define LOADER_TEST_READ_SIZE 2048
+
+static DBusMessage*
+new_byte_array_message (int n_bytes)
+{
+  DBusMessage *message;
+  unsigned char *bytes;
+  int i;
+
+  bytes = dbus_malloc (n_bytes);
+  if (bytes == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  for (i = 0; i < n_bytes; i++)
+    bytes[i] = i & 0xff;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &bytes, n_bytes,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("out of memory");
+
+  dbus_free (bytes);
+
+  _dbus_message_set_serial (message, 1);
+  _dbus_message_lock (message);
+
+  return message;
+}
+
+static void
+append_message_to_stream (DBusMessage *message,
+                          DBusString  *stream)
+{
+  if (!_dbus_string_copy (&message->header.data, 0, stream,
+                          _dbus_string_get_length (stream)) ||
+      !_dbus_string_copy (&message->body, 0, stream,
+                          _dbus_string_get_length (stream)))
+    _dbus_assert_not_reached ("out of memory");
+}
+
+/* Feeds the stream to the loader the way the socket transport would
+ * and returns the loaded messages, up to max_messages of them are
+ * stored in messages and the rest are dropped.
+ */
+static int
+load_stream (const DBusString  *stream,
+             DBusMessage      **messages,
+             int                max_messages)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  int pos, len, n;
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  n = 0;
+  for (pos = 0; pos < _dbus_string_get_length (stream); pos += len)
+    {
+      DBusString *buffer;
+
+      len = MIN (LOADER_TEST_READ_SIZE,
+                 _dbus_string_get_length (stream) - pos);
+
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      if (!_dbus_string_copy_len (stream, pos, len, buffer,
+                                  _dbus_string_get_length (buffer)))
+        _dbus_assert_not_reached ("out of memory");
+      _dbus_message_loader_return_buffer (loader, buffer, len);
+
+      if (!_dbus_message_loader_queue_messages (loader))
+        _dbus_assert_not_reached ("no memory to queue messages");
+      if (_dbus_message_loader_get_is_corrupted (loader))
+        _dbus_assert_not_reached ("message loader corrupted");
+
+      while ((message = _dbus_message_loader_pop_message (loader)) != NULL)
+        {
+          if (n < max_messages)
+            messages[n] = message;
+          else
+            dbus_message_unref (message);
+          n += 1;
+        }
+    }
+
+  _dbus_message_loader_unref (loader);
+
+  return n;
+}
+
+/* Large bodies are read in place; make sure the bytes that follow
+ * them in the same read still end up in the next message.
+ */
+static void
+check_large_body_loading (void)
+{
+  DBusMessage *sent[4];
+  DBusMessage *received[4];
+  DBusString stream;
+  int i;
+
+  sent[0] = new_byte_array_message (64 * 1024);
+  sent[1] = new_byte_array_message (16);
+  sent[2] = new_byte_array_message (5000);
+  sent[3] = new_byte_array_message (64 * 1024 + 3);
+
+  if (!_dbus_string_init (&stream))
+    _dbus_assert_not_reached ("out of memory");
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (sent); i++)
+    append_message_to_stream (sent[i], &stream);
+
+  if (load_stream (&stream, received, _DBUS_N_ELEMENTS (received)) !=
+      _DBUS_N_ELEMENTS (received))
+    _dbus_assert_not_reached ("wrong number of messages loaded");
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (sent); i++)
+    {
+      if (!_dbus_string_equal (&sent[i]->body, &received[i]->body))
+        _dbus_assert_not_reached ("loaded message has the wrong body");
+
+      dbus_message_unref (sent[i]);
+      dbus_message_unref (received[i]);
+    }
+
+  _dbus_string_free (&stream);
+}
+
+static void
+count_borrowed_free (void *data)
+{
+  int *n_frees = data;
+
+  *n_frees += 1;
+}
+
+static DBusMessage*
+new_borrowed_array_message (const double *array,
+                            int           n_elements,
+                            int          *n_frees)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
+  dbus_int32_t v_INT32 = 42;
+
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "TestMethod");
+  if (message == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  /* The int32 leaves the array's elements needing padding */
+  dbus_message_iter_init_append (message, &iter);
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_INT32, &v_INT32) ||
+      !dbus_message_iter_append_borrowed_array (&iter, DBUS_TYPE_DOUBLE,
+                                                &array, n_elements,
+                                                count_borrowed_free, n_frees))
+    _dbus_assert_not_reached ("out of memory");
+
+  return message;
+}
+
+static void
+check_borrowed_arrays (void)
+{
+  DBusMessage *message;
+  DBusMessage *appended;
+  DBusMessage *copy;
+  DBusMessage *loaded;
+  DBusString stream;
+  const DBusString *header;
+  const DBusString *body;
+  const DBusString *borrowed;
+  double array[1000];
+  const double *v_ARRAY_DOUBLE = array;
+  const double *read_array;
+  dbus_int32_t v_INT32 = 42;
+  int n_read;
+  int n_frees;
+  int i;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (array); i++)
+    array[i] = i * 0.5;
+
+  appended = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                           "/org/freedesktop/TestPath",
+                                           "Foo.TestInterface",
+                                           "TestMethod");
+  if (appended == NULL ||
+      !dbus_message_append_args (appended,
+                                 DBUS_TYPE_INT32, &v_INT32,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_DOUBLE,
+                                 &v_ARRAY_DOUBLE, _DBUS_N_ELEMENTS (array),
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("out of memory");
+
+  _dbus_message_set_serial (appended, 1);
+  _dbus_message_lock (appended);
+
+  /* On the wire it's the same as a copied array, and the array is
+   * only released with the message
+   */
+  n_frees = 0;
+  message = new_borrowed_array_message (array, _DBUS_N_ELEMENTS (array),
+                                        &n_frees);
+  _dbus_message_set_serial (message, 1);
+  _dbus_message_lock (message);
+
+  _dbus_message_get_network_data (message, &header, &body, &borrowed);
+  if (_dbus_string_get_length (borrowed) != sizeof (array))
+    _dbus_assert_not_reached ("borrowed array was copied into the body");
+
+  if (!_dbus_string_init (&stream))
+    _dbus_assert_not_reached ("out of memory");
+
+  if (!_dbus_string_copy (header, 0, &stream, 0) ||
+      !_dbus_string_copy (body, 0, &stream, _dbus_string_get_length (&stream)) ||
+      !_dbus_string_copy (borrowed, 0, &stream, _dbus_string_get_length (&stream)))
+    _dbus_assert_not_reached ("out of memory");
+
+  if (load_stream (&stream, &loaded, 1) != 1)
+    _dbus_assert_not_reached ("message with borrowed array didn't load");
+
+  if (!_dbus_string_equal (&loaded->header.data, &appended->header.data) ||
+      !_dbus_string_equal (&loaded->body, &appended->body))
+    _dbus_assert_not_reached ("message with borrowed array is different on the wire");
+
+  dbus_message_unref (loaded);
+  _dbus_string_free (&stream);
+
+  /* Copies don't borrow */
+  copy = dbus_message_copy (message);
+  if (copy == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  if (!_dbus_string_equal (&copy->body, &appended->body))
+    _dbus_assert_not_reached ("copy of message with borrowed array has the wrong body");
+
+  if (n_frees != 0)
+    _dbus_assert_not_reached ("borrowed array released before the message");
+
+  dbus_message_unref (message);
+
+  if (n_frees != 1)
+    _dbus_assert_not_reached ("borrowed array not released with the message");
+
+  dbus_message_unref (copy);
+
+  /* Reading the arguments before sending takes the array in early */
+  n_frees = 0;
+  message = new_borrowed_array_message (array, _DBUS_N_ELEMENTS (array),
+                                        &n_frees);
+
+  if (!dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_INT32, &v_INT32,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_DOUBLE,
+                              &read_array, &n_read,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("couldn't read message with borrowed array");
+
+  if (n_frees != 1 || n_read != _DBUS_N_ELEMENTS (array) ||
+      read_array == array ||
+      memcmp (read_array, array, sizeof (array)) != 0)
+    _dbus_assert_not_reached ("borrowed array wasn't taken into the message");
+
+  dbus_message_unref (message);
+  dbus_message_unref (appended);
+
+  if (n_frees != 1)
+    _dbus_assert_not_reached ("borrowed array released twice");
+}
+
+static void
+loader_benchmark (int body_len,
+                  int n_messages)
+{
+  DBusMessage *message;
+  DBusString stream;
+  long start_sec, start_usec, end_sec, end_usec;
+  double usec;
+  int i;
+
+  message = new_byte_array_message (body_len);
+
+  if (!_dbus_string_init (&stream))
+    _dbus_assert_not_reached ("out of memory");
+
+  for (i = 0; i < n_messages; i++)
+    append_message_to_stream (message, &stream);
+
+  dbus_message_unref (message);
+
+  _dbus_get_current_time (&start_sec, &start_usec);
+
+  if (load_stream (&stream, NULL, 0) != n_messages)
+    _dbus_assert_not_reached ("wrong number of messages loaded");
+
+  _dbus_get_current_time (&end_sec, &end_usec);
+
+  usec = (end_sec - start_sec) * 1000000.0 + (end_usec - start_usec);
+  if (usec < 1)
+    usec = 1;
+
+  printf ("  loaded %d messages with %d byte bodies: %.0f messages/s, %.1f MB/s\n",
+          n_messages, body_len, n_messages * 1000000.0 / usec,
+          _dbus_string_get_length (&stream) / usec);
+
+  _dbus_string_free (&stream);
+}
+
+/* Messages are created in batches so the message cache, which holds
+ * only a few messages, doesn't hide the cost of creating them.
+ */
+#define MESSAGE_BENCHMARK_BATCH 32
+
+static void
+message_benchmark (int n_batches)
+{
+  DBusMessage *messages[MESSAGE_BENCHMARK_BATCH];
+  long start_sec, start_usec, end_sec, end_usec;
+  int start_allocs;
+  double usec;
+  int i, j;
+
+  start_allocs = _dbus_get_fail_alloc_counter ();
+  _dbus_get_current_time (&start_sec, &start_usec);
+
+  for (i = 0; i < n_batches; i++)
+    {
+      for (j = 0; j < MESSAGE_BENCHMARK_BATCH; j++)
+        {
+          const char *v_STRING = "Hello";
+          dbus_int32_t v_INT32 = j;
+
+          messages[j] = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                                      "/org/freedesktop/TestPath",
+                                                      "Foo.TestInterface",
+                                                      "TestMethod");
+          if (messages[j] == NULL ||
+              !dbus_message_append_args (messages[j],
+                                         DBUS_TYPE_STRING, &v_STRING,
+                                         DBUS_TYPE_INT32, &v_INT32,
+                                         DBUS_TYPE_INVALID))
+            _dbus_assert_not_reached ("out of memory");
+
+          /* what dbus_connection_send() does to the message */
+          _dbus_message_set_serial (messages[j], j + 1);
+          _dbus_message_lock (messages[j]);
+        }
+
+      for (j = 0; j < MESSAGE_BENCHMARK_BATCH; j++)
+        dbus_message_unref (messages[j]);
+    }
+
+  _dbus_get_current_time (&end_sec, &end_usec);
+
+  usec = (end_sec - start_sec) * 1000000.0 + (end_usec - start_usec);
+  if (usec < 1)
+    usec = 1;
+
+  printf ("  created, filled, locked and freed %d small messages: %.0f messages/s, %.2f allocations per message\n",
+          n_batches * MESSAGE_BENCHMARK_BATCH,
+          n_batches * MESSAGE_BENCHMARK_BATCH * 1000000.0 / usec,
+          (start_allocs - _dbus_get_fail_alloc_counter ()) /
+          (double) (n_batches * MESSAGE_BENCHMARK_BATCH));
+}
+
+static DBusMessage*
+new_template_prototype (void)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  if (message == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  return message;
+}
+
+static void
+check_same_as_appended (DBusMessage *from_template,
+                        DBusMessage *appended)
+{
+  _dbus_message_set_serial (from_template, 1);
+  _dbus_message_lock (from_template);
+  _dbus_message_set_serial (appended, 1);
+  _dbus_message_lock (appended);
+
+  if (!_dbus_string_equal (&from_template->header.data, &appended->header.data))
+    _dbus_assert_not_reached ("message from template has the wrong header");
+
+  if (!_dbus_string_equal (&from_template->body, &appended->body))
+    _dbus_assert_not_reached ("message from template has the wrong body");
+
+  dbus_message_unref (from_template);
+  dbus_message_unref (appended);
+}
+
+static void
+check_message_templates (void)
+{
+  DBusMessageTemplate *tmpl;
+  DBusMessage *message;
+  DBusMessage *appended;
+  unsigned char v_BYTE = 42;
+  dbus_bool_t v_BOOLEAN = TRUE;
+  dbus_int16_t v_INT16 = -16;
+  dbus_int32_t v_INT32 = -32;
+  dbus_uint64_t v_UINT64 = 64;
+  double v_DOUBLE = 3.14159;
+  const char *v_STRING = "Hello";
+  const char *strings[] = { "one", "two", "three" };
+  const char **v_ARRAY_STRING = strings;
+  const dbus_int32_t ints[] = { 1, 2, 3, 4 };
+  const dbus_int32_t *v_ARRAY_INT32 = ints;
+  int i;
+
+  /* Fixed layout, with padding between most of the arguments */
+  message = new_template_prototype ();
+  tmpl = dbus_message_template_new (message, "ybnitd");
+  dbus_message_unref (message);
+  if (tmpl == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  for (i = 0; i < 3; i++)
+    {
+      v_INT32 = i;
+
+      message = dbus_message_template_instantiate (tmpl,
+                                                   DBUS_TYPE_BYTE, &v_BYTE,
+                                                   DBUS_TYPE_BOOLEAN, &v_BOOLEAN,
+                                                   DBUS_TYPE_INT16, &v_INT16,
+                                                   DBUS_TYPE_INT32, &v_INT32,
+                                                   DBUS_TYPE_UINT64, &v_UINT64,
+                                                   DBUS_TYPE_DOUBLE, &v_DOUBLE,
+                                                   DBUS_TYPE_INVALID);
+      appended = new_template_prototype ();
+      if (message == NULL ||
+          !dbus_message_append_args (appended,
+                                     DBUS_TYPE_BYTE, &v_BYTE,
+                                     DBUS_TYPE_BOOLEAN, &v_BOOLEAN,
+                                     DBUS_TYPE_INT16, &v_INT16,
+                                     DBUS_TYPE_INT32, &v_INT32,
+                                     DBUS_TYPE_UINT64, &v_UINT64,
+                                     DBUS_TYPE_DOUBLE, &v_DOUBLE,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("out of memory");
+
+      check_same_as_appended (message, appended);
+    }
+
+  dbus_message_template_free (tmpl);
+
+  /* Strings and arrays go through the type writer */
+  message = new_template_prototype ();
+  tmpl = dbus_message_template_new (message, "sasaiy");
+  dbus_message_unref (message);
+  if (tmpl == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  for (i = 0; i < 3; i++)
+    {
+      message = dbus_message_template_instantiate (tmpl,
+                                                   DBUS_TYPE_STRING, &v_STRING,
+                                                   DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                                   &v_ARRAY_STRING, i,
+                                                   DBUS_TYPE_ARRAY, DBUS_TYPE_INT32,
+                                                   &v_ARRAY_INT32, i + 1,
+                                                   DBUS_TYPE_BYTE, &v_BYTE,
+                                                   DBUS_TYPE_INVALID);
+      appended = new_template_prototype ();
+      if (message == NULL ||
+          !dbus_message_append_args (appended,
+                                     DBUS_TYPE_STRING, &v_STRING,
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                     &v_ARRAY_STRING, i,
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_INT32,
+                                     &v_ARRAY_INT32, i + 1,
+                                     DBUS_TYPE_BYTE, &v_BYTE,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("out of memory");
+
+      check_same_as_appended (message, appended);
+    }
+
+  dbus_message_template_free (tmpl);
+
+  /* No arguments at all */
+  message = new_template_prototype ();
+  tmpl = dbus_message_template_new (message, "");
+  dbus_message_unref (message);
+  if (tmpl == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  message = dbus_message_template_instantiate (tmpl, DBUS_TYPE_INVALID);
+  if (message == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  check_same_as_appended (message, new_template_prototype ());
+
+  dbus_message_template_free (tmpl);
+}
+
+static void
+template_benchmark (int n_batches)
+{
+  DBusMessage *messages[MESSAGE_BENCHMARK_BATCH];
+  DBusMessageTemplate *tmpl;
+  long start_sec, start_usec, end_sec, end_usec;
+  double usec[2];
+  int round;
+  int i, j;
+
+  messages[0] = new_template_prototype ();
+  tmpl = dbus_message_template_new (messages[0], "ud");
+  dbus_message_unref (messages[0]);
+  if (tmpl == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  for (round = 0; round < 2; round++)
+    {
+      _dbus_get_current_time (&start_sec, &start_usec);
+
+      for (i = 0; i < n_batches; i++)
+        {
+          for (j = 0; j < MESSAGE_BENCHMARK_BATCH; j++)
+            {
+              dbus_uint32_t v_UINT32 = j;
+              double v_DOUBLE = j / 2.0;
+
+              if (round == 0)
+                {
+                  messages[j] = new_template_prototype ();
+                  if (!dbus_message_append_args (messages[j],
+                                                 DBUS_TYPE_UINT32, &v_UINT32,
+                                                 DBUS_TYPE_DOUBLE, &v_DOUBLE,
+                                                 DBUS_TYPE_INVALID))
+                    _dbus_assert_not_reached ("out of memory");
+                }
+              else
+                {
+                  messages[j] = dbus_message_template_instantiate (tmpl,
+                                                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                                                   DBUS_TYPE_DOUBLE, &v_DOUBLE,
+                                                                   DBUS_TYPE_INVALID);
+                  if (messages[j] == NULL)
+                    _dbus_assert_not_reached ("out of memory");
+                }
+
+              _dbus_message_set_serial (messages[j], j + 1);
+              _dbus_message_lock (messages[j]);
+            }
+
+          for (j = 0; j < MESSAGE_BENCHMARK_BATCH; j++)
+            dbus_message_unref (messages[j]);
+        }
+
+      _dbus_get_current_time (&end_sec, &end_usec);
+
+      usec[round] = (end_sec - start_sec) * 1000000.0 + (end_usec - start_usec);
+      if (usec[round] < 1)
+        usec[round] = 1;
+    }
+
+  dbus_message_template_free (tmpl);
+
+  printf ("  created %d signals: %.0f messages/s with dbus_message_append_args(), %.0f messages/s from a template\n",
+          n_batches * MESSAGE_BENCHMARK_BATCH,
+          n_batches * MESSAGE_BENCHMARK_BATCH * 1000000.0 / usec[0],
+          n_batches * MESSAGE_BENCHMARK_BATCH * 1000000.0 / usec[1]);
+}
+
 /**
  * @ingroup DBusMessageInternals
  * Unit test for DBusMessage.
@@ -1227,6 +1811,158 @@ _dbus_message_test (const char *test_data_dir)
 
   check_memleaks ();
 
+#ifdef HAVE_UNIX_FD_PASSING
+  /* Unix fd test: the fds travel beside the byte stream, so feed
+   * them to the loader by hand as the socket transport would
+   */
+  {
+    int fd1, fd2, fd;
+    int *loader_fds;
+    unsigned n_loader_fds;
+    const int *message_fds;
+    unsigned n_message_fds;
+    DBusString *buffer;
+    DBusString byte;
+    DBusString got;
+    DBusCounter *counter;
+
+    if (!_dbus_full_duplex_pipe (&fd1, &fd2, TRUE, NULL))
+      _dbus_assert_not_reached ("could not create socket pair");
+
+    message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                       "Foo.TestInterface",
+                                       "TestSignal");
+    if (message == NULL ||
+        !dbus_message_append_args (message,
+                                   DBUS_TYPE_UNIX_FD, &fd1,
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("out of memory");
+
+    _dbus_assert (dbus_message_contains_unix_fds (message));
+    _dbus_assert (strcmp (dbus_message_get_signature (message),
+                          DBUS_TYPE_UNIX_FD_AS_STRING) == 0);
+
+    copy = dbus_message_copy (message);
+    if (copy == NULL)
+      _dbus_assert_not_reached ("out of memory");
+    _dbus_assert (dbus_message_contains_unix_fds (copy));
+    dbus_message_unref (copy);
+
+    _dbus_message_set_serial (message, 1);
+    _dbus_message_lock (message);
+    _dbus_message_get_unix_fds (message, &message_fds, &n_message_fds);
+    _dbus_assert (n_message_fds == 1);
+
+    /* First without the fd: the loader must notice it is missing */
+    loader = _dbus_message_loader_new ();
+    if (loader == NULL)
+      _dbus_assert_not_reached ("out of memory");
+
+    _dbus_message_loader_get_buffer (loader, &buffer);
+    if (!_dbus_string_copy (&message->header.data, 0, buffer, 0) ||
+        !_dbus_string_copy (&message->body, 0, buffer,
+                            _dbus_string_get_length (buffer)))
+      _dbus_assert_not_reached ("out of memory");
+    _dbus_message_loader_return_buffer (loader, buffer,
+                                        _dbus_string_get_length (buffer));
+
+    if (!_dbus_message_loader_queue_messages (loader))
+      _dbus_assert_not_reached ("no memory to queue messages");
+    _dbus_assert (_dbus_message_loader_get_is_corrupted (loader));
+    _dbus_assert (loader->corruption_reason == DBUS_INVALID_MISSING_UNIX_FDS);
+    _dbus_message_loader_unref (loader);
+
+    /* Then with it */
+    loader = _dbus_message_loader_new ();
+    if (loader == NULL)
+      _dbus_assert_not_reached ("out of memory");
+
+    _dbus_message_loader_get_buffer (loader, &buffer);
+    if (!_dbus_string_copy (&message->header.data, 0, buffer, 0) ||
+        !_dbus_string_copy (&message->body, 0, buffer,
+                            _dbus_string_get_length (buffer)))
+      _dbus_assert_not_reached ("out of memory");
+    _dbus_message_loader_return_buffer (loader, buffer,
+                                        _dbus_string_get_length (buffer));
+
+    if (!_dbus_message_loader_get_unix_fds (loader, &loader_fds, &n_loader_fds))
+      _dbus_assert_not_reached ("out of memory");
+    _dbus_assert (n_loader_fds >= 1);
+    loader_fds[0] = _dbus_dup (message_fds[0], NULL);
+    _dbus_assert (loader_fds[0] >= 0);
+    _dbus_message_loader_return_unix_fds (loader, loader_fds, 1);
+
+    dbus_message_unref (message);
+
+    if (!_dbus_message_loader_queue_messages (loader))
+      _dbus_assert_not_reached ("no memory to queue messages");
+    _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+
+    message = _dbus_message_loader_pop_message (loader);
+    _dbus_assert (message != NULL);
+    _dbus_assert (dbus_message_contains_unix_fds (message));
+
+    fd = -1;
+    if (!dbus_message_get_args (message, NULL,
+                                DBUS_TYPE_UNIX_FD, &fd,
+                                DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("could not read fd back");
+    _dbus_assert (fd >= 0 && fd != fd1);
+
+    /* The transport limits fds held by live messages through this */
+    counter = _dbus_counter_new ();
+    if (counter == NULL ||
+        !_dbus_message_add_size_counter (message, counter))
+      _dbus_assert_not_reached ("out of memory");
+    _dbus_assert (_dbus_counter_get_unix_fd_value (counter) == 1);
+
+    dbus_message_unref (message);
+    _dbus_assert (_dbus_counter_get_unix_fd_value (counter) == 0);
+    _dbus_counter_unref (counter);
+    _dbus_message_loader_unref (loader);
+
+    /* What we got back must still be our end of the pair */
+    _dbus_string_init_const (&byte, "x");
+    if (_dbus_write (fd, &byte, 0, 1) != 1)
+      _dbus_assert_not_reached ("could not write through received fd");
+    if (!_dbus_string_init (&got))
+      _dbus_assert_not_reached ("out of memory");
+    if (_dbus_read (fd2, &got, 1) != 1 ||
+        _dbus_string_get_byte (&got, 0) != 'x')
+      _dbus_assert_not_reached ("received fd is not the one we sent");
+    _dbus_string_free (&got);
+
+    _dbus_close (fd, NULL);
+    _dbus_close (fd1, NULL);
+    _dbus_close (fd2, NULL);
+  }
+
+  check_memleaks ();
+#endif
+
+  check_large_body_loading ();
+
+  check_memleaks ();
+
+  check_borrowed_arrays ();
+
+  check_memleaks ();
+
+  printf ("Loader throughput:\n");
+  loader_benchmark (64, 20000);
+  loader_benchmark (4096, 2000);
+  loader_benchmark (64 * 1024, 200);
+
+  printf ("Message construction:\n");
+  message_benchmark (500);
+
+  check_message_templates ();
+
+  printf ("Message templates:\n");
+  template_benchmark (500);
+
+  check_memleaks ();
+
   /* Load all the sample messages from the message factory */
   {
     DBusMessageDataIter diter;
@@ -33,6 +33,9 @@
 #include "dbus-memory.h"
 #include "dbus-list.h"
 #include "dbus-threads-internal.h"
+#ifdef HAVE_UNIX_FD_PASSING
+#include "dbus-sysdeps-unix.h"
+#endif
 #include <string.h>
 
 static void dbus_message_finalize (DBusMessage *message);
@@ -140,23 +143,160 @@ _dbus_message_byteswap (DBusMessage *message)
 
 /**
  * Gets the data to be sent over the network for this message.
- * The header and then the body should be written out.
+ * The header, then the body, then the borrowed array data should be
+ * written out; the borrowed data is empty unless the message has an
+ * array appended with dbus_message_iter_append_borrowed_array().
  * This function is guaranteed to always return the same
  * data once a message is locked (with _dbus_message_lock()).
  *
  * @param message the message.
  * @param header return location for message header data.
  * @param body return location for message body data.
+ * @param borrowed return location for borrowed data that follows the body.
  */
 void
 _dbus_message_get_network_data (DBusMessage          *message,
                                 const DBusString    **header,
-                                const DBusString    **body)
+                                const DBusString    **body,
+                                const DBusString    **borrowed)
 {
   _dbus_assert (message->locked);
 
   *header = &message->header.data;
   *body = &message->body;
+  *borrowed = &message->borrowed;
+}
+
+/**
+ * Gets the number of bytes the message takes up on the wire: header,
+ * body and any borrowed data. Unlike _dbus_message_get_network_data()
+ * this works on an unlocked message, where it may be off by the
+ * header padding.
+ *
+ * @param message the message.
+ * @returns size in bytes
+ */
+int
+_dbus_message_get_size (DBusMessage *message)
+{
+  return _dbus_string_get_length (&message->header.data) +
+    _dbus_string_get_length (&message->body) +
+    _dbus_string_get_length (&message->borrowed);
+}
+
+/**
+ * Gets the unix fds to be sent over the network for this message.
+ * This function is guaranteed to always return the same data once a
+ * message is locked (with _dbus_message_lock()).
+ *
+ * @param message the message.
+ * @param fds return location of unix fd array
+ * @param n_fds return number of entries in array
+ */
+void
+_dbus_message_get_unix_fds (DBusMessage *message,
+                            const int  **fds,
+                            unsigned    *n_fds)
+{
+  _dbus_assert (message->locked);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  *fds = message->unix_fds;
+  *n_fds = message->n_unix_fds;
+#else
+  *fds = NULL;
+  *n_fds = 0;
+#endif
+}
+
+/**
+ * Gets the number of unix fds the message carries. Unlike
+ * _dbus_message_get_unix_fds(), this works on messages that are not
+ * locked yet, such as those just read by the loader.
+ *
+ * @param message the message.
+ * @returns the number of unix fds
+ */
+unsigned
+_dbus_message_get_n_unix_fds (DBusMessage *message)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  return message->n_unix_fds;
+#else
+  return 0;
+#endif
+}
+
+/* Forgets the cached split of the message's path */
+static void
+invalidate_path_view (DBusMessage *message)
+{
+  if (message->path_view.starts != message->inline_path_starts)
+    dbus_free ((int *) message->path_view.starts);
+
+  message->path_view.starts = message->inline_path_starts;
+  message->path_view_valid = FALSE;
+}
+
+/**
+ * Gets the object path of the message split into its components,
+ * without copying them. The split is cached on the message, so
+ * dispatching the same message to several object trees only does it
+ * once, and only paths deeper than #MESSAGE_INLINE_PATH_COMPONENTS
+ * allocate.
+ *
+ * Like dbus_message_get_path(), the view becomes invalid if the
+ * message is modified.
+ *
+ * @param message the message
+ * @param view return location for the view, set to #NULL if the message has no path
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_message_get_path_view (DBusMessage         *message,
+                             const DBusPathView **view)
+{
+  const char *path;
+
+  *view = NULL;
+
+  path = dbus_message_get_path (message);
+  if (path == NULL)
+    return TRUE;
+
+  if (!message->path_view_valid)
+    {
+      int *starts;
+      int len;
+      int n_components;
+
+      len = strlen (path);
+      n_components = _dbus_path_count_components (path, len);
+
+      _dbus_assert (message->path_view.starts == message->inline_path_starts);
+
+      if (n_components > MESSAGE_INLINE_PATH_COMPONENTS)
+        {
+          starts = dbus_new (int, n_components + 1);
+          if (starts == NULL)
+            return FALSE;
+        }
+      else
+        starts = message->inline_path_starts;
+
+      _dbus_path_find_components (path, len, starts);
+
+      message->path_view.starts = starts;
+      message->path_view.components = NULL;
+      message->path_view.n_components = n_components;
+      message->path_view_valid = TRUE;
+    }
+
+  /* the header may have been reallocated since the split */
+  message->path_view.data = path;
+  *view = &message->path_view;
+
+  return TRUE;
 }
 
 /**
@@ -181,6 +321,8 @@ _dbus_message_set_serial (DBusMessage   *message,
  * Adds a counter to be incremented immediately with the
  * size of this message, and decremented by the size
  * of this message when this message if finalized.
+ * The counter's unix fd count goes up and down in the same way
+ * with the number of unix fds in the message.
  * The link contains a counter with its refcount already
  * incremented, but the counter itself not incremented.
  * Ownership of link and counter refcount is passed to
@@ -203,7 +345,12 @@ _dbus_message_add_size_counter_link (DBusMessage  *message,
     {
       message->size_counter_delta =
         _dbus_string_get_length (&message->header.data) +
-        _dbus_string_get_length (&message->body);
+        _dbus_string_get_length (&message->body) +
+        _dbus_string_get_length (&message->borrowed);
+
+#ifdef HAVE_UNIX_FD_PASSING
+      message->unix_fd_counter_delta = message->n_unix_fds;
+#endif
 
 #if 0
       _dbus_verbose ("message has size %ld\n",
@@ -214,6 +361,9 @@ _dbus_message_add_size_counter_link (DBusMessage  *message,
   _dbus_list_append_link (&message->size_counters, link);
 
   _dbus_counter_adjust (link->data, message->size_counter_delta);
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_counter_adjust_unix_fd (link->data, message->unix_fd_counter_delta);
+#endif
 }
 
 /**
@@ -268,6 +418,9 @@ _dbus_message_remove_size_counter (DBusMessage  *message,
     _dbus_list_free_link (link);
 
   _dbus_counter_adjust (counter, - message->size_counter_delta);
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_counter_adjust_unix_fd (counter, - message->unix_fd_counter_delta);
+#endif
 
   _dbus_counter_unref (counter);
 }
@@ -287,7 +440,8 @@ _dbus_message_lock (DBusMessage  *message)
   if (!message->locked)
     {
       _dbus_header_update_lengths (&message->header,
-                                   _dbus_string_get_length (&message->body));
+                                   _dbus_string_get_length (&message->body) +
+                                   _dbus_string_get_length (&message->borrowed));
 
       /* must have a signature if you have a body */
       _dbus_assert (_dbus_string_get_length (&message->body) == 0 ||
@@ -402,6 +556,33 @@ _dbus_message_set_signature (DBusMessage *message,
  * mempool).
  */
 
+#ifdef HAVE_UNIX_FD_PASSING
+static void
+close_unix_fds (int      *fds,
+                unsigned *n_fds)
+{
+  DBusError e;
+  unsigned int i;
+
+  if (*n_fds <= 0)
+    return;
+
+  dbus_error_init (&e);
+
+  for (i = 0; i < *n_fds; i++)
+    {
+      if (!_dbus_close (fds[i], &e))
+        {
+          _dbus_warn ("Failed to close file descriptor: %s\n", e.message);
+          dbus_error_free (&e);
+        }
+    }
+
+  /* Keep the array itself around, a cached message may reuse it */
+  *n_fds = 0;
+}
+#endif
+
 /** Avoid caching huge messages */
 #define MAX_MESSAGE_SIZE_TO_CACHE 10 * _DBUS_ONE_KILOBYTE
 
@@ -498,10 +679,32 @@ free_size_counter (void *element,
   DBusMessage *message = data;
 
   _dbus_counter_adjust (counter, - message->size_counter_delta);
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_counter_adjust_unix_fd (counter, - message->unix_fd_counter_delta);
+#endif
 
   _dbus_counter_unref (counter);
 }
 
+/* Gives a borrowed array back to its owner. The message no longer
+ * has any use for it, or has just copied it into the body.
+ */
+static void
+release_borrowed (DBusMessage *message)
+{
+  DBusFreeFunction free_function;
+
+  free_function = message->borrowed_free_function;
+
+  _dbus_string_init_const (&message->borrowed, "");
+  message->borrowed_free_function = NULL;
+
+  if (free_function != NULL)
+    (* free_function) (message->borrowed_free_data);
+
+  message->borrowed_free_data = NULL;
+}
+
 /**
  * Tries to cache a message, otherwise finalize it.
  *
@@ -524,6 +727,15 @@ dbus_message_cache_or_finalize (DBusMessage *message)
                       free_size_counter, message);
   _dbus_list_clear (&message->size_counters);
 
+#ifdef HAVE_UNIX_FD_PASSING
+  close_unix_fds (message->unix_fds, &message->n_unix_fds);
+#endif
+
+  /* This calls application code too */
+  release_borrowed (message);
+
+  invalidate_path_view (message);
+
   was_cached = FALSE;
 
   _DBUS_LOCK (message_cache);
@@ -573,10 +785,14 @@ dbus_message_cache_or_finalize (DBusMessage *message)
  out:
   _DBUS_UNLOCK (message_cache);
 
-  _dbus_assert (message->refcount.value == 0);
-  
+  /* Once cached, another thread may already have taken the message
+   * back out of the cache and ref'd it, so it's not ours to check
+   */
   if (!was_cached)
-    dbus_message_finalize (message);
+    {
+      _dbus_assert (message->refcount.value == 0);
+      dbus_message_finalize (message);
+    }
 }
 
 #ifndef DBUS_DISABLE_CHECKS
@@ -669,7 +885,38 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
           goto out;
 	}
 
-      if (dbus_type_is_basic (spec_type))
+      if (spec_type == DBUS_TYPE_UNIX_FD)
+        {
+#ifdef HAVE_UNIX_FD_PASSING
+          DBusBasicValue idx;
+          int *pfd, nfd;
+
+          pfd = va_arg (var_args, int*);
+          _dbus_assert (pfd != NULL);
+
+          _dbus_type_reader_read_basic (&real->u.reader, &idx);
+
+          if (idx.u32 >= real->message->n_unix_fds)
+            {
+              dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                              "Message refers to file descriptor at index %u, "
+                              "but has only %u descriptors attached.\n",
+                              idx.u32,
+                              real->message->n_unix_fds);
+              goto out;
+            }
+
+          if ((nfd = _dbus_dup (real->message->unix_fds[idx.u32], error)) < 0)
+            goto out;
+
+          *pfd = nfd;
+#else
+          dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                          "Platform does not support file descriptor passing.\n");
+          goto out;
+#endif
+        }
+      else if (dbus_type_is_basic (spec_type))
         {
           DBusBasicValue *ptr;
 
@@ -703,7 +950,8 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
               goto out;
             }
 
-          if (dbus_type_is_fixed (spec_element_type))
+          if (dbus_type_is_fixed (spec_element_type) &&
+              element_type != DBUS_TYPE_UNIX_FD)
             {
               ptr = va_arg (var_args, const DBusBasicValue**);
               n_elements_p = va_arg (var_args, int*);
@@ -939,6 +1187,13 @@ dbus_message_finalize (DBusMessage *message)
   _dbus_header_free (&message->header);
   _dbus_string_free (&message->body);
 
+#ifdef HAVE_UNIX_FD_PASSING
+  close_unix_fds (message->unix_fds, &message->n_unix_fds);
+  dbus_free (message->unix_fds);
+#endif
+
+  invalidate_path_view (message);
+
   _dbus_assert (message->refcount.value == 0);
   
   dbus_free (message);
@@ -965,42 +1220,53 @@ dbus_message_new_empty_header (void)
 #ifndef DBUS_DISABLE_CHECKS
       message->generation = _dbus_current_generation;
 #endif
+
+#ifdef HAVE_UNIX_FD_PASSING
+      message->unix_fds = NULL;
+      message->n_unix_fds_allocated = 0;
+#endif
+
+      message->path_view.starts = message->inline_path_starts;
     }
   
   message->refcount.value = 1;
   message->byte_order = DBUS_COMPILER_BYTE_ORDER;
   message->locked = FALSE;
+  message->path_view_valid = FALSE;
 #ifndef DBUS_DISABLE_CHECKS
   message->in_cache = FALSE;
 #endif
   message->size_counters = NULL;
   message->size_counter_delta = 0;
   message->changed_stamp = 0;
+  _dbus_string_init_const (&message->borrowed, "");
+  message->borrowed_free_function = NULL;
+  message->borrowed_free_data = NULL;
+
+#ifdef HAVE_UNIX_FD_PASSING
+  message->n_unix_fds = 0;
+#endif
 
   if (!from_cache)
     _dbus_data_slot_list_init (&message->slot_list);
 
   if (from_cache)
     {
-      _dbus_header_reinit (&message->header, message->byte_order);
       _dbus_string_set_length (&message->body, 0);
     }
   else
     {
-      if (!_dbus_header_init (&message->header, message->byte_order))
-        {
-          dbus_free (message);
-          return NULL;
-        }
-
-      if (!_dbus_string_init_preallocated (&message->body, 32))
-        {
-          _dbus_header_free (&message->header);
-          dbus_free (message);
-          return NULL;
-        }
+      /* Small messages live entirely in the one allocation */
+      _dbus_string_init_in_place (&message->header.data,
+                                  message->inline_header,
+                                  sizeof (message->inline_header));
+      _dbus_string_init_in_place (&message->body,
+                                  message->inline_body,
+                                  sizeof (message->inline_body));
     }
 
+  _dbus_header_reinit (&message->header, message->byte_order);
+
   return message;
 }
 
@@ -1321,6 +1587,7 @@ dbus_message_copy (const DBusMessage *message)
   retval->refcount.value = 1;
   retval->byte_order = message->byte_order;
   retval->locked = FALSE;
+  retval->path_view.starts = retval->inline_path_starts;
 #ifndef DBUS_DISABLE_CHECKS
   retval->generation = message->generation;
 #endif
@@ -1331,23 +1598,57 @@ dbus_message_copy (const DBusMessage *message)
       return NULL;
     }
 
+  _dbus_string_init_const (&retval->borrowed, "");
+
   if (!_dbus_string_init_preallocated (&retval->body,
-                                       _dbus_string_get_length (&message->body)))
+                                       _dbus_string_get_length (&message->body) +
+                                       _dbus_string_get_length (&message->borrowed)))
     {
       _dbus_header_free (&retval->header);
       dbus_free (retval);
       return NULL;
     }
 
+  /* The copy has its own copy of any borrowed array */
   if (!_dbus_string_copy (&message->body, 0,
-			  &retval->body, 0))
+			  &retval->body, 0) ||
+      !_dbus_string_copy (&message->borrowed, 0,
+                          &retval->body, _dbus_string_get_length (&retval->body)))
     goto failed_copy;
 
+#ifdef HAVE_UNIX_FD_PASSING
+  if (message->n_unix_fds > 0)
+    {
+      retval->unix_fds = dbus_new (int, message->n_unix_fds);
+      if (retval->unix_fds == NULL)
+        goto failed_copy;
+
+      retval->n_unix_fds_allocated = message->n_unix_fds;
+
+      for (retval->n_unix_fds = 0;
+           retval->n_unix_fds < message->n_unix_fds;
+           retval->n_unix_fds++)
+        {
+          retval->unix_fds[retval->n_unix_fds] =
+            _dbus_dup (message->unix_fds[retval->n_unix_fds], NULL);
+
+          if (retval->unix_fds[retval->n_unix_fds] < 0)
+            goto failed_copy;
+        }
+    }
+#endif
+
   return retval;
 
  failed_copy:
   _dbus_header_free (&retval->header);
   _dbus_string_free (&retval->body);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  close_unix_fds (retval->unix_fds, &retval->n_unix_fds);
+  dbus_free (retval->unix_fds);
+#endif
+
   dbus_free (retval);
 
   return NULL;
@@ -1552,7 +1853,8 @@ dbus_message_append_args_valist (DBusMessage *message,
                                                  &array))
             goto failed;
           
-          if (dbus_type_is_fixed (element_type))
+          if (dbus_type_is_fixed (element_type) &&
+              element_type != DBUS_TYPE_UNIX_FD)
             {
               const DBusBasicValue **value;
               int n_elements;
@@ -1620,92 +1922,510 @@ dbus_message_append_args_valist (DBusMessage *message,
 }
 
 /**
- * Gets arguments from a message given a variable argument list.  The
- * supported types include those supported by
- * dbus_message_append_args(); that is, basic types and arrays of
- * fixed-length basic types.  The arguments are the same as they would
- * be for dbus_message_iter_get_basic() or
- * dbus_message_iter_get_fixed_array().
- *
- * In addition to those types, arrays of string, object path, and
- * signature are supported; but these are returned as allocated memory
- * and must be freed with dbus_free_string_array(), while the other
- * types are returned as const references. To get a string array
- * pass in "char ***array_location" and "int *n_elements"
- *
- * The variable argument list should contain the type of the argument
- * followed by a pointer to where the value should be stored. The list
- * is terminated with #DBUS_TYPE_INVALID.
- *
- * Except for string arrays, the returned values are constant; do not
- * free them. They point into the #DBusMessage.
+ * @typedef DBusMessageTemplate
+ *
+ * A DBusMessageTemplate holds the header and signature of a message
+ * that gets sent over and over with different arguments, such as a
+ * high-rate signal. The header is built and the signature checked
+ * once, when the template is created; after that each message costs
+ * little more than a copy of the header and the writing of its
+ * arguments.
+ */
+
+/**
+ * Internals of DBusMessageTemplate
+ */
+struct DBusMessageTemplate
+{
+  DBusHeader header;    /**< Header of every message, signature field included */
+  DBusString signature; /**< Signature of every message's body */
+  DBusString body;      /**< Zero-filled body with all padding in place, for fixed layouts */
+  int *offsets;         /**< Offset of each argument in body, or #NULL if the layout isn't fixed */
+};
+
+/* Templates take the same arguments as dbus_message_append_args():
+ * basic types, and arrays of basic types, but no unix fds since those
+ * have to be dup()ed into each message.
+ */
+static dbus_bool_t
+template_signature_is_supported (const char *signature)
+{
+  const char *p;
+
+  if (strlen (signature) > DBUS_MAXIMUM_SIGNATURE_LENGTH)
+    return FALSE;
+
+  p = signature;
+  while (*p != '\0')
+    {
+      if (*p == DBUS_TYPE_ARRAY)
+        ++p;
+
+      if (!dbus_type_is_basic (*p) || *p == DBUS_TYPE_UNIX_FD)
+        return FALSE;
+
+      ++p;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Creates a template for messages that look like the given prototype
+ * message and carry arguments with the given signature. The prototype
+ * supplies the message type, path, interface, member, destination and
+ * flags; it must not have any arguments yet, and it can be unreffed as
+ * soon as this function returns.
+ *
+ * The signature may contain the types dbus_message_append_args()
+ * supports, except #DBUS_TYPE_UNIX_FD. When every argument is a
+ * fixed-length type (integers, doubles, booleans and bytes) the
+ * position of each argument in the body is worked out here, and
+ * creating a message from the template just stores the values at
+ * those positions.
  *
- * If the requested arguments are not present, or do not have the
- * requested types, then an error will be set.
+ * @code
+ * DBusMessage *prototype;
+ * DBusMessageTemplate *tmpl;
  *
- * If more arguments than requested are present, the requested
- * arguments are returned and the extra arguments are ignored.
- * 
- * @todo support DBUS_TYPE_STRUCT and DBUS_TYPE_VARIANT and complex arrays
+ * prototype = dbus_message_new_signal ("/org/example/Sensor",
+ *                                      "org.example.Sensor", "Reading");
+ * tmpl = dbus_message_template_new (prototype, "ud");
+ * dbus_message_unref (prototype);
+ * @endcode
  *
- * @param message the message
- * @param error error to be filled in on failure
- * @param first_arg_type the first argument type
- * @param ... location for first argument value, then list of type-location pairs
- * @returns #FALSE if the error was set
+ * @param prototype a message with no arguments
+ * @param signature signature of the arguments each message will carry
+ * @returns a new template, or #NULL if not enough memory
  */
-dbus_bool_t
-dbus_message_get_args (DBusMessage     *message,
-                       DBusError       *error,
-		       int              first_arg_type,
-		       ...)
+DBusMessageTemplate*
+dbus_message_template_new (DBusMessage *prototype,
+                           const char  *signature)
 {
-  dbus_bool_t retval;
-  va_list var_args;
+  DBusMessageTemplate *tmpl;
+  dbus_bool_t fixed_layout;
+  int n_args;
+  int pos;
+  int i;
 
-  _dbus_return_val_if_fail (message != NULL, FALSE);
-  _dbus_return_val_if_error_is_set (error, FALSE);
+  _dbus_return_val_if_fail (prototype != NULL, NULL);
+  _dbus_return_val_if_fail (signature != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_string_get_length (&prototype->body) == 0, NULL);
+  _dbus_return_val_if_fail (prototype->byte_order == DBUS_COMPILER_BYTE_ORDER, NULL);
+  _dbus_return_val_if_fail (template_signature_is_supported (signature), NULL);
 
-  va_start (var_args, first_arg_type);
-  retval = dbus_message_get_args_valist (message, error, first_arg_type, var_args);
-  va_end (var_args);
+  n_args = 0;
+  fixed_layout = TRUE;
+  for (i = 0; signature[i] != '\0'; i++)
+    {
+      if (!dbus_type_is_fixed (signature[i]))
+        fixed_layout = FALSE;
 
-  return retval;
+      if (signature[i] == DBUS_TYPE_ARRAY && signature[i + 1] != '\0')
+        ++i;
+
+      ++n_args;
+    }
+
+  tmpl = dbus_new0 (DBusMessageTemplate, 1);
+  if (tmpl == NULL)
+    return NULL;
+
+  if (!_dbus_header_copy (&prototype->header, &tmpl->header))
+    goto failed_0;
+
+  if (n_args > 0 &&
+      !_dbus_header_set_field_basic (&tmpl->header,
+                                     DBUS_HEADER_FIELD_SIGNATURE,
+                                     DBUS_TYPE_SIGNATURE,
+                                     &signature))
+    goto failed_1;
+
+  if (!_dbus_string_init (&tmpl->signature))
+    goto failed_1;
+
+  if (!_dbus_string_append (&tmpl->signature, signature))
+    goto failed_2;
+
+  if (!_dbus_string_init (&tmpl->body))
+    goto failed_2;
+
+  if (fixed_layout && n_args > 0)
+    {
+      tmpl->offsets = dbus_new (int, n_args);
+      if (tmpl->offsets == NULL)
+        goto failed_3;
+
+      /* Every fixed-length type is exactly as big as its alignment */
+      pos = 0;
+      for (i = 0; i < n_args; i++)
+        {
+          pos = _DBUS_ALIGN_VALUE (pos, _dbus_type_get_alignment (signature[i]));
+          tmpl->offsets[i] = pos;
+          pos += _dbus_type_get_alignment (signature[i]);
+        }
+
+      if (!_dbus_string_insert_bytes (&tmpl->body, 0, pos, '\0'))
+        goto failed_4;
+    }
+
+  return tmpl;
+
+ failed_4:
+  dbus_free (tmpl->offsets);
+ failed_3:
+  _dbus_string_free (&tmpl->body);
+ failed_2:
+  _dbus_string_free (&tmpl->signature);
+ failed_1:
+  _dbus_header_free (&tmpl->header);
+ failed_0:
+  dbus_free (tmpl);
+  return NULL;
 }
 
 /**
- * Like dbus_message_get_args but takes a va_list for use by language bindings.
+ * Frees a template created with dbus_message_template_new().
+ * Messages created from the template are not affected.
  *
- * @see dbus_message_get_args
- * @param message the message
- * @param error error to be filled in
- * @param first_arg_type type of the first argument
- * @param var_args return location for first argument, followed by list of type/location pairs
- * @returns #FALSE if error was set
+ * @param tmpl the template
  */
-dbus_bool_t
-dbus_message_get_args_valist (DBusMessage     *message,
-                              DBusError       *error,
-			      int              first_arg_type,
-			      va_list          var_args)
+void
+dbus_message_template_free (DBusMessageTemplate *tmpl)
 {
-  DBusMessageIter iter;
-
-  _dbus_return_val_if_fail (message != NULL, FALSE);
-  _dbus_return_val_if_error_is_set (error, FALSE);
+  _dbus_return_if_fail (tmpl != NULL);
 
-  dbus_message_iter_init (message, &iter);
-  return _dbus_message_iter_get_args_valist (&iter, error, first_arg_type, var_args);
+  _dbus_header_free (&tmpl->header);
+  _dbus_string_free (&tmpl->signature);
+  _dbus_string_free (&tmpl->body);
+  dbus_free (tmpl->offsets);
+  dbus_free (tmpl);
 }
 
 static void
-_dbus_message_iter_init_common (DBusMessage         *message,
-                                DBusMessageRealIter *real,
-                                int                  iter_type)
+warn_template_mismatch (DBusMessageTemplate *tmpl,
+                        int                  type)
 {
-  _dbus_assert (sizeof (DBusMessageRealIter) <= sizeof (DBusMessageIter));
+  _dbus_warn ("argument of type %s doesn't match the template signature \"%s\" in %s\n",
+              _dbus_type_to_string (type),
+              _dbus_string_get_const_data (&tmpl->signature),
+              "dbus_message_template_instantiate");
+}
 
-  /* Since the iterator will read or write who-knows-what from the
+static dbus_bool_t
+template_write_fixed_layout (DBusMessageTemplate *tmpl,
+                             DBusMessage         *message,
+                             int                  first_arg_type,
+                             va_list              var_args)
+{
+  const char *signature;
+  unsigned char *body;
+  int type;
+  int i;
+
+  if (!_dbus_string_copy (&tmpl->body, 0, &message->body, 0))
+    return FALSE;
+
+  signature = _dbus_string_get_const_data (&tmpl->signature);
+  body = (unsigned char *) _dbus_string_get_data (&message->body);
+
+  type = first_arg_type;
+  for (i = 0; signature[i] != '\0'; i++)
+    {
+      const DBusBasicValue *value;
+
+      if (type != signature[i])
+        {
+          warn_template_mismatch (tmpl, type);
+          return FALSE;
+        }
+
+      /* The message is in our own byte order, so values go in as-is */
+      value = va_arg (var_args, const DBusBasicValue*);
+      memcpy (body + tmpl->offsets[i], value, _dbus_type_get_alignment (type));
+
+      type = va_arg (var_args, int);
+    }
+
+  if (type != DBUS_TYPE_INVALID)
+    {
+      warn_template_mismatch (tmpl, type);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Like dbus_message_append_args_valist(), but the signature is
+ * already in the header, so the writer only has to write values.
+ */
+static dbus_bool_t
+template_write_args (DBusMessageTemplate *tmpl,
+                     DBusMessage         *message,
+                     int                  first_arg_type,
+                     va_list              var_args)
+{
+  DBusTypeWriter writer;
+  const char *signature;
+  int type;
+  int pos;
+
+  signature = _dbus_string_get_const_data (&tmpl->signature);
+
+  _dbus_type_writer_init_values_only (&writer, message->byte_order,
+                                      &tmpl->signature, 0,
+                                      &message->body, 0);
+
+  type = first_arg_type;
+  pos = 0;
+  while (signature[pos] != '\0')
+    {
+      if (type != signature[pos])
+        {
+          warn_template_mismatch (tmpl, type);
+          return FALSE;
+        }
+
+      if (type == DBUS_TYPE_ARRAY)
+        {
+          DBusTypeWriter array;
+          int element_type;
+          int n_elements;
+
+          element_type = va_arg (var_args, int);
+          if (element_type != signature[pos + 1])
+            {
+              warn_template_mismatch (tmpl, element_type);
+              return FALSE;
+            }
+
+          if (!_dbus_type_writer_recurse (&writer, DBUS_TYPE_ARRAY,
+                                          &tmpl->signature, pos + 1,
+                                          &array))
+            return FALSE;
+
+          if (dbus_type_is_fixed (element_type))
+            {
+              const DBusBasicValue **value;
+
+              value = va_arg (var_args, const DBusBasicValue**);
+              n_elements = va_arg (var_args, int);
+
+              if (!_dbus_type_writer_write_fixed_multi (&array, element_type,
+                                                        value, n_elements))
+                return FALSE;
+            }
+          else
+            {
+              const char ***value_p;
+              int i;
+
+              value_p = va_arg (var_args, const char***);
+              n_elements = va_arg (var_args, int);
+
+              for (i = 0; i < n_elements; i++)
+                {
+                  if (!_dbus_type_writer_write_basic (&array, element_type,
+                                                      &(*value_p)[i]))
+                    return FALSE;
+                }
+            }
+
+          if (!_dbus_type_writer_unrecurse (&writer, &array))
+            return FALSE;
+
+          pos += 2;
+        }
+      else
+        {
+          const DBusBasicValue *value;
+
+          value = va_arg (var_args, const DBusBasicValue*);
+
+          if (!_dbus_type_writer_write_basic (&writer, type, value))
+            return FALSE;
+
+          pos += 1;
+        }
+
+      type = va_arg (var_args, int);
+    }
+
+  if (type != DBUS_TYPE_INVALID)
+    {
+      warn_template_mismatch (tmpl, type);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Creates a new message from a template, with the given arguments.
+ * The arguments are passed exactly as to dbus_message_append_args(),
+ * and must match the template's signature; if they don't, a warning
+ * is printed and #NULL is returned.
+ *
+ * The new message is an ordinary message that can be modified,
+ * sent and unreffed like any other. It has no serial until it's
+ * sent.
+ *
+ * @param tmpl the template
+ * @param first_arg_type type of the first argument
+ * @param ... value of first argument, list of additional type-value pairs
+ * @returns a new message, or #NULL if not enough memory
+ */
+DBusMessage*
+dbus_message_template_instantiate (DBusMessageTemplate *tmpl,
+                                   int                  first_arg_type,
+                                   ...)
+{
+  DBusMessage *message;
+  va_list var_args;
+
+  _dbus_return_val_if_fail (tmpl != NULL, NULL);
+
+  va_start (var_args, first_arg_type);
+  message = dbus_message_template_instantiate_valist (tmpl,
+                                                      first_arg_type,
+                                                      var_args);
+  va_end (var_args);
+
+  return message;
+}
+
+/**
+ * Like dbus_message_template_instantiate() but takes a va_list for
+ * use by language bindings.
+ *
+ * @param tmpl the template
+ * @param first_arg_type type of the first argument
+ * @param var_args value of first argument, then list of type/value pairs
+ * @returns a new message, or #NULL if not enough memory
+ */
+DBusMessage*
+dbus_message_template_instantiate_valist (DBusMessageTemplate *tmpl,
+                                          int                  first_arg_type,
+                                          va_list              var_args)
+{
+  DBusMessage *message;
+  dbus_bool_t written;
+
+  _dbus_return_val_if_fail (tmpl != NULL, NULL);
+
+  message = dbus_message_new_empty_header ();
+  if (message == NULL)
+    return NULL;
+
+  if (!_dbus_header_copy_into (&tmpl->header, &message->header))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  if (tmpl->offsets != NULL)
+    written = template_write_fixed_layout (tmpl, message,
+                                           first_arg_type, var_args);
+  else
+    written = template_write_args (tmpl, message,
+                                   first_arg_type, var_args);
+
+  if (!written)
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  return message;
+}
+
+/**
+ * Gets arguments from a message given a variable argument list.  The
+ * supported types include those supported by
+ * dbus_message_append_args(); that is, basic types and arrays of
+ * fixed-length basic types.  The arguments are the same as they would
+ * be for dbus_message_iter_get_basic() or
+ * dbus_message_iter_get_fixed_array().
+ *
+ * In addition to those types, arrays of string, object path, and
+ * signature are supported; but these are returned as allocated memory
+ * and must be freed with dbus_free_string_array(), while the other
+ * types are returned as const references. To get a string array
+ * pass in "char ***array_location" and "int *n_elements"
+ *
+ * The variable argument list should contain the type of the argument
+ * followed by a pointer to where the value should be stored. The list
+ * is terminated with #DBUS_TYPE_INVALID.
+ *
+ * Except for string arrays, the returned values are constant; do not
+ * free them. They point into the #DBusMessage.
+ *
+ * If the requested arguments are not present, or do not have the
+ * requested types, then an error will be set.
+ *
+ * If more arguments than requested are present, the requested
+ * arguments are returned and the extra arguments are ignored.
+ * 
+ * @todo support DBUS_TYPE_STRUCT and DBUS_TYPE_VARIANT and complex arrays
+ *
+ * @param message the message
+ * @param error error to be filled in on failure
+ * @param first_arg_type the first argument type
+ * @param ... location for first argument value, then list of type-location pairs
+ * @returns #FALSE if the error was set
+ */
+dbus_bool_t
+dbus_message_get_args (DBusMessage     *message,
+                       DBusError       *error,
+		       int              first_arg_type,
+		       ...)
+{
+  dbus_bool_t retval;
+  va_list var_args;
+
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  va_start (var_args, first_arg_type);
+  retval = dbus_message_get_args_valist (message, error, first_arg_type, var_args);
+  va_end (var_args);
+
+  return retval;
+}
+
+/**
+ * Like dbus_message_get_args but takes a va_list for use by language bindings.
+ *
+ * @see dbus_message_get_args
+ * @param message the message
+ * @param error error to be filled in
+ * @param first_arg_type type of the first argument
+ * @param var_args return location for first argument, followed by list of type/location pairs
+ * @returns #FALSE if error was set
+ */
+dbus_bool_t
+dbus_message_get_args_valist (DBusMessage     *message,
+                              DBusError       *error,
+			      int              first_arg_type,
+			      va_list          var_args)
+{
+  DBusMessageIter iter;
+
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  dbus_message_iter_init (message, &iter);
+  return _dbus_message_iter_get_args_valist (&iter, error, first_arg_type, var_args);
+}
+
+static void
+_dbus_message_iter_init_common (DBusMessage         *message,
+                                DBusMessageRealIter *real,
+                                int                  iter_type)
+{
+  _dbus_assert (sizeof (DBusMessageRealIter) <= sizeof (DBusMessageIter));
+
+  /* Since the iterator will read or write who-knows-what from the
    * message, we need to get in the right byte order
    */
   ensure_byte_order (message);
@@ -1748,6 +2468,19 @@ dbus_message_iter_init (DBusMessage     *message,
 
   _dbus_return_val_if_fail (message != NULL, FALSE);
   _dbus_return_val_if_fail (iter != NULL, FALSE);
+  _dbus_return_val_if_fail (!message->locked ||
+                            _dbus_string_get_length (&message->borrowed) == 0,
+                            FALSE);
+
+  /* Readers need the whole body in one place */
+  if (_dbus_string_get_length (&message->borrowed) > 0)
+    {
+      if (!_dbus_string_copy (&message->borrowed, 0, &message->body,
+                              _dbus_string_get_length (&message->body)))
+        return FALSE;
+
+      release_borrowed (message);
+    }
 
   get_const_signature (&message->header, &type_str, &type_pos);
 
@@ -1944,6 +2677,11 @@ dbus_message_iter_get_signature (DBusMessageIter *iter)
  * expecting, or you'll crash when you try to use an integer as a
  * string or something.
  *
+ * #DBUS_TYPE_UNIX_FD is the exception to "by reference": the value
+ * is an int holding a newly duplicated file descriptor, which the
+ * caller owns and must close. If the message does not actually carry
+ * the referenced descriptor, -1 is returned.
+ *
  * @param iter the iterator
  * @param value location to store the value
  */
@@ -1956,8 +2694,32 @@ dbus_message_iter_get_basic (DBusMessageIter  *iter,
   _dbus_return_if_fail (_dbus_message_iter_check (real));
   _dbus_return_if_fail (value != NULL);
 
-  _dbus_type_reader_read_basic (&real->u.reader,
-                                value);
+  if (dbus_message_iter_get_arg_type (iter) == DBUS_TYPE_UNIX_FD)
+    {
+#ifdef HAVE_UNIX_FD_PASSING
+      DBusBasicValue idx;
+
+      _dbus_type_reader_read_basic (&real->u.reader, &idx);
+
+      if (idx.u32 >= real->message->n_unix_fds)
+        {
+          /* We can't report an error from here, so hand out
+           * an invalid fd instead.
+           */
+          *((int*) value) = -1;
+          return;
+        }
+
+      *((int*) value) = _dbus_dup (real->message->unix_fds[idx.u32], NULL);
+#else
+      *((int*) value) = -1;
+#endif
+    }
+  else
+    {
+      _dbus_type_reader_read_basic (&real->u.reader,
+                                    value);
+    }
 }
 
 /**
@@ -2020,7 +2782,8 @@ dbus_message_iter_get_fixed_array (DBusMessageIter  *iter,
   _dbus_return_if_fail (_dbus_message_iter_check (real));
   _dbus_return_if_fail (value != NULL);
   _dbus_return_if_fail ((subtype == DBUS_TYPE_INVALID) ||
-                         dbus_type_is_fixed (subtype));
+                         (dbus_type_is_fixed (subtype) &&
+                          subtype != DBUS_TYPE_UNIX_FD));
 
   _dbus_type_reader_read_fixed_multi (&real->u.reader,
                                       value, n_elements);
@@ -2186,10 +2949,53 @@ _dbus_message_iter_append_check (DBusMessageRealIter *iter)
       return FALSE;
     }
 
+  if (iter->message->borrowed_free_function != NULL ||
+      _dbus_string_get_length (&iter->message->borrowed) > 0)
+    {
+      _dbus_warn_check_failed ("dbus append iterator can't be used: nothing can be appended after a borrowed array\n");
+      return FALSE;
+    }
+
   return TRUE;
 }
 #endif /* DBUS_DISABLE_CHECKS */
 
+#ifdef HAVE_UNIX_FD_PASSING
+/**
+ * Makes room for n more unix fds in the message's fd array.
+ *
+ * @param m the message
+ * @param n number of fds to make room for
+ * @returns where the first new fd should be stored, or #NULL if no memory
+ */
+static int *
+expand_fd_array (DBusMessage *m,
+                 unsigned     n)
+{
+  _dbus_assert (m != NULL);
+
+  if (m->n_unix_fds + n > m->n_unix_fds_allocated)
+    {
+      unsigned k;
+      int *p;
+
+      /* Grow geometrically, starting at four */
+      k = (m->n_unix_fds + n) * 2;
+      if (k < 4)
+        k = 4;
+
+      p = dbus_realloc (m->unix_fds, k * sizeof (int));
+      if (p == NULL)
+        return NULL;
+
+      m->unix_fds = p;
+      m->n_unix_fds_allocated = k;
+    }
+
+  return m->unix_fds + m->n_unix_fds;
+}
+#endif
+
 /**
  * Appends a basic-typed value to the message. The basic types are the
  * non-container types such as integer and string.
@@ -2197,6 +3003,11 @@ _dbus_message_iter_append_check (DBusMessageRealIter *iter)
  * The "value" argument should be the address of a basic-typed value.
  * So for string, const char**. For integer, dbus_int32_t*.
  *
+ * For #DBUS_TYPE_UNIX_FD the value is an int* pointing at a file
+ * descriptor. The message keeps its own duplicate, so the caller
+ * remains responsible for closing the original. Check
+ * dbus_connection_can_send_type() before sending such a message.
+ *
  * @todo If this fails due to lack of memory, the message is hosed and
  * you have to start over building the whole message.
  *
@@ -2221,7 +3032,52 @@ dbus_message_iter_append_basic (DBusMessageIter *iter,
   if (!_dbus_message_iter_open_signature (real))
     return FALSE;
 
-  ret = _dbus_type_writer_write_basic (&real->u.writer, type, value);
+  if (type == DBUS_TYPE_UNIX_FD)
+    {
+#ifdef HAVE_UNIX_FD_PASSING
+      int *fds;
+      dbus_uint32_t u;
+
+      ret = FALSE;
+
+      /* First, keep a private duplicate of the fd in the message */
+      fds = expand_fd_array (real->message, 1);
+      if (fds != NULL)
+        *fds = _dbus_dup (*(int*) value, NULL);
+
+      if (fds != NULL && *fds >= 0)
+        {
+          /* Then marshal its index into the body */
+          u = real->message->n_unix_fds;
+
+          if (_dbus_type_writer_write_basic (&real->u.writer,
+                                             DBUS_TYPE_UNIX_FD, &u))
+            {
+              real->message->n_unix_fds += 1;
+              u += 1;
+
+              /* And finally record the new count in the header. If
+               * this fails the message is hosed, but the fd is
+               * already owned by the message and won't leak.
+               */
+              ret = _dbus_header_set_field_basic (&real->message->header,
+                                                  DBUS_HEADER_FIELD_UNIX_FDS,
+                                                  DBUS_TYPE_UINT32,
+                                                  &u);
+            }
+          else
+            {
+              _dbus_close (*fds, NULL);
+            }
+        }
+#else
+      ret = FALSE;
+#endif
+    }
+  else
+    {
+      ret = _dbus_type_writer_write_basic (&real->u.writer, type, value);
+    }
 
   if (!_dbus_message_iter_close_signature (real))
     ret = FALSE;
@@ -2275,7 +3131,8 @@ dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
 
   _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
   _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
-  _dbus_return_val_if_fail (dbus_type_is_fixed (element_type), FALSE);
+  _dbus_return_val_if_fail (dbus_type_is_fixed (element_type) &&
+                            element_type != DBUS_TYPE_UNIX_FD, FALSE);
   _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_ARRAY, FALSE);
   _dbus_return_val_if_fail (value != NULL, FALSE);
   _dbus_return_val_if_fail (n_elements >= 0, FALSE);
@@ -2288,6 +3145,113 @@ dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
   return ret;
 }
 
+/**
+ * Appends an array of fixed-length values to the message without
+ * copying it. The message keeps a pointer to the caller's array and
+ * the array is written to the socket straight from there when the
+ * message is sent. free_function is called with free_data once the
+ * message no longer needs the array, which is when the last reference
+ * to the message is dropped; the array must not change until then.
+ * That can happen in whatever thread unrefs the message last,
+ * including the connection's I/O thread if it has one.
+ *
+ * This is only worth it for big arrays, where copying the array into
+ * the message costs more than the array itself. It has a few
+ * restrictions:
+ *
+ *  - iter must be the message's top-level append iterator
+ *    (from dbus_message_iter_init_append()), not a container's.
+ *  - The borrowed array must be the message's last argument;
+ *    nothing else can be appended after it.
+ *  - The message must be in the machine's own byte order, which
+ *    messages you create yourself always are.
+ *  - Reading the message's arguments back with an iterator before
+ *    sending it copies the array into the message after all, and
+ *    releases it early. A message can't be read back once it has
+ *    been sent; use dbus_message_copy() for that.
+ *
+ * As with dbus_message_iter_append_fixed_array(), value is the
+ * address of the pointer to the array.
+ *
+ * @code
+ * dbus_message_iter_init_append (message, &iter);
+ * if (!dbus_message_iter_append_borrowed_array (&iter, DBUS_TYPE_BYTE,
+ *                                               &image_data, image_len,
+ *                                               free, image_data))
+ *   fprintf (stderr, "No memory!\n");
+ * @endcode
+ *
+ * If this function returns #FALSE the array was not borrowed, and
+ * free_function will not be called.
+ *
+ * @param iter the message's top-level append iterator
+ * @param element_type the type of the array elements
+ * @param value the address of the array
+ * @param n_elements the number of elements to append
+ * @param free_function function to call when the message is done with the array, or #NULL
+ * @param free_data data to pass to free_function
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_append_borrowed_array (DBusMessageIter  *iter,
+                                         int               element_type,
+                                         const void       *value,
+                                         int               n_elements,
+                                         DBusFreeFunction  free_function,
+                                         void             *free_data)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  DBusMessageRealIter *real_array;
+  DBusMessageIter array;
+  DBusMessage *message;
+  const char *data;
+  char element_signature[2];
+  int len_pos;
+  int n_bytes;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_INVALID, FALSE);
+  _dbus_return_val_if_fail (real->message->byte_order == DBUS_COMPILER_BYTE_ORDER, FALSE);
+  _dbus_return_val_if_fail (dbus_type_is_fixed (element_type) &&
+                            element_type != DBUS_TYPE_UNIX_FD, FALSE);
+  _dbus_return_val_if_fail (value != NULL, FALSE);
+  _dbus_return_val_if_fail (n_elements >= 0, FALSE);
+  _dbus_return_val_if_fail (n_elements <=
+                            DBUS_MAXIMUM_ARRAY_LENGTH / _dbus_type_get_alignment (element_type),
+                            FALSE);
+
+  message = real->message;
+  data = *(const char **) value;
+  n_bytes = n_elements * _dbus_type_get_alignment (element_type);
+
+  /* Write an empty array, which leaves the body ending exactly where
+   * the elements go, then claim the borrowed elements in its length.
+   */
+  element_signature[0] = element_type;
+  element_signature[1] = '\0';
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         element_signature, &array))
+    return FALSE;
+
+  real_array = (DBusMessageRealIter *) &array;
+  len_pos = real_array->u.writer.u.array.len_pos;
+
+  if (!dbus_message_iter_close_container (iter, &array))
+    return FALSE;
+
+  _dbus_marshal_set_uint32 (&message->body, len_pos, n_bytes,
+                            message->byte_order);
+
+  _dbus_string_init_const_len (&message->borrowed,
+                               n_bytes > 0 ? data : "", n_bytes);
+  message->borrowed_free_function = free_function;
+  message->borrowed_free_data = free_data;
+
+  return TRUE;
+}
+
 /**
  * Appends a container-typed value to the message; you are required to
  * append the contents of the container using the returned
@@ -2506,6 +3470,8 @@ dbus_message_set_path (DBusMessage   *message,
                             _dbus_check_is_valid_path (object_path),
                             FALSE);
 
+  invalidate_path_view (message);
+
   return set_or_delete_string_field (message,
                                      DBUS_HEADER_FIELD_PATH,
                                      DBUS_TYPE_OBJECT_PATH,
@@ -3203,6 +4169,24 @@ dbus_message_has_signature (DBusMessage   *message,
     return FALSE;
 }
 
+/**
+ * Checks whether a message contains unix fds
+ *
+ * @param message the message
+ * @returns #TRUE if the message contains unix fds
+ */
+dbus_bool_t
+dbus_message_contains_unix_fds (DBusMessage *message)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_assert (message != NULL);
+
+  return message->n_unix_fds > 0;
+#else
+  return FALSE;
+#endif
+}
+
 /**
  * Sets a #DBusError based on the contents of the given
  * message. The error is only set if the message
@@ -3268,6 +4252,14 @@ dbus_set_error_from_message (DBusError   *error,
  */
 #define INITIAL_LOADER_DATA_LEN 32
 
+/**
+ * Bodies at least this long are read from the network straight into
+ * the DBusMessage once the header has arrived, rather than buffered
+ * in the loader and copied out. Below this the copy is cheaper than
+ * the extra bookkeeping.
+ */
+#define MIN_BODY_LEN_TO_READ_IN_PLACE (4 * _DBUS_ONE_KILOBYTE)
+
 /**
  * Creates a new message loader. Returns #NULL if memory can't
  * be allocated.
@@ -3291,6 +4283,12 @@ _dbus_message_loader_new (void)
   /* this can be configured by the app, but defaults to the protocol max */
   loader->max_message_size = DBUS_MAXIMUM_MESSAGE_LENGTH;
 
+  /* We set a very relatively conservative default here since due to how
+     SCM_RIGHTS works we need to preallocate an fd array of the maximum
+     number of unix fds we want to receive in advance. A
+     try-and-reallocate loop is not possible. */
+  loader->max_message_unix_fds = 1024;
+
   if (!_dbus_string_init (&loader->data))
     {
       dbus_free (loader);
@@ -3334,7 +4332,13 @@ _dbus_message_loader_unref (DBusMessageLoader *loader)
                           (DBusForeachFunction) dbus_message_unref,
                           NULL);
       _dbus_list_clear (&loader->messages);
+      if (loader->partial)
+        dbus_message_unref (loader->partial);
       _dbus_string_free (&loader->data);
+#ifdef HAVE_UNIX_FD_PASSING
+      close_unix_fds (loader->unix_fds, &loader->n_unix_fds);
+      dbus_free (loader->unix_fds);
+#endif
       dbus_free (loader);
     }
 }
@@ -3347,10 +4351,10 @@ _dbus_message_loader_unref (DBusMessageLoader *loader)
  * _dbus_message_loader_return_buffer(), even if no bytes are
  * successfully read.
  *
- * @todo this function can be a lot more clever. For example
- * it can probably always return a buffer size to read exactly
- * the body of the next message, thus avoiding any memory wastage
- * or reallocs.
+ * Once the header of a message with a large body has been loaded,
+ * the buffer returned is the body of that message, so the body is
+ * never copied. Data read past the end of the body is handed back to
+ * the loader by _dbus_message_loader_queue_messages().
  *
  * @todo we need to enforce a max length on strings in header fields.
  *
@@ -3363,7 +4367,10 @@ _dbus_message_loader_get_buffer (DBusMessageLoader  *loader,
 {
   _dbus_assert (!loader->buffer_outstanding);
 
-  *buffer = &loader->data;
+  if (loader->partial)
+    *buffer = &loader->partial->body;
+  else
+    *buffer = &loader->data;
 
   loader->buffer_outstanding = TRUE;
 }
@@ -3384,65 +4391,124 @@ _dbus_message_loader_return_buffer (DBusMessageLoader  *loader,
                                     int                 bytes_read)
 {
   _dbus_assert (loader->buffer_outstanding);
-  _dbus_assert (buffer == &loader->data);
+  _dbus_assert (buffer == &loader->data ||
+                (loader->partial && buffer == &loader->partial->body));
 
   loader->buffer_outstanding = FALSE;
 }
 
+/**
+ * Gets the buffer to use for reading unix fds from the network.
+ *
+ * This works similar to _dbus_message_loader_get_buffer(): the array
+ * has room for at least max_message_unix_fds descriptors and must
+ * always be returned with _dbus_message_loader_return_unix_fds(),
+ * even if no descriptors were read.
+ *
+ * @param loader the message loader.
+ * @param fds the array to read fds into
+ * @param max_n_fds how many fds to read at most
+ * @return TRUE on success, FALSE on OOM
+ */
+dbus_bool_t
+_dbus_message_loader_get_unix_fds (DBusMessageLoader  *loader,
+                                   int               **fds,
+                                   unsigned           *max_n_fds)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_assert (!loader->unix_fds_outstanding);
+
+  /* Allocate space where we can put the fds we read. We allocate
+     space for max_message_unix_fds since this is an
+     upper limit how many fds can be received within a single
+     message. Since SCM_RIGHTS doesn't allow a reallocate+retry logic
+     we are allocating the maximum possible array size right from the
+     beginning. This sucks a bit, however unless SCM_RIGHTS is fixed
+     there is no better way. */
+
+  if (loader->n_unix_fds_allocated < loader->max_message_unix_fds)
+    {
+      int *a = dbus_realloc (loader->unix_fds,
+                             loader->max_message_unix_fds * sizeof (loader->unix_fds[0]));
+
+      if (!a)
+        return FALSE;
+
+      loader->unix_fds = a;
+      loader->n_unix_fds_allocated = loader->max_message_unix_fds;
+    }
+
+  *fds = loader->unix_fds + loader->n_unix_fds;
+  *max_n_fds = loader->n_unix_fds_allocated - loader->n_unix_fds;
+
+  loader->unix_fds_outstanding = TRUE;
+  return TRUE;
+#else
+  _dbus_assert_not_reached ("Platform doesn't support unix fd passing");
+  return FALSE;
+#endif
+}
+
+/**
+ * Returns a buffer obtained from _dbus_message_loader_get_unix_fds().
+ *
+ * This works similar to _dbus_message_loader_return_buffer()
+ *
+ * @param loader the message loader.
+ * @param fds the array fds were read into
+ * @param n_fds how many fds were read
+ */
+void
+_dbus_message_loader_return_unix_fds (DBusMessageLoader  *loader,
+                                      int                *fds,
+                                      unsigned            n_fds)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_assert (loader->unix_fds_outstanding);
+  _dbus_assert (loader->unix_fds + loader->n_unix_fds == fds);
+  _dbus_assert (loader->n_unix_fds + n_fds <= loader->n_unix_fds_allocated);
+
+  loader->n_unix_fds += n_fds;
+  loader->unix_fds_outstanding = FALSE;
+#else
+  _dbus_assert_not_reached ("Platform doesn't support unix fd passing");
+#endif
+}
+
 /*
  * FIXME when we move the header out of the buffer, that memmoves all
- * buffered messages. Kind of crappy.
- *
- * Also we copy the header and body, which is kind of crappy.  To
- * avoid this, we have to allow header and body to be in a single
- * memory block, which is good for messages we read and bad for
- * messages we are creating. But we could move_len() the buffer into
- * this single memory block, and move_len() will just swap the buffers
- * if you're moving the entire buffer replacing the dest string.
- *
- * We could also have the message loader tell the transport how many
- * bytes to read; so it would first ask for some arbitrary number like
- * 256, then if the message was incomplete it would use the
- * header/body len to ask for exactly the size of the message (or
- * blocks the size of a typical kernel buffer for the socket). That
- * way we don't get trailing bytes in the buffer that have to be
- * memmoved. Though I suppose we also don't have a chance of reading a
- * bunch of small messages at once, so the optimization may be stupid.
- *
- * Another approach would be to keep a "start" index into
- * loader->data and only delete it occasionally, instead of after
- * each message is loaded.
- *
- * load_message() returns FALSE if not enough memory OR the loader was corrupted
+ * buffered messages. Kind of crappy. We can't just keep a "start"
+ * index into loader->data, because alignment in the marshaled data
+ * is relative to the start of the message and messages aren't padded
+ * to 8 bytes.
+ *
+ * Small messages are copied out of the loader buffer. For large
+ * bodies, load_partial_message() loads the header as soon as it has
+ * arrived and the rest of the body is then read directly into the
+ * message, see _dbus_message_loader_get_buffer().
+ *
+ * These functions return FALSE if not enough memory OR the loader was
+ * corrupted
  */
 static dbus_bool_t
-load_message (DBusMessageLoader *loader,
-              DBusMessage       *message,
-              int                byte_order,
-              int                fields_array_len,
-              int                header_len,
-              int                body_len)
+load_message_header (DBusMessageLoader *loader,
+                     DBusMessage       *message,
+                     int                byte_order,
+                     int                fields_array_len,
+                     int                header_len,
+                     int                body_len)
 {
-  dbus_bool_t oom;
   DBusValidity validity;
-  const DBusString *type_str;
-  int type_pos;
-  DBusValidationMode mode;
-
-  mode = DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED;
-  
-  oom = FALSE;
 
 #if 0
   _dbus_verbose_bytes_of_string (&loader->data, 0, header_len /* + body_len */);
 #endif
 
-  /* 1. VALIDATE AND COPY OVER HEADER */
   _dbus_assert (_dbus_string_get_length (&message->header.data) == 0);
-  _dbus_assert ((header_len + body_len) <= _dbus_string_get_length (&loader->data));
+  _dbus_assert (header_len <= _dbus_string_get_length (&loader->data));
 
   if (!_dbus_header_load (&message->header,
-                          mode,
+                          DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED,
                           &validity,
                           byte_order,
                           fields_array_len,
@@ -3457,20 +4523,46 @@ load_message (DBusMessageLoader *loader,
          oom errors.  They should use DBUS_VALIDITY_UNKNOWN_OOM_ERROR instead */
       _dbus_assert (validity != DBUS_VALID);
 
-      if (validity == DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
-        oom = TRUE;
-      else
+      if (validity != DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
         {
           loader->corrupted = TRUE;
           loader->corruption_reason = validity;
         }
-      goto failed;
+      return FALSE;
     }
 
   _dbus_assert (validity == DBUS_VALID);
 
   message->byte_order = byte_order;
 
+  return TRUE;
+}
+
+/*
+ * Validates the body, which is body_len bytes of body_str at
+ * body_start, and queues the message. The body is copied into the
+ * message unless body_str already is the message body.
+ */
+static dbus_bool_t
+load_message_body (DBusMessageLoader *loader,
+                   DBusMessage       *message,
+                   const DBusString  *body_str,
+                   int                body_start,
+                   int                body_len)
+{
+  dbus_bool_t oom;
+  DBusValidity validity;
+  const DBusString *type_str;
+  int type_pos;
+  DBusValidationMode mode;
+  dbus_uint32_t n_unix_fds = 0;
+
+  mode = DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED;
+  
+  oom = FALSE;
+
+  _dbus_assert ((body_start + body_len) <= _dbus_string_get_length (body_str));
+
   /* 2. VALIDATE BODY */
   if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
     {
@@ -3481,10 +4573,10 @@ load_message (DBusMessageLoader *loader,
        */
       validity = _dbus_validate_body_with_reason (type_str,
                                                   type_pos,
-                                                  byte_order,
+                                                  message->byte_order,
                                                   NULL,
-                                                  &loader->data,
-                                                  header_len,
+                                                  body_str,
+                                                  body_start,
                                                   body_len);
       if (validity != DBUS_VALID)
         {
@@ -3497,29 +4589,78 @@ load_message (DBusMessageLoader *loader,
         }
     }
 
-  /* 3. COPY OVER BODY AND QUEUE MESSAGE */
+  /* 3. CHECK THAT THE REFERENCED UNIX FDS ARRIVED */
 
-  if (!_dbus_list_append (&loader->messages, message))
+  _dbus_header_get_field_basic (&message->header,
+                                DBUS_HEADER_FIELD_UNIX_FDS,
+                                DBUS_TYPE_UINT32,
+                                &n_unix_fds);
+
+  if (n_unix_fds > 0)
     {
-      _dbus_verbose ("Failed to append new message to loader queue\n");
-      oom = TRUE;
+#ifdef HAVE_UNIX_FD_PASSING
+      if (n_unix_fds > loader->n_unix_fds)
+        {
+          _dbus_verbose ("Message contains references to more unix fds than were sent %u != %u\n",
+                         n_unix_fds, loader->n_unix_fds);
+
+          loader->corrupted = TRUE;
+          loader->corruption_reason = DBUS_INVALID_MISSING_UNIX_FDS;
+          goto failed;
+        }
+
+      /* Reserve the space now so nothing can fail after the fds
+       * have been taken out of the loader
+       */
+      if (expand_fd_array (message, n_unix_fds) == NULL)
+        {
+          _dbus_verbose ("Failed to allocate file descriptor array\n");
+          oom = TRUE;
+          goto failed;
+        }
+#else
+      _dbus_verbose ("Message contains unix fds but we can't receive them\n");
+
+      loader->corrupted = TRUE;
+      loader->corruption_reason = DBUS_INVALID_MISSING_UNIX_FDS;
       goto failed;
+#endif
     }
 
-  _dbus_assert (_dbus_string_get_length (&message->body) == 0);
-  _dbus_assert (_dbus_string_get_length (&loader->data) >=
-                (header_len + body_len));
+  /* 4. COPY OVER BODY AND FDS, AND QUEUE MESSAGE */
 
-  if (!_dbus_string_copy_len (&loader->data, header_len, body_len, &message->body, 0))
+  if (!_dbus_list_append (&loader->messages, message))
     {
-      _dbus_verbose ("Failed to move body into new message\n");
+      _dbus_verbose ("Failed to append new message to loader queue\n");
       oom = TRUE;
       goto failed;
     }
 
-  _dbus_string_delete (&loader->data, 0, header_len + body_len);
+  if (body_str != &message->body)
+    {
+      _dbus_assert (_dbus_string_get_length (&message->body) == 0);
+
+      if (!_dbus_string_copy_len (body_str, body_start, body_len,
+                                  &message->body, 0))
+        {
+          _dbus_verbose ("Failed to move body into new message\n");
+          oom = TRUE;
+          goto failed;
+        }
+    }
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (n_unix_fds > 0)
+    {
+      memcpy (message->unix_fds, loader->unix_fds, n_unix_fds * sizeof (message->unix_fds[0]));
+      message->n_unix_fds = n_unix_fds;
+
+      memmove (loader->unix_fds, loader->unix_fds + n_unix_fds,
+               (loader->n_unix_fds - n_unix_fds) * sizeof (loader->unix_fds[0]));
+      loader->n_unix_fds -= n_unix_fds;
+    }
+#endif
 
-  _dbus_assert (_dbus_string_get_length (&message->header.data) == header_len);
   _dbus_assert (_dbus_string_get_length (&message->body) == body_len);
 
   _dbus_verbose ("Loaded message %p\n", message);
@@ -3543,11 +4684,126 @@ load_message (DBusMessageLoader *loader,
   else
     _dbus_assert (loader->corrupted);
 
-  _dbus_verbose_bytes_of_string (&loader->data, 0, _dbus_string_get_length (&loader->data));
+  _dbus_verbose_bytes_of_string (body_str, body_start, body_len);
+
+  return FALSE;
+}
+
+static dbus_bool_t
+load_message (DBusMessageLoader *loader,
+              DBusMessage       *message,
+              int                byte_order,
+              int                fields_array_len,
+              int                header_len,
+              int                body_len)
+{
+  _dbus_assert ((header_len + body_len) <= _dbus_string_get_length (&loader->data));
+
+  if (!load_message_header (loader, message, byte_order,
+                            fields_array_len, header_len, body_len))
+    return FALSE;
+
+  if (!load_message_body (loader, message, &loader->data,
+                          header_len, body_len))
+    return FALSE;
+
+  _dbus_string_delete (&loader->data, 0, header_len + body_len);
+
+  _dbus_assert (_dbus_string_get_length (&message->header.data) == header_len);
+
+  return TRUE;
+}
+
+/*
+ * Loads the header of a message whose body has not fully arrived and
+ * moves what we have of the body into the message, which becomes
+ * loader->partial.
+ */
+static dbus_bool_t
+load_partial_message (DBusMessageLoader *loader,
+                      int                byte_order,
+                      int                fields_array_len,
+                      int                header_len,
+                      int                body_len)
+{
+  DBusMessage *message;
+
+  _dbus_assert (loader->partial == NULL);
+  _dbus_assert (header_len <= _dbus_string_get_length (&loader->data));
+  _dbus_assert ((header_len + body_len) > _dbus_string_get_length (&loader->data));
+
+  message = dbus_message_new_empty_header ();
+  if (message == NULL)
+    return FALSE;
+
+  if (!load_message_header (loader, message, byte_order,
+                            fields_array_len, header_len, body_len))
+    goto failed;
+
+  /* The body buffer is not preallocated to body_len since that would
+   * let a peer make us allocate max_message_size with a header alone;
+   * it grows as data arrives, like loader->data would.
+   */
+  if (!_dbus_string_move_len (&loader->data, header_len,
+                              _dbus_string_get_length (&loader->data) - header_len,
+                              &message->body, 0))
+    goto failed;
+
+  _dbus_string_set_length (&loader->data, 0);
+
+  loader->partial = message;
+  loader->partial_body_len = body_len;
+
+  _dbus_verbose ("Reading body of %d bytes in place for message %p\n",
+                 body_len, message);
+
+  return TRUE;
 
+ failed:
+  dbus_message_unref (message);
   return FALSE;
 }
 
+/*
+ * Queues loader->partial if its body is complete. Returns FALSE if
+ * not enough memory or the loader was corrupted.
+ */
+static dbus_bool_t
+finish_partial_message (DBusMessageLoader *loader)
+{
+  DBusMessage *message;
+  int excess;
+
+  message = loader->partial;
+  excess = _dbus_string_get_length (&message->body) - loader->partial_body_len;
+
+  if (excess < 0)
+    return TRUE;
+
+  /* Anything read past the end of the body belongs to the next
+   * message; loader->data is empty while a partial message is pending
+   */
+  if (excess > 0)
+    {
+      _dbus_assert (_dbus_string_get_length (&loader->data) == 0);
+
+      if (!_dbus_string_move_len (&message->body, loader->partial_body_len,
+                                  excess, &loader->data, 0))
+        return FALSE;
+    }
+
+  if (!load_message_body (loader, message, &message->body,
+                          0, loader->partial_body_len))
+    return FALSE;
+
+  loader->partial = NULL;
+  loader->partial_body_len = 0;
+
+  /* the loader's queue now owns the message */
+
+  return TRUE;
+}
+
 /**
  * Converts buffered data into messages, if we have enough data.  If
  * we don't have enough data, does nothing.
@@ -3565,6 +4821,15 @@ load_message (DBusMessageLoader *loader,
 dbus_bool_t
 _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
 {
+  if (loader->partial && !loader->corrupted)
+    {
+      if (!finish_partial_message (loader))
+        return loader->corrupted;
+
+      if (loader->partial)
+        return TRUE;
+    }
+
   while (!loader->corrupted &&
          _dbus_string_get_length (&loader->data) >= DBUS_MINIMUM_HEADER_SIZE)
     {
@@ -3611,6 +4876,14 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
               loader->corrupted = TRUE;
               loader->corruption_reason = validity;
             }
+          else if (body_len >= MIN_BODY_LEN_TO_READ_IN_PLACE &&
+                   header_len <= _dbus_string_get_length (&loader->data))
+            {
+              if (!load_partial_message (loader, byte_order,
+                                         fields_array_len,
+                                         header_len, body_len))
+                return loader->corrupted;
+            }
           return TRUE;
         }
     }
@@ -3723,6 +4996,37 @@ _dbus_message_loader_get_max_message_size (DBusMessageLoader  *loader)
   return loader->max_message_size;
 }
 
+/**
+ * Sets the maximum unix fds per message we allow.
+ *
+ * @param loader the loader
+ * @param n the max number of unix fds in a message
+ */
+void
+_dbus_message_loader_set_max_message_unix_fds (DBusMessageLoader  *loader,
+                                               long                n)
+{
+  if (n > DBUS_MAXIMUM_MESSAGE_UNIX_FDS)
+    {
+      _dbus_verbose ("clamping requested max message unix_fds %ld to %d\n",
+                     n, DBUS_MAXIMUM_MESSAGE_UNIX_FDS);
+      n = DBUS_MAXIMUM_MESSAGE_UNIX_FDS;
+    }
+  loader->max_message_unix_fds = n;
+}
+
+/**
+ * Gets the maximum allowed number of unix fds per message
+ *
+ * @param loader the loader
+ * @returns max unix fds
+ */
+long
+_dbus_message_loader_get_max_message_unix_fds (DBusMessageLoader  *loader)
+{
+  return loader->max_message_unix_fds;
+}
+
 static DBusDataSlotAllocator slot_allocator;
 _DBUS_DEFINE_GLOBAL_LOCK (message_slots);
 
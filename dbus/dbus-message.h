@@ -42,6 +42,8 @@ DBUS_BEGIN_DECLS
  */
 
 typedef struct DBusMessage DBusMessage;
+/** Opaque type holding the pre-built header of messages sent many times over */
+typedef struct DBusMessageTemplate DBusMessageTemplate;
 /** Opaque type representing a message iterator. Can be copied by value, and contains no allocated memory so never needs to be freed and can be allocated on the stack. */
 typedef struct DBusMessageIter DBusMessageIter;
 
@@ -142,6 +144,8 @@ dbus_bool_t   dbus_message_get_auto_start   (DBusMessage   *message);
 dbus_bool_t   dbus_message_get_path_decomposed (DBusMessage   *message,
                                                 char        ***path);
 
+dbus_bool_t   dbus_message_contains_unix_fds (DBusMessage  *message);
+
 dbus_bool_t dbus_message_append_args          (DBusMessage     *message,
 					       int              first_arg_type,
 					       ...);
@@ -157,6 +161,16 @@ dbus_bool_t dbus_message_get_args_valist      (DBusMessage     *message,
 					       int              first_arg_type,
 					       va_list          var_args);
 
+DBusMessageTemplate* dbus_message_template_new                (DBusMessage         *prototype,
+                                                               const char          *signature);
+void                 dbus_message_template_free               (DBusMessageTemplate *tmpl);
+DBusMessage*         dbus_message_template_instantiate        (DBusMessageTemplate *tmpl,
+                                                               int                  first_arg_type,
+                                                               ...);
+DBusMessage*         dbus_message_template_instantiate_valist (DBusMessageTemplate *tmpl,
+                                                               int                  first_arg_type,
+                                                               va_list              var_args);
+
 
 dbus_bool_t dbus_message_iter_init             (DBusMessage     *message,
                                                 DBusMessageIter *iter);
@@ -189,6 +203,12 @@ dbus_bool_t dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
                                                   int              element_type,
                                                   const void      *value,
                                                   int              n_elements);
+dbus_bool_t dbus_message_iter_append_borrowed_array (DBusMessageIter  *iter,
+                                                     int               element_type,
+                                                     const void       *value,
+                                                     int               n_elements,
+                                                     DBusFreeFunction  free_function,
+                                                     void             *free_data);
 dbus_bool_t dbus_message_iter_open_container     (DBusMessageIter *iter,
                                                   int              type,
                                                   const char      *contained_signature,
@@ -22,6 +22,7 @@
  */
 #include "dbus-object-tree.h"
 #include "dbus-connection-internal.h"
+#include "dbus-message-internal.h"
 #include "dbus-internals.h"
 #include "dbus-hash.h"
 #include "dbus-protocol.h"
@@ -44,6 +45,7 @@
 typedef struct DBusObjectSubtree DBusObjectSubtree;
 
 static DBusObjectSubtree* _dbus_object_subtree_new   (const char                  *name,
+                                                      int                          name_len,
                                                       const DBusObjectPathVTable  *vtable,
                                                       void                        *user_data);
 static DBusObjectSubtree* _dbus_object_subtree_ref   (DBusObjectSubtree           *subtree);
@@ -58,6 +60,8 @@ struct DBusObjectTree
   DBusConnection     *connection; /**< Connection this tree belongs to */
 
   DBusObjectSubtree  *root;       /**< Root of the tree ("/" node) */
+
+  DBusHashTable      *handlers;   /**< Path string to the subtree with a handler registered there */
 };
 
 /**
@@ -72,6 +76,8 @@ struct DBusObjectSubtree
   DBusObjectPathUnregisterFunction   unregister_function; /**< Function to call on unregister */
   DBusObjectPathMessageFunction      message_function;    /**< Function to handle messages */
   void                              *user_data;           /**< Data for functions */
+  char                              *path;                /**< Full path, key in the tree's handlers table; #NULL if no handler */
+  char                              *introspection;       /**< Default Introspect() data listing the child nodes, #NULL until needed */
   DBusObjectSubtree                **subtrees;            /**< Child nodes */
   int                                n_subtrees;          /**< Number of child nodes */
   int                                max_subtrees;        /**< Number of allocated entries in subtrees */
@@ -102,16 +108,23 @@ _dbus_object_tree_new (DBusConnection *connection)
 
   tree->refcount = 1;
   tree->connection = connection;
-  tree->root = _dbus_object_subtree_new ("/", NULL, NULL);
+  tree->root = _dbus_object_subtree_new ("/", 1, NULL, NULL);
   if (tree->root == NULL)
     goto oom;
   tree->root->invoke_as_fallback = TRUE;
+
+  /* keys are owned by the subtrees */
+  tree->handlers = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (tree->handlers == NULL)
+    goto oom;
   
   return tree;
 
  oom:
   if (tree)
     {
+      if (tree->root)
+        _dbus_object_subtree_unref (tree->root);
       dbus_free (tree);
     }
 
@@ -148,6 +161,7 @@ _dbus_object_tree_unref (DBusObjectTree *tree)
     {
       _dbus_object_tree_free_all_unlocked (tree);
 
+      _dbus_hash_table_unref (tree->handlers);
       dbus_free (tree);
     }
 }
@@ -157,21 +171,87 @@ _dbus_object_tree_unref (DBusObjectTree *tree)
  */
 #define VERBOSE_FIND 0
 
+/** Number of handlers for one message that dispatch keeps track of
+ * without allocating
+ */
+#define MAX_STACK_HANDLERS 8
+
+/* Gets component i of the path and its length */
+static const char*
+path_component (const DBusPathView *path,
+                int                 i,
+                int                *len)
+{
+  _dbus_assert (i < path->n_components);
+
+  if (path->data != NULL)
+    {
+      *len = path->starts[i + 1] - path->starts[i] - 1;
+      return path->data + path->starts[i];
+    }
+  else
+    {
+      *len = strlen (path->components[i]);
+      return path->components[i];
+    }
+}
+
+/* Compares a path component that isn't nul-terminated to a subtree
+ * name, ordering them the way strcmp() would
+ */
+static int
+compare_component (const char *component,
+                   int         len,
+                   const char *name)
+{
+  int v;
+
+  v = strncmp (component, name, len);
+  if (v == 0 && name[len] != '\0')
+    v = -1;
+
+  return v;
+}
+
+/* Describes a decomposed path without copying it */
+static void
+path_view_init_decomposed (DBusPathView  *view,
+                           const char   **path)
+{
+  view->data = NULL;
+  view->starts = NULL;
+  view->components = path;
+  view->n_components = 0;
+  while (path[view->n_components] != NULL)
+    view->n_components += 1;
+}
+
+/* Forgets the default Introspect() data, when the children change */
+static void
+invalidate_introspection (DBusObjectSubtree *subtree)
+{
+  dbus_free (subtree->introspection);
+  subtree->introspection = NULL;
+}
+
 static DBusObjectSubtree*
 find_subtree_recurse (DBusObjectSubtree  *subtree,
-                      const char        **path,
+                      const DBusPathView *path,
+                      int                 component,
                       dbus_bool_t         create_if_not_found,
                       int                *index_in_parent,
                       dbus_bool_t        *exact_match)
 {
   int i, j;
+  const char *name;
+  int name_len;
   dbus_bool_t return_deepest_match;
 
   return_deepest_match = exact_match != NULL;
 
   _dbus_assert (!(return_deepest_match && create_if_not_found));
 
-  if (path[0] == NULL)
+  if (component == path->n_components)
     {
 #if VERBOSE_FIND
       _dbus_verbose ("  path exhausted, returning %s\n",
@@ -182,9 +262,11 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
       return subtree;
     }
 
+  name = path_component (path, component, &name_len);
+
 #if VERBOSE_FIND
-  _dbus_verbose ("  searching children of %s for %s\n",
-                 subtree->name, path[0]);
+  _dbus_verbose ("  searching children of %s for %.*s\n",
+                 subtree->name, name_len, name);
 #endif
   
   i = 0;
@@ -194,11 +276,11 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
       int k, v;
 
       k = (i + j) / 2;
-      v = strcmp (path[0], subtree->subtrees[k]->name);
+      v = compare_component (name, name_len, subtree->subtrees[k]->name);
 
 #if VERBOSE_FIND
-      _dbus_verbose ("  %s cmp %s = %d\n",
-                     path[0], subtree->subtrees[k]->name,
+      _dbus_verbose ("  %.*s cmp %s = %d\n",
+                     name_len, name, subtree->subtrees[k]->name,
                      v);
 #endif
       
@@ -217,7 +299,8 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
               DBusObjectSubtree *next;
 
               next = find_subtree_recurse (subtree->subtrees[k],
-                                           &path[1], create_if_not_found, 
+                                           path, component + 1,
+                                           create_if_not_found, 
                                            index_in_parent, exact_match);
               if (next == NULL &&
                   subtree->invoke_as_fallback)
@@ -235,7 +318,8 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
             }
           else
             return find_subtree_recurse (subtree->subtrees[k],
-                                         &path[1], create_if_not_found, 
+                                         path, component + 1,
+                                         create_if_not_found, 
                                          index_in_parent, exact_match);
         }
       else if (v < 0)
@@ -259,11 +343,11 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
       int child_pos, new_n_subtrees;
 
 #if VERBOSE_FIND
-      _dbus_verbose ("  creating subtree %s\n",
-                     path[0]);
+      _dbus_verbose ("  creating subtree %.*s\n",
+                     name_len, name);
 #endif
       
-      child = _dbus_object_subtree_new (path[0],
+      child = _dbus_object_subtree_new (name, name_len,
                                         NULL, NULL);
       if (child == NULL)
         return NULL;
@@ -305,8 +389,11 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
       subtree->n_subtrees = new_n_subtrees;
       child->parent = subtree;
 
+      invalidate_introspection (subtree);
+
       return find_subtree_recurse (child,
-                                   &path[1], create_if_not_found, 
+                                   path, component + 1,
+                                   create_if_not_found, 
                                    index_in_parent, exact_match);
     }
   else
@@ -323,12 +410,14 @@ find_subtree (DBusObjectTree *tree,
               int            *index_in_parent)
 {
   DBusObjectSubtree *subtree;
+  DBusPathView view;
 
 #if VERBOSE_FIND
   _dbus_verbose ("Looking for exact registered subtree\n");
 #endif
-  
-  subtree = find_subtree_recurse (tree->root, path, FALSE, index_in_parent, NULL);
+
+  path_view_init_decomposed (&view, path);
+  subtree = find_subtree_recurse (tree->root, &view, 0, FALSE, index_in_parent, NULL);
 
   if (subtree && subtree->message_function == NULL)
     return NULL;
@@ -337,19 +426,19 @@ find_subtree (DBusObjectTree *tree,
 }
 
 static DBusObjectSubtree*
-lookup_subtree (DBusObjectTree *tree,
-                const char    **path)
+lookup_subtree (DBusObjectTree     *tree,
+                const DBusPathView *path)
 {
 #if VERBOSE_FIND
   _dbus_verbose ("Looking for subtree\n");
 #endif
-  return find_subtree_recurse (tree->root, path, FALSE, NULL, NULL);
+  return find_subtree_recurse (tree->root, path, 0, FALSE, NULL, NULL);
 }
 
 static DBusObjectSubtree*
-find_handler (DBusObjectTree *tree,
-              const char    **path,
-              dbus_bool_t    *exact_match)
+find_handler_for_view (DBusObjectTree     *tree,
+                       const DBusPathView *path,
+                       dbus_bool_t        *exact_match)
 {
 #if VERBOSE_FIND
   _dbus_verbose ("Looking for deepest handler\n");
@@ -358,17 +447,75 @@ find_handler (DBusObjectTree *tree,
 
   *exact_match = FALSE; /* ensure always initialized */
   
-  return find_subtree_recurse (tree->root, path, FALSE, NULL, exact_match);
+  return find_subtree_recurse (tree->root, path, 0, FALSE, NULL, exact_match);
+}
+
+static DBusObjectSubtree*
+find_handler (DBusObjectTree *tree,
+              const char    **path,
+              dbus_bool_t    *exact_match)
+{
+  DBusPathView view;
+
+  path_view_init_decomposed (&view, path);
+  return find_handler_for_view (tree, &view, exact_match);
 }
 
 static DBusObjectSubtree*
 ensure_subtree (DBusObjectTree *tree,
                 const char    **path)
 {
+  DBusPathView view;
+
 #if VERBOSE_FIND
   _dbus_verbose ("Ensuring subtree\n");
 #endif
-  return find_subtree_recurse (tree->root, path, TRUE, NULL, NULL);
+  path_view_init_decomposed (&view, path);
+  return find_subtree_recurse (tree->root, &view, 0, TRUE, NULL, NULL);
+}
+
+/* Builds the path string for a decomposed path */
+static char*
+flatten_path (const char **path)
+{
+  DBusString str;
+  char *s;
+
+  if (!_dbus_string_init (&str))
+    return NULL;
+
+  if (path[0] == NULL)
+    {
+      if (!_dbus_string_append_byte (&str, '/'))
+        goto nomem;
+    }
+  else
+    {
+      int i;
+      
+      i = 0;
+      while (path[i])
+        {
+          if (!_dbus_string_append_byte (&str, '/'))
+            goto nomem;
+          
+          if (!_dbus_string_append (&str, path[i]))
+            goto nomem;
+          
+          ++i;
+        }
+    }
+
+  if (!_dbus_string_steal_data (&str, &s))
+    goto nomem;
+
+  _dbus_string_free (&str);
+
+  return s;
+
+ nomem:
+  _dbus_string_free (&str);
+  return NULL;
 }
 
 /**
@@ -389,6 +536,7 @@ _dbus_object_tree_register (DBusObjectTree              *tree,
                             void                        *user_data)
 {
   DBusObjectSubtree  *subtree;
+  char *flat_path;
 
   _dbus_assert (tree != NULL);
   _dbus_assert (vtable->message_function != NULL);
@@ -409,6 +557,19 @@ _dbus_object_tree_register (DBusObjectTree              *tree,
   _dbus_assert (subtree->message_function == NULL);
 #endif
 
+  _dbus_assert (subtree->path == NULL);
+
+  flat_path = flatten_path (path);
+  if (flat_path == NULL)
+    return FALSE;
+
+  if (!_dbus_hash_table_insert_string (tree->handlers, flat_path, subtree))
+    {
+      dbus_free (flat_path);
+      return FALSE;
+    }
+
+  subtree->path = flat_path;
   subtree->message_function = vtable->message_function;
   subtree->unregister_function = vtable->unregister_function;
   subtree->user_data = user_data;
@@ -458,6 +619,10 @@ _dbus_object_tree_unregister_and_unlock (DBusObjectTree          *tree,
 
   subtree->message_function = NULL;
 
+  _dbus_hash_table_remove_string (tree->handlers, subtree->path);
+  dbus_free (subtree->path);
+  subtree->path = NULL;
+
   unregister_function = subtree->unregister_function;
   user_data = subtree->user_data;
 
@@ -477,6 +642,7 @@ _dbus_object_tree_unregister_and_unlock (DBusObjectTree          *tree,
                sizeof (subtree->parent->subtrees[0]));
       subtree->parent->n_subtrees -= 1;
 
+      invalidate_introspection (subtree->parent);
       subtree->parent = NULL;
 
       _dbus_object_subtree_unref (subtree);
@@ -524,6 +690,8 @@ free_subtree_recurse (DBusConnection    *connection,
       free_subtree_recurse (connection, child);
     }
 
+  invalidate_introspection (subtree);
+
   /* Call application code */
   if (subtree->unregister_function)
     (* subtree->unregister_function) (connection,
@@ -532,6 +700,8 @@ free_subtree_recurse (DBusConnection    *connection,
   subtree->message_function = NULL;
   subtree->unregister_function = NULL;
   subtree->user_data = NULL;
+  dbus_free (subtree->path);
+  subtree->path = NULL;
 
   /* Now free ourselves */
   _dbus_object_subtree_unref (subtree);
@@ -546,6 +716,8 @@ free_subtree_recurse (DBusConnection    *connection,
 void
 _dbus_object_tree_free_all_unlocked (DBusObjectTree *tree)
 {
+  _dbus_hash_table_remove_all (tree->handlers);
+
   if (tree->root)
     free_subtree_recurse (tree->connection,
                           tree->root);
@@ -558,6 +730,7 @@ _dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
                                             char         ***child_entries)
 {
   DBusObjectSubtree *subtree;
+  DBusPathView view;
   char **retval;
   
   _dbus_assert (parent_path != NULL);
@@ -565,7 +738,8 @@ _dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
 
   *child_entries = NULL;
   
-  subtree = lookup_subtree (tree, parent_path);
+  path_view_init_decomposed (&view, parent_path);
+  subtree = lookup_subtree (tree, &view);
   if (subtree == NULL)
     {
       retval = dbus_new0 (char *, 1);
@@ -596,15 +770,63 @@ _dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
   return retval != NULL;
 }
 
+/* Gets the default Introspect() data for a node, which lists its
+ * children. It is built on first use and kept on the subtree until
+ * its children change; a path with no node has no children.
+ */
+static const char*
+get_default_introspection (DBusObjectSubtree *subtree)
+{
+  DBusString xml;
+  int i;
+
+  if (subtree == NULL)
+    return DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE "<node>\n</node>\n";
+
+  if (subtree->introspection != NULL)
+    return subtree->introspection;
+
+  if (!_dbus_string_init (&xml))
+    return NULL;
+
+  if (!_dbus_string_append (&xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
+    goto nomem;
+  
+  if (!_dbus_string_append (&xml, "<node>\n"))
+    goto nomem;
+
+  i = 0;
+  while (i < subtree->n_subtrees)
+    {
+      if (!_dbus_string_append (&xml, "  <node name=\"") ||
+          !_dbus_string_append (&xml, subtree->subtrees[i]->name) ||
+          !_dbus_string_append (&xml, "\"/>\n"))
+        goto nomem;
+
+      ++i;
+    }
+
+  if (!_dbus_string_append (&xml, "</node>\n"))
+    goto nomem;
+
+  if (!_dbus_string_steal_data (&xml, &subtree->introspection))
+    goto nomem;
+
+  _dbus_string_free (&xml);
+
+  return subtree->introspection;
+
+ nomem:
+  _dbus_string_free (&xml);
+  return NULL;
+}
+
 static DBusHandlerResult
 handle_default_introspect_and_unlock (DBusObjectTree          *tree,
-                                      DBusMessage             *message,
-                                      const char             **path)
+                                      DBusMessage             *message)
 {
-  DBusString xml;
+  const DBusPathView *path;
   DBusHandlerResult result;
-  char **children;
-  int i;
   DBusMessage *reply;
   DBusMessageIter iter;
   const char *v_STRING;
@@ -634,43 +856,22 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
     }
 
   _dbus_verbose (" using default Introspect() handler!\n");
-  
-  if (!_dbus_string_init (&xml))
-    {
-#ifdef DBUS_BUILD_TESTS
-      if (tree->connection)
-#endif
-        {
-          _dbus_verbose ("unlock %s %d\n", _DBUS_FUNCTION_NAME, __LINE__);
-          _dbus_connection_unlock (tree->connection);
-        }
-
-      return DBUS_HANDLER_RESULT_NEED_MEMORY;
-    }
 
   result = DBUS_HANDLER_RESULT_NEED_MEMORY;
 
-  children = NULL;
-  if (!_dbus_object_tree_list_registered_unlocked (tree, path, &children))
+  if (!_dbus_message_get_path_view (message, &path))
     goto out;
 
-  if (!_dbus_string_append (&xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
-    goto out;
-  
-  if (!_dbus_string_append (&xml, "<node>\n"))
-    goto out;
-
-  i = 0;
-  while (children[i] != NULL)
+  if (path == NULL)
     {
-      if (!_dbus_string_append_printf (&xml, "  <node name=\"%s\"/>\n",
-                                       children[i]))
-        goto out;
-
-      ++i;
+      /* no path to introspect; dispatch doesn't get here without one */
+      result = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+      goto out;
     }
 
-  if (!_dbus_string_append (&xml, "</node>\n"))
+  /* The data is only valid while we hold the lock */
+  v_STRING = get_default_introspection (lookup_subtree (tree, path));
+  if (v_STRING == NULL)
     goto out;
 
   reply = dbus_message_new_method_return (message);
@@ -678,7 +879,6 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
     goto out;
 
   dbus_message_iter_init_append (reply, &iter);
-  v_STRING = _dbus_string_get_const_data (&xml);
   if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &v_STRING))
     goto out;
   
@@ -706,14 +906,40 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
         }
     }
   
-  _dbus_string_free (&xml);
-  dbus_free_string_array (children);
   if (reply)
     dbus_message_unref (reply);
   
   return result;
 }
 
+/* Counts the handlers that cover a message to the path of subtree,
+ * and if handlers is not NULL stores them there with a reference,
+ * deepest paths first since they run first
+ */
+static int
+collect_handlers (DBusObjectSubtree  *subtree,
+                  dbus_bool_t         exact_match,
+                  DBusObjectSubtree **handlers)
+{
+  int n_handlers;
+
+  n_handlers = 0;
+  while (subtree != NULL)
+    {
+      if (subtree->message_function != NULL && (exact_match || subtree->invoke_as_fallback))
+        {
+          if (handlers != NULL)
+            handlers[n_handlers] = _dbus_object_subtree_ref (subtree);
+          n_handlers += 1;
+        }
+
+      exact_match = FALSE;
+      subtree = subtree->parent;
+    }
+
+  return n_handlers;
+}
+
 /**
  * Tries to dispatch a message by directing it to handler for the
  * object path listed in the message header, if any. Messages are
@@ -731,19 +957,36 @@ DBusHandlerResult
 _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
                                        DBusMessage             *message)
 {
-  char **path;
+  const DBusPathView *path;
+  const char *flat_path;
   dbus_bool_t exact_match;
-  DBusList *list;
-  DBusList *link;
+  DBusObjectSubtree *stack_handlers[MAX_STACK_HANDLERS];
+  DBusObjectSubtree **handlers;
+  int n_handlers;
+  int i;
   DBusHandlerResult result;
   DBusObjectSubtree *subtree;
   
 #if 0
   _dbus_verbose ("Dispatch of message by object path\n");
 #endif
+
+  /* Most messages go to a path that has a handler registered for it
+   * exactly, which one hash lookup finds
+   */
+  flat_path = dbus_message_get_path (message);
+  if (flat_path != NULL)
+    subtree = _dbus_hash_table_lookup_string (tree->handlers, flat_path);
+  else
+    subtree = NULL;
+
+  if (subtree != NULL)
+    {
+      exact_match = TRUE;
+      goto have_handler;
+    }
   
-  path = NULL;
-  if (!dbus_message_get_path_decomposed (message, &path))
+  if (!_dbus_message_get_path_view (message, &path))
     {
 #ifdef DBUS_BUILD_TESTS
       if (tree->connection)
@@ -773,43 +1016,48 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
     }
   
   /* Find the deepest path that covers the path in the message */
-  subtree = find_handler (tree, (const char**) path, &exact_match);
-  
-  /* Build a list of all paths that cover the path in the message */
+  subtree = find_handler_for_view (tree, path, &exact_match);
 
-  list = NULL;
+ have_handler:
+  
+  /* Collect all paths that cover the path in the message; there
+   * are rarely more than a couple, so they normally fit on the stack
+   */
 
-  while (subtree != NULL)
+  n_handlers = collect_handlers (subtree, exact_match, NULL);
+  if (n_handlers <= MAX_STACK_HANDLERS)
     {
-      if (subtree->message_function != NULL && (exact_match || subtree->invoke_as_fallback))
+      handlers = stack_handlers;
+    }
+  else
+    {
+      handlers = dbus_new (DBusObjectSubtree *, n_handlers);
+      if (handlers == NULL)
         {
-          _dbus_object_subtree_ref (subtree);
-
-          /* run deepest paths first */
-          if (!_dbus_list_append (&list, subtree))
+#ifdef DBUS_BUILD_TESTS
+          if (tree->connection)
+#endif
             {
-              result = DBUS_HANDLER_RESULT_NEED_MEMORY;
-              _dbus_object_subtree_unref (subtree);
-              goto free_and_return;
+              _dbus_verbose ("unlock %s\n", _DBUS_FUNCTION_NAME);
+              _dbus_connection_unlock (tree->connection);
             }
-        }
 
-      exact_match = FALSE;
-      subtree = subtree->parent;
+          return DBUS_HANDLER_RESULT_NEED_MEMORY;
+        }
     }
 
+  collect_handlers (subtree, exact_match, handlers);
+
   _dbus_verbose ("%d handlers in the path tree for this message\n",
-                 _dbus_list_get_length (&list));
+                 n_handlers);
 
-  /* Invoke each handler in the list */
+  /* Invoke each handler in turn */
 
   result = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-  link = _dbus_list_get_first_link (&list);
-  while (link != NULL)
+  for (i = 0; i < n_handlers; i++)
     {
-      DBusList *next = _dbus_list_get_next_link (&list, link);
-      subtree = link->data;
+      subtree = handlers[i];
 
       /* message_function is NULL if we're unregistered
        * due to reentrancy
@@ -849,20 +1097,15 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
             _dbus_connection_lock (tree->connection);
 
           if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
-            goto free_and_return;
+            break;
         }
-
-      link = next;
     }
 
- free_and_return:
-
   if (result == DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
     {
       /* This hardcoded default handler does a minimal Introspect()
        */
-      result = handle_default_introspect_and_unlock (tree, message,
-                                                     (const char**) path);
+      result = handle_default_introspect_and_unlock (tree, message);
     }
   else
     {
@@ -875,14 +1118,11 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
         }
     }
   
-  while (list != NULL)
-    {
-      link = _dbus_list_get_first_link (&list);
-      _dbus_object_subtree_unref (link->data);
-      _dbus_list_remove_link (&list, link);
-    }
-  
-  dbus_free_string_array (path);
+  for (i = 0; i < n_handlers; i++)
+    _dbus_object_subtree_unref (handlers[i]);
+
+  if (handlers != stack_handlers)
+    dbus_free (handlers);
 
   return result;
 }
@@ -921,38 +1161,39 @@ _dbus_object_tree_get_user_data_unlocked (DBusObjectTree *tree,
 /**
  * Allocates a subtree object.
  *
- * @param name name to duplicate.
+ * @param name name to duplicate, need not be nul-terminated
+ * @param len length of name
  * @returns newly-allocated subtree
  */
 static DBusObjectSubtree*
-allocate_subtree_object (const char *name)
+allocate_subtree_object (const char *name,
+                         int         len)
 {
-  int len;
   DBusObjectSubtree *subtree;
   const size_t front_padding = _DBUS_STRUCT_OFFSET (DBusObjectSubtree, name);
 
   _dbus_assert (name != NULL);
 
-  len = strlen (name);
-
   subtree = dbus_malloc (MAX (front_padding + (len + 1), sizeof (DBusObjectSubtree)));
 
   if (subtree == NULL)
     return NULL;
 
-  memcpy (subtree->name, name, len + 1);
+  memcpy (subtree->name, name, len);
+  subtree->name[len] = '\0';
 
   return subtree;
 }
 
 static DBusObjectSubtree*
 _dbus_object_subtree_new (const char                  *name,
+                          int                          name_len,
                           const DBusObjectPathVTable  *vtable,
                           void                        *user_data)
 {
   DBusObjectSubtree *subtree;
 
-  subtree = allocate_subtree_object (name);
+  subtree = allocate_subtree_object (name, name_len);
   if (subtree == NULL)
     goto oom;
 
@@ -972,6 +1213,8 @@ _dbus_object_subtree_new (const char                  *name,
     }
 
   subtree->user_data = user_data;
+  subtree->path = NULL;
+  subtree->introspection = NULL;
   subtree->refcount.value = 1;
   subtree->subtrees = NULL;
   subtree->n_subtrees = 0;
@@ -1002,7 +1245,9 @@ _dbus_object_subtree_unref (DBusObjectSubtree *subtree)
     {
       _dbus_assert (subtree->unregister_function == NULL);
       _dbus_assert (subtree->message_function == NULL);
+      _dbus_assert (subtree->path == NULL);
 
+      dbus_free (subtree->introspection);
       dbus_free (subtree->subtrees);
       dbus_free (subtree);
     }
@@ -1071,17 +1316,7 @@ _dbus_decompose_path (const char*     data,
                  data);
 #endif
   
-  n_components = 0;
-  if (len > 1) /* if path is not just "/" */
-    {
-      i = 0;
-      while (i < len)
-        {
-          if (data[i] == '/')
-            n_components += 1;
-          ++i;
-        }
-    }
+  n_components = _dbus_path_count_components (data, len);
   
   retval = dbus_new0 (char*, n_components + 1);
 
@@ -1138,58 +1373,80 @@ _dbus_decompose_path (const char*     data,
   return TRUE;
 }
 
-/** @} */
-
-#ifdef DBUS_BUILD_TESTS
+/**
+ * Counts the components of a valid object path; "/" has none.
+ * The path need not be nul terminated.
+ *
+ * @param data the path data
+ * @param len the length of the path string
+ * @returns the number of components
+ */
+int
+_dbus_path_count_components (const char *data,
+                             int         len)
+{
+  int n_components;
+  int i;
 
-#ifndef DOXYGEN_SHOULD_SKIP_THIS
+  n_components = 0;
+  if (len > 1) /* if path is not just "/" */
+    {
+      i = 0;
+      while (i < len)
+        {
+          if (data[i] == '/')
+            n_components += 1;
+          ++i;
+        }
+    }
 
-#include "dbus-test.h"
-#include <stdio.h>
+  return n_components;
+}
 
-static char*
-flatten_path (const char **path)
+/**
+ * Finds where the components of a valid object path start, for a
+ * #DBusPathView. starts must have room for one more entry than
+ * _dbus_path_count_components() returns; the last one is set to
+ * len + 1, so component i is always
+ * [starts[i], starts[i + 1] - 1).
+ *
+ * @param data the path data
+ * @param len the length of the path string
+ * @param starts return location for the component offsets
+ */
+void
+_dbus_path_find_components (const char *data,
+                            int         len,
+                            int        *starts)
 {
-  DBusString str;
-  char *s;
-
-  if (!_dbus_string_init (&str))
-    return NULL;
+  int i, comp;
 
-  if (path[0] == NULL)
-    {
-      if (!_dbus_string_append_byte (&str, '/'))
-        goto nomem;
-    }
-  else
+  comp = 0;
+  if (len > 1)
     {
-      int i;
-      
       i = 0;
-      while (path[i])
+      while (i < len)
         {
-          if (!_dbus_string_append_byte (&str, '/'))
-            goto nomem;
-          
-          if (!_dbus_string_append (&str, path[i]))
-            goto nomem;
-          
+          if (data[i] == '/')
+            {
+              starts[comp] = i + 1;
+              comp += 1;
+            }
           ++i;
         }
     }
 
-  if (!_dbus_string_steal_data (&str, &s))
-    goto nomem;
+  starts[comp] = len + 1;
+}
 
-  _dbus_string_free (&str);
+/** @} */
 
-  return s;
+#ifdef DBUS_BUILD_TESTS
 
- nomem:
-  _dbus_string_free (&str);
-  return NULL;
-}
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
 
+#include "dbus-test.h"
+#include <stdio.h>
 
 typedef enum 
 {
@@ -1439,6 +1696,9 @@ run_decompose_tests (void)
       char **result;
       int    result_len;
       int    expected_len;
+      DBusPathView view;
+      int   *starts;
+      int    j;
 
       if (!_dbus_decompose_path (decompose_tests[i].path,
                                  strlen (decompose_tests[i].path),
@@ -1468,6 +1728,41 @@ run_decompose_tests (void)
           _dbus_assert_not_reached ("path decompose failed\n");
         }
 
+      starts = dbus_new (int, result_len + 1);
+      if (starts == NULL)
+        {
+          dbus_free_string_array (result);
+          return FALSE;
+        }
+
+      view.data = decompose_tests[i].path;
+      view.starts = starts;
+      view.components = NULL;
+      view.n_components = _dbus_path_count_components (view.data,
+                                                       strlen (view.data));
+      _dbus_assert (view.n_components == result_len);
+      _dbus_path_find_components (view.data, strlen (view.data), starts);
+
+      j = 0;
+      while (j < result_len)
+        {
+          const char *component;
+          int len;
+
+          component = path_component (&view, j, &len);
+          if (len != (int) strlen (result[j]) ||
+              strncmp (component, result[j], len) != 0 ||
+              compare_component (component, len, result[j]) != 0)
+            {
+              _dbus_warn ("Expected component %d of %s to be %s\n",
+                          j, decompose_tests[i].path, result[j]);
+              _dbus_assert_not_reached ("path components did not match");
+            }
+
+          ++j;
+        }
+
+      dbus_free (starts);
       dbus_free_string_array (result);
 
       ++i;
@@ -1914,6 +2209,109 @@ object_tree_test_iteration (void *data)
   return TRUE;
 }
 
+/* Dispatching to registered objects, whether the path has a handler
+ * of its own or goes to a fallback, shouldn't allocate
+ */
+static void
+check_dispatch_allocations (void)
+{
+  const char *fallback_path[] = { "foo", NULL };
+  const char *object_path[] = { "foo", "bar", NULL };
+  const char *message_paths[] = { "/foo/bar", "/foo/bar/baz/boo", "/foo/quux" };
+  TreeTestData tree_test_data[2];
+  DBusObjectTree *tree;
+  int i;
+
+  tree = _dbus_object_tree_new (NULL);
+  if (tree == NULL ||
+      !do_register (tree, fallback_path, TRUE, 0, tree_test_data) ||
+      !do_register (tree, object_path, FALSE, 1, tree_test_data))
+    _dbus_assert_not_reached ("no memory");
+
+  i = 0;
+  while (i < _DBUS_N_ELEMENTS (message_paths))
+    {
+      DBusMessage *message;
+      int start_allocs;
+
+      message = dbus_message_new_method_call (NULL,
+                                              message_paths[i],
+                                              "org.freedesktop.TestInterface",
+                                              "Foo");
+      if (message == NULL)
+        _dbus_assert_not_reached ("no memory");
+
+      tree_test_data[0].message_handled = FALSE;
+      tree_test_data[1].message_handled = FALSE;
+
+      start_allocs = _dbus_get_fail_alloc_counter ();
+      if (_dbus_object_tree_dispatch_and_unlock (tree, message) ==
+          DBUS_HANDLER_RESULT_NEED_MEMORY)
+        _dbus_assert_not_reached ("no memory");
+      if (_dbus_get_fail_alloc_counter () != start_allocs)
+        _dbus_assert_not_reached ("dispatching to the object tree allocated memory");
+
+      _dbus_assert (tree_test_data[0].message_handled);
+      _dbus_assert (tree_test_data[1].message_handled == (i == 0));
+
+      dbus_message_unref (message);
+
+      ++i;
+    }
+
+  _dbus_object_tree_unref (tree);
+}
+
+/* The default Introspect() data follows the children of a node as
+ * objects are registered and unregistered
+ */
+static void
+check_default_introspection (void)
+{
+  const char *foo[] = { "foo", NULL };
+  const char *bar[] = { "foo", "bar", NULL };
+  const char *baz[] = { "foo", "baz", NULL };
+  TreeTestData tree_test_data[2];
+  DBusObjectTree *tree;
+  DBusPathView view;
+  const char *xml;
+
+  path_view_init_decomposed (&view, foo);
+
+  tree = _dbus_object_tree_new (NULL);
+  if (tree == NULL ||
+      !do_register (tree, bar, FALSE, 0, tree_test_data))
+    _dbus_assert_not_reached ("no memory");
+
+  xml = get_default_introspection (lookup_subtree (tree, &view));
+  if (xml == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (strstr (xml, "<node name=\"bar\"/>") != NULL);
+  _dbus_assert (strstr (xml, "<node name=\"baz\"/>") == NULL);
+
+  /* cached until the children change */
+  _dbus_assert (get_default_introspection (lookup_subtree (tree, &view)) == xml);
+
+  if (!do_register (tree, baz, FALSE, 1, tree_test_data))
+    _dbus_assert_not_reached ("no memory");
+
+  xml = get_default_introspection (lookup_subtree (tree, &view));
+  if (xml == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (strstr (xml, "<node name=\"bar\"/>") != NULL);
+  _dbus_assert (strstr (xml, "<node name=\"baz\"/>") != NULL);
+
+  _dbus_object_tree_unregister_and_unlock (tree, bar);
+
+  xml = get_default_introspection (lookup_subtree (tree, &view));
+  if (xml == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (strstr (xml, "<node name=\"bar\"/>") == NULL);
+  _dbus_assert (strstr (xml, "<node name=\"baz\"/>") != NULL);
+
+  _dbus_object_tree_unref (tree);
+}
+
 /**
  * @ingroup DBusObjectTree
  * Unit test for DBusObjectTree
@@ -1922,6 +2320,9 @@ object_tree_test_iteration (void *data)
 dbus_bool_t
 _dbus_object_tree_test (void)
 {
+  check_dispatch_allocations ();
+  check_default_introspection ();
+
   _dbus_test_oom_handling ("object tree",
                            object_tree_test_iteration,
                            NULL);
@@ -56,6 +56,24 @@ dbus_bool_t _dbus_decompose_path (const char   *data,
                                   char       ***path,
                                   int          *path_len);
 
+/**
+ * The components of an object path, described without copying them:
+ * either offsets into the path string or an array of strings.
+ */
+typedef struct
+{
+  const char *data;        /**< The path string, or #NULL if components is used */
+  const int *starts;       /**< Offset in data of each component, then one past the end of data */
+  const char **components; /**< #NULL-terminated array of components, if data is #NULL */
+  int n_components;        /**< Number of components, 0 for the path "/" */
+} DBusPathView;
+
+int  _dbus_path_count_components (const char *data,
+                                  int         len);
+void _dbus_path_find_components  (const char *data,
+                                  int         len,
+                                  int        *starts);
+
 DBUS_END_DECLS
 
 #endif /* DBUS_OBJECT_TREE_H */
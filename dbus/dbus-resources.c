@@ -54,6 +54,7 @@ struct DBusCounter
   int refcount;  /**< reference count */
 
   long value;    /**< current counter value */
+  long unix_fd_value; /**< current number of unix fds counted */
 
   long notify_guard_value; /**< call notify function when crossing this value */
   DBusCounterNotifyFunction notify_function; /**< notify function */
@@ -84,6 +85,7 @@ _dbus_counter_new (void)
   
   counter->refcount = 1;
   counter->value = 0;
+  counter->unix_fd_value = 0;
 
   counter->notify_guard_value = 0;
   counter->notify_function = NULL;
@@ -158,6 +160,23 @@ _dbus_counter_adjust (DBusCounter *counter,
     (* counter->notify_function) (counter, counter->notify_data);
 }
 
+/**
+ * Adjusts the number of unix fds counted. Unlike the main value,
+ * this never calls the notify function; code that limits the number
+ * of fds checks it directly.
+ *
+ * @param counter the counter
+ * @param delta value to add to the fd count
+ */
+void
+_dbus_counter_adjust_unix_fd (DBusCounter *counter,
+                              long         delta)
+{
+  counter->unix_fd_value += delta;
+
+  _dbus_assert (counter->unix_fd_value >= 0);
+}
+
 /**
  * Gets the current value of the counter.
  *
@@ -170,6 +189,18 @@ _dbus_counter_get_value (DBusCounter *counter)
   return counter->value;
 }
 
+/**
+ * Gets the number of unix fds counted.
+ *
+ * @param counter the counter
+ * @returns the number of unix fds
+ */
+long
+_dbus_counter_get_unix_fd_value (DBusCounter *counter)
+{
+  return counter->unix_fd_value;
+}
+
 /**
  * Sets the notify function for this counter; the notify function is
  * called whenever the counter's value crosses the guard value in
@@ -40,6 +40,9 @@ void         _dbus_counter_unref     (DBusCounter *counter);
 void         _dbus_counter_adjust    (DBusCounter *counter,
                                       long         delta);
 long         _dbus_counter_get_value (DBusCounter *counter);
+void         _dbus_counter_adjust_unix_fd    (DBusCounter *counter,
+                                              long         delta);
+long         _dbus_counter_get_unix_fd_value (DBusCounter *counter);
 
 void _dbus_counter_set_notify (DBusCounter               *counter,
                                long                       guard_value,
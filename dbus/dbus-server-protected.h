@@ -48,8 +48,25 @@ struct DBusServerVTable
   
   void        (* disconnect)    (DBusServer *server);
   /**< Disconnect this server. */
+
+  dbus_bool_t (* set_listen_backlog) (DBusServer *server,
+                                      int         backlog,
+                                      DBusError  *error);
+  /**< Change the listen backlog, or #NULL if the server has none. */
 };
 
+/**
+ * Counters kept by servers that accept connections on a listening
+ * socket; all zero for other servers.
+ */
+typedef struct
+{
+  unsigned long n_wakeups;  /**< Times the listening socket was readable */
+  unsigned long n_accepted; /**< Connections accepted */
+  unsigned long n_failed;   /**< accept() failures other than there being no one to accept */
+  int max_per_wakeup;       /**< Most connections accepted in one wakeup */
+} DBusServerAcceptStats;
+
 /**
  * Internals of DBusServer object
  */
@@ -82,6 +99,8 @@ struct DBusServer
    */
 
   char **auth_mechanisms; /**< Array of allowed authentication mechanisms */
+
+  DBusServerAcceptStats accept_stats; /**< How connections have been accepted */
   
   unsigned int disconnected : 1;              /**< TRUE if we are disconnected. */
 
@@ -112,6 +131,9 @@ void        _dbus_server_toggle_timeout (DBusServer             *server,
 void        _dbus_server_ref_unlocked   (DBusServer             *server);
 void        _dbus_server_unref_unlocked (DBusServer             *server);
 
+void        _dbus_server_get_accept_stats (DBusServer            *server,
+                                           DBusServerAcceptStats *stats);
+
 typedef enum
 {
   DBUS_SERVER_LISTEN_NOT_HANDLED, /**< we aren't in charge of this address type */
@@ -52,6 +52,9 @@ struct DBusServerSocket
   char *socket_name; /**< Name of domain socket, to unlink if appropriate */
 };
 
+/** Most connections accepted each time the listening socket becomes readable */
+#define MAX_ACCEPTS_PER_WAKEUP 64
+
 static void
 socket_finalize (DBusServer *server)
 {
@@ -83,12 +86,6 @@ handle_new_client_fd_and_unlock (DBusServer *server,
 
   HAVE_LOCK_CHECK (server);
   
-  if (!_dbus_set_fd_nonblocking (client_fd, NULL))
-    {
-      SERVER_UNLOCK (server);
-      return TRUE;
-    }
-  
   transport = _dbus_transport_new_for_socket (client_fd, &server->guid_hex, NULL);
   if (transport == NULL)
     {
@@ -160,30 +157,63 @@ socket_handle_watch (DBusWatch    *watch,
     {
       int client_fd;
       int listen_fd;
-      
+      int n_accepted;
+
       listen_fd = dbus_watch_get_fd (watch);
 
-      client_fd = _dbus_accept (listen_fd);
-      
-      if (client_fd < 0)
-        {
-          /* EINTR handled for us */
-          
-          if (errno == EAGAIN || errno == EWOULDBLOCK)
-            _dbus_verbose ("No client available to accept after all\n");
-          else
-            _dbus_verbose ("Failed to accept a client connection: %s\n",
-                           _dbus_strerror (errno));
+      /* The new connection function may drop the last reference */
+      _dbus_server_ref_unlocked (server);
 
-          SERVER_UNLOCK (server);
-        }
-      else
+      server->accept_stats.n_wakeups += 1;
+
+      /* Take everyone who is already waiting, so a burst of clients
+       * costs one main loop iteration per batch rather than per
+       * client; but don't starve everything else while doing it.
+       */
+      n_accepted = 0;
+      while (n_accepted < MAX_ACCEPTS_PER_WAKEUP)
         {
-	  _dbus_fd_set_close_on_exec (client_fd);	  
+          client_fd = _dbus_accept (listen_fd);
+
+          if (client_fd < 0)
+            {
+              /* EINTR handled for us */
+
+              if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                  if (n_accepted == 0)
+                    _dbus_verbose ("No client available to accept after all\n");
+                }
+              else
+                {
+                  server->accept_stats.n_failed += 1;
+                  _dbus_verbose ("Failed to accept a client connection: %s\n",
+                                 _dbus_strerror (errno));
+                }
+
+              break;
+            }
+
+          n_accepted += 1;
+          server->accept_stats.n_accepted += 1;
+          if (n_accepted > server->accept_stats.max_per_wakeup)
+            server->accept_stats.max_per_wakeup = n_accepted;
 
           if (!handle_new_client_fd_and_unlock (server, client_fd))
             _dbus_verbose ("Rejected client connection due to lack of memory\n");
+
+          SERVER_LOCK (server);
+
+          /* The new connection function may have disconnected us */
+          if (socket_server->watch == NULL)
+            break;
         }
+
+      if (n_accepted > 1)
+        _dbus_verbose ("Accepted %d clients in one wakeup\n", n_accepted);
+
+      SERVER_UNLOCK (server);
+      dbus_server_unref (server);
     }
 
   if (flags & DBUS_WATCH_ERROR)
@@ -223,9 +253,29 @@ socket_disconnect (DBusServer *server)
   HAVE_LOCK_CHECK (server);
 }
 
+static dbus_bool_t
+socket_set_listen_backlog (DBusServer *server,
+                           int         backlog,
+                           DBusError  *error)
+{
+  DBusServerSocket *socket_server = (DBusServerSocket*) server;
+
+  HAVE_LOCK_CHECK (server);
+
+  if (socket_server->fd < 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Server is not listening any more");
+      return FALSE;
+    }
+
+  return _dbus_set_listen_backlog (socket_server->fd, backlog, error);
+}
+
 static const DBusServerVTable socket_vtable = {
   socket_finalize,
-  socket_disconnect
+  socket_disconnect,
+  socket_set_listen_backlog
 };
 
 /**
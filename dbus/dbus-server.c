@@ -103,6 +103,7 @@ _dbus_server_init_base (DBusServer             *server,
   server->address = NULL;
   server->watches = NULL;
   server->timeouts = NULL;
+  _DBUS_ZERO (server->accept_stats);
 
   if (!_dbus_string_init (&server->guid_hex))
     return FALSE;
@@ -483,6 +484,22 @@ _dbus_server_unref_unlocked (DBusServer *server)
     }
 }
 
+/**
+ * Gets the counters describing how the server has been accepting
+ * connections, for statistics.
+ *
+ * @param server the server
+ * @param stats return location for the counters
+ */
+void
+_dbus_server_get_accept_stats (DBusServer            *server,
+                               DBusServerAcceptStats *stats)
+{
+  SERVER_LOCK (server);
+  *stats = server->accept_stats;
+  SERVER_UNLOCK (server);
+}
+
 /** @} */
 
 /**
@@ -989,6 +1006,50 @@ dbus_server_set_auth_mechanisms (DBusServer  *server,
   return TRUE;
 }
 
+/**
+ * Sets how many connections the operating system queues up for the
+ * server while the application is too busy to accept them. Once
+ * the queue is full, new clients are refused until there's room.
+ * This matters when a lot of clients connect at once, for example
+ * when they all reconnect after the server restarts.
+ *
+ * Only servers listening on a socket have a backlog; for other
+ * servers this fails. New servers start with a small default.
+ *
+ * @param server the server
+ * @param backlog the number of pending connections to queue
+ * @param error return location for an error, or #NULL
+ * @returns #FALSE if the backlog could not be changed
+ */
+dbus_bool_t
+dbus_server_set_listen_backlog (DBusServer *server,
+                                int         backlog,
+                                DBusError  *error)
+{
+  dbus_bool_t result;
+
+  _dbus_return_val_if_fail (server != NULL, FALSE);
+  _dbus_return_val_if_fail (backlog > 0, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  SERVER_LOCK (server);
+
+  if (server->vtable->set_listen_backlog != NULL)
+    {
+      result = (* server->vtable->set_listen_backlog) (server, backlog, error);
+    }
+  else
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "This server has no listen backlog");
+      result = FALSE;
+    }
+
+  SERVER_UNLOCK (server);
+
+  return result;
+}
+
 
 static DBusDataSlotAllocator slot_allocator;
 _DBUS_DEFINE_GLOBAL_LOCK (server_slots);
@@ -1110,6 +1171,103 @@ dbus_server_get_data (DBusServer   *server,
 
 #ifdef DBUS_BUILD_TESTS
 #include "dbus-test.h"
+#include "dbus-sysdeps-unix.h"
+
+#define N_ACCEPT_TEST_CLIENTS 5
+
+static dbus_bool_t
+remember_watch (DBusWatch *watch,
+                void      *data)
+{
+  DBusWatch **watch_p = data;
+
+  *watch_p = watch;
+
+  return TRUE;
+}
+
+static void
+forget_watch (DBusWatch *watch,
+              void      *data)
+{
+  DBusWatch **watch_p = data;
+
+  *watch_p = NULL;
+}
+
+static void
+check_accept_batching (void)
+{
+  DBusServer *server;
+  DBusWatch *watch;
+  DBusServerAcceptStats stats;
+  DBusError error;
+  int client_fds[N_ACCEPT_TEST_CLIENTS];
+  int i;
+
+  dbus_error_init (&error);
+
+  server = dbus_server_listen ("unix:path=./accept-test", &error);
+  if (server == NULL)
+    {
+      _dbus_warn ("server listen error: %s: %s\n", error.name, error.message);
+      _dbus_assert_not_reached ("Failed to listen for accept test");
+    }
+
+  if (!dbus_server_set_listen_backlog (server, 2 * N_ACCEPT_TEST_CLIENTS,
+                                       &error))
+    {
+      _dbus_warn ("couldn't set listen backlog: %s\n", error.message);
+      _dbus_assert_not_reached ("Failed to set listen backlog");
+    }
+
+  watch = NULL;
+  if (!dbus_server_set_watch_functions (server, remember_watch, forget_watch,
+                                        NULL, &watch, NULL))
+    _dbus_assert_not_reached ("out of memory");
+
+  _dbus_assert (watch != NULL);
+
+  for (i = 0; i < N_ACCEPT_TEST_CLIENTS; i++)
+    {
+      client_fds[i] = _dbus_connect_unix_socket ("./accept-test", FALSE,
+                                                 &error);
+      if (client_fds[i] < 0)
+        {
+          _dbus_warn ("connect error: %s\n", error.message);
+          _dbus_assert_not_reached ("Failed to connect for accept test");
+        }
+    }
+
+  /* Everyone waiting is taken in one go; with no new connection
+   * function set, the connections are dropped straight away
+   */
+  dbus_watch_handle (watch, DBUS_WATCH_READABLE);
+
+  _dbus_server_get_accept_stats (server, &stats);
+  if (stats.n_wakeups != 1 ||
+      stats.n_accepted != N_ACCEPT_TEST_CLIENTS ||
+      stats.max_per_wakeup != N_ACCEPT_TEST_CLIENTS ||
+      stats.n_failed != 0)
+    _dbus_assert_not_reached ("waiting clients weren't accepted in one batch");
+
+  for (i = 0; i < N_ACCEPT_TEST_CLIENTS; i++)
+    _dbus_close_socket (client_fds[i], NULL);
+
+  dbus_server_disconnect (server);
+  dbus_server_unref (server);
+
+  /* Servers that don't listen on a socket have no backlog */
+  server = dbus_server_listen ("debug-pipe:name=accept-test", &error);
+  if (server == NULL)
+    _dbus_assert_not_reached ("Failed to listen on debug pipe");
+
+  if (dbus_server_set_listen_backlog (server, 10, NULL))
+    _dbus_assert_not_reached ("debug pipe server has a listen backlog");
+
+  dbus_server_disconnect (server);
+  dbus_server_unref (server);
+}
 
 dbus_bool_t
 _dbus_server_test (void)
@@ -1156,6 +1314,8 @@ _dbus_server_test (void)
       dbus_server_unref (server);
     }
 
+  check_accept_batching ();
+
   return TRUE;
 }
 
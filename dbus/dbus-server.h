@@ -73,6 +73,9 @@ dbus_bool_t dbus_server_set_timeout_functions       (DBusServer                *
                                                      DBusFreeFunction           free_data_function);
 dbus_bool_t dbus_server_set_auth_mechanisms         (DBusServer                *server,
                                                      const char               **mechanisms);
+dbus_bool_t dbus_server_set_listen_backlog          (DBusServer                *server,
+                                                     int                        backlog,
+                                                     DBusError                 *error);
 
 dbus_bool_t dbus_server_allocate_data_slot (dbus_int32_t     *slot_p);
 void        dbus_server_free_data_slot     (dbus_int32_t     *slot_p);
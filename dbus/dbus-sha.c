@@ -24,9 +24,13 @@
 
 #include "dbus-internals.h"
 #include "dbus-sha.h"
-#include "dbus-marshal-basic.h" /* for byteswap routines */
 #include <string.h>
 
+#ifdef HAVE_X86_SHA_INTRINSICS
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
 /* The following comments have the history of where this code
  * comes from. I actually copied it from GNet in GNOME CVS.
  * - hp@redhat.com
@@ -157,144 +161,369 @@ effort (for example the reengineering of a great many Capstone chips).
 #define subRound(a, b, c, d, e, f, k, data) \
    ( e += ROTL( 5, a ) + f( b, c, d ) + k + data, b = ROTL( 30, b ) )
 
-#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
+/* SHA is defined on big-endian words; loading them a byte at a time
+   works whatever the alignment and byte order of the host */
 
-/* Perform the SHA transformation.  Note that this code, like MD5, seems to
-   break some optimizing compilers due to the complexity of the expressions
-   and the size of the basic block.  It may be necessary to split it into
-   sections, e.g. based on the four subrounds
+#define LOAD32_BE(p) \
+   ( ( (dbus_uint32_t) (p)[0] << 24 ) | ( (dbus_uint32_t) (p)[1] << 16 ) | \
+     ( (dbus_uint32_t) (p)[2] << 8 ) | ( (dbus_uint32_t) (p)[3] ) )
 
-   Note that this corrupts the context->data area */
+#define STORE32_BE(p, v) \
+   ( (p)[0] = (unsigned char) ( (v) >> 24 ), (p)[1] = (unsigned char) ( (v) >> 16 ), \
+     (p)[2] = (unsigned char) ( (v) >> 8 ), (p)[3] = (unsigned char) (v) )
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
+
+/* Perform the SHA transformation on n_blocks consecutive blocks.  Note
+   that this code, like MD5, seems to break some optimizing compilers due
+   to the complexity of the expressions and the size of the basic block.
+   It may be necessary to split it into sections, e.g. based on the four
+   subrounds */
 
 static void
-SHATransform(dbus_uint32_t *digest, dbus_uint32_t *data)
+SHATransform (dbus_uint32_t       *digest,
+              const unsigned char *data,
+              int                  n_blocks)
 {
   dbus_uint32_t A, B, C, D, E;     /* Local vars */
   dbus_uint32_t eData[16];       /* Expanded data */
+  int i;
 
-  /* Set up first buffer and local data buffer */
-  A = digest[0];
-  B = digest[1];
-  C = digest[2];
-  D = digest[3];
-  E = digest[4];
-  memmove (eData, data, SHA_DATASIZE);
-
-  /* Heavy mangling, in 4 sub-rounds of 20 interations each. */
-  subRound (A, B, C, D, E, f1, K1, eData[0]);
-  subRound (E, A, B, C, D, f1, K1, eData[1]);
-  subRound (D, E, A, B, C, f1, K1, eData[2]);
-  subRound (C, D, E, A, B, f1, K1, eData[3]);
-  subRound (B, C, D, E, A, f1, K1, eData[4]);
-  subRound (A, B, C, D, E, f1, K1, eData[5]);
-  subRound (E, A, B, C, D, f1, K1, eData[6]);
-  subRound (D, E, A, B, C, f1, K1, eData[7]);
-  subRound (C, D, E, A, B, f1, K1, eData[8]);
-  subRound (B, C, D, E, A, f1, K1, eData[9]);
-  subRound (A, B, C, D, E, f1, K1, eData[10]);
-  subRound (E, A, B, C, D, f1, K1, eData[11]);
-  subRound (D, E, A, B, C, f1, K1, eData[12]);
-  subRound (C, D, E, A, B, f1, K1, eData[13]);
-  subRound (B, C, D, E, A, f1, K1, eData[14]);
-  subRound (A, B, C, D, E, f1, K1, eData[15]);
-  subRound (E, A, B, C, D, f1, K1, expand ( eData, 16) );
-  subRound (D, E, A, B, C, f1, K1, expand ( eData, 17) );
-  subRound (C, D, E, A, B, f1, K1, expand ( eData, 18) );
-  subRound (B, C, D, E, A, f1, K1, expand ( eData, 19) );
-
-  subRound (A, B, C, D, E, f2, K2, expand ( eData, 20) );
-  subRound (E, A, B, C, D, f2, K2, expand ( eData, 21) );
-  subRound (D, E, A, B, C, f2, K2, expand ( eData, 22) );
-  subRound (C, D, E, A, B, f2, K2, expand ( eData, 23) );
-  subRound (B, C, D, E, A, f2, K2, expand ( eData, 24) );
-  subRound (A, B, C, D, E, f2, K2, expand ( eData, 25) );
-  subRound (E, A, B, C, D, f2, K2, expand ( eData, 26) );
-  subRound (D, E, A, B, C, f2, K2, expand ( eData, 27) );
-  subRound (C, D, E, A, B, f2, K2, expand ( eData, 28) );
-  subRound (B, C, D, E, A, f2, K2, expand ( eData, 29) );
-  subRound (A, B, C, D, E, f2, K2, expand ( eData, 30) );
-  subRound (E, A, B, C, D, f2, K2, expand ( eData, 31) );
-  subRound (D, E, A, B, C, f2, K2, expand ( eData, 32) );
-  subRound (C, D, E, A, B, f2, K2, expand ( eData, 33) );
-  subRound (B, C, D, E, A, f2, K2, expand ( eData, 34) );
-  subRound (A, B, C, D, E, f2, K2, expand ( eData, 35) );
-  subRound (E, A, B, C, D, f2, K2, expand ( eData, 36) );
-  subRound (D, E, A, B, C, f2, K2, expand ( eData, 37) );
-  subRound (C, D, E, A, B, f2, K2, expand ( eData, 38) );
-  subRound (B, C, D, E, A, f2, K2, expand ( eData, 39) );
-
-  subRound (A, B, C, D, E, f3, K3, expand ( eData, 40) );
-  subRound (E, A, B, C, D, f3, K3, expand ( eData, 41) );
-  subRound (D, E, A, B, C, f3, K3, expand ( eData, 42) );
-  subRound (C, D, E, A, B, f3, K3, expand ( eData, 43) );
-  subRound (B, C, D, E, A, f3, K3, expand ( eData, 44) );
-  subRound (A, B, C, D, E, f3, K3, expand ( eData, 45) );
-  subRound (E, A, B, C, D, f3, K3, expand ( eData, 46) );
-  subRound (D, E, A, B, C, f3, K3, expand ( eData, 47) );
-  subRound (C, D, E, A, B, f3, K3, expand ( eData, 48) );
-  subRound (B, C, D, E, A, f3, K3, expand ( eData, 49) );
-  subRound (A, B, C, D, E, f3, K3, expand ( eData, 50) );
-  subRound (E, A, B, C, D, f3, K3, expand ( eData, 51) );
-  subRound (D, E, A, B, C, f3, K3, expand ( eData, 52) );
-  subRound (C, D, E, A, B, f3, K3, expand ( eData, 53) );
-  subRound (B, C, D, E, A, f3, K3, expand ( eData, 54) );
-  subRound (A, B, C, D, E, f3, K3, expand ( eData, 55) );
-  subRound (E, A, B, C, D, f3, K3, expand ( eData, 56) );
-  subRound (D, E, A, B, C, f3, K3, expand ( eData, 57) );
-  subRound (C, D, E, A, B, f3, K3, expand ( eData, 58) );
-  subRound (B, C, D, E, A, f3, K3, expand ( eData, 59) );
-
-  subRound (A, B, C, D, E, f4, K4, expand ( eData, 60) );
-  subRound (E, A, B, C, D, f4, K4, expand ( eData, 61) );
-  subRound (D, E, A, B, C, f4, K4, expand ( eData, 62) );
-  subRound (C, D, E, A, B, f4, K4, expand ( eData, 63) );
-  subRound (B, C, D, E, A, f4, K4, expand ( eData, 64) );
-  subRound (A, B, C, D, E, f4, K4, expand ( eData, 65) );
-  subRound (E, A, B, C, D, f4, K4, expand ( eData, 66) );
-  subRound (D, E, A, B, C, f4, K4, expand ( eData, 67) );
-  subRound (C, D, E, A, B, f4, K4, expand ( eData, 68) );
-  subRound (B, C, D, E, A, f4, K4, expand ( eData, 69) );
-  subRound (A, B, C, D, E, f4, K4, expand ( eData, 70) );
-  subRound (E, A, B, C, D, f4, K4, expand ( eData, 71) );
-  subRound (D, E, A, B, C, f4, K4, expand ( eData, 72) );
-  subRound (C, D, E, A, B, f4, K4, expand ( eData, 73) );
-  subRound (B, C, D, E, A, f4, K4, expand ( eData, 74) );
-  subRound (A, B, C, D, E, f4, K4, expand ( eData, 75) );
-  subRound (E, A, B, C, D, f4, K4, expand ( eData, 76) );
-  subRound (D, E, A, B, C, f4, K4, expand ( eData, 77) );
-  subRound (C, D, E, A, B, f4, K4, expand ( eData, 78) );
-  subRound (B, C, D, E, A, f4, K4, expand ( eData, 79) );
-
-  /* Build message digest */
-  digest[0] += A;
-  digest[1] += B;
-  digest[2] += C;
-  digest[3] += D;
-  digest[4] += E;
+  while (n_blocks-- > 0)
+    {
+      /* Set up first buffer and local data buffer */
+      A = digest[0];
+      B = digest[1];
+      C = digest[2];
+      D = digest[3];
+      E = digest[4];
+      for (i = 0; i < 16; i++)
+        eData[i] = LOAD32_BE (data + i * 4);
+
+      /* Heavy mangling, in 4 sub-rounds of 20 interations each. */
+      subRound (A, B, C, D, E, f1, K1, eData[0]);
+      subRound (E, A, B, C, D, f1, K1, eData[1]);
+      subRound (D, E, A, B, C, f1, K1, eData[2]);
+      subRound (C, D, E, A, B, f1, K1, eData[3]);
+      subRound (B, C, D, E, A, f1, K1, eData[4]);
+      subRound (A, B, C, D, E, f1, K1, eData[5]);
+      subRound (E, A, B, C, D, f1, K1, eData[6]);
+      subRound (D, E, A, B, C, f1, K1, eData[7]);
+      subRound (C, D, E, A, B, f1, K1, eData[8]);
+      subRound (B, C, D, E, A, f1, K1, eData[9]);
+      subRound (A, B, C, D, E, f1, K1, eData[10]);
+      subRound (E, A, B, C, D, f1, K1, eData[11]);
+      subRound (D, E, A, B, C, f1, K1, eData[12]);
+      subRound (C, D, E, A, B, f1, K1, eData[13]);
+      subRound (B, C, D, E, A, f1, K1, eData[14]);
+      subRound (A, B, C, D, E, f1, K1, eData[15]);
+      subRound (E, A, B, C, D, f1, K1, expand ( eData, 16) );
+      subRound (D, E, A, B, C, f1, K1, expand ( eData, 17) );
+      subRound (C, D, E, A, B, f1, K1, expand ( eData, 18) );
+      subRound (B, C, D, E, A, f1, K1, expand ( eData, 19) );
+
+      subRound (A, B, C, D, E, f2, K2, expand ( eData, 20) );
+      subRound (E, A, B, C, D, f2, K2, expand ( eData, 21) );
+      subRound (D, E, A, B, C, f2, K2, expand ( eData, 22) );
+      subRound (C, D, E, A, B, f2, K2, expand ( eData, 23) );
+      subRound (B, C, D, E, A, f2, K2, expand ( eData, 24) );
+      subRound (A, B, C, D, E, f2, K2, expand ( eData, 25) );
+      subRound (E, A, B, C, D, f2, K2, expand ( eData, 26) );
+      subRound (D, E, A, B, C, f2, K2, expand ( eData, 27) );
+      subRound (C, D, E, A, B, f2, K2, expand ( eData, 28) );
+      subRound (B, C, D, E, A, f2, K2, expand ( eData, 29) );
+      subRound (A, B, C, D, E, f2, K2, expand ( eData, 30) );
+      subRound (E, A, B, C, D, f2, K2, expand ( eData, 31) );
+      subRound (D, E, A, B, C, f2, K2, expand ( eData, 32) );
+      subRound (C, D, E, A, B, f2, K2, expand ( eData, 33) );
+      subRound (B, C, D, E, A, f2, K2, expand ( eData, 34) );
+      subRound (A, B, C, D, E, f2, K2, expand ( eData, 35) );
+      subRound (E, A, B, C, D, f2, K2, expand ( eData, 36) );
+      subRound (D, E, A, B, C, f2, K2, expand ( eData, 37) );
+      subRound (C, D, E, A, B, f2, K2, expand ( eData, 38) );
+      subRound (B, C, D, E, A, f2, K2, expand ( eData, 39) );
+
+      subRound (A, B, C, D, E, f3, K3, expand ( eData, 40) );
+      subRound (E, A, B, C, D, f3, K3, expand ( eData, 41) );
+      subRound (D, E, A, B, C, f3, K3, expand ( eData, 42) );
+      subRound (C, D, E, A, B, f3, K3, expand ( eData, 43) );
+      subRound (B, C, D, E, A, f3, K3, expand ( eData, 44) );
+      subRound (A, B, C, D, E, f3, K3, expand ( eData, 45) );
+      subRound (E, A, B, C, D, f3, K3, expand ( eData, 46) );
+      subRound (D, E, A, B, C, f3, K3, expand ( eData, 47) );
+      subRound (C, D, E, A, B, f3, K3, expand ( eData, 48) );
+      subRound (B, C, D, E, A, f3, K3, expand ( eData, 49) );
+      subRound (A, B, C, D, E, f3, K3, expand ( eData, 50) );
+      subRound (E, A, B, C, D, f3, K3, expand ( eData, 51) );
+      subRound (D, E, A, B, C, f3, K3, expand ( eData, 52) );
+      subRound (C, D, E, A, B, f3, K3, expand ( eData, 53) );
+      subRound (B, C, D, E, A, f3, K3, expand ( eData, 54) );
+      subRound (A, B, C, D, E, f3, K3, expand ( eData, 55) );
+      subRound (E, A, B, C, D, f3, K3, expand ( eData, 56) );
+      subRound (D, E, A, B, C, f3, K3, expand ( eData, 57) );
+      subRound (C, D, E, A, B, f3, K3, expand ( eData, 58) );
+      subRound (B, C, D, E, A, f3, K3, expand ( eData, 59) );
+
+      subRound (A, B, C, D, E, f4, K4, expand ( eData, 60) );
+      subRound (E, A, B, C, D, f4, K4, expand ( eData, 61) );
+      subRound (D, E, A, B, C, f4, K4, expand ( eData, 62) );
+      subRound (C, D, E, A, B, f4, K4, expand ( eData, 63) );
+      subRound (B, C, D, E, A, f4, K4, expand ( eData, 64) );
+      subRound (A, B, C, D, E, f4, K4, expand ( eData, 65) );
+      subRound (E, A, B, C, D, f4, K4, expand ( eData, 66) );
+      subRound (D, E, A, B, C, f4, K4, expand ( eData, 67) );
+      subRound (C, D, E, A, B, f4, K4, expand ( eData, 68) );
+      subRound (B, C, D, E, A, f4, K4, expand ( eData, 69) );
+      subRound (A, B, C, D, E, f4, K4, expand ( eData, 70) );
+      subRound (E, A, B, C, D, f4, K4, expand ( eData, 71) );
+      subRound (D, E, A, B, C, f4, K4, expand ( eData, 72) );
+      subRound (C, D, E, A, B, f4, K4, expand ( eData, 73) );
+      subRound (B, C, D, E, A, f4, K4, expand ( eData, 74) );
+      subRound (A, B, C, D, E, f4, K4, expand ( eData, 75) );
+      subRound (E, A, B, C, D, f4, K4, expand ( eData, 76) );
+      subRound (D, E, A, B, C, f4, K4, expand ( eData, 77) );
+      subRound (C, D, E, A, B, f4, K4, expand ( eData, 78) );
+      subRound (B, C, D, E, A, f4, K4, expand ( eData, 79) );
+
+      /* Build message digest */
+      digest[0] += A;
+      digest[1] += B;
+      digest[2] += C;
+      digest[3] += D;
+      digest[4] += E;
+
+      data += SHA_DATASIZE;
+    }
 }
 
-/* When run on a little-endian CPU we need to perform byte reversal on an
-   array of longwords. */
+#ifdef HAVE_X86_SHA_INTRINSICS
+/* The same transformation using the SHA extensions of x86 processors,
+   which do four rounds per instruction.  The register shuffling follows
+   Intel's white paper "Intel SHA Extensions" */
 
-#ifdef WORDS_BIGENDIAN
-#define swap_words(buffer, byte_count)
-#else
+__attribute__ ((target ("sha,ssse3,sse4.1")))
 static void
-swap_words (dbus_uint32_t *buffer,
-            int            byte_count)
+SHATransformX86 (dbus_uint32_t       *digest,
+                 const unsigned char *data,
+                 int                  n_blocks)
 {
-  byte_count /= sizeof (dbus_uint32_t);
-  while (byte_count--)
+  __m128i abcd, abcd_save, e0, e0_save, e1;
+  __m128i msg0, msg1, msg2, msg3;
+  const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL,
+                                       0x08090a0b0c0d0e0fULL);
+
+  abcd = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) digest), 0x1B);
+  e0 = _mm_set_epi32 (digest[4], 0, 0, 0);
+
+  while (n_blocks-- > 0)
     {
-      *buffer = DBUS_UINT32_SWAP_LE_BE (*buffer);
-      ++buffer;
+      abcd_save = abcd;
+      e0_save = e0;
+
+      /* Rounds 0-3 */
+      msg0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 0)), mask);
+      e0 = _mm_add_epi32 (e0, msg0);
+      e1 = abcd;
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+
+      /* Rounds 4-7 */
+      msg1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 16)), mask);
+      e1 = _mm_sha1nexte_epu32 (e1, msg1);
+      e0 = abcd;
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+      msg0 = _mm_sha1msg1_epu32 (msg0, msg1);
+
+      /* Rounds 8-11 */
+      msg2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 32)), mask);
+      e0 = _mm_sha1nexte_epu32 (e0, msg2);
+      e1 = abcd;
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+      msg1 = _mm_sha1msg1_epu32 (msg1, msg2);
+      msg0 = _mm_xor_si128 (msg0, msg2);
+
+      /* Rounds 12-15 */
+      msg3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 48)), mask);
+      e1 = _mm_sha1nexte_epu32 (e1, msg3);
+      e0 = abcd;
+      msg0 = _mm_sha1msg2_epu32 (msg0, msg3);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+      msg2 = _mm_sha1msg1_epu32 (msg2, msg3);
+      msg1 = _mm_xor_si128 (msg1, msg3);
+
+      /* Rounds 16-19 */
+      e0 = _mm_sha1nexte_epu32 (e0, msg0);
+      e1 = abcd;
+      msg1 = _mm_sha1msg2_epu32 (msg1, msg0);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+      msg3 = _mm_sha1msg1_epu32 (msg3, msg0);
+      msg2 = _mm_xor_si128 (msg2, msg0);
+
+      /* Rounds 20-23 */
+      e1 = _mm_sha1nexte_epu32 (e1, msg1);
+      e0 = abcd;
+      msg2 = _mm_sha1msg2_epu32 (msg2, msg1);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 1);
+      msg0 = _mm_sha1msg1_epu32 (msg0, msg1);
+      msg3 = _mm_xor_si128 (msg3, msg1);
+
+      /* Rounds 24-27 */
+      e0 = _mm_sha1nexte_epu32 (e0, msg2);
+      e1 = abcd;
+      msg3 = _mm_sha1msg2_epu32 (msg3, msg2);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 1);
+      msg1 = _mm_sha1msg1_epu32 (msg1, msg2);
+      msg0 = _mm_xor_si128 (msg0, msg2);
+
+      /* Rounds 28-31 */
+      e1 = _mm_sha1nexte_epu32 (e1, msg3);
+      e0 = abcd;
+      msg0 = _mm_sha1msg2_epu32 (msg0, msg3);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 1);
+      msg2 = _mm_sha1msg1_epu32 (msg2, msg3);
+      msg1 = _mm_xor_si128 (msg1, msg3);
+
+      /* Rounds 32-35 */
+      e0 = _mm_sha1nexte_epu32 (e0, msg0);
+      e1 = abcd;
+      msg1 = _mm_sha1msg2_epu32 (msg1, msg0);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 1);
+      msg3 = _mm_sha1msg1_epu32 (msg3, msg0);
+      msg2 = _mm_xor_si128 (msg2, msg0);
+
+      /* Rounds 36-39 */
+      e1 = _mm_sha1nexte_epu32 (e1, msg1);
+      e0 = abcd;
+      msg2 = _mm_sha1msg2_epu32 (msg2, msg1);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 1);
+      msg0 = _mm_sha1msg1_epu32 (msg0, msg1);
+      msg3 = _mm_xor_si128 (msg3, msg1);
+
+      /* Rounds 40-43 */
+      e0 = _mm_sha1nexte_epu32 (e0, msg2);
+      e1 = abcd;
+      msg3 = _mm_sha1msg2_epu32 (msg3, msg2);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 2);
+      msg1 = _mm_sha1msg1_epu32 (msg1, msg2);
+      msg0 = _mm_xor_si128 (msg0, msg2);
+
+      /* Rounds 44-47 */
+      e1 = _mm_sha1nexte_epu32 (e1, msg3);
+      e0 = abcd;
+      msg0 = _mm_sha1msg2_epu32 (msg0, msg3);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 2);
+      msg2 = _mm_sha1msg1_epu32 (msg2, msg3);
+      msg1 = _mm_xor_si128 (msg1, msg3);
+
+      /* Rounds 48-51 */
+      e0 = _mm_sha1nexte_epu32 (e0, msg0);
+      e1 = abcd;
+      msg1 = _mm_sha1msg2_epu32 (msg1, msg0);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 2);
+      msg3 = _mm_sha1msg1_epu32 (msg3, msg0);
+      msg2 = _mm_xor_si128 (msg2, msg0);
+
+      /* Rounds 52-55 */
+      e1 = _mm_sha1nexte_epu32 (e1, msg1);
+      e0 = abcd;
+      msg2 = _mm_sha1msg2_epu32 (msg2, msg1);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 2);
+      msg0 = _mm_sha1msg1_epu32 (msg0, msg1);
+      msg3 = _mm_xor_si128 (msg3, msg1);
+
+      /* Rounds 56-59 */
+      e0 = _mm_sha1nexte_epu32 (e0, msg2);
+      e1 = abcd;
+      msg3 = _mm_sha1msg2_epu32 (msg3, msg2);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 2);
+      msg1 = _mm_sha1msg1_epu32 (msg1, msg2);
+      msg0 = _mm_xor_si128 (msg0, msg2);
+
+      /* Rounds 60-63 */
+      e1 = _mm_sha1nexte_epu32 (e1, msg3);
+      e0 = abcd;
+      msg0 = _mm_sha1msg2_epu32 (msg0, msg3);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 3);
+      msg2 = _mm_sha1msg1_epu32 (msg2, msg3);
+      msg1 = _mm_xor_si128 (msg1, msg3);
+
+      /* Rounds 64-67 */
+      e0 = _mm_sha1nexte_epu32 (e0, msg0);
+      e1 = abcd;
+      msg1 = _mm_sha1msg2_epu32 (msg1, msg0);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 3);
+      msg3 = _mm_sha1msg1_epu32 (msg3, msg0);
+      msg2 = _mm_xor_si128 (msg2, msg0);
+
+      /* Rounds 68-71 */
+      e1 = _mm_sha1nexte_epu32 (e1, msg1);
+      e0 = abcd;
+      msg2 = _mm_sha1msg2_epu32 (msg2, msg1);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 3);
+      msg3 = _mm_xor_si128 (msg3, msg1);
+
+      /* Rounds 72-75 */
+      e0 = _mm_sha1nexte_epu32 (e0, msg2);
+      e1 = abcd;
+      msg3 = _mm_sha1msg2_epu32 (msg3, msg2);
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 3);
+
+      /* Rounds 76-79 */
+      e1 = _mm_sha1nexte_epu32 (e1, msg3);
+      e0 = abcd;
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 3);
+
+      e0 = _mm_sha1nexte_epu32 (e0, e0_save);
+      abcd = _mm_add_epi32 (abcd, abcd_save);
+
+      data += SHA_DATASIZE;
     }
+
+  _mm_storeu_si128 ((__m128i *) digest, _mm_shuffle_epi32 (abcd, 0x1B));
+  digest[4] = _mm_extract_epi32 (e0, 3);
 }
+
+static dbus_bool_t
+have_x86_sha (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return FALSE;
+
+  __cpuid (1, eax, ebx, ecx, edx);
+  if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+    return FALSE;
+
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+  return (ebx & bit_SHA) != 0;
+}
+#endif /* HAVE_X86_SHA_INTRINSICS */
+
+typedef void (* SHATransformFunction) (dbus_uint32_t       *digest,
+                                       const unsigned char *data,
+                                       int                  n_blocks);
+
+/* Picked on first use; every thread picks the same one, so
+   racing to set it is harmless */
+static SHATransformFunction sha_transform = NULL;
+
+static SHATransformFunction
+sha_pick_transform (void)
+{
+#ifdef HAVE_X86_SHA_INTRINSICS
+  if (have_x86_sha ())
+    return SHATransformX86;
 #endif
 
+  return SHATransform;
+}
+
 static void
 sha_init (DBusSHAContext *context)
 {
+  if (sha_transform == NULL)
+    sha_transform = sha_pick_transform ();
+
   /* Set the h-vars to their initial values */
   context->digest[0] = h0init;
   context->digest[1] = h1init;
@@ -335,20 +564,19 @@ sha_append (DBusSHAContext      *context,
           return;
         }
       memmove (p, buffer, dataCount);
-      swap_words (context->data, SHA_DATASIZE);
-      SHATransform (context->digest, context->data);
+      (* sha_transform) (context->digest,
+                         (unsigned char *) context->data, 1);
       buffer += dataCount;
       count -= dataCount;
     }
 
-  /* Process data in SHA_DATASIZE chunks */
-  while (count >= SHA_DATASIZE)
+  /* Process data in SHA_DATASIZE chunks, straight from the caller's
+     buffer */
+  if (count >= SHA_DATASIZE)
     {
-      memmove (context->data, buffer, SHA_DATASIZE);
-      swap_words (context->data, SHA_DATASIZE);
-      SHATransform (context->digest, context->data);
-      buffer += SHA_DATASIZE;
-      count -= SHA_DATASIZE;
+      (* sha_transform) (context->digest, buffer, count / SHA_DATASIZE);
+      buffer += count & ~(SHA_DATASIZE - 1);
+      count &= SHA_DATASIZE - 1;
     }
 
   /* Handle any remaining bytes of data. */
@@ -363,6 +591,7 @@ static void
 sha_finish (DBusSHAContext *context, unsigned char digest[20])
 {
   int count;
+  int i;
   unsigned char *data_p;
 
   /* Compute number of bytes mod 64 */
@@ -382,8 +611,8 @@ sha_finish (DBusSHAContext *context, unsigned char digest[20])
     {
       /* Two lots of padding:  Pad the first block to 64 bytes */
       memset (data_p, 0, count);
-      swap_words (context->data, SHA_DATASIZE);
-      SHATransform (context->digest, context->data);
+      (* sha_transform) (context->digest,
+                         (unsigned char *) context->data, 1);
 
       /* Now fill the next block with 56 bytes */
       memset (context->data, 0, SHA_DATASIZE - 8);
@@ -393,13 +622,14 @@ sha_finish (DBusSHAContext *context, unsigned char digest[20])
     memset (data_p, 0, count - 8);
 
   /* Append length in bits and transform */
-  context->data[14] = context->count_hi;
-  context->data[15] = context->count_lo;
+  data_p = (unsigned char *) context->data;
+  STORE32_BE (data_p + 56, context->count_hi);
+  STORE32_BE (data_p + 60, context->count_lo);
 
-  swap_words (context->data, SHA_DATASIZE - 8);
-  SHATransform (context->digest, context->data);
-  swap_words (context->digest, SHA_DIGESTSIZE);
-  memmove (digest, context->digest, SHA_DIGESTSIZE);
+  (* sha_transform) (context->digest, data_p, 1);
+
+  for (i = 0; i < 5; i++)
+    STORE32_BE (digest + i * 4, context->digest[i]);
 }
 
 /** @} */ /* End of internals */
@@ -920,14 +1150,8 @@ process_test_data (const char *test_data_dir)
   return retval;
 }
 
-/**
- * @ingroup DBusSHAInternals
- * Unit test for SHA computation.
- *
- * @returns #TRUE on success.
- */
-dbus_bool_t
-_dbus_sha_test (const char *test_data_dir)
+static dbus_bool_t
+check_sha_transform (const char *test_data_dir)
 {
   unsigned char all_bytes[256];
   int i;
@@ -966,4 +1190,130 @@ _dbus_sha_test (const char *test_data_dir)
   return TRUE;
 }
 
+#ifdef HAVE_X86_SHA_INTRINSICS
+/* Runs both transforms over the same pseudo-random blocks from the
+   same pseudo-random state, for runs of 1 to 17 blocks at varying
+   alignments, and checks that they end up in the same state */
+static dbus_bool_t
+check_x86_sha_transform (void)
+{
+  unsigned char data[64 * 17 + 16];
+  dbus_uint32_t portable[5];
+  dbus_uint32_t accelerated[5];
+  dbus_uint32_t seed;
+  int n_blocks;
+  int i;
+
+  seed = 1;
+  for (i = 0; i < (int) sizeof (data); i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      data[i] = seed >> 16;
+    }
+
+  for (n_blocks = 1; n_blocks <= 17; n_blocks++)
+    {
+      for (i = 0; i < 5; i++)
+        {
+          seed = seed * 1103515245 + 12345;
+          portable[i] = accelerated[i] = seed;
+        }
+
+      SHATransform (portable, data + n_blocks % 16, n_blocks);
+      SHATransformX86 (accelerated, data + n_blocks % 16, n_blocks);
+
+      if (memcmp (portable, accelerated, sizeof (portable)) != 0)
+        {
+          _dbus_warn ("x86 SHA transform of %d blocks differs from the portable one\n",
+                      n_blocks);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+#endif /* HAVE_X86_SHA_INTRINSICS */
+
+static void
+benchmark_sha_transform (const char *name)
+{
+  DBusString data;
+  DBusString cookie;
+  DBusString results;
+  long start_sec, start_usec, end_sec, end_usec;
+  double elapsed;
+  int i;
+
+  if (!_dbus_string_init (&data) ||
+      !_dbus_string_lengthen (&data, 65536) ||
+      !_dbus_string_init (&results))
+    _dbus_assert_not_reached ("no memory");
+
+  /* about the size of what DBUS_COOKIE_SHA1 hashes */
+  _dbus_string_init_const (&cookie,
+                           "a44d2ab8329a3f3b2e4a5b4a0c56e8bd:"
+                           "10c3a8f3e2ac84c5b8ff4e2e63a1d2f4:"
+                           "f2ba1c6a7f0e6d5e3c4b2a19080706050403020100ffeedd");
+
+  _dbus_get_current_time (&start_sec, &start_usec);
+  for (i = 0; i < 256; i++)
+    {
+      _dbus_string_set_length (&results, 0);
+      if (!_dbus_sha_compute (&data, &results))
+        _dbus_assert_not_reached ("no memory");
+    }
+  _dbus_get_current_time (&end_sec, &end_usec);
+
+  elapsed = (end_sec - start_sec) + (end_usec - start_usec) / 1000000.0;
+  printf ("  %s: %.0f MB/s on 64k buffers", name,
+          elapsed > 0 ? 16 / elapsed : 0.0);
+
+  _dbus_get_current_time (&start_sec, &start_usec);
+  for (i = 0; i < 100000; i++)
+    {
+      _dbus_string_set_length (&results, 0);
+      if (!_dbus_sha_compute (&cookie, &results))
+        _dbus_assert_not_reached ("no memory");
+    }
+  _dbus_get_current_time (&end_sec, &end_usec);
+
+  elapsed = (end_sec - start_sec) + (end_usec - start_usec) / 1000000.0;
+  printf (", %.2f us per cookie hash\n", elapsed * 10);
+
+  _dbus_string_free (&data);
+  _dbus_string_free (&results);
+}
+
+/**
+ * @ingroup DBusSHAInternals
+ * Unit test for SHA computation.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_sha_test (const char *test_data_dir)
+{
+  dbus_bool_t retval;
+
+  sha_transform = SHATransform;
+  retval = check_sha_transform (test_data_dir);
+  benchmark_sha_transform ("portable SHA-1");
+
+#ifdef HAVE_X86_SHA_INTRINSICS
+  if (retval && have_x86_sha ())
+    {
+      retval = check_x86_sha_transform ();
+
+      sha_transform = SHATransformX86;
+      if (retval)
+        retval = check_sha_transform (test_data_dir);
+      benchmark_sha_transform ("x86 SHA extensions");
+    }
+#endif
+
+  sha_transform = NULL;
+
+  return retval;
+}
+
 #endif /* DBUS_BUILD_TESTS */
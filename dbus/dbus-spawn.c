@@ -33,6 +33,7 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * @addtogroup DBusInternalsUtils
@@ -167,6 +168,14 @@ read_pid (int        fd,
  * and the grandchild. The grandchild is our spawned process. The intermediate
  * child is a babysitter process; it keeps track of when the grandchild
  * exits/crashes, and reaps the grandchild.
+ *
+ * Forking a process with a large address space is slow, so the
+ * message bus can start a spawn helper early on, while it is still
+ * small. The helper forks the babysitters on request; the main
+ * process sends it the command line and its ends of the pipes
+ * to the babysitter and the grandchild. When nothing has to run
+ * between fork() and exec(), the babysitter uses vfork() for the
+ * grandchild.
  */
 
 /* Messages from children to parents */
@@ -620,6 +629,21 @@ _dbus_babysitter_get_child_exited (DBusBabysitter *sitter)
   return sitter->socket_to_babysitter < 0;
 }
 
+/**
+ * Checks whether the babysitter has reported the PID of the child,
+ * without blocking. When there is no child setup function the
+ * babysitter only learns the PID once the child has called exec(),
+ * so this tells the caller the child is running the new program.
+ *
+ * @param sitter the babysitter
+ * @returns #TRUE if the child has been started
+ */
+dbus_bool_t
+_dbus_babysitter_get_child_started (DBusBabysitter *sitter)
+{
+  return sitter->grandchild_pid != -1;
+}
+
 /**
  * Sets the #DBusError with an explanation of why the spawned
  * child process exited (on a signal, or whatever). If
@@ -838,24 +862,12 @@ write_status_and_exit (int fd, int status)
   exit (0);
 }
 
+#ifdef DBUS_BUILD_TESTS
 static void
-do_exec (int                       child_err_report_fd,
-	 char                    **argv,
-	 DBusSpawnChildSetupFunc   child_setup,
-	 void                     *user_data)
+check_close_on_exec (int child_err_report_fd)
 {
-#ifdef DBUS_BUILD_TESTS
   int i, max_open;
-#endif
-
-  _dbus_verbose_reset ();
-  _dbus_verbose ("Child process has PID %lu\n",
-                 _dbus_getpid ());
-  
-  if (child_setup)
-    (* child_setup) (user_data);
 
-#ifdef DBUS_BUILD_TESTS
   max_open = sysconf (_SC_OPEN_MAX);
   
   for (i = 3; i < max_open; i++)
@@ -870,6 +882,24 @@ do_exec (int                       child_err_report_fd,
       if (retval != -1 && !(retval & FD_CLOEXEC))
 	_dbus_warn ("Fd %d did not have the close-on-exec flag set!\n", i);
     }
+}
+#endif
+
+static void
+do_exec (int                       child_err_report_fd,
+	 char                    **argv,
+	 DBusSpawnChildSetupFunc   child_setup,
+	 void                     *user_data)
+{
+  _dbus_verbose_reset ();
+  _dbus_verbose ("Child process has PID %lu\n",
+                 _dbus_getpid ());
+  
+  if (child_setup)
+    (* child_setup) (user_data);
+
+#ifdef DBUS_BUILD_TESTS
+  check_close_on_exec (child_err_report_fd);
 #endif
   
   execv (argv[0], argv);
@@ -879,6 +909,25 @@ do_exec (int                       child_err_report_fd,
                       CHILD_EXEC_FAILED);
 }
 
+/* Like do_exec(), for a child made with vfork(): it shares our memory
+ * and stack until it execs, so it may only make system calls
+ */
+static void
+do_exec_vforked (int    child_err_report_fd,
+                 char **argv)
+{
+  int msg[2];
+
+  execv (argv[0], argv);
+
+  /* Exec failed; pipe writes this small are atomic */
+  msg[0] = CHILD_EXEC_FAILED;
+  msg[1] = errno;
+  write (child_err_report_fd, msg, sizeof (msg));
+
+  _exit (1);
+}
+
 static void
 check_babysit_events (pid_t grandchild_pid,
                       int   parent_pipe,
@@ -1008,6 +1057,438 @@ babysit (pid_t grandchild_pid,
   exit (1);
 }
 
+/* Runs in the babysitter process: starts the grandchild with env
+ * added to its environment, then reports on it until it exits
+ */
+static void
+run_babysitter (char                    **argv,
+                char                    **env,
+                DBusSpawnChildSetupFunc   child_setup,
+                void                     *user_data,
+                int                       child_err_report_fd,
+                int                       parent_pipe)
+{
+  pid_t grandchild_pid;
+  int i;
+
+  /* Be sure we crash if the parent exits
+   * and we write to the err_report_pipe
+   */
+  signal (SIGPIPE, SIG_DFL);
+
+  /* The spawn helper reaps its children from a SIGCHLD handler,
+   * and we need to reap the grandchild ourselves
+   */
+  signal (SIGCHLD, SIG_DFL);
+
+  /* We never exec, so our environment is the grandchild's to change */
+  for (i = 0; env != NULL && env[i] != NULL; i++)
+    {
+      if (putenv (env[i]) != 0)
+        {
+          errno = ENOMEM;
+          write_err_and_exit (parent_pipe, CHILD_FORK_FAILED);
+        }
+    }
+
+  /* Create the child that will exec () */
+  if (child_setup == NULL)
+    {
+#ifdef DBUS_BUILD_TESTS
+      check_close_on_exec (child_err_report_fd);
+#endif
+
+      /* Nothing to run before exec(), so don't copy our address
+       * space again for the grandchild
+       */
+      grandchild_pid = vfork ();
+
+      if (grandchild_pid == 0)
+        do_exec_vforked (child_err_report_fd, argv);
+    }
+  else
+    {
+      grandchild_pid = fork ();
+
+      if (grandchild_pid == 0)
+        {
+          do_exec (child_err_report_fd,
+                   argv,
+                   child_setup, user_data);
+          _dbus_assert_not_reached ("Got to code after exec() - should have exited on error");
+        }
+    }
+
+  if (grandchild_pid < 0)
+    {
+      write_err_and_exit (parent_pipe,
+                          CHILD_FORK_FAILED);
+      _dbus_assert_not_reached ("Got to code after write_err_and_exit()");
+    }
+
+  babysit (grandchild_pid, parent_pipe);
+  _dbus_assert_not_reached ("Got to code after babysit()");
+}
+
+#ifdef HAVE_UNIX_FD_PASSING
+
+static int spawn_helper_fd = -1;     /**< Our end of the socket to the spawn helper */
+static pid_t spawn_helper_pid = -1;  /**< PID of the spawn helper */
+
+static void
+spawn_helper_signal_handler (int signo)
+{
+  int saved_errno;
+
+  /* Reap the babysitters that have exited */
+  saved_errno = errno;
+  while (waitpid (-1, NULL, WNOHANG) > 0)
+    ;
+  errno = saved_errno;
+}
+
+/* Reads exactly len bytes, returning FALSE on error or EOF; fds
+ * passed along with the data are appended to fds
+ */
+static dbus_bool_t
+spawn_helper_read (int         fd,
+                   DBusString *buffer,
+                   int         len,
+                   int        *fds,
+                   int        *n_fds)
+{
+  int start;
+
+  start = _dbus_string_get_length (buffer);
+
+  while (_dbus_string_get_length (buffer) - start < len)
+    {
+      int n;
+      int bytes_read;
+
+      n = 2 - *n_fds;
+      bytes_read = _dbus_read_socket_with_unix_fds (fd, buffer,
+                                                    len - (_dbus_string_get_length (buffer) - start),
+                                                    fds + *n_fds, &n);
+      if (bytes_read <= 0)
+        return FALSE;
+
+      *n_fds += n;
+    }
+
+  return TRUE;
+}
+
+/* Points strings at the next n nul-terminated strings in data,
+ * starting at *pos
+ */
+static dbus_bool_t
+spawn_helper_parse_strings (const DBusString  *data,
+                            int               *pos,
+                            char            ***strings)
+{
+  int n, i;
+
+  if (*pos + (int) sizeof (int) > _dbus_string_get_length (data))
+    return FALSE;
+
+  memcpy (&n, _dbus_string_get_const_data_len (data, *pos, sizeof (int)),
+          sizeof (int));
+  *pos += sizeof (int);
+
+  if (n < 0 || n > _dbus_string_get_length (data))
+    return FALSE;
+
+  *strings = dbus_new0 (char *, n + 1);
+  if (*strings == NULL)
+    return FALSE;
+
+  for (i = 0; i < n; i++)
+    {
+      const char *start;
+      const char *end;
+
+      start = _dbus_string_get_const_data (data) + *pos;
+      end = memchr (start, '\0', _dbus_string_get_length (data) - *pos);
+      if (end == NULL)
+        return FALSE;
+
+      (*strings)[i] = (char *) start;
+      *pos += end - start + 1;
+    }
+
+  return TRUE;
+}
+
+/* The spawn helper: forks babysitters for the parent until the
+ * parent closes the socket
+ */
+static void
+spawn_helper_main (int fd)
+{
+  _dbus_verbose_reset ();
+
+#ifdef DBUS_BUILD_TESTS
+  /* We may have been forked in the middle of an out-of-memory test,
+   * which shouldn't carry on in here
+   */
+  _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
+#endif
+
+  _dbus_set_signal_handler (SIGCHLD, spawn_helper_signal_handler);
+
+  while (TRUE)
+    {
+      DBusString request;
+      int fds[2];
+      int n_fds;
+      int len;
+      int pos;
+      char **argv;
+      char **env;
+      pid_t pid;
+
+      if (!_dbus_string_init (&request))
+        _exit (1);
+
+      n_fds = 0;
+      argv = NULL;
+      env = NULL;
+
+      /* The request is its length, the command line and the
+       * environment to add, with the babysitter's ends of the
+       * pipes attached
+       */
+      if (!spawn_helper_read (fd, &request, sizeof (int), fds, &n_fds))
+        _exit (0);
+
+      memcpy (&len, _dbus_string_get_const_data (&request), sizeof (int));
+      if (len < (int) sizeof (int) ||
+          !spawn_helper_read (fd, &request, len - sizeof (int), fds, &n_fds) ||
+          n_fds != 2)
+        _exit (1);
+
+      /* the strings are nul-terminated in place */
+      pos = sizeof (int);
+      if (!spawn_helper_parse_strings (&request, &pos, &argv) ||
+          !spawn_helper_parse_strings (&request, &pos, &env) ||
+          argv[0] == NULL)
+        {
+          errno = ENOMEM;
+          pid = -1;
+        }
+      else
+        pid = fork ();
+
+      if (pid == 0)
+        {
+          close (fd);
+          run_babysitter (argv, env, NULL, NULL, fds[1], fds[0]);
+        }
+      else if (pid < 0)
+        {
+          int msg[2];
+
+          msg[0] = CHILD_FORK_FAILED;
+          msg[1] = errno;
+          write (fds[0], msg, sizeof (msg));
+        }
+
+      close (fds[0]);
+      close (fds[1]);
+      dbus_free (argv);
+      dbus_free (env);
+      _dbus_string_free (&request);
+    }
+}
+
+static void
+spawn_helper_shutdown (void *data)
+{
+  _dbus_spawn_stop_helper ();
+}
+
+/* Asks the spawn helper to start a babysitter. Returns FALSE if out
+ * of memory; *sent is FALSE if the helper is gone.
+ */
+static dbus_bool_t
+spawn_with_helper (char        **argv,
+                   char        **env,
+                   int           child_err_report_fd,
+                   int           babysitter_fd,
+                   dbus_bool_t  *sent)
+{
+  DBusString request;
+  char **strings[2];
+  int fds[2];
+  int i, j;
+  int len;
+  int written;
+  int bytes;
+
+  *sent = FALSE;
+
+  if (!_dbus_string_init (&request))
+    return FALSE;
+
+  /* length goes first, filled in below */
+  len = 0;
+  if (!_dbus_string_append_len (&request, (const char *) &len, sizeof (int)))
+    goto nomem;
+
+  strings[0] = argv;
+  strings[1] = env;
+  for (i = 0; i < 2; i++)
+    {
+      int n;
+
+      n = 0;
+      while (strings[i] != NULL && strings[i][n] != NULL)
+        n += 1;
+
+      if (!_dbus_string_append_len (&request, (const char *) &n, sizeof (int)))
+        goto nomem;
+
+      for (j = 0; j < n; j++)
+        {
+          if (!_dbus_string_append_len (&request, strings[i][j],
+                                        strlen (strings[i][j]) + 1))
+            goto nomem;
+        }
+    }
+
+  len = _dbus_string_get_length (&request);
+  memcpy (_dbus_string_get_data_len (&request, 0, sizeof (int)), &len,
+          sizeof (int));
+
+  fds[0] = babysitter_fd;
+  fds[1] = child_err_report_fd;
+
+  written = _dbus_write_socket_with_unix_fds_two (spawn_helper_fd,
+                                                  &request, 0, len,
+                                                  NULL, 0, 0,
+                                                  fds, 2);
+  while (written >= 0 && written < len)
+    {
+      bytes = _dbus_write_socket (spawn_helper_fd, &request,
+                                  written, len - written);
+      if (bytes < 0)
+        written = -1;
+      else
+        written += bytes;
+    }
+
+  if (written < 0)
+    {
+      if (errno == ENOMEM)
+        goto nomem;
+
+      _dbus_verbose ("Spawn helper is gone: %s\n", _dbus_strerror (errno));
+      _dbus_spawn_stop_helper ();
+    }
+  else
+    *sent = TRUE;
+
+  _dbus_string_free (&request);
+  return TRUE;
+
+ nomem:
+  _dbus_string_free (&request);
+  return FALSE;
+}
+
+#endif /* HAVE_UNIX_FD_PASSING */
+
+/**
+ * Starts a helper process that forks babysitters for
+ * _dbus_spawn_async_with_babysitter() when there is no child setup
+ * function. Call this while the process is still small, since
+ * forking gets slower with the size of the address space; the
+ * spawned processes inherit the environment, credentials and
+ * resource limits the process has now.
+ *
+ * The helper is stopped by _dbus_spawn_stop_helper() or
+ * dbus_shutdown(). Not threadsafe; meant for the message bus.
+ *
+ * Does nothing where file descriptors can't be passed over sockets.
+ *
+ * @param error error to fill in on failure
+ * @returns #FALSE if error is set
+ */
+dbus_bool_t
+_dbus_spawn_start_helper (DBusError *error)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  int fds[2];
+  pid_t pid;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (spawn_helper_fd >= 0)
+    return TRUE;
+
+  if (!_dbus_register_shutdown_func (spawn_helper_shutdown, NULL))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return FALSE;
+    }
+
+  if (!_dbus_full_duplex_pipe (&fds[0], &fds[1], TRUE, error))
+    return FALSE;
+
+  _dbus_fd_set_close_on_exec (fds[0]);
+  _dbus_fd_set_close_on_exec (fds[1]);
+
+  pid = fork ();
+
+  if (pid < 0)
+    {
+      dbus_set_error (error,
+		      DBUS_ERROR_SPAWN_FORK_FAILED,
+		      "Failed to fork spawn helper (%s)",
+		      _dbus_strerror (errno));
+      close_and_invalidate (&fds[0]);
+      close_and_invalidate (&fds[1]);
+      return FALSE;
+    }
+  else if (pid == 0)
+    {
+      close_and_invalidate (&fds[0]);
+      spawn_helper_main (fds[1]);
+      _dbus_assert_not_reached ("Got to code after spawn_helper_main()");
+    }
+
+  close_and_invalidate (&fds[1]);
+
+  spawn_helper_fd = fds[0];
+  spawn_helper_pid = pid;
+
+  _dbus_verbose ("Started spawn helper %ld\n", (long) pid);
+#endif
+
+  return TRUE;
+}
+
+/**
+ * Stops the helper started by _dbus_spawn_start_helper(), if it is
+ * running. Later spawns fork from this process.
+ */
+void
+_dbus_spawn_stop_helper (void)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  if (spawn_helper_fd < 0)
+    return;
+
+  /* The helper exits when it reads EOF */
+  close_and_invalidate (&spawn_helper_fd);
+
+  while (waitpid (spawn_helper_pid, NULL, 0) < 0 && errno == EINTR)
+    ;
+  spawn_helper_pid = -1;
+#endif
+}
+
 /**
  * Spawns a new process. The executable name and argv[0]
  * are the same, both are provided in argv[0]. The child_setup
@@ -1019,8 +1500,14 @@ babysit (pid_t grandchild_pid,
  * If the spawn fails, no babysitter is created.
  * If sitter_p is #NULL, no babysitter is kept.
  *
+ * Variables to set in the child are given as "NAME=value" strings in
+ * env. When there is no child_setup function, the child is started
+ * by the helper from _dbus_spawn_start_helper() if it is running,
+ * and without copying the address space a second time.
+ *
  * @param sitter_p return location for babysitter or #NULL
  * @param argv the executable and arguments
+ * @param env #NULL-terminated variables to add to the environment, or #NULL
  * @param child_setup function to call in child pre-exec()
  * @param user_data user data for setup function
  * @param error error object to be filled in if function fails
@@ -1029,6 +1516,7 @@ babysit (pid_t grandchild_pid,
 dbus_bool_t
 _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
                                    char                    **argv,
+                                   char                    **env,
                                    DBusSpawnChildSetupFunc   child_setup,
                                    void                     *user_data,
                                    DBusError                *error)
@@ -1105,6 +1593,29 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
     }
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (child_setup == NULL && spawn_helper_fd >= 0)
+    {
+      dbus_bool_t sent;
+
+      if (!spawn_with_helper (argv, env,
+                              child_err_report_pipe[WRITE_END],
+                              babysitter_pipe[1],
+                              &sent))
+        {
+          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          goto cleanup_and_fail;
+        }
+
+      if (sent)
+        {
+          /* The babysitter is the helper's child, not ours */
+          pid = -1;
+          goto spawned;
+        }
+    }
+#endif
   
   pid = fork ();
   
@@ -1119,41 +1630,20 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
   else if (pid == 0)
     {
       /* Immediate child, this is the babysitter process. */
-      int grandchild_pid;
-      
-      /* Be sure we crash if the parent exits
-       * and we write to the err_report_pipe
-       */
-      signal (SIGPIPE, SIG_DFL);
 
       /* Close the parent's end of the pipes. */
       close_and_invalidate (&child_err_report_pipe[READ_END]);
       close_and_invalidate (&babysitter_pipe[0]);
       
-      /* Create the child that will exec () */
-      grandchild_pid = fork ();
-      
-      if (grandchild_pid < 0)
-	{
-	  write_err_and_exit (babysitter_pipe[1],
-			      CHILD_FORK_FAILED);
-          _dbus_assert_not_reached ("Got to code after write_err_and_exit()");
-	}
-      else if (grandchild_pid == 0)
-	{
-	  do_exec (child_err_report_pipe[WRITE_END],
-		   argv,
-		   child_setup, user_data);
-          _dbus_assert_not_reached ("Got to code after exec() - should have exited on error");
-	}
-      else
-	{
-          babysit (grandchild_pid, babysitter_pipe[1]);
-          _dbus_assert_not_reached ("Got to code after babysit()");
-	}
+      run_babysitter (argv, env, child_setup, user_data,
+                      child_err_report_pipe[WRITE_END],
+                      babysitter_pipe[1]);
     }
   else
-    {      
+    {
+#ifdef HAVE_UNIX_FD_PASSING
+    spawned:
+#endif
       /* Close the uncared-about ends of the pipes */
       close_and_invalidate (&child_err_report_pipe[WRITE_END]);
       close_and_invalidate (&babysitter_pipe[1]);
@@ -1195,6 +1685,8 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
 
 #ifdef DBUS_BUILD_TESTS
 
+#include <stdio.h>
+
 static void
 _dbus_babysitter_block_for_child_exit (DBusBabysitter *sitter)
 {
@@ -1216,7 +1708,7 @@ check_spawn_nonexistent (void *data)
   /*** Test launching nonexistent binary */
   
   argv[0] = "/this/does/not/exist/32542sdgafgafdg";
-  if (_dbus_spawn_async_with_babysitter (&sitter, argv,
+  if (_dbus_spawn_async_with_babysitter (&sitter, argv, NULL,
                                          NULL, NULL,
                                          &error))
     {
@@ -1261,7 +1753,7 @@ check_spawn_segfault (void *data)
   /*** Test launching segfault binary */
   
   argv[0] = TEST_SEGFAULT_BINARY;
-  if (_dbus_spawn_async_with_babysitter (&sitter, argv,
+  if (_dbus_spawn_async_with_babysitter (&sitter, argv, NULL,
                                          NULL, NULL,
                                          &error))
     {
@@ -1306,7 +1798,7 @@ check_spawn_exit (void *data)
   /*** Test launching exit failure binary */
   
   argv[0] = TEST_EXIT_BINARY;
-  if (_dbus_spawn_async_with_babysitter (&sitter, argv,
+  if (_dbus_spawn_async_with_babysitter (&sitter, argv, NULL,
                                          NULL, NULL,
                                          &error))
     {
@@ -1351,7 +1843,7 @@ check_spawn_and_kill (void *data)
   /*** Test launching sleeping binary then killing it */
 
   argv[0] = TEST_SLEEP_FOREVER_BINARY;
-  if (_dbus_spawn_async_with_babysitter (&sitter, argv,
+  if (_dbus_spawn_async_with_babysitter (&sitter, argv, NULL,
                                          NULL, NULL,
                                          &error))
     {
@@ -1385,8 +1877,107 @@ check_spawn_and_kill (void *data)
   return TRUE;
 }
 
-dbus_bool_t
-_dbus_spawn_test (const char *test_data_dir)
+static dbus_bool_t
+check_spawn_env (void *data)
+{
+  char *argv[4] = { "/bin/sh", "-c", "exit $DBUS_SPAWN_TEST_STATUS", NULL };
+  char *env[2] = { "DBUS_SPAWN_TEST_STATUS=7", NULL };
+  DBusBabysitter *sitter;
+  DBusError error;
+  
+  sitter = NULL;
+  
+  dbus_error_init (&error);
+
+  /*** Test that the child gets the variables we add */
+
+  if (_dbus_spawn_async_with_babysitter (&sitter, argv, env,
+                                         NULL, NULL,
+                                         &error))
+    {
+      _dbus_babysitter_block_for_child_exit (sitter);
+      _dbus_babysitter_set_child_exit_error (sitter, &error);
+    }
+
+  if (sitter)
+    _dbus_babysitter_unref (sitter);
+
+  if (!dbus_error_is_set (&error))
+    {
+      _dbus_warn ("Did not get an error from child that should have exited with status 7\n");
+      return FALSE;
+    }
+
+  if (!(dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY) ||
+        (dbus_error_has_name (&error, DBUS_ERROR_SPAWN_CHILD_EXITED) &&
+         strstr (error.message, "status 7") != NULL)))
+    {
+      _dbus_warn ("Not expecting error from child with environment: %s: %s\n",
+                  error.name, error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  dbus_error_free (&error);
+  
+  return TRUE;
+}
+
+static dbus_bool_t
+check_spawn_env_override (void *data)
+{
+  char *argv[4] = { "/bin/sh", "-c",
+                    "test \"$DBUS_SPAWN_TEST_A\" = a && test \"$DBUS_SPAWN_TEST_B\" = b && exit 7",
+                    NULL };
+  char *env[3] = { "DBUS_SPAWN_TEST_A=a", "DBUS_SPAWN_TEST_B=b", NULL };
+  DBusBabysitter *sitter;
+  DBusError error;
+  
+  sitter = NULL;
+  
+  dbus_error_init (&error);
+
+  /*** Test that the variables we add replace the ones we have */
+
+  if (!_dbus_setenv ("DBUS_SPAWN_TEST_A", "parent"))
+    return TRUE; /* no memory */
+
+  if (_dbus_spawn_async_with_babysitter (&sitter, argv, env,
+                                         NULL, NULL,
+                                         &error))
+    {
+      _dbus_babysitter_block_for_child_exit (sitter);
+      _dbus_babysitter_set_child_exit_error (sitter, &error);
+    }
+
+  if (sitter)
+    _dbus_babysitter_unref (sitter);
+
+  _dbus_setenv ("DBUS_SPAWN_TEST_A", NULL);
+
+  if (!dbus_error_is_set (&error))
+    {
+      _dbus_warn ("Did not get an error from child that should have exited with status 7\n");
+      return FALSE;
+    }
+
+  if (!(dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY) ||
+        (dbus_error_has_name (&error, DBUS_ERROR_SPAWN_CHILD_EXITED) &&
+         strstr (error.message, "status 7") != NULL)))
+    {
+      _dbus_warn ("Child did not see the environment it was given: %s: %s\n",
+                  error.name, error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  dbus_error_free (&error);
+  
+  return TRUE;
+}
+
+static dbus_bool_t
+run_spawn_checks (void)
 {
   if (!_dbus_test_oom_handling ("spawn_nonexistent",
                                 check_spawn_nonexistent,
@@ -1407,6 +1998,113 @@ _dbus_spawn_test (const char *test_data_dir)
                                 check_spawn_and_kill,
                                 NULL))
     return FALSE;
+
+  if (!_dbus_test_oom_handling ("spawn_env",
+                                check_spawn_env,
+                                NULL))
+    return FALSE;
+
+  if (!_dbus_test_oom_handling ("spawn_env_override",
+                                check_spawn_env_override,
+                                NULL))
+    return FALSE;
+
+  return TRUE;
+}
+
+/** Number of children spawn_benchmark() starts each way */
+#define SPAWN_BENCHMARK_CHILDREN 20
+
+/** Memory spawn_benchmark() touches to make the process look like a big daemon */
+#define SPAWN_BENCHMARK_RESIDENT (128 * 1024 * 1024)
+
+/* Times starting a child that exits at once, from a process with a
+ * large resident set, with and without the spawn helper
+ */
+static void
+spawn_benchmark (void)
+{
+  char *argv[2] = { TEST_EXIT_BINARY, NULL };
+  char *ballast;
+  int with_helper;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  /* The helper has to start while we're small */
+  if (!_dbus_spawn_start_helper (&error))
+    _dbus_assert_not_reached ("could not start spawn helper");
+
+  ballast = malloc (SPAWN_BENCHMARK_RESIDENT);
+  if (ballast == NULL)
+    {
+      _dbus_spawn_stop_helper ();
+      return;
+    }
+  memset (ballast, 1, SPAWN_BENCHMARK_RESIDENT);
+
+  for (with_helper = 1; with_helper >= 0; with_helper--)
+    {
+      long start_sec, start_usec, end_sec, end_usec;
+      double usec;
+      int i;
+
+      if (!with_helper)
+        _dbus_spawn_stop_helper ();
+
+      _dbus_get_current_time (&start_sec, &start_usec);
+
+      for (i = 0; i < SPAWN_BENCHMARK_CHILDREN; i++)
+        {
+          DBusBabysitter *sitter;
+
+          if (!_dbus_spawn_async_with_babysitter (&sitter, argv, NULL,
+                                                  NULL, NULL, &error))
+            _dbus_assert_not_reached ("could not spawn");
+
+          _dbus_babysitter_block_for_child_exit (sitter);
+          _dbus_babysitter_unref (sitter);
+        }
+
+      _dbus_get_current_time (&end_sec, &end_usec);
+      usec = (end_sec - start_sec) * 1000000.0 + (end_usec - start_usec);
+
+      printf ("  spawned %d children from a %d MB process %s the spawn helper: %.2f ms each\n",
+              SPAWN_BENCHMARK_CHILDREN, SPAWN_BENCHMARK_RESIDENT / (1024 * 1024),
+              with_helper ? "with" : "without",
+              usec / SPAWN_BENCHMARK_CHILDREN / 1000.0);
+
+      /* babysitters forked from us exit() and would flush it again */
+      fflush (stdout);
+    }
+
+  free (ballast);
+}
+
+dbus_bool_t
+_dbus_spawn_test (const char *test_data_dir)
+{
+  DBusError error;
+
+  /* Forking babysitters ourselves */
+  if (!run_spawn_checks ())
+    return FALSE;
+
+  /* Forking them from the helper */
+  dbus_error_init (&error);
+  if (!_dbus_spawn_start_helper (&error))
+    {
+      _dbus_warn ("Could not start spawn helper: %s\n", error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  if (!run_spawn_checks ())
+    return FALSE;
+
+  _dbus_spawn_stop_helper ();
+
+  spawn_benchmark ();
   
   return TRUE;
 }
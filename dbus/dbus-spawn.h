@@ -35,8 +35,11 @@ typedef void (* DBusSpawnChildSetupFunc) (void *user_data);
 
 typedef struct DBusBabysitter DBusBabysitter;
 
+dbus_bool_t _dbus_spawn_start_helper              (DBusError                 *error);
+void        _dbus_spawn_stop_helper               (void);
 dbus_bool_t _dbus_spawn_async_with_babysitter     (DBusBabysitter           **sitter_p,
                                                    char                     **argv,
+                                                   char                     **env,
                                                    DBusSpawnChildSetupFunc    child_setup,
                                                    void                      *user_data,
                                                    DBusError                 *error);
@@ -44,6 +47,7 @@ DBusBabysitter* _dbus_babysitter_ref              (DBusBabysitter            *si
 void        _dbus_babysitter_unref                (DBusBabysitter            *sitter);
 void        _dbus_babysitter_kill_child           (DBusBabysitter            *sitter);
 dbus_bool_t _dbus_babysitter_get_child_exited     (DBusBabysitter            *sitter);
+dbus_bool_t _dbus_babysitter_get_child_started    (DBusBabysitter            *sitter);
 void        _dbus_babysitter_set_child_exit_error (DBusBabysitter            *sitter,
                                                    DBusError                 *error);
 dbus_bool_t _dbus_babysitter_set_watch_functions  (DBusBabysitter            *sitter,
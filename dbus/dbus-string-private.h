@@ -51,6 +51,7 @@ typedef struct
   unsigned int   locked : 1;     /**< DBusString has been locked and can't be changed */
   unsigned int   invalid : 1;    /**< DBusString is invalid (e.g. already freed) */
   unsigned int   align_offset : 3; /**< str - align_offset is the actual malloc block */
+  unsigned int   in_place : 1;  /**< str - align_offset is caller-supplied memory, not a malloc block */
 } DBusRealString;
 
 
@@ -157,12 +157,54 @@ _dbus_string_init_preallocated (DBusString *str,
   real->locked = FALSE;
   real->invalid = FALSE;
   real->align_offset = 0;
+  real->in_place = FALSE;
   
   fixup_alignment (real);
   
   return TRUE;
 }
 
+/**
+ * Initializes a string that keeps its data in memory supplied by the
+ * caller, typically allocated in the same block as the object the
+ * string is embedded in. Once the string needs more room than the
+ * buffer has, the data is moved to a malloc block and the string
+ * behaves exactly as if it had been created by _dbus_string_init().
+ * The string starts life with zero length and must eventually be
+ * freed with _dbus_string_free(), which never frees the buffer.
+ *
+ * @param str memory to hold the string
+ * @param buffer memory for the string data, must outlive the string
+ * @param size size of buffer, more than #_DBUS_STRING_ALLOCATION_PADDING
+ */
+void
+_dbus_string_init_in_place (DBusString *str,
+                            void       *buffer,
+                            int         size)
+{
+  DBusRealString *real;
+
+  _dbus_assert (str != NULL);
+  _dbus_assert (buffer != NULL);
+  _dbus_assert (size > _DBUS_STRING_ALLOCATION_PADDING);
+
+  real = (DBusRealString*) str;
+
+  real->str = buffer;
+  real->allocated = size;
+  real->len = 0;
+  real->str[real->len] = '\0';
+
+  real->max_length = _DBUS_STRING_MAX_MAX_LENGTH;
+  real->constant = FALSE;
+  real->locked = FALSE;
+  real->invalid = FALSE;
+  real->align_offset = 0;
+  real->in_place = TRUE;
+
+  fixup_alignment (real);
+}
+
 /**
  * Initializes a string. The string starts life with zero length.  The
  * string must eventually be freed with _dbus_string_free().
@@ -246,6 +288,7 @@ _dbus_string_init_const_len (DBusString *str,
   real->locked = TRUE;
   real->invalid = FALSE;
   real->align_offset = 0;
+  real->in_place = FALSE;
 
   /* We don't require const strings to be 8-byte aligned as the
    * memory is coming from elsewhere.
@@ -265,7 +308,8 @@ _dbus_string_free (DBusString *str)
   
   if (real->constant)
     return;
-  dbus_free (real->str - real->align_offset);
+  if (!real->in_place)
+    dbus_free (real->str - real->align_offset);
 
   real->invalid = TRUE;
 }
@@ -294,7 +338,7 @@ _dbus_string_lock (DBusString *str)
    * we know we won't change the string further
    */
 #define MAX_WASTE 48
-  if (real->allocated - MAX_WASTE > real->len)
+  if (!real->in_place && real->allocated - MAX_WASTE > real->len)
     {
       unsigned char *new_str;
       int new_allocated;
@@ -313,6 +357,33 @@ _dbus_string_lock (DBusString *str)
 }
 #endif /* DBUS_BUILD_TESTS */
 
+/* Moves the data of a string created by _dbus_string_init_in_place()
+ * to a malloc block of the given size.
+ */
+static dbus_bool_t
+move_out_of_place (DBusRealString *real,
+                   int             new_allocated)
+{
+  unsigned char *new_str;
+
+  _dbus_assert (real->in_place);
+  _dbus_assert (new_allocated >= real->len + _DBUS_STRING_ALLOCATION_PADDING);
+
+  new_str = dbus_malloc (new_allocated);
+  if (_DBUS_UNLIKELY (new_str == NULL))
+    return FALSE;
+
+  memcpy (new_str, real->str, real->len + 1);
+
+  real->str = new_str;
+  real->allocated = new_allocated;
+  real->align_offset = 0;
+  real->in_place = FALSE;
+  fixup_alignment (real);
+
+  return TRUE;
+}
+
 static dbus_bool_t
 reallocate_for_length (DBusRealString *real,
                        int             new_length)
@@ -349,6 +420,10 @@ reallocate_for_length (DBusRealString *real,
                        new_length + _DBUS_STRING_ALLOCATION_PADDING);
 
   _dbus_assert (new_allocated >= real->allocated); /* code relies on this */
+
+  if (real->in_place)
+    return move_out_of_place (real, new_allocated);
+
   new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
   if (_DBUS_UNLIKELY (new_str == NULL))
     return FALSE;
@@ -611,6 +686,11 @@ _dbus_string_steal_data (DBusString        *str,
   DBUS_STRING_PREAMBLE (str);
   _dbus_assert (data_return != NULL);
 
+  /* The caller gets to free the data, so it has to be a malloc block */
+  if (real->in_place &&
+      !move_out_of_place (real, real->len + _DBUS_STRING_ALLOCATION_PADDING))
+    return FALSE;
+
   undo_alignment (real);
   
   *data_return = (char*) real->str;
@@ -1518,10 +1598,14 @@ _dbus_string_move_len (DBusString       *source,
     }
   else if (start == 0 &&
            len == real_source->len &&
-           real_dest->len == 0)
+           real_dest->len == 0 &&
+           !real_source->in_place &&
+           !real_dest->in_place)
     {
       /* Short-circuit moving an entire existing string to an empty string
-       * by just swapping the buffers.
+       * by just swapping the buffers. Buffers supplied to
+       * _dbus_string_init_in_place() belong to their string and can't
+       * be swapped.
        */
       /* we assume ->constant doesn't matter as you can't have
        * a constant string involved in a move.
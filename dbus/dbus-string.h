@@ -47,6 +47,7 @@ struct DBusString
   unsigned int dummy6 : 1; /**< placeholder */
   unsigned int dummy7 : 1; /**< placeholder */
   unsigned int dummy8 : 3; /**< placeholder */
+  unsigned int dummy9 : 1; /**< placeholder */
 };
 
 #ifdef DBUS_DISABLE_ASSERT
@@ -70,6 +71,9 @@ void          _dbus_string_init_const_len        (DBusString        *str,
                                                   int                len);
 dbus_bool_t   _dbus_string_init_preallocated     (DBusString        *str,
                                                   int                allocate_size);
+void          _dbus_string_init_in_place         (DBusString        *str,
+                                                  void              *buffer,
+                                                  int                size);
 void          _dbus_string_free                  (DBusString        *str);
 void          _dbus_string_lock                  (DBusString        *str);
 #ifndef _dbus_string_get_data
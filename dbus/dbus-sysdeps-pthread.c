@@ -27,6 +27,7 @@
 
 #include <sys/time.h>
 #include <pthread.h>
+#include <signal.h>
 #include <string.h>
 
 typedef struct {
@@ -323,3 +324,143 @@ _dbus_threads_init_platform_specific (void)
   (void) _dbus_check_setuid ();
   return dbus_threads_init (&pthread_functions);
 }
+
+typedef struct
+{
+  DBusThreadFunction function;
+  void *data;
+} DBusThreadStart;
+
+static void *
+thread_start_func (void *data)
+{
+  DBusThreadStart start = *(DBusThreadStart*) data;
+
+  dbus_free (data);
+  (* start.function) (start.data);
+
+  return NULL;
+}
+
+/**
+ * Starts a detached thread running the given function. The thread
+ * blocks all signals, so they keep being delivered to the threads
+ * the application expects them on.
+ *
+ * @param function the function to run
+ * @param data data to pass to the function
+ * @returns #FALSE if no memory or the thread could not be created
+ */
+dbus_bool_t
+_dbus_thread_start (DBusThreadFunction  function,
+                    void               *data)
+{
+  DBusThreadStart *start;
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all_signals, old_signals;
+  int result;
+
+  start = dbus_new (DBusThreadStart, 1);
+  if (start == NULL)
+    return FALSE;
+
+  start->function = function;
+  start->data = data;
+
+  if (pthread_attr_init (&attr) != 0)
+    {
+      dbus_free (start);
+      return FALSE;
+    }
+
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+  /* the new thread inherits our signal mask */
+  sigfillset (&all_signals);
+  pthread_sigmask (SIG_SETMASK, &all_signals, &old_signals);
+
+  result = pthread_create (&thread, &attr, thread_start_func, start);
+
+  pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+  pthread_attr_destroy (&attr);
+
+  if (result != 0)
+    {
+      _dbus_verbose ("Failed to create thread: %s\n", _dbus_strerror (result));
+      dbus_free (start);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+struct DBusThreadLocal
+{
+  pthread_key_t key; /**< The pthread key holding the values */
+};
+
+/**
+ * Creates a slot holding a separate value for each thread; each
+ * thread starts out with #NULL there. When a thread exits, free_func
+ * is called on its value if it isn't #NULL.
+ *
+ * @param free_func function to free a thread's value when it exits, or #NULL
+ * @returns the new slot, or #NULL if no memory
+ */
+DBusThreadLocal*
+_dbus_thread_local_new (DBusFreeFunction free_func)
+{
+  DBusThreadLocal *local;
+
+  local = dbus_new (DBusThreadLocal, 1);
+  if (local == NULL)
+    return NULL;
+
+  if (pthread_key_create (&local->key, free_func) != 0)
+    {
+      dbus_free (local);
+      return NULL;
+    }
+
+  return local;
+}
+
+/**
+ * Frees a slot created with _dbus_thread_local_new(). The values
+ * threads still have in it are not freed.
+ *
+ * @param local the slot
+ */
+void
+_dbus_thread_local_free (DBusThreadLocal *local)
+{
+  pthread_key_delete (local->key);
+  dbus_free (local);
+}
+
+/**
+ * Gets the calling thread's value.
+ *
+ * @param local the slot
+ * @returns the value, #NULL if never set
+ */
+void*
+_dbus_thread_local_get (DBusThreadLocal *local)
+{
+  return pthread_getspecific (local->key);
+}
+
+/**
+ * Sets the calling thread's value.
+ *
+ * @param local the slot
+ * @param value the new value
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_thread_local_set (DBusThreadLocal *local,
+                        void            *value)
+{
+  return pthread_setspecific (local->key, value) == 0;
+}
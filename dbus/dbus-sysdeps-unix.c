@@ -22,6 +22,10 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for accept4() */
+#endif
+
 #include "dbus-internals.h"
 #include "dbus-sysdeps.h"
 #include "dbus-sysdeps-unix.h"
@@ -196,6 +200,347 @@ _dbus_write_socket_two (int               fd,
                           buffer2, start2, len2);
 }
 
+/**
+ * Like _dbus_write_socket_two() but for any number of whole
+ * buffers, written in order with a single writev() where available.
+ * n_buffers must not exceed #_DBUS_MAX_WRITE_BUFFERS.
+ *
+ * @param fd the file descriptor
+ * @param buffers the buffers to write
+ * @param n_buffers number of buffers
+ * @returns total bytes written from all buffers, or -1 on error
+ */
+int
+_dbus_write_socket_many (int                fd,
+                         const DBusString **buffers,
+                         int                n_buffers)
+{
+  _dbus_assert (n_buffers > 0 && n_buffers <= _DBUS_MAX_WRITE_BUFFERS);
+
+#ifdef HAVE_WRITEV
+  {
+    struct iovec vectors[_DBUS_MAX_WRITE_BUFFERS];
+    int bytes_written;
+    int i;
+
+    for (i = 0; i < n_buffers; i++)
+      {
+        vectors[i].iov_base = (char*) _dbus_string_get_const_data (buffers[i]);
+        vectors[i].iov_len = _dbus_string_get_length (buffers[i]);
+      }
+
+  again:
+
+    bytes_written = writev (fd, vectors, n_buffers);
+
+    if (bytes_written < 0 && errno == EINTR)
+      goto again;
+
+    return bytes_written;
+  }
+#else /* HAVE_WRITEV */
+  {
+    int total;
+    int len;
+    int ret;
+    int i;
+
+    total = 0;
+    for (i = 0; i < n_buffers; i++)
+      {
+        len = _dbus_string_get_length (buffers[i]);
+        ret = _dbus_write (fd, buffers[i], 0, len);
+        if (ret < 0)
+          return total > 0 ? total : ret; /* the earlier writes were OK */
+
+        total += ret;
+        if (ret < len)
+          break;
+      }
+
+    return total;
+  }
+#endif /* !HAVE_WRITEV */
+}
+
+
+/**
+ * Like _dbus_read_socket(), but uses recvmsg() so that unix file
+ * descriptors sent along with the data (SCM_RIGHTS) are received
+ * too. On entry, *n_fds is the number of descriptors fds has room
+ * for; on return it is the number actually received. Any
+ * descriptors the kernel had to truncate are lost, which the message
+ * loader will later notice as a message referring to missing fds.
+ *
+ * The received descriptors have the close-on-exec flag set.
+ *
+ * @param fd the socket
+ * @param buffer string to append data to
+ * @param count max amount of data to read
+ * @param fds array to store received file descriptors in
+ * @param n_fds in: size of fds, out: number of fds received
+ * @returns number of bytes appended to the string, or -1 on error
+ */
+int
+_dbus_read_socket_with_unix_fds (int               fd,
+                                 DBusString       *buffer,
+                                 int               count,
+                                 int              *fds,
+                                 int              *n_fds)
+{
+#ifndef HAVE_UNIX_FD_PASSING
+  int r;
+
+  if ((r = _dbus_read_socket (fd, buffer, count)) < 0)
+    return r;
+
+  *n_fds = 0;
+  return r;
+
+#else
+  int bytes_read;
+  int start;
+  struct msghdr m;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  char *control;
+
+  _dbus_assert (count >= 0);
+  _dbus_assert (*n_fds >= 0);
+
+  start = _dbus_string_get_length (buffer);
+
+  if (!_dbus_string_lengthen (buffer, count))
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  _DBUS_ZERO (iov);
+  iov.iov_base = _dbus_string_get_data_len (buffer, start, count);
+  iov.iov_len = count;
+
+  _DBUS_ZERO (m);
+  m.msg_iov = &iov;
+  m.msg_iovlen = 1;
+
+  /* Hmm, we have no clue how long the control data will actually be
+     that is queued for us. The least we can do is assume that the
+     caller knows. Hence let's make space for the number of fds that
+     we shall read at max plus the cmsg header. */
+  m.msg_controllen = CMSG_SPACE (*n_fds * sizeof (int));
+
+  control = dbus_malloc0 (m.msg_controllen);
+  if (control == NULL)
+    {
+      _dbus_string_set_length (buffer, start);
+      errno = ENOMEM;
+      return -1;
+    }
+  m.msg_control = control;
+
+ again:
+
+  bytes_read = recvmsg (fd, &m, 0
+#ifdef MSG_CMSG_CLOEXEC
+                        |MSG_CMSG_CLOEXEC
+#endif
+                        );
+
+  if (bytes_read < 0)
+    {
+      if (errno == EINTR)
+        goto again;
+      else
+        {
+          /* put length back (note that this doesn't actually realloc anything) */
+          _dbus_string_set_length (buffer, start);
+          dbus_free (control);
+          return -1;
+        }
+    }
+  else
+    {
+      dbus_bool_t found = FALSE;
+
+      if (m.msg_flags & MSG_CTRUNC)
+        {
+          /* Hmm, apparently the control data was truncated. The bad
+             thing is that we might have completely lost a couple of fds
+             without chance to recover them. Hence let's treat this as a
+             serious error. */
+          _dbus_string_set_length (buffer, start);
+          dbus_free (control);
+          errno = ENOSPC;
+          return -1;
+        }
+
+      for (cm = CMSG_FIRSTHDR (&m); cm; cm = CMSG_NXTHDR (&m, cm))
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+          {
+            unsigned i;
+
+            _dbus_assert (cm->cmsg_len <= CMSG_LEN (*n_fds * sizeof (int)));
+            *n_fds = (cm->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+
+            memcpy (fds, CMSG_DATA (cm), *n_fds * sizeof (int));
+            found = TRUE;
+
+            /* Linux doesn't tell us whether MSG_CMSG_CLOEXEC actually
+               worked, hence we need to go through this list and set
+               CLOEXEC everywhere in any case */
+            for (i = 0; i < (unsigned) *n_fds; i++)
+              _dbus_fd_set_close_on_exec (fds[i]);
+
+            break;
+          }
+
+      if (!found)
+        *n_fds = 0;
+
+      dbus_free (control);
+
+      /* put length back (doesn't actually realloc) */
+      _dbus_string_set_length (buffer, start + bytes_read);
+
+      return bytes_read;
+    }
+#endif
+}
+
+/**
+ * Like _dbus_write_socket_two(), but uses sendmsg() so that the
+ * given unix file descriptors are passed along with the data
+ * (SCM_RIGHTS). The descriptors are attached to the first byte
+ * written, so the caller must pass them only once per message.
+ *
+ * @param fd the socket
+ * @param buffer1 first buffer
+ * @param start1 first byte to write in first buffer
+ * @param len1 number of bytes to write from first buffer
+ * @param buffer2 second buffer, or #NULL
+ * @param start2 first byte to write in second buffer
+ * @param len2 number of bytes to write in second buffer
+ * @param fds file descriptors to pass
+ * @param n_fds number of file descriptors to pass
+ * @returns total bytes written from both buffers, or -1 on error
+ */
+int
+_dbus_write_socket_with_unix_fds_two (int               fd,
+                                      const DBusString *buffer1,
+                                      int               start1,
+                                      int               len1,
+                                      const DBusString *buffer2,
+                                      int               start2,
+                                      int               len2,
+                                      const int        *fds,
+                                      int               n_fds)
+{
+#ifndef HAVE_UNIX_FD_PASSING
+
+  if (n_fds > 0)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  return _dbus_write_socket_two (fd,
+                                 buffer1, start1, len1,
+                                 buffer2, start2, len2);
+#else
+
+  struct msghdr m;
+  struct cmsghdr *cm;
+  struct iovec iov[2];
+  char *control;
+  int bytes_written;
+
+  _dbus_assert (len1 >= 0);
+  _dbus_assert (len2 >= 0);
+  _dbus_assert (n_fds >= 0);
+
+  _DBUS_ZERO (iov);
+  iov[0].iov_base = (char*) _dbus_string_get_const_data_len (buffer1, start1, len1);
+  iov[0].iov_len = len1;
+
+  if (buffer2)
+    {
+      iov[1].iov_base = (char*) _dbus_string_get_const_data_len (buffer2, start2, len2);
+      iov[1].iov_len = len2;
+    }
+
+  _DBUS_ZERO (m);
+  m.msg_iov = iov;
+  m.msg_iovlen = buffer2 ? 2 : 1;
+
+  control = NULL;
+  if (n_fds > 0)
+    {
+      m.msg_controllen = CMSG_SPACE (n_fds * sizeof (int));
+      control = dbus_malloc0 (m.msg_controllen);
+      if (control == NULL)
+        {
+          errno = ENOMEM;
+          return -1;
+        }
+      m.msg_control = control;
+
+      cm = CMSG_FIRSTHDR (&m);
+      cm->cmsg_level = SOL_SOCKET;
+      cm->cmsg_type = SCM_RIGHTS;
+      cm->cmsg_len = CMSG_LEN (n_fds * sizeof (int));
+      memcpy (CMSG_DATA (cm), fds, n_fds * sizeof (int));
+    }
+
+ again:
+
+  bytes_written = sendmsg (fd, &m, 0
+#ifdef MSG_NOSIGNAL
+                           |MSG_NOSIGNAL
+#endif
+                           );
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  dbus_free (control);
+
+  return bytes_written;
+#endif
+}
+
+/**
+ * Checks whether the given socket is able to pass unix file
+ * descriptors, i.e. whether it is a unix domain socket and the
+ * platform supports SCM_RIGHTS.
+ *
+ * @param fd the socket
+ * @returns #TRUE if file descriptors can be passed over fd
+ */
+dbus_bool_t
+_dbus_socket_can_pass_unix_fd (int fd)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  union {
+    struct sockaddr sa;
+    struct sockaddr_storage storage;
+    struct sockaddr_un un;
+  } sa_buf;
+
+  socklen_t sa_len = sizeof (sa_buf);
+
+  _DBUS_ZERO (sa_buf);
+
+  if (getsockname (fd, &sa_buf.sa, &sa_len) < 0)
+    return FALSE;
+
+  return sa_buf.sa.sa_family == AF_UNIX;
+
+#else
+  return FALSE;
+
+#endif
+}
 
 /**
  * Thin wrapper around the read() system call that appends
@@ -668,7 +1013,7 @@ _dbus_listen_unix_socket (const char     *path,
 
 #endif  /* android init managed sockets */
 
-  if (listen (listen_fd, 30 /* backlog */) < 0)
+  if (listen (listen_fd, _DBUS_DEFAULT_LISTEN_BACKLOG) < 0)
     {
       dbus_set_error (error, _dbus_error_from_errno (errno),
                       "Failed to listen on socket \"%s\": %s",
@@ -838,7 +1183,7 @@ _dbus_listen_tcp_socket (const char     *host,
       return -1;
     }
 
-  if (listen (listen_fd, 30 /* backlog */) < 0)
+  if (listen (listen_fd, _DBUS_DEFAULT_LISTEN_BACKLOG) < 0)
     {
       dbus_set_error (error, _dbus_error_from_errno (errno),  
                       "Failed to listen on socket \"%s:%d\": %s",
@@ -1118,9 +1463,29 @@ _dbus_send_credentials_unix_socket  (int              server_fd,
     return FALSE;
 }
 
+/**
+ * Returns whether the byte _dbus_send_credentials_unix_socket()
+ * writes is just a nul byte with nothing attached, in which case it
+ * may as well be written together with whatever follows it.
+ *
+ * @returns #TRUE if no ancillary data goes with the credentials byte
+ */
+dbus_bool_t
+_dbus_credentials_byte_is_plain (void)
+{
+#if defined(HAVE_CMSGCRED)
+  return FALSE;
+#else
+  return TRUE;
+#endif
+}
+
 /**
  * Accepts a connection on a listening socket.
- * Handles EINTR for you.
+ * Handles EINTR for you. The new socket is close-on-exec
+ * and nonblocking; where accept4() is available both flags
+ * are set by the accept itself rather than by two more
+ * system calls.
  *
  * @param listen_fd the listen file descriptor
  * @returns the connection fd of the client, or -1 on error
@@ -1131,21 +1496,85 @@ _dbus_accept  (int listen_fd)
   int client_fd;
   struct sockaddr addr;
   socklen_t addrlen;
+#ifdef HAVE_ACCEPT4
+  dbus_bool_t have_flags;
+#endif
 
-  addrlen = sizeof (addr);
-  
  retry:
+  addrlen = sizeof (addr);
+
+#ifdef HAVE_ACCEPT4
+  client_fd = accept4 (listen_fd, &addr, &addrlen,
+                       SOCK_CLOEXEC | SOCK_NONBLOCK);
+  have_flags = TRUE;
+
+  /* The C library has it but the kernel may not */
+  if (client_fd < 0 && (errno == ENOSYS || errno == EINVAL))
+    {
+      addrlen = sizeof (addr);
+      client_fd = accept (listen_fd, &addr, &addrlen);
+      have_flags = FALSE;
+    }
+#else
   client_fd = accept (listen_fd, &addr, &addrlen);
-  
+#endif
+
   if (client_fd < 0)
     {
       if (errno == EINTR)
         goto retry;
+
+      return -1;
     }
-  
+
+#ifdef HAVE_ACCEPT4
+  if (have_flags)
+    return client_fd;
+#endif
+
+  _dbus_fd_set_close_on_exec (client_fd);
+
+  if (!_dbus_set_fd_nonblocking (client_fd, NULL))
+    {
+      int saved_errno;
+
+      saved_errno = errno;
+      _dbus_close (client_fd, NULL);
+      errno = saved_errno;
+      return -1;
+    }
+
   return client_fd;
 }
 
+/**
+ * Changes how many pending connections the kernel queues on a
+ * listening socket before refusing new ones. Calling listen() again
+ * on a socket that is already listening just updates its backlog.
+ *
+ * @param listen_fd the listen file descriptor
+ * @param backlog the new backlog
+ * @param error error to set on failure
+ * @returns #FALSE on failure
+ */
+dbus_bool_t
+_dbus_set_listen_backlog (int        listen_fd,
+                          int        backlog,
+                          DBusError *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (listen (listen_fd, backlog) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set listen backlog to %d: %s",
+                      backlog, _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /**
  * Checks to make sure the given directory is 
  * private to the user 
@@ -1931,6 +2360,136 @@ _dbus_delete_file (const DBusString *filename,
     return TRUE;
 }
 
+/**
+ * Opens the given lock file, creating it if needed, and takes an
+ * exclusive fcntl() lock on it, blocking until whoever holds it
+ * lets go. The lock is released by closing the returned file
+ * descriptor, or when the process exits, so a holder that crashes
+ * never leaves a stale lock behind.
+ *
+ * If the file system doesn't support locking, sets
+ * #DBUS_ERROR_NOT_SUPPORTED; a lock file this function created is
+ * removed again in that case.
+ *
+ * @param filename the lock file
+ * @param error error location
+ * @returns the file descriptor holding the lock, or -1
+ */
+int
+_dbus_lock_file_blocking (const DBusString *filename,
+                          DBusError        *error)
+{
+  const char *filename_c;
+  struct flock lock;
+  dbus_bool_t created;
+  int saved_errno;
+  int fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  filename_c = _dbus_string_get_const_data (filename);
+
+  created = TRUE;
+  fd = open (filename_c, O_RDWR | O_BINARY | O_EXCL | O_CREAT, 0600);
+  if (fd < 0 && errno == EEXIST)
+    {
+      created = FALSE;
+      fd = open (filename_c, O_RDWR | O_BINARY);
+    }
+
+  if (fd < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not open lock file %s: %s",
+                      filename_c, _dbus_strerror (errno));
+      return -1;
+    }
+
+  _dbus_fd_set_close_on_exec (fd);
+
+  memset (&lock, 0, sizeof (lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+
+ again:
+  if (fcntl (fd, F_SETLKW, &lock) < 0)
+    {
+      if (errno == EINTR)
+        goto again;
+
+      saved_errno = errno;
+
+      if (created)
+        unlink (filename_c);
+      _dbus_close (fd, NULL);
+
+      if (saved_errno == ENOLCK || saved_errno == EINVAL ||
+          saved_errno == EOPNOTSUPP)
+        dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                        "File system does not support locking %s",
+                        filename_c);
+      else
+        dbus_set_error (error, _dbus_error_from_errno (saved_errno),
+                        "Could not lock %s: %s",
+                        filename_c, _dbus_strerror (saved_errno));
+      return -1;
+    }
+
+  return fd;
+}
+
+/**
+ * Releases a lock taken with _dbus_lock_file_blocking(). The lock
+ * file itself stays around for the next user.
+ *
+ * @param lock_fd the file descriptor holding the lock
+ */
+void
+_dbus_unlock_file (int lock_fd)
+{
+  _dbus_close (lock_fd, NULL);
+}
+
+/**
+ * stat() wrapper.
+ *
+ * @param filename the filename to stat
+ * @param statbuf the stat info to fill in
+ * @param error return location for error
+ * @returns #FALSE if error was set
+ */
+dbus_bool_t
+_dbus_stat (const DBusString *filename,
+            DBusStat         *statbuf,
+            DBusError        *error)
+{
+  const char *filename_c;
+  struct stat sb;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  
+  filename_c = _dbus_string_get_const_data (filename);
+
+  if (stat (filename_c, &sb) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "%s", _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  statbuf->mode = sb.st_mode;
+  statbuf->nlink = sb.st_nlink;
+  statbuf->uid = sb.st_uid;
+  statbuf->gid = sb.st_gid;
+  statbuf->size = sb.st_size;
+  statbuf->atime = sb.st_atime;
+  statbuf->mtime = sb.st_mtime;
+  statbuf->ctime = sb.st_ctime;
+  statbuf->ino = sb.st_ino;
+
+  return TRUE;
+}
+
 /**
  * Creates a directory; succeeds if the directory
  * is created or already existed.
@@ -2190,6 +2749,41 @@ _dbus_close (int        fd,
   return TRUE;
 }
 
+/**
+ * Duplicates a file descriptor. The new descriptor has the
+ * close-on-exec flag set, so it is not leaked into children
+ * we spawn.
+ *
+ * @param fd the file descriptor to duplicate
+ * @param error error object
+ * @returns the new file descriptor, or -1 if error set
+ */
+int
+_dbus_dup (int        fd,
+           DBusError *error)
+{
+  int new_fd;
+
+#ifdef F_DUPFD_CLOEXEC
+  new_fd = fcntl (fd, F_DUPFD_CLOEXEC, 3);
+  if (new_fd >= 0)
+    return new_fd;
+  /* fall back to dup() if the kernel doesn't know F_DUPFD_CLOEXEC */
+#endif
+
+  new_fd = fcntl (fd, F_DUPFD, 3);
+  if (new_fd < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not duplicate fd %d", fd);
+      return -1;
+    }
+
+  _dbus_fd_set_close_on_exec (new_fd);
+
+  return new_fd;
+}
+
 /**
  * Sets a file descriptor to be nonblocking.
  *
@@ -2326,6 +2920,98 @@ _dbus_full_duplex_pipe (int        *fd1,
 #endif
 }
 
+/**
+ * Creates a pipe used to wake up a thread blocked in _dbus_poll():
+ * the thread polls the read end for input, and another thread calls
+ * _dbus_wakeup_pipe_signal() on the write end. Both ends are
+ * nonblocking and close-on-exec.
+ *
+ * @param read_fd return location for the end to poll
+ * @param write_fd return location for the end to signal
+ * @param error error return
+ * @returns #FALSE on failure (if error is set)
+ */
+dbus_bool_t
+_dbus_wakeup_pipe_open (int       *read_fd,
+                        int       *write_fd,
+                        DBusError *error)
+{
+  int fds[2];
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (pipe (fds) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not create wakeup pipe: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  if (!_dbus_set_fd_nonblocking (fds[0], error) ||
+      !_dbus_set_fd_nonblocking (fds[1], error))
+    {
+      _dbus_close (fds[0], NULL);
+      _dbus_close (fds[1], NULL);
+      return FALSE;
+    }
+
+  _dbus_fd_set_close_on_exec (fds[0]);
+  _dbus_fd_set_close_on_exec (fds[1]);
+
+  *read_fd = fds[0];
+  *write_fd = fds[1];
+
+  return TRUE;
+}
+
+/**
+ * Makes the read end of a wakeup pipe readable. If the pipe is
+ * already full there is a wakeup pending anyway, so that isn't
+ * an error.
+ *
+ * @param write_fd the write end of the pipe
+ */
+void
+_dbus_wakeup_pipe_signal (int write_fd)
+{
+  char c = 0;
+
+  while (write (write_fd, &c, 1) < 0 && errno == EINTR)
+    ;
+}
+
+/**
+ * Reads everything pending on the read end of a wakeup pipe, so
+ * that it only polls as readable again after the next signal.
+ *
+ * @param read_fd the read end of the pipe
+ */
+void
+_dbus_wakeup_pipe_drain (int read_fd)
+{
+  char buf[64];
+  int bytes;
+
+  do
+    bytes = read (read_fd, buf, sizeof (buf));
+  while (bytes == sizeof (buf) || (bytes < 0 && errno == EINTR));
+}
+
+/**
+ * Closes both ends of a wakeup pipe.
+ *
+ * @param read_fd the read end of the pipe
+ * @param write_fd the write end of the pipe
+ */
+void
+_dbus_wakeup_pipe_close (int read_fd,
+                         int write_fd)
+{
+  _dbus_close (read_fd, NULL);
+  _dbus_close (write_fd, NULL);
+}
+
 
 /**
  * Measure the length of the given format string and arguments,
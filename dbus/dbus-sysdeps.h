@@ -28,6 +28,7 @@
 #include <config.h>
 
 #include <dbus/dbus-errors.h>
+#include <dbus/dbus-memory.h>
 
 /* this is perhaps bogus, but strcmp() etc. are faster if we use the
  * stuff straight out of string.h, so have this here for now.
@@ -138,6 +139,30 @@ int         _dbus_write_socket_two (int               fd,
                                     const DBusString *buffer2,
                                     int               start2,
                                     int               len2);
+
+/** Most buffers _dbus_write_socket_many() takes at once */
+#define _DBUS_MAX_WRITE_BUFFERS 32
+
+int         _dbus_write_socket_many (int                fd,
+                                     const DBusString **buffers,
+                                     int                n_buffers);
+
+int         _dbus_read_socket_with_unix_fds      (int               fd,
+                                                  DBusString       *buffer,
+                                                  int               count,
+                                                  int              *fds,
+                                                  int              *n_fds);
+int         _dbus_write_socket_with_unix_fds_two (int               fd,
+                                                  const DBusString *buffer1,
+                                                  int               start1,
+                                                  int               len1,
+                                                  const DBusString *buffer2,
+                                                  int               start2,
+                                                  int               len2,
+                                                  const int        *fds,
+                                                  int               n_fds);
+dbus_bool_t _dbus_socket_can_pass_unix_fd        (int               fd);
+
 int _dbus_connect_tcp_socket  (const char     *host,
                                dbus_uint32_t   port,
                                DBusError      *error);
@@ -145,6 +170,12 @@ int _dbus_listen_tcp_socket   (const char     *host,
                                dbus_uint32_t   port,
                                DBusError      *error);
 int _dbus_accept              (int             listen_fd);
+dbus_bool_t _dbus_set_listen_backlog (int        listen_fd,
+                                      int        backlog,
+                                      DBusError *error);
+
+/** Backlog of pending connections new listening sockets start with */
+#define _DBUS_DEFAULT_LISTEN_BACKLOG 30
 
 /**
  * Struct representing socket credentials
@@ -164,6 +195,7 @@ dbus_bool_t _dbus_read_credentials_unix_socket (int              client_fd,
                                                 DBusError       *error);
 dbus_bool_t _dbus_send_credentials_unix_socket (int              server_fd,
                                                 DBusError       *error);
+dbus_bool_t _dbus_credentials_byte_is_plain     (void);
 
 
 void        _dbus_credentials_clear                (DBusCredentials       *credentials);
@@ -286,6 +318,9 @@ dbus_bool_t    _dbus_create_file_exclusively (const DBusString *filename,
                                               DBusError        *error);
 dbus_bool_t    _dbus_delete_file             (const DBusString *filename,
                                               DBusError        *error);
+int            _dbus_lock_file_blocking      (const DBusString *filename,
+                                              DBusError        *error);
+void           _dbus_unlock_file             (int               lock_fd);
 dbus_bool_t    _dbus_create_directory        (const DBusString *filename,
                                               DBusError        *error);
 dbus_bool_t    _dbus_delete_directory        (const DBusString *filename,
@@ -352,6 +387,7 @@ typedef struct
   unsigned long atime; /**< Access time */
   unsigned long mtime; /**< Modify time */
   unsigned long ctime; /**< Creation time */
+  unsigned long ino;   /**< Inode number */
 } DBusStat;
 
 dbus_bool_t _dbus_stat             (const DBusString *filename,
@@ -361,6 +397,13 @@ dbus_bool_t _dbus_full_duplex_pipe (int              *fd1,
                                     int              *fd2,
                                     dbus_bool_t       blocking,
                                     DBusError        *error);
+dbus_bool_t _dbus_wakeup_pipe_open   (int              *read_fd,
+                                     int              *write_fd,
+                                     DBusError        *error);
+void        _dbus_wakeup_pipe_signal (int               write_fd);
+void        _dbus_wakeup_pipe_drain  (int               read_fd);
+void        _dbus_wakeup_pipe_close  (int               read_fd,
+                                     int               write_fd);
 
 void        _dbus_print_backtrace  (void);
 
@@ -440,6 +483,21 @@ dbus_bool_t _dbus_read_local_machine_uuid   (DBusGUID         *machine_id,
  */
 dbus_bool_t _dbus_threads_init_platform_specific (void);
 
+/** A function run in a thread started with _dbus_thread_start() */
+typedef void (* DBusThreadFunction) (void *data);
+
+dbus_bool_t _dbus_thread_start (DBusThreadFunction  function,
+                                void               *data);
+
+/** A value that is different in each thread, see _dbus_thread_local_new() */
+typedef struct DBusThreadLocal DBusThreadLocal;
+
+DBusThreadLocal* _dbus_thread_local_new  (DBusFreeFunction  free_func);
+void             _dbus_thread_local_free (DBusThreadLocal  *local);
+void*            _dbus_thread_local_get  (DBusThreadLocal  *local);
+dbus_bool_t      _dbus_thread_local_set  (DBusThreadLocal  *local,
+                                          void             *value);
+
 /** @} */
 
 DBUS_END_DECLS
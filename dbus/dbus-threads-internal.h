@@ -48,6 +48,8 @@ void         _dbus_condvar_wake_all          (DBusCondVar       *cond);
 void         _dbus_condvar_new_at_location   (DBusCondVar      **location_p);
 void         _dbus_condvar_free_at_location  (DBusCondVar      **location_p);
 
+dbus_bool_t  _dbus_threads_initialized       (void);
+
 DBUS_END_DECLS
 
 #endif /* DBUS_THREADS_INTERNAL_H */
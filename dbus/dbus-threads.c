@@ -431,7 +431,9 @@ init_locks (void)
     LOCK_ADDR (system_users),
     LOCK_ADDR (message_cache),
     LOCK_ADDR (shared_connections),
-    LOCK_ADDR (machine_uuid)
+    LOCK_ADDR (machine_uuid),
+    LOCK_ADDR (keyrings),
+    LOCK_ADDR (hash_seed)
 #undef LOCK_ADDR
   };
 
@@ -648,6 +650,18 @@ dbus_threads_init (const DBusThreadFunctions *functions)
   return TRUE;
 }
 
+/**
+ * Checks whether dbus_threads_init() has been called since
+ * libdbus was last shut down, i.e. whether the locks are real.
+ *
+ * @returns #TRUE if threads have been initialized
+ */
+dbus_bool_t
+_dbus_threads_initialized (void)
+{
+  return thread_init_generation == _dbus_current_generation;
+}
+
 
 
 /* Default thread implemenation */
@@ -92,6 +92,7 @@ struct DBusTransport
   DBusCredentials credentials;                /**< Credentials of other end */  
 
   long max_live_messages_size;                /**< Max total size of received messages. */
+  long max_live_messages_unix_fds;            /**< Max total unix fds of received messages. */
 
   DBusCounter *live_messages_size;            /**< Counter for size of all live messages. */
 
@@ -104,6 +105,9 @@ struct DBusTransport
   void *unix_user_data;                         /**< Data for unix_user_function */
   
   DBusFreeFunction free_unix_user_data;         /**< Function to free unix_user_data */
+
+  int wakeup_read_fd;                           /**< Polled along with the transport in blocking iterations, or -1 */
+  int wakeup_write_fd;                          /**< Signaled to interrupt such an iteration, or -1 */
   
   unsigned int disconnected : 1;              /**< #TRUE if we are disconnected. */
   unsigned int authenticated : 1;             /**< Cache of auth state; use _dbus_transport_get_is_authenticated() to query value */
@@ -152,6 +152,8 @@ check_write_watch (DBusTransport *transport)
           if (auth_state == DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND ||
               auth_state == DBUS_AUTH_STATE_WAITING_FOR_MEMORY)
             needed = TRUE;
+          else if (_dbus_auth_get_pipelined (transport->auth))
+            needed = _dbus_connection_has_messages_to_send_unlocked (transport->connection);
           else
             needed = FALSE;
         }
@@ -293,6 +295,125 @@ read_data_into_auth (DBusTransport *transport,
     }
 }
 
+/** Most whole messages write_queued_messages() puts in one write */
+#define MAX_MESSAGES_PER_WRITE (_DBUS_MAX_WRITE_BUFFERS / 2)
+
+/*
+ * Fills in the header and body buffers of the messages at the head of
+ * the outgoing queue that can be written together, up to max_messages
+ * of them and as many as fit in budget bytes (but at least two).
+ * Stops at the first message carrying unix fds or a borrowed array.
+ * Returns how many messages were taken, with their total length in
+ * *total_p.
+ */
+static int
+gather_queued_messages (DBusTransport     *transport,
+                        DBusMessage      **messages,
+                        const DBusString **buffers,
+                        int               *lengths,
+                        int                max_messages,
+                        int                budget,
+                        int               *total_p)
+{
+  const DBusString *borrowed;
+  int n_messages;
+  int total;
+  int i;
+
+  n_messages = _dbus_connection_get_messages_to_send (transport->connection,
+                                                      messages,
+                                                      max_messages);
+
+  total = 0;
+  for (i = 0; i < n_messages; i++)
+    {
+#ifdef HAVE_UNIX_FD_PASSING
+      const int *unix_fds;
+      unsigned n_fds;
+
+      _dbus_message_get_unix_fds (messages[i], &unix_fds, &n_fds);
+      if (n_fds > 0)
+        break;
+#endif
+
+      _dbus_message_lock (messages[i]);
+      _dbus_message_get_network_data (messages[i],
+                                      &buffers[i * 2], &buffers[i * 2 + 1],
+                                      &borrowed);
+      if (_dbus_string_get_length (borrowed) > 0)
+        break;
+
+      lengths[i] = _dbus_string_get_length (buffers[i * 2]) +
+        _dbus_string_get_length (buffers[i * 2 + 1]);
+
+      if (i >= 2 && total + lengths[i] > budget)
+        break;
+
+      total += lengths[i];
+    }
+
+  *total_p = total;
+
+  return i;
+}
+
+/*
+ * Removes the messages that bytes_written covered completely from the
+ * outgoing queue; whatever is left of a partly written message is
+ * finished off by do_writing() one message at a time.
+ */
+static void
+queued_messages_written (DBusTransport  *transport,
+                         DBusMessage   **messages,
+                         const int      *lengths,
+                         int             n_messages,
+                         int             bytes_written)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  int i;
+
+  for (i = 0; i < n_messages; i++)
+    {
+      if (bytes_written < lengths[i])
+        {
+          socket_transport->message_bytes_written = bytes_written;
+          break;
+        }
+
+      bytes_written -= lengths[i];
+      _dbus_connection_message_sent (transport->connection, messages[i]);
+    }
+}
+
+/*
+ * A pipelined client writes its messages as soon as everything the
+ * handshake had to say is out, without waiting for the server's OK.
+ */
+static dbus_bool_t
+can_write_messages (DBusTransport *transport)
+{
+  const DBusString *auth_bytes;
+
+  if (_dbus_transport_get_is_authenticated (transport))
+    return TRUE;
+
+  return _dbus_auth_get_pipelined (transport->auth) &&
+    !transport->send_credentials_pending &&
+    !_dbus_auth_get_bytes_to_send (transport->auth, &auth_bytes);
+}
+
+/*
+ * With pipelined auth and a credentials byte that carries nothing
+ * special, the byte goes out in the same write as the auth bytes.
+ */
+static dbus_bool_t
+credentials_go_with_auth (DBusTransport *transport)
+{
+  return transport->send_credentials_pending &&
+    _dbus_auth_get_pipelined (transport->auth) &&
+    _dbus_credentials_byte_is_plain ();
+}
+
 /* Return value is whether we successfully wrote any bytes */
 static dbus_bool_t
 write_data_from_auth (DBusTransport *transport)
@@ -300,18 +421,78 @@ write_data_from_auth (DBusTransport *transport)
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
   int bytes_written;
   const DBusString *buffer;
+  DBusMessage *messages[MAX_MESSAGES_PER_WRITE - 1];
+  const DBusString *buffers[_DBUS_MAX_WRITE_BUFFERS];
+  int lengths[MAX_MESSAGES_PER_WRITE - 1];
+  DBusString credentials_byte;
+  dbus_bool_t with_credentials;
+  int n_buffers;
+  int n_messages;
+  int auth_len;
+  int total;
 
   if (!_dbus_auth_get_bytes_to_send (transport->auth,
                                      &buffer))
     return FALSE;
-  
-  bytes_written = _dbus_write_socket (socket_transport->fd,
-                                      buffer,
-                                      0, _dbus_string_get_length (buffer));
+
+  with_credentials = FALSE;
+  n_messages = 0;
+
+  if (!_dbus_auth_get_pipelined (transport->auth))
+    {
+      bytes_written = _dbus_write_socket (socket_transport->fd,
+                                          buffer,
+                                          0, _dbus_string_get_length (buffer));
+    }
+  else
+    {
+      /* Credentials byte, auth conversation and the first messages,
+       * all in one write
+       */
+      n_buffers = 0;
+      if (credentials_go_with_auth (transport))
+        {
+          _dbus_string_init_const_len (&credentials_byte, "", 1);
+          buffers[n_buffers++] = &credentials_byte;
+          with_credentials = TRUE;
+        }
+      buffers[n_buffers++] = buffer;
+
+      total = 0;
+      if (socket_transport->message_bytes_written == 0)
+        n_messages = gather_queued_messages (transport, messages,
+                                             &buffers[n_buffers], lengths,
+                                             MAX_MESSAGES_PER_WRITE - 1,
+                                             socket_transport->max_bytes_written_per_iteration,
+                                             &total);
+
+      bytes_written = _dbus_write_socket_many (socket_transport->fd, buffers,
+                                               n_buffers + n_messages * 2);
+
+      if (bytes_written > 0)
+        _dbus_verbose (" wrote %d bytes of pipelined auth and %d messages (%d bytes)\n",
+                       bytes_written, n_messages, total);
+    }
 
   if (bytes_written > 0)
     {
-      _dbus_auth_bytes_sent (transport->auth, bytes_written);
+      if (with_credentials)
+        {
+          transport->send_credentials_pending = FALSE;
+          bytes_written -= 1;
+        }
+
+      auth_len = _dbus_string_get_length (buffer);
+      if (bytes_written > auth_len)
+        {
+          queued_messages_written (transport, messages, lengths, n_messages,
+                                   bytes_written - auth_len);
+          bytes_written = auth_len;
+        }
+
+      if (bytes_written > 0)
+        _dbus_auth_bytes_sent (transport->auth, bytes_written);
+
       return TRUE;
     }
   else if (bytes_written < 0)
@@ -344,7 +525,8 @@ exchange_credentials (DBusTransport *transport,
                   do_reading, do_writing);
 
   dbus_error_init (&error);
-  if (do_writing && transport->send_credentials_pending)
+  if (do_writing && transport->send_credentials_pending &&
+      !credentials_go_with_auth (transport))
     {
       if (_dbus_send_credentials_unix_socket (socket_transport->fd,
                                               &error))
@@ -414,7 +596,8 @@ do_authentication (DBusTransport *transport,
     {      
       exchange_credentials (transport, do_reading, do_writing);
       
-      if (transport->send_credentials_pending ||
+      if ((transport->send_credentials_pending &&
+           !credentials_go_with_auth (transport)) ||
           transport->receive_credentials_pending)
         {
           _dbus_verbose ("send_credentials_pending = %d receive_credentials_pending = %d\n",
@@ -474,6 +657,55 @@ do_authentication (DBusTransport *transport,
     return TRUE;
 }
 
+/*
+ * If several messages are queued and none of them has been partly
+ * written yet, writes as many of them as fit in budget bytes (but at
+ * least two) with a single system call, and removes the ones that
+ * went out completely from the queue. Messages that need encoding,
+ * carry unix fds or have a borrowed array still go one at a time
+ * through do_writing().
+ *
+ * Returns #FALSE if it didn't try; otherwise *bytes_written_p is
+ * the result of the write, -1 on error with errno set.
+ */
+static dbus_bool_t
+write_queued_messages (DBusTransport *transport,
+                       int            budget,
+                       int           *bytes_written_p)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusMessage *messages[MAX_MESSAGES_PER_WRITE];
+  const DBusString *buffers[_DBUS_MAX_WRITE_BUFFERS];
+  int lengths[MAX_MESSAGES_PER_WRITE];
+  int n_messages;
+  int bytes_written;
+  int total;
+
+  if (socket_transport->message_bytes_written > 0 ||
+      _dbus_auth_needs_encoding (transport->auth))
+    return FALSE;
+
+  n_messages = gather_queued_messages (transport, messages, buffers, lengths,
+                                       MAX_MESSAGES_PER_WRITE, budget, &total);
+  if (n_messages < 2)
+    return FALSE;
+
+  bytes_written = _dbus_write_socket_many (socket_transport->fd,
+                                           buffers, n_messages * 2);
+  *bytes_written_p = bytes_written;
+
+  if (bytes_written < 0)
+    return TRUE;
+
+  _dbus_verbose (" wrote %d bytes of %d messages (%d bytes)\n",
+                 bytes_written, n_messages, total);
+
+  queued_messages_written (transport, messages, lengths, n_messages,
+                           bytes_written);
+
+  return TRUE;
+}
+
 /* returns false on oom */
 static dbus_bool_t
 do_writing (DBusTransport *transport)
@@ -483,7 +715,7 @@ do_writing (DBusTransport *transport)
   dbus_bool_t oom;
   
   /* No messages without authentication! */
-  if (!_dbus_transport_get_is_authenticated (transport))
+  if (!can_write_messages (transport))
     {
       _dbus_verbose ("Not authenticated, not writing anything\n");
       return TRUE;
@@ -511,7 +743,8 @@ do_writing (DBusTransport *transport)
       DBusMessage *message;
       const DBusString *header;
       const DBusString *body;
-      int header_len, body_len;
+      const DBusString *borrowed;
+      int header_len, body_len, borrowed_len;
       int total_bytes_to_write;
       
       if (total > socket_transport->max_bytes_written_per_iteration)
@@ -521,6 +754,26 @@ do_writing (DBusTransport *transport)
           goto out;
         }
       
+      if (write_queued_messages (transport,
+                                 socket_transport->max_bytes_written_per_iteration - total,
+                                 &bytes_written))
+        {
+          if (bytes_written < 0)
+            {
+              if (errno == EAGAIN ||
+                  errno == EWOULDBLOCK)
+                goto out;
+
+              _dbus_verbose ("Error writing to remote app: %s\n",
+                             _dbus_strerror (errno));
+              do_io_error (transport);
+              goto out;
+            }
+
+          total += bytes_written;
+          continue;
+        }
+
       message = _dbus_connection_get_message_to_send (transport->connection);
       _dbus_assert (message != NULL);
       _dbus_message_lock (message);
@@ -530,10 +783,11 @@ do_writing (DBusTransport *transport)
 #endif
       
       _dbus_message_get_network_data (message,
-                                      &header, &body);
+                                      &header, &body, &borrowed);
 
       header_len = _dbus_string_get_length (header);
       body_len = _dbus_string_get_length (body);
+      borrowed_len = _dbus_string_get_length (borrowed);
 
       if (_dbus_auth_needs_encoding (transport->auth))
         {
@@ -553,6 +807,15 @@ do_writing (DBusTransport *transport)
                   oom = TRUE;
                   goto out;
                 }
+
+              if (borrowed_len > 0 &&
+                  !_dbus_auth_encode_data (transport->auth,
+                                           borrowed, &socket_transport->encoded_outgoing))
+                {
+                  _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
+                  oom = TRUE;
+                  goto out;
+                }
             }
           
           total_bytes_to_write = _dbus_string_get_length (&socket_transport->encoded_outgoing);
@@ -570,13 +833,38 @@ do_writing (DBusTransport *transport)
         }
       else
         {
-          total_bytes_to_write = header_len + body_len;
+          total_bytes_to_write = header_len + body_len + borrowed_len;
 
 #if 0
           _dbus_verbose ("message is %d bytes\n",
                          total_bytes_to_write);          
 #endif
           
+#ifdef HAVE_UNIX_FD_PASSING
+          if (socket_transport->message_bytes_written <= 0 &&
+              _dbus_auth_get_unix_fd_negotiated (transport->auth))
+            {
+              /* Send the fds along with the first byte of the message */
+              const int *unix_fds;
+              unsigned n;
+
+              _dbus_message_get_unix_fds (message, &unix_fds, &n);
+
+              bytes_written =
+                _dbus_write_socket_with_unix_fds_two (socket_transport->fd,
+                                                      header,
+                                                      socket_transport->message_bytes_written,
+                                                      header_len - socket_transport->message_bytes_written,
+                                                      body,
+                                                      0, body_len,
+                                                      unix_fds,
+                                                      n);
+
+              if (bytes_written > 0 && n > 0)
+                _dbus_verbose ("Wrote %u unix fds\n", n);
+            }
+          else
+#endif
           if (socket_transport->message_bytes_written < header_len)
             {
               bytes_written =
@@ -587,7 +875,7 @@ do_writing (DBusTransport *transport)
                                         body,
                                         0, body_len);
             }
-          else
+          else if (socket_transport->message_bytes_written < header_len + body_len)
             {
               bytes_written =
                 _dbus_write_socket (socket_transport->fd,
@@ -596,6 +884,16 @@ do_writing (DBusTransport *transport)
                                     body_len -
                                     (socket_transport->message_bytes_written - header_len));
             }
+          else
+            {
+              /* A borrowed array goes out straight from the caller's memory */
+              bytes_written =
+                _dbus_write_socket (socket_transport->fd,
+                                    borrowed,
+                                    (socket_transport->message_bytes_written - header_len - body_len),
+                                    total_bytes_to_write -
+                                    socket_transport->message_bytes_written);
+            }
         }
 
       if (bytes_written < 0)
@@ -725,10 +1023,40 @@ do_reading (DBusTransport *transport)
     {
       _dbus_message_loader_get_buffer (transport->loader,
                                        &buffer);
-      
-      bytes_read = _dbus_read_socket (socket_transport->fd,
-                                      buffer, socket_transport->max_bytes_read_per_iteration);
-      
+
+#ifdef HAVE_UNIX_FD_PASSING
+      if (_dbus_auth_get_unix_fd_negotiated (transport->auth))
+        {
+          int *fds, n_fds;
+          unsigned max_n_fds;
+
+          if (!_dbus_message_loader_get_unix_fds (transport->loader, &fds, &max_n_fds))
+            {
+              _dbus_verbose ("Out of memory reading file descriptors\n");
+              _dbus_message_loader_return_buffer (transport->loader, buffer, 0);
+              oom = TRUE;
+              goto out;
+            }
+
+          n_fds = max_n_fds;
+          bytes_read = _dbus_read_socket_with_unix_fds (socket_transport->fd,
+                                                        buffer,
+                                                        socket_transport->max_bytes_read_per_iteration,
+                                                        fds, &n_fds);
+
+          if (bytes_read >= 0 && n_fds > 0)
+            _dbus_verbose ("Read %i unix fds\n", n_fds);
+
+          _dbus_message_loader_return_unix_fds (transport->loader, fds,
+                                                bytes_read < 0 ? 0 : n_fds);
+        }
+      else
+#endif
+        {
+          bytes_read = _dbus_read_socket (socket_transport->fd,
+                                          buffer, socket_transport->max_bytes_read_per_iteration);
+        }
+
       _dbus_message_loader_return_buffer (transport->loader,
                                           buffer,
                                           bytes_read < 0 ? 0 : bytes_read);
@@ -774,6 +1102,14 @@ do_reading (DBusTransport *transport)
           goto out;
         }
       
+      /* A message refused while queueing may have left an error
+       * reply to send
+       */
+      if (socket_transport->write_watch != NULL &&
+          !dbus_watch_get_enabled (socket_transport->write_watch) &&
+          _dbus_connection_has_messages_to_send_unlocked (transport->connection))
+        check_write_watch (transport);
+
       /* Try reading more data until we get EAGAIN and return, or
        * exceed max bytes per iteration.  If in blocking mode of
        * course we'll block instead of returning.
@@ -937,7 +1273,8 @@ socket_do_iteration (DBusTransport *transport,
                    int            timeout_milliseconds)
 {
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
-  DBusPollFD poll_fd;
+  DBusPollFD poll_fds[2];
+  int n_poll_fds;
   int poll_res;
   int poll_timeout;
 
@@ -955,8 +1292,8 @@ socket_do_iteration (DBusTransport *transport,
    * we don't want to read any messages yet if not given DO_READING.
    */
 
-  poll_fd.fd = socket_transport->fd;
-  poll_fd.events = 0;
+  poll_fds[0].fd = socket_transport->fd;
+  poll_fds[0].events = 0;
   
   if (_dbus_transport_get_is_authenticated (transport))
     {
@@ -984,12 +1321,18 @@ socket_do_iteration (DBusTransport *transport,
 
       /* If we get here, we decided to do the poll() after all */
       _dbus_assert (socket_transport->read_watch);
-      if (flags & DBUS_ITERATION_DO_READING)
-	poll_fd.events |= _DBUS_POLLIN;
+      /* With a wakeup pipe nothing else will notice when the read
+       * watch is disabled because too much has been received, so
+       * leave the socket alone until we are woken up again
+       */
+      if ((flags & DBUS_ITERATION_DO_READING) &&
+          (transport->wakeup_read_fd < 0 ||
+           dbus_watch_get_enabled (socket_transport->read_watch)))
+	poll_fds[0].events |= _DBUS_POLLIN;
 
       _dbus_assert (socket_transport->write_watch);
       if (flags & DBUS_ITERATION_DO_WRITING)
-        poll_fd.events |= _DBUS_POLLOUT;
+        poll_fds[0].events |= _DBUS_POLLOUT;
     }
   else
     {
@@ -999,14 +1342,27 @@ socket_do_iteration (DBusTransport *transport,
 
       if (transport->receive_credentials_pending ||
           auth_state == DBUS_AUTH_STATE_WAITING_FOR_INPUT)
-	poll_fd.events |= _DBUS_POLLIN;
+	poll_fds[0].events |= _DBUS_POLLIN;
 
       if (transport->send_credentials_pending ||
           auth_state == DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND)
-	poll_fd.events |= _DBUS_POLLOUT;
+	poll_fds[0].events |= _DBUS_POLLOUT;
+      else if ((flags & DBUS_ITERATION_DO_WRITING) &&
+               can_write_messages (transport) &&
+               _dbus_connection_has_messages_to_send_unlocked (transport->connection))
+	poll_fds[0].events |= _DBUS_POLLOUT;
     }
 
-  if (poll_fd.events)
+  n_poll_fds = 1;
+  if ((flags & DBUS_ITERATION_BLOCK) && transport->wakeup_read_fd >= 0)
+    {
+      poll_fds[1].fd = transport->wakeup_read_fd;
+      poll_fds[1].events = _DBUS_POLLIN;
+      poll_fds[1].revents = 0;
+      n_poll_fds = 2;
+    }
+
+  if (poll_fds[0].events || n_poll_fds > 1)
     {
       if (flags & DBUS_ITERATION_BLOCK)
 	poll_timeout = timeout_milliseconds;
@@ -1025,7 +1381,7 @@ socket_do_iteration (DBusTransport *transport,
         }
       
     again:
-      poll_res = _dbus_poll (&poll_fd, 1, poll_timeout);
+      poll_res = _dbus_poll (poll_fds, n_poll_fds, poll_timeout);
 
       if (poll_res < 0 && errno == EINTR)
 	goto again;
@@ -1034,22 +1390,30 @@ socket_do_iteration (DBusTransport *transport,
         {
           _dbus_verbose ("lock %s post poll\n", _DBUS_FUNCTION_NAME);
           _dbus_connection_lock (transport->connection);
+
+          /* someone may have closed the connection while we were
+           * polling without the lock
+           */
+          if (transport->disconnected)
+            goto out;
         }
       
       if (poll_res >= 0)
         {
           if (poll_res == 0)
-            poll_fd.revents = 0; /* some concern that posix does not guarantee this;
+            poll_fds[0].revents = 0; /* some concern that posix does not guarantee this;
                                   * valgrind flags it as an error. though it probably
                                   * is guaranteed on linux at least.
                                   */
+          else if (n_poll_fds > 1 && poll_fds[1].revents != 0)
+            _dbus_wakeup_pipe_drain (transport->wakeup_read_fd);
           
-          if (poll_fd.revents & _DBUS_POLLERR)
+          if (poll_fds[0].revents & _DBUS_POLLERR)
             do_io_error (transport);
           else
             {
-              dbus_bool_t need_read = (poll_fd.revents & _DBUS_POLLIN) > 0;
-              dbus_bool_t need_write = (poll_fd.revents & _DBUS_POLLOUT) > 0;
+              dbus_bool_t need_read = (poll_fds[0].revents & _DBUS_POLLIN) > 0;
+              dbus_bool_t need_write = (poll_fds[0].revents & _DBUS_POLLOUT) > 0;
 	      dbus_bool_t authentication_completed;
 
               _dbus_verbose ("in iteration, need_read=%d need_write=%d\n",
@@ -1094,8 +1458,21 @@ socket_do_iteration (DBusTransport *transport,
 static void
 socket_live_messages_changed (DBusTransport *transport)
 {
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  dbus_bool_t was_reading;
+
+  was_reading = socket_transport->read_watch == NULL ||
+    dbus_watch_get_enabled (socket_transport->read_watch);
+
   /* See if we should look for incoming messages again */
   check_read_watch (transport);
+
+  /* A thread blocked in do_iteration() isn't polling for input while
+   * the watch is disabled, so tell it to start again
+   */
+  if (!was_reading && transport->wakeup_write_fd >= 0 &&
+      dbus_watch_get_enabled (socket_transport->read_watch))
+    _dbus_wakeup_pipe_signal (transport->wakeup_write_fd);
 }
 
 
@@ -1166,7 +1543,10 @@ _dbus_transport_new_for_socket (int               fd,
                                   &socket_vtable,
                                   server_guid, address))
     goto failed_4;
-  
+
+  _dbus_auth_set_unix_fd_possible (socket_transport->base.auth,
+                                   _dbus_socket_can_pass_unix_fd (fd));
+
   socket_transport->fd = fd;
   socket_transport->message_bytes_written = 0;
   
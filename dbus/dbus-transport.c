@@ -155,12 +155,16 @@ _dbus_transport_init_base (DBusTransport             *transport,
   transport->unix_user_data = NULL;
   transport->free_unix_user_data = NULL;
 
+  transport->wakeup_read_fd = -1;
+  transport->wakeup_write_fd = -1;
+
   transport->expected_guid = NULL;
   
   /* Try to default to something that won't totally hose the system,
    * but doesn't impose too much of a limitation.
    */
   transport->max_live_messages_size = _DBUS_ONE_MEGABYTE * 63;
+  transport->max_live_messages_unix_fds = 4096;
   
   transport->credentials.pid = -1;
   transport->credentials.uid = -1;
@@ -782,6 +786,26 @@ _dbus_transport_do_iteration (DBusTransport  *transport,
   _dbus_verbose ("%s end\n", _DBUS_FUNCTION_NAME);
 }
 
+/**
+ * Gives the transport a wakeup pipe (see _dbus_wakeup_pipe_open()).
+ * Blocking iterations then also return when the pipe is signaled,
+ * and the transport signals it itself when it becomes able to read
+ * again after the received-size limit stopped it. The caller keeps
+ * ownership of the pipe.
+ *
+ * @param transport the transport
+ * @param read_fd the read end of the pipe
+ * @param write_fd the write end of the pipe
+ */
+void
+_dbus_transport_set_wakeup_pipe (DBusTransport *transport,
+                                 int            read_fd,
+                                 int            write_fd)
+{
+  transport->wakeup_read_fd = read_fd;
+  transport->wakeup_write_fd = write_fd;
+}
+
 static dbus_bool_t
 recover_unused_bytes (DBusTransport *transport)
 {
@@ -935,6 +959,38 @@ _dbus_transport_queue_messages (DBusTransport *transport)
       _dbus_assert (link != NULL);
       
       message = link->data;
+
+#ifdef HAVE_UNIX_FD_PASSING
+      {
+        unsigned n_fds;
+
+        /* Every fd in a live message is open in this process, so a
+         * peer must not be able to pile up more than the limit; the
+         * message is refused and its fds closed instead.
+         */
+        n_fds = _dbus_message_get_n_unix_fds (message);
+        if (n_fds > 0 &&
+            _dbus_counter_get_unix_fd_value (transport->live_messages_size) + n_fds >
+            transport->max_live_messages_unix_fds)
+          {
+            _dbus_verbose ("rejecting received message %p, its %u unix fds would exceed the limit of %ld\n",
+                           message, n_fds, transport->max_live_messages_unix_fds);
+
+            if (!_dbus_connection_reject_received_message_link (transport->connection,
+                                                                link,
+                                                                DBUS_ERROR_LIMITS_EXCEEDED,
+                                                                "Too many file descriptors in queued messages"))
+              {
+                _dbus_message_loader_putback_message_link (transport->loader,
+                                                           link);
+                status = DBUS_DISPATCH_NEED_MEMORY;
+                break;
+              }
+
+            continue;
+          }
+      }
+#endif
       
       _dbus_verbose ("queueing received message %p\n", message);
 
@@ -987,6 +1043,18 @@ _dbus_transport_get_max_message_size (DBusTransport  *transport)
   return _dbus_message_loader_get_max_message_size (transport->loader);
 }
 
+/**
+ * Returns TRUE if the transport supports sending unix fds.
+ *
+ * @param transport the transport
+ * @returns #TRUE if TRUE it is possible to send unix fds across the transport.
+ */
+dbus_bool_t
+_dbus_transport_can_pass_unix_fd (DBusTransport *transport)
+{
+  return _dbus_auth_get_unix_fd_negotiated (transport->auth);
+}
+
 /**
  * See dbus_connection_set_max_received_size().
  *
@@ -1005,6 +1073,31 @@ _dbus_transport_set_max_received_size (DBusTransport  *transport,
 }
 
 
+/**
+ * See dbus_connection_set_max_received_unix_fds().
+ *
+ * @param transport the transport
+ * @param n the max number of unix fds of all incoming messages
+ */
+void
+_dbus_transport_set_max_received_unix_fds (DBusTransport  *transport,
+                                           long            n)
+{
+  transport->max_live_messages_unix_fds = n;
+}
+
+/**
+ * See dbus_connection_get_max_received_unix_fds().
+ *
+ * @param transport the transport
+ * @returns max unix fds for all live messages
+ */
+long
+_dbus_transport_get_max_received_unix_fds (DBusTransport  *transport)
+{
+  return transport->max_live_messages_unix_fds;
+}
+
 /**
  * See dbus_connection_get_max_received_size().
  *
@@ -1017,6 +1110,19 @@ _dbus_transport_get_max_received_size (DBusTransport  *transport)
   return transport->max_live_messages_size;
 }
 
+/**
+ * Gets the total size of the messages received on this transport
+ * that are still alive, whether queued or held by the application.
+ *
+ * @param transport the transport
+ * @returns bytes of live received messages
+ */
+long
+_dbus_transport_get_live_messages_size (DBusTransport  *transport)
+{
+  return _dbus_counter_get_value (transport->live_messages_size);
+}
+
 /**
  * See dbus_connection_get_unix_user().
  *
@@ -1123,4 +1229,22 @@ _dbus_transport_set_auth_mechanisms (DBusTransport  *transport,
 }
 
 
+/**
+ * Switches a client transport that hasn't done any I/O yet to
+ * pipelined authentication, see _dbus_auth_set_pipelined().
+ *
+ * @param transport the transport
+ * @returns #FALSE if no memory, or if it's too late or not possible
+ */
+dbus_bool_t
+_dbus_transport_set_pipelined_auth (DBusTransport *transport)
+{
+  if (transport->is_server ||
+      !transport->send_credentials_pending)
+    return FALSE;
+
+  return _dbus_auth_set_pipelined (transport->auth);
+}
+
+
 /** @} */
@@ -48,6 +48,9 @@ dbus_bool_t        _dbus_transport_set_connection         (DBusTransport
 void               _dbus_transport_do_iteration           (DBusTransport              *transport,
                                                            unsigned int                flags,
                                                            int                         timeout_milliseconds);
+void               _dbus_transport_set_wakeup_pipe        (DBusTransport              *transport,
+                                                           int                         read_fd,
+                                                           int                         write_fd);
 DBusDispatchStatus _dbus_transport_get_dispatch_status    (DBusTransport              *transport);
 dbus_bool_t        _dbus_transport_queue_messages         (DBusTransport              *transport);
 void               _dbus_transport_set_max_message_size   (DBusTransport              *transport,
@@ -56,6 +59,11 @@ long               _dbus_transport_get_max_message_size   (DBusTransport
 void               _dbus_transport_set_max_received_size  (DBusTransport              *transport,
                                                            long                        size);
 long               _dbus_transport_get_max_received_size  (DBusTransport              *transport);
+void               _dbus_transport_set_max_received_unix_fds (DBusTransport           *transport,
+                                                              long                     n);
+long               _dbus_transport_get_max_received_unix_fds (DBusTransport           *transport);
+long               _dbus_transport_get_live_messages_size (DBusTransport              *transport);
+dbus_bool_t        _dbus_transport_can_pass_unix_fd       (DBusTransport              *transport);
 dbus_bool_t        _dbus_transport_get_socket_fd          (DBusTransport              *transport,
                                                            int                        *fd_p);
 dbus_bool_t        _dbus_transport_get_unix_user          (DBusTransport              *transport,
@@ -70,6 +78,7 @@ void               _dbus_transport_set_unix_user_function (DBusTransport
                                                            DBusFreeFunction           *old_free_data_function);
 dbus_bool_t        _dbus_transport_set_auth_mechanisms    (DBusTransport              *transport,
                                                            const char                **mechanisms);
+dbus_bool_t        _dbus_transport_set_pipelined_auth     (DBusTransport              *transport);
 
 
 
@@ -32,3 +32,9 @@ libtool --mode=execute $DEBUG $DBUS_TOP_BUILDDIR/test/name-test/test-pending-cal
 
 echo "running test-threads-init"
 libtool --mode=execute $DEBUG $DBUS_TOP_BUILDDIR/test/name-test/test-threads-init || die "test-client failed"
+
+echo "running test-io-thread"
+libtool --mode=execute $DEBUG $DBUS_TOP_BUILDDIR/test/name-test/test-io-thread || die "test-client failed"
+
+echo "running test-list-contention"
+libtool --mode=execute $DEBUG $DBUS_TOP_BUILDDIR/test/name-test/test-list-contention || die "test-client failed"
@@ -0,0 +1,140 @@
+/**
+ * Test that a connection with an I/O thread sends and receives
+ * correctly while several threads make blocking calls on it at once.
+ */
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-sysdeps.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define N_THREADS 4
+#define N_CALLS_PER_THREAD 200
+#define N_SIGNALS 1000
+
+static void *
+call_thread (void *data)
+{
+  DBusConnection *conn = data;
+  DBusMessage *method;
+  DBusMessage *reply;
+  DBusError error;
+  const char *name = DBUS_SERVICE_DBUS;
+  dbus_bool_t has_owner;
+  int i;
+
+  dbus_error_init (&error);
+
+  for (i = 0; i < N_CALLS_PER_THREAD; i++)
+    {
+      method = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                             DBUS_PATH_DBUS,
+                                             DBUS_INTERFACE_DBUS,
+                                             "NameHasOwner");
+      if (method == NULL ||
+          !dbus_message_append_args (method, DBUS_TYPE_STRING, &name,
+                                     DBUS_TYPE_INVALID))
+        {
+          printf ("Failed: no memory ***\n");
+          exit (1);
+        }
+
+      reply = dbus_connection_send_with_reply_and_block (conn, method,
+                                                         -1, &error);
+      dbus_message_unref (method);
+
+      if (reply == NULL)
+        {
+          printf ("Failed: %s: %s ***\n", error.name, error.message);
+          exit (1);
+        }
+
+      if (!dbus_message_get_args (reply, &error,
+                                  DBUS_TYPE_BOOLEAN, &has_owner,
+                                  DBUS_TYPE_INVALID) ||
+          !has_owner)
+        {
+          printf ("Failed: unexpected reply ***\n");
+          exit (1);
+        }
+
+      dbus_message_unref (reply);
+    }
+
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  pthread_t threads[N_THREADS];
+  long start_tv_sec, start_tv_usec;
+  long end_tv_sec, end_tv_usec;
+  DBusConnection *conn;
+  DBusMessage *signal;
+  DBusError error;
+  int i;
+
+  printf ("*** Testing connections with an I/O thread\n");
+
+  if (!dbus_threads_init_default ())
+    {
+      printf ("Failed: no memory ***\n");
+      exit (1);
+    }
+
+  dbus_error_init (&error);
+
+  conn = dbus_bus_get_private (DBUS_BUS_SESSION, &error);
+  if (conn == NULL)
+    {
+      printf ("Failed: %s ***\n", error.message);
+      exit (1);
+    }
+
+  if (!dbus_connection_start_io_thread (conn))
+    {
+      printf ("Failed: could not start I/O thread ***\n");
+      exit (1);
+    }
+
+  _dbus_get_current_time (&start_tv_sec, &start_tv_usec);
+
+  for (i = 0; i < N_THREADS; i++)
+    pthread_create (&threads[i], NULL, call_thread, conn);
+
+  /* signals go out from here while the other threads block */
+  for (i = 0; i < N_SIGNALS; i++)
+    {
+      signal = dbus_message_new_signal ("/org/freedesktop/TestSuite",
+                                        "org.freedesktop.TestSuite",
+                                        "Tick");
+      if (signal == NULL || !dbus_connection_send (conn, signal, NULL))
+        {
+          printf ("Failed: no memory ***\n");
+          exit (1);
+        }
+      dbus_message_unref (signal);
+    }
+
+  dbus_connection_flush (conn);
+
+  for (i = 0; i < N_THREADS; i++)
+    pthread_join (threads[i], NULL);
+
+  _dbus_get_current_time (&end_tv_sec, &end_tv_usec);
+
+  if (end_tv_sec - start_tv_sec >= 10)
+    {
+      printf ("Failed: calls took %lds, a thread may be stuck waiting ***\n",
+              end_tv_sec - start_tv_sec);
+      exit (1);
+    }
+
+  dbus_connection_close (conn);
+  dbus_connection_unref (conn);
+
+  printf ("Success ***\n");
+  exit (0);
+}
@@ -0,0 +1,202 @@
+/**
+ * Time allocating and freeing DBusList links from several threads at
+ * once, which is what every queued message and pending call does.
+ * Prints the throughput for one thread and for N_THREADS so that
+ * contention on the shared link pool shows up as a drop in the
+ * per-thread rate. Then does the same with threads sending signals
+ * on a session bus connection each.
+ */
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-sysdeps.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define N_THREADS 8
+#define N_ROUNDS 2000
+#define N_LINKS_PER_ROUND 100
+#define N_SIGNALS_PER_THREAD 2000
+
+typedef struct
+{
+  int n;                /* which thread this is */
+  DBusConnection *conn; /* the thread's own connection, for send_thread */
+} ThreadData;
+
+static void *
+churn_thread (void *data)
+{
+  DBusList *list;
+  int i, j;
+
+  for (i = 0; i < N_ROUNDS; i++)
+    {
+      list = NULL;
+
+      for (j = 0; j < N_LINKS_PER_ROUND; j++)
+        {
+          if (!_dbus_list_append (&list, data))
+            {
+              printf ("Failed: no memory ***\n");
+              exit (1);
+            }
+        }
+
+      for (j = 0; j < N_LINKS_PER_ROUND; j++)
+        {
+          if (_dbus_list_pop_first (&list) != data)
+            {
+              printf ("Failed: list lost an element ***\n");
+              exit (1);
+            }
+        }
+
+      if (list != NULL)
+        {
+          printf ("Failed: list not empty ***\n");
+          exit (1);
+        }
+    }
+
+  return NULL;
+}
+
+/* Every message sent takes a link for the outgoing queue and
+ * another one for the size counter
+ */
+static void *
+send_thread (void *data)
+{
+  ThreadData *thread = data;
+  DBusMessage *signal;
+  int i;
+
+  for (i = 0; i < N_SIGNALS_PER_THREAD; i++)
+    {
+      signal = dbus_message_new_signal ("/org/freedesktop/TestSuite",
+                                        "org.freedesktop.TestSuite",
+                                        "Tick");
+      if (signal == NULL || !dbus_connection_send (thread->conn, signal, NULL))
+        {
+          printf ("Failed: no memory ***\n");
+          exit (1);
+        }
+      dbus_message_unref (signal);
+    }
+
+  dbus_connection_flush (thread->conn);
+
+  if (!dbus_connection_get_is_connected (thread->conn))
+    {
+      printf ("Failed: thread %d was disconnected ***\n", thread->n);
+      exit (1);
+    }
+
+  return NULL;
+}
+
+static double
+run_threads (int         n_threads,
+             void     *(* thread_func) (void *),
+             ThreadData *data,
+             const char *what,
+             int         n_per_thread)
+{
+  pthread_t threads[N_THREADS];
+  long start_tv_sec, start_tv_usec;
+  long end_tv_sec, end_tv_usec;
+  double secs;
+  int i;
+
+  _dbus_get_current_time (&start_tv_sec, &start_tv_usec);
+
+  for (i = 0; i < n_threads; i++)
+    pthread_create (&threads[i], NULL, thread_func, &data[i]);
+
+  for (i = 0; i < n_threads; i++)
+    pthread_join (threads[i], NULL);
+
+  _dbus_get_current_time (&end_tv_sec, &end_tv_usec);
+
+  secs = (end_tv_sec - start_tv_sec) +
+    (end_tv_usec - start_tv_usec) / 1000000.0;
+
+  printf ("%d thread(s): %.0f %s per second per thread\n",
+          n_threads,
+          (double) n_per_thread / (secs > 0 ? secs : 1e-6),
+          what);
+
+  return secs;
+}
+
+int
+main (int argc, char *argv[])
+{
+  ThreadData data[N_THREADS];
+  DBusError error;
+  double secs;
+  int i;
+
+  printf ("*** Testing list link allocation from several threads\n");
+
+  if (!dbus_threads_init_default ())
+    {
+      printf ("Failed: no memory ***\n");
+      exit (1);
+    }
+
+  for (i = 0; i < N_THREADS; i++)
+    {
+      data[i].n = i;
+      data[i].conn = NULL;
+    }
+
+  run_threads (1, churn_thread, data,
+               "link alloc/free pairs", N_ROUNDS * N_LINKS_PER_ROUND);
+  secs = run_threads (N_THREADS, churn_thread, data,
+                      "link alloc/free pairs", N_ROUNDS * N_LINKS_PER_ROUND);
+
+  if (secs >= 30)
+    {
+      printf ("Failed: took %.1fs, threads may be stuck on the list lock ***\n",
+              secs);
+      exit (1);
+    }
+
+  dbus_error_init (&error);
+
+  for (i = 0; i < N_THREADS; i++)
+    {
+      data[i].conn = dbus_bus_get_private (DBUS_BUS_SESSION, &error);
+      if (data[i].conn == NULL)
+        {
+          printf ("Failed: %s ***\n", error.message);
+          exit (1);
+        }
+    }
+
+  run_threads (1, send_thread, data,
+               "signals sent", N_SIGNALS_PER_THREAD);
+  secs = run_threads (N_THREADS, send_thread, data,
+                      "signals sent", N_SIGNALS_PER_THREAD);
+
+  if (secs >= 30)
+    {
+      printf ("Failed: took %.1fs, sending threads may be stuck ***\n",
+              secs);
+      exit (1);
+    }
+
+  for (i = 0; i < N_THREADS; i++)
+    {
+      dbus_connection_close (data[i].conn);
+      dbus_connection_unref (data[i].conn);
+    }
+
+  dbus_shutdown ();
+
+  printf ("Success ***\n");
+  exit (0);
+}
@@ -17,8 +17,11 @@ main (int argc, char **argv)
 {
   char **argv_copy;
   int i;
+  DBusBabysitter *sitter;
   DBusError error;
   
+  dbus_error_init (&error);
+  
   if (argc < 2)
     {
       fprintf (stderr, "You need to specify a program to launch.\n");
@@ -31,10 +34,12 @@ main (int argc, char **argv)
     argv_copy [i] = argv[i + 1];
   argv_copy[argc - 1] = NULL;
   
-  if (!_dbus_spawn_async_with_babysitter (NULL, argv_copy, setup_func, NULL, &error))
+  if (!_dbus_spawn_async_with_babysitter (&sitter, argv_copy, NULL,
+                                          setup_func, NULL, &error))
     {
       fprintf (stderr, "Could not launch application: \"%s\"\n",
 	       error.message);
+      dbus_error_free (&error);
     }
   
   return 0;
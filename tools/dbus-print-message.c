@@ -21,6 +21,8 @@
  */
 #include "dbus-print-message.h"
 
+#include <unistd.h>
+
 static const char*
 type_to_name (int message_type)
 {
@@ -169,6 +171,16 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	    break;
 	  }
 
+	case DBUS_TYPE_UNIX_FD:
+	  {
+	    int fd;
+	    dbus_message_iter_get_basic (iter, &fd);
+	    printf ("file descriptor %d\n", fd);
+	    if (fd >= 0)
+	      close (fd);
+	    break;
+	  }
+
 	case DBUS_TYPE_VARIANT:
 	  {
 	    DBusMessageIter subiter;